@@ -4,6 +4,7 @@
 
 #include "pd_api.h"
 #include "s3m.h"
+#include "tmc.h"
 #include "tracker_music.h"
 
 #define MAX_FILES 500
@@ -45,7 +46,8 @@ bool caseInsensitiveStrEquals(const char *a, const char *b)
 void findMusicCallback(const char *filename, void *userdata) {
     int len = strlen(filename);
     
-    if (len < 5 || !caseInsensitiveStrEquals(&filename[len-4], ".s3m")) {
+    if (len < 5 || (!caseInsensitiveStrEquals(&filename[len-4], ".s3m")
+                    && !caseInsensitiveStrEquals(&filename[len-4], ".tmc"))) {
         return;
     }
     
@@ -54,6 +56,21 @@ void findMusicCallback(const char *filename, void *userdata) {
     files[fileCount++] = copy;
     
     pd->system->logToConsole("file: %s", copy);
+    
+    if (caseInsensitiveStrEquals(&filename[len-4], ".s3m")) {
+        char *path = NULL;
+        S3MInfo info;
+        
+        pd->system->formatString(&path, "music/%s", filename);
+        
+        if (readMusicInfoFromS3M(&info, path, kFileRead | kFileReadData) == kMusicNoError) {
+            pd->system->logToConsole("    \"%s\": %d channels, %d orders, %d instruments, about %d KB",
+                                     info.title, info.enabledChannelCount, info.orderCount, info.instrumentCount,
+                                     (int)(info.estimatedMemory / 1024));
+        }
+        
+        pd->system->realloc(path, 0);
+    }
 }
 
 void redraw(void)
@@ -81,14 +98,21 @@ void loadSelection(void)
     char *path = NULL;
     
     if (currentMusicIndex != -1) {
-        stopTrackerMusic();
+        stopTrackerMusic(currentMusic.player);
         freeTrackerMusic(&currentMusic);
     }
     
     pd->system->logToConsole("Loading: %s", files[selection]);
     
     pd->system->formatString(&path, "music/%s", files[selection]);
-    int error = loadMusicFromS3M(&currentMusic, path, kFileRead | kFileReadData);
+    int error;
+    
+    if (caseInsensitiveStrEquals(&path[strlen(path)-4], ".tmc")) {
+        error = loadMusicFromTMC(&currentMusic, path, kFileRead | kFileReadData);
+    } else {
+        error = loadMusicFromS3M(&currentMusic, path, kFileRead | kFileReadData);
+    }
+    
     pd->system->realloc(path, 0);
     
     if (error != kMusicNoError) {
@@ -110,7 +134,7 @@ void play(void)
 
 void stop(void)
 {
-    stopTrackerMusic();
+    stopTrackerMusic(currentMusic.player);
 }
 
 void adjustSpeedFromCrank(void)
@@ -132,16 +156,16 @@ void adjustSpeedFromCrank(void)
         float d = crank * CRANK_SPEED * 0.01f;
         
         if (crank > 0.0f) {
-            setTrackerMusicSpeed(d + 1.0f);
+            setTrackerMusicSpeed(currentMusic.player, d + 1.0f);
         } else {
-            setTrackerMusicSpeed(1.0f / (-d + 1.0f));
+            setTrackerMusicSpeed(currentMusic.player, 1.0f / (-d + 1.0f));
         }
         
-        setTrackerMusicPitchShift(d);
+        setTrackerMusicPitchShift(currentMusic.player, d);
         
     } else {
-        setTrackerMusicSpeed(1.0f);
-        setTrackerMusicPitchShift(0.0f);
+        setTrackerMusicSpeed(currentMusic.player, 1.0f);
+        setTrackerMusicPitchShift(currentMusic.player, 0.0f);
     }
 }
 
@@ -169,7 +193,7 @@ void startup(void)
 
 void shutdown(void)
 {
-    stopTrackerMusic();
+    stopTrackerMusic(currentMusic.player);
     
     for(int i = 0; i < fileCount; ++i) {
         free(files[i]);
@@ -0,0 +1,263 @@
+#define _GNU_SOURCE
+
+#include "host_playdate.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+static _Thread_local char lastError[256];
+static struct timespec elapsedTimeStart;
+
+double hostTimeSeconds(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec + (double)t.tv_nsec / 1e9;
+}
+
+static void setLastError(void)
+{
+    snprintf(lastError, sizeof(lastError), "%s", strerror(errno));
+}
+
+static void * hostRealloc(void *ptr, size_t size)
+{
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+    
+    return realloc(ptr, size);
+}
+
+static int hostFormatString(char **ret, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    int result = vasprintf(ret, fmt, args);
+    va_end(args);
+    return result;
+}
+
+static void hostLogToConsole(const char *fmt, ...)
+{
+    char message[1024];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(message, sizeof(message), fmt, args);
+    va_end(args);
+    
+    // One write per message so that lines from different threads don't mix
+    fprintf(stderr, "%s\n", message);
+}
+
+static unsigned int hostGetCurrentTimeMilliseconds(void)
+{
+    return (unsigned int)(hostTimeSeconds() * 1000.0);
+}
+
+static float hostGetElapsedTime(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (float)(t.tv_sec - elapsedTimeStart.tv_sec) + (float)(t.tv_nsec - elapsedTimeStart.tv_nsec) / 1e9f;
+}
+
+static void hostResetElapsedTime(void)
+{
+    clock_gettime(CLOCK_MONOTONIC, &elapsedTimeStart);
+}
+
+static const char * hostGetErr(void)
+{
+    return lastError;
+}
+
+static int hostListFiles(const char *path, void (*callback)(const char *path, void *userdata), void *userdata,
+                         int showhidden)
+{
+    DIR *dir = opendir(path);
+    struct dirent *entry;
+    
+    if (!dir) {
+        setLastError();
+        return -1;
+    }
+    
+    while((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0
+            || (!showhidden && entry->d_name[0] == '.')) {
+            continue;
+        }
+        
+        callback(entry->d_name, userdata);
+    }
+    
+    closedir(dir);
+    return 0;
+}
+
+static int hostStat(const char *path, FileStat *fileStat)
+{
+    struct stat st;
+    struct tm modified;
+    
+    if (stat(path, &st) != 0) {
+        setLastError();
+        return -1;
+    }
+    
+    gmtime_r(&st.st_mtime, &modified);
+    memset(fileStat, 0, sizeof(FileStat));
+    fileStat->isdir = S_ISDIR(st.st_mode);
+    fileStat->size = (unsigned int)st.st_size;
+    fileStat->m_year = modified.tm_year + 1900;
+    fileStat->m_month = modified.tm_mon + 1;
+    fileStat->m_day = modified.tm_mday;
+    fileStat->m_hour = modified.tm_hour;
+    fileStat->m_minute = modified.tm_min;
+    fileStat->m_second = modified.tm_sec;
+    return 0;
+}
+
+static int hostMkdir(const char *path)
+{
+    if (mkdir(path, 0777) != 0 && errno != EEXIST) {
+        setLastError();
+        return -1;
+    }
+    
+    return 0;
+}
+
+static int hostUnlink(const char *path, int recursive)
+{
+    if (remove(path) != 0) {
+        setLastError();
+        return -1;
+    }
+    
+    return 0;
+}
+
+static int hostRename(const char *from, const char *to)
+{
+    if (rename(from, to) != 0) {
+        setLastError();
+        return -1;
+    }
+    
+    return 0;
+}
+
+static SDFile * hostOpen(const char *path, FileOptions mode)
+{
+    const char *fopenMode = "rb";
+    
+    if (mode & kFileWrite) {
+        fopenMode = "wb";
+    } else if (mode & kFileAppend) {
+        fopenMode = "ab";
+    }
+    
+    FILE *f = fopen(path, fopenMode);
+    
+    if (!f) {
+        setLastError();
+    }
+    
+    return (SDFile *)f;
+}
+
+static int hostClose(SDFile *file)
+{
+    return fclose((FILE *)file);
+}
+
+static int hostRead(SDFile *file, void *buf, unsigned int len)
+{
+    size_t result = fread(buf, 1, len, (FILE *)file);
+    
+    if (result < len && ferror((FILE *)file)) {
+        setLastError();
+        return -1;
+    }
+    
+    return (int)result;
+}
+
+static int hostWrite(SDFile *file, const void *buf, unsigned int len)
+{
+    size_t result = fwrite(buf, 1, len, (FILE *)file);
+    
+    if (result < len) {
+        setLastError();
+        return -1;
+    }
+    
+    return (int)result;
+}
+
+static int hostFlush(SDFile *file)
+{
+    return fflush((FILE *)file);
+}
+
+static int hostTell(SDFile *file)
+{
+    return (int)ftell((FILE *)file);
+}
+
+static int hostSeek(SDFile *file, int pos, int whence)
+{
+    if (fseek((FILE *)file, pos, whence) != 0) {
+        setLastError();
+        return -1;
+    }
+    
+    return 0;
+}
+
+static const struct playdate_sys hostSystem = {
+    .realloc = hostRealloc,
+    .formatString = hostFormatString,
+    .logToConsole = hostLogToConsole,
+    .error = hostLogToConsole,
+    .getCurrentTimeMilliseconds = hostGetCurrentTimeMilliseconds,
+    .getElapsedTime = hostGetElapsedTime,
+    .resetElapsedTime = hostResetElapsedTime,
+};
+
+static const struct playdate_file hostFile = {
+    .geterr = hostGetErr,
+    .listfiles = hostListFiles,
+    .stat = hostStat,
+    .mkdir = hostMkdir,
+    .unlink = hostUnlink,
+    .rename = hostRename,
+    .open = hostOpen,
+    .close = hostClose,
+    .read = hostRead,
+    .write = hostWrite,
+    .flush = hostFlush,
+    .tell = hostTell,
+    .seek = hostSeek,
+};
+
+static PlaydateAPI hostAPI = {
+    .system = &hostSystem,
+    .file = &hostFile,
+    .sound = NULL,
+};
+
+PlaydateAPI * hostPlaydateAPI(void)
+{
+    hostResetElapsedTime();
+    return &hostAPI;
+}
@@ -0,0 +1,14 @@
+#ifndef HOST_PLAYDATE_H
+#define HOST_PLAYDATE_H
+
+#include "pd_api.h"
+
+// A stand-in for the parts of the Playdate API that the tracker music loaders
+// use, so that they can be run on a host machine. File paths are plain host
+// file system paths. The sound API is not available.
+PlaydateAPI * hostPlaydateAPI(void);
+
+// Monotonic wall clock time in seconds, for timing things
+double hostTimeSeconds(void);
+
+#endif // HOST_PLAYDATE_H
@@ -0,0 +1,266 @@
+// Converts a directory of S3M files into precompiled TMC files, using every
+// CPU core, and reports how much faster each song is to load afterwards.
+//
+// Usage: s3m2tmc [--sparse] [--adpcm] [--max-rate <hz>] [--remove-unused] <input directory> <output directory>
+//
+// --sparse stores patterns as only their non-empty cells (see
+// kPatternStorageSparse), which makes both the TMC files and the loaded songs
+// smaller. --adpcm encodes 16-bit mono samples as ADPCM (see adpcmSamples in
+// TrackerMusicLoadOptions). --max-rate resamples instruments with a higher
+// sample rate down to the given rate (see maxSampleRate). --remove-unused
+// leaves out patterns, instruments and sample data that can never be heard (see
+// removeUnusedData).
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "host_playdate.h"
+#include "s3m.h"
+#include "tmc.h"
+#include "tracker_music.h"
+#include "tracker_music_p.h"
+
+#define kLoadTimingRuns 3
+
+typedef struct _ConversionJob {
+    char *name;
+    char *inputPath;
+    char *outputPath;
+    int error;
+    double s3mLoadTime;
+    double tmcLoadTime;
+    long s3mSize;
+    long tmcSize;
+} ConversionJob;
+
+static ConversionJob *jobs = NULL;
+static int jobCount = 0;
+static atomic_int nextJob = 0;
+static TrackerMusicLoadOptions loadOptions = {0};
+
+static bool hasS3MExtension(const char *name)
+{
+    size_t len = strlen(name);
+    return len > 4 && strcasecmp(&name[len - 4], ".s3m") == 0;
+}
+
+static long fileSize(const char *path)
+{
+    struct stat st;
+    return (stat(path, &st) == 0) ? (long)st.st_size : 0;
+}
+
+// Loads the S3M the same way it's loaded on the Playdate, minus creating the
+// audio entities, which is the same for both formats
+static int timeS3MLoad(ConversionJob *job, TrackerMusic *music)
+{
+    double start = hostTimeSeconds();
+    int error = readMusicFromS3M(music, job->inputPath, kFileRead, &loadOptions);
+    
+    if (error == kMusicNoError) {
+        error = createTrackerMusicOffsetSamples(music);
+    }
+    
+    if (error == kMusicNoError) {
+        encodeTrackerMusicADPCMSamples(music);
+    }
+    
+    double time = hostTimeSeconds() - start;
+    
+    if (job->s3mLoadTime == 0 || time < job->s3mLoadTime) {
+        job->s3mLoadTime = time;
+    }
+    
+    return error;
+}
+
+static int timeTMCLoad(ConversionJob *job, TrackerMusic *music)
+{
+    double start = hostTimeSeconds();
+    int error = readMusicFromTMC(music, job->outputPath, kFileRead);
+    double time = hostTimeSeconds() - start;
+    
+    if (job->tmcLoadTime == 0 || time < job->tmcLoadTime) {
+        job->tmcLoadTime = time;
+    }
+    
+    return error;
+}
+
+static void convert(ConversionJob *job)
+{
+    TrackerMusic *music = calloc(1, sizeof(TrackerMusic));
+    
+    if (!music) {
+        job->error = kMusicMemoryError;
+        return;
+    }
+    
+    job->error = timeS3MLoad(job, music);
+    
+    if (job->error == kMusicNoError) {
+        job->error = writeMusicToTMC(music, job->outputPath);
+    }
+    
+    freeTrackerMusic(music);
+    
+    for(int i = 1; job->error == kMusicNoError && i < kLoadTimingRuns; ++i) {
+        job->error = timeS3MLoad(job, music);
+        freeTrackerMusic(music);
+    }
+    
+    for(int i = 0; job->error == kMusicNoError && i < kLoadTimingRuns; ++i) {
+        job->error = timeTMCLoad(job, music);
+        freeTrackerMusic(music);
+    }
+    
+    job->s3mSize = fileSize(job->inputPath);
+    job->tmcSize = fileSize(job->outputPath);
+    free(music);
+}
+
+static void * worker(void *unused)
+{
+    int i;
+    
+    while((i = atomic_fetch_add(&nextJob, 1)) < jobCount) {
+        convert(&jobs[i]);
+    }
+    
+    return NULL;
+}
+
+static int compareJobs(const void *a, const void *b)
+{
+    return strcmp(((const ConversionJob *)a)->name, ((const ConversionJob *)b)->name);
+}
+
+static bool findJobs(const char *inputDir, const char *outputDir)
+{
+    DIR *dir = opendir(inputDir);
+    struct dirent *entry;
+    
+    if (!dir) {
+        fprintf(stderr, "Error: couldn't open directory %s\n", inputDir);
+        return false;
+    }
+    
+    while((entry = readdir(dir)) != NULL) {
+        if (!hasS3MExtension(entry->d_name)) {
+            continue;
+        }
+        
+        jobs = realloc(jobs, sizeof(ConversionJob) * (jobCount + 1));
+        ConversionJob *job = &jobs[jobCount++];
+        memset(job, 0, sizeof(ConversionJob));
+        
+        job->name = strdup(entry->d_name);
+        asprintf(&job->inputPath, "%s/%s", inputDir, entry->d_name);
+        asprintf(&job->outputPath, "%s/%.*s.tmc", outputDir, (int)strlen(entry->d_name) - 4, entry->d_name);
+    }
+    
+    closedir(dir);
+    qsort(jobs, jobCount, sizeof(ConversionJob), compareJobs);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    char *programName = argv[0];
+    
+    while(argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+        if (strcmp(argv[1], "--sparse") == 0) {
+            loadOptions.patternStorage = kPatternStorageSparse;
+        } else if (strcmp(argv[1], "--adpcm") == 0) {
+            loadOptions.adpcmSamples = true;
+        } else if (strcmp(argv[1], "--remove-unused") == 0) {
+            loadOptions.removeUnusedData = true;
+        } else if (strcmp(argv[1], "--max-rate") == 0 && argc > 2) {
+            loadOptions.maxSampleRate = (uint32_t)strtoul(argv[2], NULL, 10);
+            --argc;
+            ++argv;
+        } else {
+            break;
+        }
+        
+        --argc;
+        ++argv;
+    }
+    
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s [--sparse] [--adpcm] [--max-rate <hz>] [--remove-unused] <input directory> "
+                "<output directory>\n", programName);
+        return 1;
+    }
+    
+    PlaydateAPI *pd = hostPlaydateAPI();
+    initializeTrackerMusic(pd);
+    
+    if (pd->file->mkdir(argv[2]) != 0) {
+        fprintf(stderr, "Error: couldn't create output directory %s: %s\n", argv[2], pd->file->geterr());
+        return 1;
+    }
+    
+    if (!findJobs(argv[1], argv[2])) {
+        return 1;
+    }
+    
+    long threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+    threadCount = MAX(1, MIN(threadCount, jobCount));
+    pthread_t *threads = malloc(sizeof(pthread_t) * MAX(threadCount, 1));
+    
+    printf("Converting %d files on %ld threads\n", jobCount, threadCount);
+    
+    for(long i = 0; i < threadCount; ++i) {
+        pthread_create(&threads[i], NULL, worker, NULL);
+    }
+    
+    for(long i = 0; i < threadCount; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    
+    int failures = 0;
+    double totalS3M = 0, totalTMC = 0;
+    
+    printf("%-32s %10s %10s %9s %10s %10s\n", "file", "s3m (ms)", "tmc (ms)", "saved", "s3m bytes", "tmc bytes");
+    
+    for(int i = 0; i < jobCount; ++i) {
+        ConversionJob *job = &jobs[i];
+        
+        if (job->error != kMusicNoError) {
+            printf("%-32s failed with error code %d\n", job->name, job->error);
+            ++failures;
+            continue;
+        }
+        
+        totalS3M += job->s3mLoadTime;
+        totalTMC += job->tmcLoadTime;
+        printf("%-32s %10.3f %10.3f %8.1f%% %10ld %10ld\n", job->name, job->s3mLoadTime * 1000.0,
+               job->tmcLoadTime * 1000.0, 100.0 * (1.0 - job->tmcLoadTime / job->s3mLoadTime), job->s3mSize,
+               job->tmcSize);
+    }
+    
+    if (totalS3M > 0) {
+        printf("%-32s %10.3f %10.3f %8.1f%%\n", "total", totalS3M * 1000.0, totalTMC * 1000.0,
+               100.0 * (1.0 - totalTMC / totalS3M));
+    }
+    
+    for(int i = 0; i < jobCount; ++i) {
+        free(jobs[i].name);
+        free(jobs[i].inputPath);
+        free(jobs[i].outputPath);
+    }
+    
+    free(jobs);
+    free(threads);
+    return failures == 0 ? 0 : 1;
+}
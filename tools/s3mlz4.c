@@ -0,0 +1,411 @@
+// Compresses a directory of S3M files with LZ4, in a form that loadMusicFromS3M
+// can load directly, and compares how long each song takes to load compressed
+// and uncompressed.
+//
+// Usage: s3mlz4 [--block-size <kb>] <input directory> <output directory>
+//
+// --block-size sets the size of the LZ4 blocks in KB, which can be 64 (the
+// default), 256, 1024 or 4096. Larger blocks compress a little better, but the
+// loader needs three blocks' worth of memory, and they can't be larger than
+// S3M_LZ4_MAX_BLOCK_SIZE. The compressed files are standard LZ4
+// frames and can be decompressed with `lz4 -d`.
+//
+// Note that the load times are for the host's file system, which is usually a
+// lot faster to read from than the Playdate's flash memory, so the difference
+// on the device will favor compression more than they suggest.
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "host_playdate.h"
+#include "lz4.h"
+#include "s3m.h"
+#include "tracker_music.h"
+#include "tracker_music_p.h"
+
+#define kLoadTimingRuns 5
+#define kHashBits 16
+#define kMaxMatchOffset 65535
+#define kMinMatch 4
+#define kMatchSearchEndDistance 12 // no match can start this close to the end of a block
+#define kLastLiterals 5 // the last this many bytes of a block are always literals
+
+typedef struct _CompressionJob {
+    char *name;
+    char *inputPath;
+    char *outputPath;
+    int error;
+    double rawLoadTime;
+    double compressedLoadTime;
+    long rawSize;
+    long compressedSize;
+} CompressionJob;
+
+static CompressionJob *jobs = NULL;
+static int jobCount = 0;
+static uint8_t blockSizeId = LZ4_MIN_BLOCK_SIZE_ID;
+
+static bool hasS3MExtension(const char *name)
+{
+    size_t len = strlen(name);
+    return len > 4 && strcasecmp(&name[len - 4], ".s3m") == 0;
+}
+
+static long fileSize(const char *path)
+{
+    struct stat st;
+    return (stat(path, &st) == 0) ? (long)st.st_size : 0;
+}
+
+static inline uint32_t read32(const uint8_t *data)
+{
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static inline void write32(uint8_t *data, uint32_t value)
+{
+    data[0] = value & 0xFF;
+    data[1] = (value >> 8) & 0xFF;
+    data[2] = (value >> 16) & 0xFF;
+    data[3] = value >> 24;
+}
+
+static inline uint32_t rotateLeft(uint32_t value, int bits)
+{
+    return (value << bits) | (value >> (32 - bits));
+}
+
+// xxHash32 with a seed of 0, which LZ4 frames use for their header checksum.
+// Only handles inputs shorter than 16 bytes, which is all that's needed here.
+static uint32_t xxHash32(const uint8_t *data, uint32_t length)
+{
+    const uint32_t prime1 = 2654435761u, prime2 = 2246822519u, prime3 = 3266489917u;
+    const uint32_t prime4 = 668265263u, prime5 = 374761393u;
+    uint32_t hash = prime5 + length;
+    uint32_t i = 0;
+    
+    for(; i + 4 <= length; i += 4) {
+        hash += read32(data + i) * prime3;
+        hash = rotateLeft(hash, 17) * prime4;
+    }
+    
+    for(; i < length; ++i) {
+        hash += data[i] * prime5;
+        hash = rotateLeft(hash, 11) * prime1;
+    }
+    
+    hash ^= hash >> 15;
+    hash *= prime2;
+    hash ^= hash >> 13;
+    hash *= prime3;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+static uint8_t * writeLength(uint8_t *out, uint32_t length)
+{
+    while(length >= 255) {
+        *out++ = 255;
+        length -= 255;
+    }
+    
+    *out++ = length;
+    return out;
+}
+
+static uint8_t * writeSequence(uint8_t *out, const uint8_t *literals, uint32_t literalLength, uint32_t matchOffset,
+                               uint32_t matchLength)
+{
+    uint8_t *token = out++;
+    
+    *token = MIN(literalLength, 15) << 4;
+    
+    if (literalLength >= 15) {
+        out = writeLength(out, literalLength - 15);
+    }
+    
+    memcpy(out, literals, literalLength);
+    out += literalLength;
+    
+    if (matchLength > 0) {
+        *out++ = matchOffset & 0xFF;
+        *out++ = matchOffset >> 8;
+        *token |= MIN(matchLength - kMinMatch, 15);
+        
+        if (matchLength - kMinMatch >= 15) {
+            out = writeLength(out, matchLength - kMinMatch - 15);
+        }
+    }
+    
+    return out;
+}
+
+// A simple greedy LZ4 block compressor. Decompression speed doesn't depend on
+// how hard the compressor tried, so this is good enough for converting assets.
+// dest must have room for lz4CompressBound(length) bytes.
+static uint32_t lz4CompressBlock(const uint8_t *src, uint32_t length, uint8_t *dest, uint32_t *hashTable)
+{
+    uint8_t *out = dest;
+    uint32_t anchor = 0;
+    uint32_t i = 0;
+    
+    memset(hashTable, 0xFF, sizeof(uint32_t) << kHashBits);
+    
+    while(i + kMatchSearchEndDistance < length) {
+        uint32_t sequence = read32(src + i);
+        uint32_t hash = (sequence * 2654435761u) >> (32 - kHashBits);
+        uint32_t candidate = hashTable[hash];
+        
+        hashTable[hash] = i;
+        
+        if (candidate == UINT32_MAX || i - candidate > kMaxMatchOffset || read32(src + candidate) != sequence) {
+            ++i;
+            continue;
+        }
+        
+        uint32_t matchLength = kMinMatch;
+        
+        while(i + matchLength < length - kLastLiterals && src[candidate + matchLength] == src[i + matchLength]) {
+            ++matchLength;
+        }
+        
+        out = writeSequence(out, src + anchor, i - anchor, i - candidate, matchLength);
+        i += matchLength;
+        anchor = i;
+    }
+    
+    out = writeSequence(out, src + anchor, length - anchor, 0, 0);
+    return (uint32_t)(out - dest);
+}
+
+static uint32_t lz4CompressBound(uint32_t length)
+{
+    return length + length / 255 + 16;
+}
+
+// Writes data out as an LZ4 frame with independent blocks, storing any block
+// that doesn't get smaller uncompressed
+static bool writeLZ4Frame(FILE *f, const uint8_t *data, uint32_t length)
+{
+    uint32_t blockSize = lz4BlockSizeForId(blockSizeId);
+    uint8_t header[7];
+    uint8_t *compressed = malloc(lz4CompressBound(blockSize));
+    uint32_t *hashTable = malloc(sizeof(uint32_t) << kHashBits);
+    bool success = (compressed && hashTable);
+    
+    write32(header, LZ4_FRAME_MAGIC);
+    header[4] = 0x40 | 0x20; // version 1, independent blocks
+    header[5] = blockSizeId << 4;
+    header[6] = (xxHash32(&header[4], 2) >> 8) & 0xFF;
+    success = success && fwrite(header, 1, sizeof(header), f) == sizeof(header);
+    
+    for(uint32_t offset = 0; success && offset < length; offset += blockSize) {
+        uint32_t blockLength = MIN(blockSize, length - offset);
+        uint32_t compressedLength = lz4CompressBlock(data + offset, blockLength, compressed, hashTable);
+        uint8_t sizeData[4];
+        
+        if (compressedLength < blockLength) {
+            write32(sizeData, compressedLength);
+            success = fwrite(sizeData, 1, 4, f) == 4 && fwrite(compressed, 1, compressedLength, f) == compressedLength;
+        } else {
+            write32(sizeData, blockLength | 0x80000000u);
+            success = fwrite(sizeData, 1, 4, f) == 4 && fwrite(data + offset, 1, blockLength, f) == blockLength;
+        }
+    }
+    
+    uint8_t endMark[4] = {0};
+    success = success && fwrite(endMark, 1, sizeof(endMark), f) == sizeof(endMark);
+    
+    free(compressed);
+    free(hashTable);
+    return success;
+}
+
+static bool compressFile(CompressionJob *job)
+{
+    FILE *in = fopen(job->inputPath, "rb");
+    FILE *out = NULL;
+    uint8_t *data = NULL;
+    bool success = false;
+    long length = fileSize(job->inputPath);
+    
+    if (in && length > 0 && (data = malloc(length)) && fread(data, 1, length, in) == (size_t)length) {
+        out = fopen(job->outputPath, "wb");
+        success = out && writeLZ4Frame(out, data, (uint32_t)length);
+    }
+    
+    if (in) {
+        fclose(in);
+    }
+    
+    if (out && fclose(out) != 0) {
+        success = false;
+    }
+    
+    free(data);
+    return success;
+}
+
+// Loads the song the same way it's loaded on the Playdate, minus creating the
+// audio entities, which is the same either way. Returns the fastest time.
+static double timeLoad(const char *path, int *error)
+{
+    TrackerMusic music;
+    double best = 0;
+    
+    for(int i = 0; *error == kMusicNoError && i < kLoadTimingRuns; ++i) {
+        double start = hostTimeSeconds();
+        *error = readMusicFromS3M(&music, (char *)path, kFileRead, NULL);
+        double time = hostTimeSeconds() - start;
+        
+        if (*error == kMusicNoError) {
+            freeTrackerMusic(&music);
+        }
+        
+        if (i == 0 || time < best) {
+            best = time;
+        }
+    }
+    
+    return best;
+}
+
+static int compareJobs(const void *a, const void *b)
+{
+    return strcmp(((const CompressionJob *)a)->name, ((const CompressionJob *)b)->name);
+}
+
+static bool findJobs(const char *inputDir, const char *outputDir)
+{
+    DIR *dir = opendir(inputDir);
+    struct dirent *entry;
+    
+    if (!dir) {
+        fprintf(stderr, "Error: couldn't open directory %s\n", inputDir);
+        return false;
+    }
+    
+    while((entry = readdir(dir)) != NULL) {
+        if (!hasS3MExtension(entry->d_name)) {
+            continue;
+        }
+        
+        jobs = realloc(jobs, sizeof(CompressionJob) * (jobCount + 1));
+        CompressionJob *job = &jobs[jobCount++];
+        memset(job, 0, sizeof(CompressionJob));
+        
+        job->name = strdup(entry->d_name);
+        asprintf(&job->inputPath, "%s/%s", inputDir, entry->d_name);
+        asprintf(&job->outputPath, "%s/%s.lz4", outputDir, entry->d_name);
+    }
+    
+    closedir(dir);
+    qsort(jobs, jobCount, sizeof(CompressionJob), compareJobs);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    char *programName = argv[0];
+    
+    while(argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+        if (strcmp(argv[1], "--block-size") == 0 && argc > 2) {
+            int kilobytes = atoi(argv[2]);
+            
+            for(blockSizeId = LZ4_MIN_BLOCK_SIZE_ID; blockSizeId <= LZ4_MAX_BLOCK_SIZE_ID; ++blockSizeId) {
+                if (lz4BlockSizeForId(blockSizeId) == (uint32_t)kilobytes * 1024) {
+                    break;
+                }
+            }
+            
+            if (blockSizeId > LZ4_MAX_BLOCK_SIZE_ID) {
+                fprintf(stderr, "Error: block size must be 64, 256, 1024 or 4096\n");
+                return 1;
+            }
+            
+            --argc;
+            ++argv;
+        } else {
+            break;
+        }
+        
+        --argc;
+        ++argv;
+    }
+    
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s [--block-size <kb>] <input directory> <output directory>\n", programName);
+        return 1;
+    }
+    
+    PlaydateAPI *pd = hostPlaydateAPI();
+    initializeTrackerMusic(pd);
+    
+    if (pd->file->mkdir(argv[2]) != 0) {
+        fprintf(stderr, "Error: couldn't create output directory %s: %s\n", argv[2], pd->file->geterr());
+        return 1;
+    }
+    
+    if (!findJobs(argv[1], argv[2])) {
+        return 1;
+    }
+    
+    int failures = 0;
+    double totalRaw = 0, totalCompressed = 0;
+    long totalRawSize = 0, totalCompressedSize = 0;
+    
+    // Songs are loaded one at a time, so that they're timed without anything
+    // else competing for the disk or CPU
+    printf("Compressing %d files with %d KB blocks\n", jobCount, (int)(lz4BlockSizeForId(blockSizeId) / 1024));
+    printf("%-32s %10s %10s %8s %10s %10s\n", "file", "raw (ms)", "lz4 (ms)", "speed", "raw bytes", "lz4 bytes");
+    
+    for(int i = 0; i < jobCount; ++i) {
+        CompressionJob *job = &jobs[i];
+        
+        if (!compressFile(job)) {
+            printf("%-32s couldn't be compressed\n", job->name);
+            ++failures;
+            continue;
+        }
+        
+        job->rawLoadTime = timeLoad(job->inputPath, &job->error);
+        job->compressedLoadTime = timeLoad(job->outputPath, &job->error);
+        
+        if (job->error != kMusicNoError) {
+            printf("%-32s failed with error code %d\n", job->name, job->error);
+            ++failures;
+            continue;
+        }
+        
+        job->rawSize = fileSize(job->inputPath);
+        job->compressedSize = fileSize(job->outputPath);
+        totalRaw += job->rawLoadTime;
+        totalCompressed += job->compressedLoadTime;
+        totalRawSize += job->rawSize;
+        totalCompressedSize += job->compressedSize;
+        printf("%-32s %10.3f %10.3f %7.2fx %10ld %10ld\n", job->name, job->rawLoadTime * 1000.0,
+               job->compressedLoadTime * 1000.0, job->rawLoadTime / job->compressedLoadTime, job->rawSize,
+               job->compressedSize);
+    }
+    
+    if (totalRaw > 0) {
+        printf("%-32s %10.3f %10.3f %7.2fx %10ld %10ld\n", "total", totalRaw * 1000.0, totalCompressed * 1000.0,
+               totalRaw / totalCompressed, totalRawSize, totalCompressedSize);
+    }
+    
+    for(int i = 0; i < jobCount; ++i) {
+        free(jobs[i].name);
+        free(jobs[i].inputPath);
+        free(jobs[i].outputPath);
+    }
+    
+    free(jobs);
+    return failures == 0 ? 0 : 1;
+}
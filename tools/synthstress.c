@@ -0,0 +1,192 @@
+// Hammers a synth's note times from two threads at once, the way the main
+// thread (playing and releasing notes) and the audio thread (retriggering them)
+// do while music plays, and checks that the lock-free note times in
+// tracker_music.c hold up:
+//
+//  - A note on time and its frequency are always read as a pair, so a note
+//    that's played again when it's released has the right frequency.
+//  - No change is lost: every change that's made counts towards the synth's
+//    change count, even when both threads make one at the same time.
+//  - A change is never made from times that are out of date. Only the main
+//    thread changes the note off time, so it always knows what it should be,
+//    and a change the audio thread made from out of date times would put back
+//    an earlier one.
+//
+// Usage: synthstress [iterations]
+//
+// Each thread makes the given number of changes (default 2,000,000). Exits
+// with a non-zero status if anything goes wrong.
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "host_playdate.h"
+#include "tracker_music.h"
+#include "tracker_music_p.h"
+
+// How far the pretend sound engine clock moves with each of the main thread's
+// changes, and the most that a change is scheduled ahead of it. Changes are
+// scheduled a random distance ahead, so that the checks in playSynthNote and
+// releaseSynthNote sometimes refuse them.
+#define kClockStep 64
+#define kMaxScheduleAhead 2048
+
+static TrackerMusicChannelSynth synth;
+static uint32_t iterations = 2000000;
+static _Atomic uint32_t currentTime = 1;
+static atomic_bool mainThreadDone = false;
+
+static atomic_uint changesMade = 0;
+static atomic_uint mismatchedFrequencies = 0;
+static atomic_uint wrongNoteOffs = 0;
+static atomic_uint refusedChanges = 0;
+static _Thread_local bool changeRefused;
+
+// Every note's frequency is worked out from when it starts, so that a note on
+// time and a frequency that don't belong together can be spotted
+static float frequencyForTime(uint32_t when)
+{
+    return (float)(when % 4096 + 1);
+}
+
+static uint32_t randomScheduleAhead(uint32_t *state)
+{
+    // xorshift32
+    (*state) ^= (*state) << 13;
+    (*state) ^= (*state) >> 17;
+    (*state) ^= (*state) << 5;
+    return (*state) % kMaxScheduleAhead;
+}
+
+static uint32_t stressGetCurrentTime(void)
+{
+    return atomic_load(&currentTime);
+}
+
+static void stressPlayNote(PDSynth *pdSynth, float freq, float vel, float len, uint32_t when)
+{
+    if (freq != frequencyForTime(when)) {
+        atomic_fetch_add(&mismatchedFrequencies, 1);
+    }
+    
+    atomic_fetch_add(&changesMade, 1);
+}
+
+static void stressNoteOff(PDSynth *pdSynth, uint32_t when)
+{
+    atomic_fetch_add(&changesMade, 1);
+}
+
+// playSynthNote and releaseSynthNote log an error whenever they refuse a
+// change, which happens a lot here and is expected
+static void stressLogToConsole(const char *fmt, ...)
+{
+    if (strncmp(fmt, "Error", 5) == 0) {
+        atomic_fetch_add(&refusedChanges, 1);
+        changeRefused = true;
+    }
+}
+
+static void * mainThread(void *arg)
+{
+    uint32_t random = 1;
+    uint32_t expectedNoteOff = 0;
+    
+    for(uint32_t i = 0; i < iterations; ++i) {
+        uint32_t now = atomic_fetch_add(&currentTime, kClockStep) + kClockStep;
+        uint32_t when = now + randomScheduleAhead(&random);
+        uint32_t noteOn, noteOff;
+        
+        changeRefused = false;
+        
+        if (i % 2 == 0) {
+            playSynthNote(&synth, frequencyForTime(when), when, now, false);
+        } else {
+            releaseSynthNote(&synth, when);
+            
+            if (!changeRefused) {
+                expectedNoteOff = when;
+            }
+        }
+        
+        getSynthLastNoteOnAndOffTimes(&synth, &noteOn, &noteOff);
+        
+        if (noteOff != expectedNoteOff) {
+            atomic_fetch_add(&wrongNoteOffs, 1);
+            expectedNoteOff = noteOff;
+        }
+    }
+    
+    atomic_store(&mainThreadDone, true);
+    return NULL;
+}
+
+static void * audioThread(void *arg)
+{
+    uint32_t random = 2;
+    
+    for(uint32_t i = 0; i < iterations && !atomic_load(&mainThreadDone); ++i) {
+        uint32_t now = atomic_load(&currentTime);
+        uint32_t when = now + randomScheduleAhead(&random);
+        
+        playSynthNote(&synth, frequencyForTime(when), when, now, true);
+    }
+    
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 2 || (argc == 2 && (iterations = (uint32_t)strtoul(argv[1], NULL, 10)) == 0)) {
+        fprintf(stderr, "Usage: synthstress [iterations]\n");
+        return 1;
+    }
+    
+    PlaydateAPI *hostAPI = hostPlaydateAPI();
+    struct playdate_sys system = *hostAPI->system;
+    struct playdate_sound_synth soundSynth = {
+        .playNote = stressPlayNote,
+        .noteOff = stressNoteOff,
+    };
+    struct playdate_sound sound = {
+        .synth = &soundSynth,
+        .getCurrentTime = stressGetCurrentTime,
+    };
+    PlaydateAPI api = *hostAPI;
+    
+    system.logToConsole = stressLogToConsole;
+    api.system = &system;
+    api.sound = &sound;
+    initializeTrackerMusic(&api);
+    
+    // The synth is never actually played, it just has to be there
+    synth.synth = (PDSynth *)&synth;
+    
+    pthread_t threads[2];
+    double startTime = hostTimeSeconds();
+    
+    pthread_create(&threads[0], NULL, mainThread, NULL);
+    pthread_create(&threads[1], NULL, audioThread, NULL);
+    pthread_join(threads[0], NULL);
+    pthread_join(threads[1], NULL);
+    
+    uint32_t changeCount = atomic_load(&synth.noteTimesIndex) >> 2;
+    uint32_t lostChanges = atomic_load(&changesMade) - changeCount;
+    
+    printf("%u changes made and %u refused in %.2f seconds\n", atomic_load(&changesMade),
+           atomic_load(&refusedChanges), hostTimeSeconds() - startTime);
+    printf("Mismatched frequencies: %u\n", atomic_load(&mismatchedFrequencies));
+    printf("Lost changes: %u\n", lostChanges);
+    printf("Wrong note off times: %u\n", atomic_load(&wrongNoteOffs));
+    
+    if (atomic_load(&mismatchedFrequencies) > 0 || lostChanges > 0 || atomic_load(&wrongNoteOffs) > 0) {
+        printf("FAILED\n");
+        return 1;
+    }
+    
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,205 @@
+// Bundles TMC files into a TMC archive (see tmc.h), which can be opened with
+// openTrackerMusicArchive or, once it's in memory, openTrackerMusicArchiveData.
+//
+// Usage: tmcpack <output archive> <tmc files...>
+//
+// Each song is named after its file, without the directory or extension, so
+// music/level1.tmc is found with findSongInTrackerMusicArchive(archive,
+// "level1"). Names must be shorter than TMC_ARCHIVE_NAME_LENGTH characters.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "host_playdate.h"
+#include "tmc.h"
+#include "tracker_music.h"
+#include "tracker_music_p.h"
+
+static uint32_t align(uint32_t value)
+{
+    return (value + TMC_ALIGNMENT - 1) & ~(TMC_ALIGNMENT - 1);
+}
+
+static uint8_t * readFile(const char *path, uint32_t *size)
+{
+    FILE *f = fopen(path, "rb");
+    uint8_t *data = NULL;
+    long length = 0;
+    
+    if (!f) {
+        return NULL;
+    }
+    
+    if (fseek(f, 0, SEEK_END) == 0 && (length = ftell(f)) > 0 && fseek(f, 0, SEEK_SET) == 0
+        && (data = malloc(length)) != NULL && fread(data, 1, length, f) != (size_t)length) {
+        free(data);
+        data = NULL;
+    }
+    
+    *size = (uint32_t)length;
+    fclose(f);
+    return data;
+}
+
+// Makes a song's name from its path by removing the directory and extension
+static bool songName(const char *path, char *name)
+{
+    const char *start = strrchr(path, '/');
+    const char *end;
+    
+    start = start ? start + 1 : path;
+    end = strrchr(start, '.');
+    
+    if (!end) {
+        end = start + strlen(start);
+    }
+    
+    if (end - start >= TMC_ARCHIVE_NAME_LENGTH) {
+        return false;
+    }
+    
+    memset(name, 0, TMC_ARCHIVE_NAME_LENGTH);
+    memcpy(name, start, end - start);
+    return true;
+}
+
+static bool writeArchive(FILE *f, TMCArchiveHeader *header, TMCArchiveEntry *entries, uint16_t *hashSlots,
+                         uint8_t **songs)
+{
+    static const uint8_t padding[TMC_ALIGNMENT] = {0};
+    uint32_t position = 0;
+    
+    if (fwrite(header, sizeof(TMCArchiveHeader), 1, f) != 1
+        || fwrite(entries, sizeof(TMCArchiveEntry), header->songCount, f) != header->songCount
+        || fwrite(hashSlots, sizeof(uint16_t), header->hashSlotCount, f) != header->hashSlotCount) {
+        return false;
+    }
+    
+    position = header->hashSlotsOffset + header->hashSlotCount * sizeof(uint16_t);
+    
+    for(int i = 0; i < header->songCount; ++i) {
+        if (fwrite(padding, 1, entries[i].offset - position, f) != entries[i].offset - position
+            || fwrite(songs[i], 1, entries[i].size, f) != entries[i].size) {
+            return false;
+        }
+        
+        position = entries[i].offset + entries[i].size;
+    }
+    
+    return true;
+}
+
+// Reads a song, checks that it loads, and adds it to the entries and hash table
+static bool addSong(TMCArchiveHeader *header, TMCArchiveEntry *entries, uint16_t *hashSlots, uint8_t **songs,
+                    int index, char *path, uint32_t *offset)
+{
+    TMCArchiveEntry *entry = &entries[index];
+    TrackerMusic music;
+    uint32_t size;
+    
+    if (!songName(path, entry->name)) {
+        fprintf(stderr, "Error: %s's name is too long\n", path);
+        return false;
+    }
+    
+    if (!(songs[index] = readFile(path, &size))) {
+        fprintf(stderr, "Error: couldn't read %s\n", path);
+        return false;
+    }
+    
+    if (readMusicFromTMCData(&music, songs[index], size) != kMusicNoError) {
+        fprintf(stderr, "Error: %s isn't a valid TMC file\n", path);
+        return false;
+    }
+    
+    freeTrackerMusic(&music);
+    
+    entry->nameHash = tmcArchiveNameHash(entry->name);
+    entry->offset = *offset;
+    entry->size = size;
+    *offset = align(*offset + size);
+    
+    uint32_t mask = header->hashSlotCount - 1;
+    uint32_t slot = entry->nameHash & mask;
+    
+    while(hashSlots[slot] != 0) {
+        if (strcmp(entries[hashSlots[slot] - 1].name, entry->name) == 0) {
+            fprintf(stderr, "Error: more than one song is named %s\n", entry->name);
+            return false;
+        }
+        
+        slot = (slot + 1) & mask;
+    }
+    
+    hashSlots[slot] = index + 1;
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <output archive> <tmc files...>\n", argv[0]);
+        return 1;
+    }
+    
+    PlaydateAPI *pd = hostPlaydateAPI();
+    initializeTrackerMusic(pd);
+    
+    int songCount = argc - 2;
+    TMCArchiveHeader header = {0};
+    
+    if (songCount > UINT16_MAX) {
+        fprintf(stderr, "Error: too many songs\n");
+        return 1;
+    }
+    
+    memcpy(header.magic, TMC_ARCHIVE_MAGIC, sizeof(header.magic));
+    header.version = TMC_ARCHIVE_VERSION;
+    header.songCount = songCount;
+    
+    // Keeping the table at most half full means lookups rarely probe more than
+    // a slot or two
+    header.hashSlotCount = 1;
+    
+    while(header.hashSlotCount < (uint32_t)songCount * 2) {
+        header.hashSlotCount *= 2;
+    }
+    
+    header.entriesOffset = sizeof(TMCArchiveHeader);
+    header.hashSlotsOffset = header.entriesOffset + songCount * sizeof(TMCArchiveEntry);
+    
+    TMCArchiveEntry *entries = calloc(songCount, sizeof(TMCArchiveEntry));
+    uint8_t **songs = calloc(songCount, sizeof(uint8_t *));
+    uint16_t *hashSlots = calloc(header.hashSlotCount, sizeof(uint16_t));
+    uint32_t offset = align(header.hashSlotsOffset + header.hashSlotCount * sizeof(uint16_t));
+    bool success = (entries && songs && hashSlots);
+    
+    for(int i = 0; success && i < songCount; ++i) {
+        success = addSong(&header, entries, hashSlots, songs, i, argv[i + 2], &offset);
+    }
+    
+    if (success) {
+        FILE *f = fopen(argv[1], "wb");
+        success = f && writeArchive(f, &header, entries, hashSlots, songs);
+        
+        if (f && fclose(f) != 0) {
+            success = false;
+        }
+        
+        if (success) {
+            printf("Wrote %d songs (%u bytes) to %s\n", songCount, offset, argv[1]);
+        } else {
+            fprintf(stderr, "Error: couldn't write %s\n", argv[1]);
+        }
+    }
+    
+    for(int i = 0; songs && i < songCount; ++i) {
+        free(songs[i]);
+    }
+    
+    free(songs);
+    free(entries);
+    free(hashSlots);
+    return success ? 0 : 1;
+}
@@ -0,0 +1,205 @@
+#include "adpcm.h"
+
+#include <string.h>
+
+#define kADPCMDataHeaderSize 2
+
+static const int16_t stepSizes[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45, 50, 55, 60, 66, 73, 80, 88, 97,
+    107, 118, 130, 143, 157, 173, 190, 209, 230, 253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796,
+    876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871,
+    5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623,
+    27086, 29794, 32767
+};
+
+static const int8_t indexAdjustments[16] = {
+    -1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8
+};
+
+typedef struct _ADPCMState {
+    int32_t predictor;
+    int32_t index;
+} ADPCMState;
+
+static inline int32_t clampInt(int32_t val, int32_t minVal, int32_t maxVal)
+{
+    if (val < minVal)
+        return minVal;
+    if (val > maxVal)
+        return maxVal;
+    return val;
+}
+
+// Applies a nibble to the decoder state and returns the resulting sample. The
+// encoder uses this too so that it tracks exactly what the decoder will do.
+static inline int16_t adpcmStep(ADPCMState *state, uint8_t nibble)
+{
+    int32_t step = stepSizes[state->index];
+    int32_t diff = step >> 3;
+    
+    if (nibble & 4) {
+        diff += step;
+    }
+    if (nibble & 2) {
+        diff += step >> 1;
+    }
+    if (nibble & 1) {
+        diff += step >> 2;
+    }
+    
+    state->predictor = clampInt(state->predictor + ((nibble & 8) ? -diff : diff), -32768, 32767);
+    state->index = clampInt(state->index + indexAdjustments[nibble], 0, 88);
+    return (int16_t)state->predictor;
+}
+
+static inline uint8_t adpcmEncodeSample(ADPCMState *state, int16_t sample)
+{
+    int32_t step = stepSizes[state->index];
+    int32_t diff = sample - state->predictor;
+    uint8_t nibble = 0;
+    
+    if (diff < 0) {
+        nibble = 8;
+        diff = -diff;
+    }
+    
+    if (diff >= step) {
+        nibble |= 4;
+        diff -= step;
+    }
+    
+    step >>= 1;
+    
+    if (diff >= step) {
+        nibble |= 2;
+        diff -= step;
+    }
+    
+    step >>= 1;
+    
+    if (diff >= step) {
+        nibble |= 1;
+    }
+    
+    adpcmStep(state, nibble);
+    return nibble;
+}
+
+uint32_t adpcmEncodedSize(uint32_t sampleCount)
+{
+    uint32_t fullBlocks = sampleCount / ADPCM_SAMPLES_PER_BLOCK;
+    uint32_t remainder = sampleCount % ADPCM_SAMPLES_PER_BLOCK;
+    uint32_t size = kADPCMDataHeaderSize + fullBlocks * ADPCM_BLOCK_SIZE;
+    
+    if (remainder > 0) {
+        size += ADPCM_BLOCK_HEADER_SIZE + remainder / 2;
+    }
+    
+    return size;
+}
+
+// The number of samples in ADPCM data of the given size. If the last block has
+// an odd number of nibbles then its final (padding) nibble is counted too.
+uint32_t adpcmSampleCount(uint32_t byteCount)
+{
+    if (byteCount <= kADPCMDataHeaderSize) {
+        return 0;
+    }
+    
+    byteCount -= kADPCMDataHeaderSize;
+    
+    uint32_t fullBlocks = byteCount / ADPCM_BLOCK_SIZE;
+    uint32_t remainder = byteCount % ADPCM_BLOCK_SIZE;
+    uint32_t count = fullBlocks * ADPCM_SAMPLES_PER_BLOCK;
+    
+    if (remainder >= ADPCM_BLOCK_HEADER_SIZE) {
+        count += 1 + (remainder - ADPCM_BLOCK_HEADER_SIZE) * 2;
+    }
+    
+    return count;
+}
+
+// data must have room for adpcmEncodedSize(sampleCount) bytes
+void encodeADPCM(const int16_t *samples, uint32_t sampleCount, uint8_t *data)
+{
+    ADPCMState state = {0, 0};
+    
+    data[0] = ADPCM_BLOCK_SIZE & 0xFF;
+    data[1] = ADPCM_BLOCK_SIZE >> 8;
+    data += kADPCMDataHeaderSize;
+    
+    for(uint32_t blockStart = 0; blockStart < sampleCount; blockStart += ADPCM_SAMPLES_PER_BLOCK) {
+        uint32_t blockSamples = sampleCount - blockStart;
+        
+        if (blockSamples > ADPCM_SAMPLES_PER_BLOCK) {
+            blockSamples = ADPCM_SAMPLES_PER_BLOCK;
+        }
+        
+        // Each block starts over from its exact first sample, so that it can
+        // be decoded on its own
+        state.predictor = samples[blockStart];
+        data[0] = (uint16_t)samples[blockStart] & 0xFF;
+        data[1] = (uint16_t)samples[blockStart] >> 8;
+        data[2] = (uint8_t)state.index;
+        data[3] = 0;
+        data += ADPCM_BLOCK_HEADER_SIZE;
+        
+        for(uint32_t i = 1; i < blockSamples; i += 2) {
+            uint8_t low = adpcmEncodeSample(&state, samples[blockStart + i]);
+            uint8_t high = 0;
+            
+            if (i + 1 < blockSamples) {
+                high = adpcmEncodeSample(&state, samples[blockStart + i + 1]);
+            }
+            
+            *data++ = low | (high << 4);
+        }
+    }
+}
+
+// Decodes sampleCount samples starting at firstSample, which must be within the
+// data. Decoding starts from the beginning of the block that firstSample is in.
+void decodeADPCM(const uint8_t *data, uint32_t byteCount, uint32_t firstSample, uint32_t sampleCount, int16_t *samples)
+{
+    uint32_t totalSamples = adpcmSampleCount(byteCount);
+    uint32_t block = firstSample / ADPCM_SAMPLES_PER_BLOCK;
+    uint32_t position = block * ADPCM_SAMPLES_PER_BLOCK;
+    uint32_t endSample = firstSample + sampleCount;
+    
+    if (endSample > totalSamples) {
+        memset(samples + (totalSamples - firstSample), 0, (endSample - totalSamples) * sizeof(int16_t));
+        endSample = totalSamples;
+    }
+    
+    data += kADPCMDataHeaderSize + block * ADPCM_BLOCK_SIZE;
+    
+    while(position < endSample) {
+        ADPCMState state;
+        const uint8_t *nibbles = data + ADPCM_BLOCK_HEADER_SIZE;
+        uint32_t blockEnd = position + ADPCM_SAMPLES_PER_BLOCK;
+        
+        state.predictor = (int16_t)(data[0] | (data[1] << 8));
+        state.index = clampInt(data[2], 0, 88);
+        
+        if (position >= firstSample) {
+            samples[position - firstSample] = (int16_t)state.predictor;
+        }
+        
+        ++position;
+        
+        if (blockEnd > endSample) {
+            blockEnd = endSample;
+        }
+        
+        for(uint32_t i = 0; position < blockEnd; ++i, ++position) {
+            uint8_t nibble = (i & 1) ? (nibbles[i >> 1] >> 4) : (nibbles[i >> 1] & 0x0F);
+            int16_t sample = adpcmStep(&state, nibble);
+            
+            if (position >= firstSample) {
+                samples[position - firstSample] = sample;
+            }
+        }
+        
+        data += ADPCM_BLOCK_SIZE;
+    }
+}
@@ -0,0 +1,23 @@
+#ifndef ADPCM_H
+#define ADPCM_H
+
+#include <stdint.h>
+
+// Encodes and decodes mono 16-bit samples as IMA ADPCM, laid out the same way
+// as the audio data of a Playdate .pda file so that it can be played directly
+// with the kSoundADPCMMono format. The data starts with the block size as a
+// little endian uint16_t, followed by the blocks. Each block starts with the
+// block's first sample (int16_t) and the step index (uint8_t, then a zero
+// byte), and the rest of its samples are 4 bits each, low nibble first. Every
+// block is ADPCM_BLOCK_SIZE bytes except for the last one, which can be shorter.
+
+#define ADPCM_BLOCK_SIZE 256
+#define ADPCM_BLOCK_HEADER_SIZE 4
+#define ADPCM_SAMPLES_PER_BLOCK (1 + (ADPCM_BLOCK_SIZE - ADPCM_BLOCK_HEADER_SIZE) * 2)
+
+uint32_t adpcmEncodedSize(uint32_t sampleCount);
+uint32_t adpcmSampleCount(uint32_t byteCount);
+void encodeADPCM(const int16_t *samples, uint32_t sampleCount, uint8_t *data);
+void decodeADPCM(const uint8_t *data, uint32_t byteCount, uint32_t firstSample, uint32_t sampleCount, int16_t *samples);
+
+#endif // ADPCM_H
@@ -0,0 +1,353 @@
+#include "lz4.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef MIN
+#define MIN(a, b) ((a < b) ? a : b)
+#endif
+
+#define printLog pd->system->logToConsole
+static PlaydateAPI *pd = NULL;
+
+#define kLZ4MinMatch 4
+#define kLZ4FlagVersionMask 0xC0
+#define kLZ4FlagVersion 0x40
+#define kLZ4FlagBlockIndependence 0x20
+#define kLZ4FlagBlockChecksum 0x10
+#define kLZ4FlagContentSize 0x08
+#define kLZ4FlagDictionaryId 0x01
+#define kLZ4UncompressedBlockFlag 0x80000000u
+
+void initializeLZ4(PlaydateAPI *inAPI)
+{
+    pd = inAPI;
+}
+
+static inline uint32_t readLittleEndian32(const uint8_t *data)
+{
+    return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+// Reads one of the extra length bytes that follow a token's 4-bit length when
+// it's 15. Returns false if the block ends first.
+static inline bool readExtraLength(const uint8_t **src, const uint8_t *srcEnd, uint32_t *length)
+{
+    uint8_t byte;
+    
+    do {
+        if (*src >= srcEnd) {
+            return false;
+        }
+        
+        byte = *(*src)++;
+        (*length) += byte;
+    } while(byte == 255);
+    
+    return true;
+}
+
+// Decompresses a single LZ4 block, and returns its decompressed length, or -1
+// if the data is invalid or doesn't fit in destCapacity bytes.
+int32_t lz4DecompressBlock(const uint8_t *src, uint32_t srcLength, uint8_t *dest, uint32_t destCapacity)
+{
+    const uint8_t *srcEnd = src + srcLength;
+    uint8_t *out = dest;
+    uint8_t *destEnd = dest + destCapacity;
+    
+    while(src < srcEnd) {
+        uint8_t token = *src++;
+        uint32_t literalLength = token >> 4;
+        
+        if (literalLength == 15 && !readExtraLength(&src, srcEnd, &literalLength)) {
+            return -1;
+        }
+        
+        if (literalLength > (uint32_t)(srcEnd - src) || literalLength > (uint32_t)(destEnd - out)) {
+            return -1;
+        }
+        
+        memcpy(out, src, literalLength);
+        out += literalLength;
+        src += literalLength;
+        
+        // The last sequence in a block is only literals
+        if (src >= srcEnd) {
+            break;
+        }
+        
+        if (srcEnd - src < 2) {
+            return -1;
+        }
+        
+        uint32_t matchOffset = src[0] | (src[1] << 8);
+        uint32_t matchLength = token & 0x0F;
+        src += 2;
+        
+        if (matchLength == 15 && !readExtraLength(&src, srcEnd, &matchLength)) {
+            return -1;
+        }
+        
+        matchLength += kLZ4MinMatch;
+        
+        if (matchOffset == 0 || matchOffset > (uint32_t)(out - dest) || matchLength > (uint32_t)(destEnd - out)) {
+            return -1;
+        }
+        
+        const uint8_t *match = out - matchOffset;
+        
+        if (matchOffset >= matchLength) {
+            memcpy(out, match, matchLength);
+        } else {
+            // The match overlaps what it's copying to, repeating its start
+            for(uint32_t i = 0; i < matchLength; ++i) {
+                out[i] = match[i];
+            }
+        }
+        
+        out += matchLength;
+    }
+    
+    return (int32_t)(out - dest);
+}
+
+// Remembers where a block starts, if it's the next one that hasn't been found
+// yet
+static bool addBlock(LZ4Reader *reader, uint32_t index, uint32_t fileOffset, uint32_t start)
+{
+    if (index < reader->knownBlockCount) {
+        return true;
+    }
+    
+    if (reader->knownBlockCount >= reader->blockCapacity) {
+        uint32_t newCapacity = reader->blockCapacity ? reader->blockCapacity * 2 : 16;
+        uint32_t *fileOffsets = realloc(reader->blockFileOffsets, newCapacity * sizeof(uint32_t));
+        
+        if (!fileOffsets) {
+            return false;
+        }
+        
+        reader->blockFileOffsets = fileOffsets;
+        
+        uint32_t *starts = realloc(reader->blockStarts, newCapacity * sizeof(uint32_t));
+        
+        if (!starts) {
+            return false;
+        }
+        
+        reader->blockStarts = starts;
+        reader->blockCapacity = newCapacity;
+    }
+    
+    reader->blockFileOffsets[reader->knownBlockCount] = fileOffset;
+    reader->blockStarts[reader->knownBlockCount] = start;
+    ++reader->knownBlockCount;
+    return true;
+}
+
+// Reads and decompresses a block that's already been found. Returns false at
+// the end of the frame or if the block can't be read.
+static bool loadBlock(LZ4Reader *reader, uint32_t index)
+{
+    uint8_t sizeData[4];
+    uint32_t fileOffset = reader->blockFileOffsets[index];
+    uint8_t *previousBlock = reader->previousBlock;
+    uint32_t previousIndex = reader->previousBlockIndex;
+    uint32_t previousLength = reader->previousBlockLength;
+    
+    // The current block becomes the previous one, and if it's the previous one
+    // that's being loaded then they just trade places
+    reader->previousBlock = reader->block;
+    reader->block = previousBlock;
+    
+    if (index == previousIndex && previousLength > 0) {
+        reader->previousBlockIndex = reader->blockIndex;
+        reader->previousBlockLength = reader->blockLength;
+        reader->blockIndex = index;
+        reader->blockLength = previousLength;
+        reader->blockPosition = 0;
+        return true;
+    }
+    
+    reader->previousBlockIndex = reader->blockIndex;
+    reader->previousBlockLength = reader->blockLength;
+    reader->blockIndex = index;
+    reader->blockLength = 0;
+    reader->blockPosition = 0;
+    
+    if (pd->file->seek(reader->file, fileOffset, SEEK_SET) != 0
+        || pd->file->read(reader->file, sizeData, sizeof(sizeData)) != sizeof(sizeData)) {
+        printLog("Error: couldn't read LZ4 block");
+        return false;
+    }
+    
+    uint32_t size = readLittleEndian32(sizeData);
+    bool isCompressed = (size & kLZ4UncompressedBlockFlag) == 0;
+    
+    size &= ~kLZ4UncompressedBlockFlag;
+    
+    if (size == 0) {
+        // The end mark
+        reader->foundEnd = true;
+        return false;
+    }
+    
+    if (size > reader->maxBlockSize) {
+        printLog("Error: LZ4 block is larger than the frame's block size");
+        return false;
+    }
+    
+    uint8_t *data = isCompressed ? reader->compressedBlock : reader->block;
+    
+    if (pd->file->read(reader->file, data, size) != (int)size) {
+        printLog("Error: couldn't read LZ4 block");
+        return false;
+    }
+    
+    if (isCompressed) {
+        int32_t length = lz4DecompressBlock(reader->compressedBlock, size, reader->block, reader->maxBlockSize);
+        
+        if (length < 0) {
+            printLog("Error: LZ4 block is invalid");
+            return false;
+        }
+        
+        reader->blockLength = length;
+    } else {
+        reader->blockLength = size;
+    }
+    
+    return addBlock(reader, index + 1, fileOffset + sizeof(sizeData) + size + (reader->hasBlockChecksums ? 4 : 0),
+                    reader->blockStarts[index] + reader->blockLength);
+}
+
+// Starts reading an LZ4 frame from the beginning of a file, refusing frames
+// whose blocks are bigger than maxBlockSize since a whole block has to fit in
+// memory three times over (compressed, decompressed and the previous block).
+// The file is left open by lz4EndReading.
+bool lz4BeginReading(LZ4Reader *reader, SDFile *file, uint32_t maxBlockSize)
+{
+    uint8_t header[7];
+    uint32_t headerLength = 7;
+    
+    memset(reader, 0, sizeof(LZ4Reader));
+    reader->file = file;
+    
+    if (pd->file->seek(file, 0, SEEK_SET) != 0 || pd->file->read(file, header, sizeof(header)) != sizeof(header)
+        || readLittleEndian32(header) != LZ4_FRAME_MAGIC) {
+        printLog("Error: file isn't an LZ4 frame");
+        return false;
+    }
+    
+    uint8_t flags = header[4];
+    uint8_t blockSizeId = (header[5] >> 4) & 0x07;
+    
+    if ((flags & kLZ4FlagVersionMask) != kLZ4FlagVersion || blockSizeId < LZ4_MIN_BLOCK_SIZE_ID) {
+        printLog("Error: unsupported LZ4 frame header");
+        return false;
+    }
+    
+    if ((flags & kLZ4FlagBlockIndependence) == 0) {
+        printLog("Error: LZ4 frames with linked blocks aren't supported (compress without lz4 -BD)");
+        return false;
+    }
+    
+    reader->maxBlockSize = lz4BlockSizeForId(blockSizeId);
+    
+    if (reader->maxBlockSize > maxBlockSize) {
+        printLog("Error: LZ4 frame's block size of %d bytes is larger than the maximum of %d",
+                 (int)reader->maxBlockSize, (int)maxBlockSize);
+        return false;
+    }
+    
+    reader->hasBlockChecksums = (flags & kLZ4FlagBlockChecksum) != 0;
+    
+    if (flags & kLZ4FlagContentSize) {
+        headerLength += 8;
+    }
+    
+    if (flags & kLZ4FlagDictionaryId) {
+        headerLength += 4;
+    }
+    
+    reader->block = malloc(reader->maxBlockSize);
+    reader->previousBlock = malloc(reader->maxBlockSize);
+    reader->compressedBlock = malloc(reader->maxBlockSize);
+    
+    if (!reader->block || !reader->previousBlock || !reader->compressedBlock || !addBlock(reader, 0, headerLength, 0)) {
+        printLog("Error: couldn't allocate memory for LZ4 blocks");
+        lz4EndReading(reader);
+        return false;
+    }
+    
+    // Nothing's loaded yet, so the first read loads the first block
+    reader->blockIndex = UINT32_MAX;
+    reader->previousBlockIndex = UINT32_MAX;
+    return true;
+}
+
+uint32_t lz4Read(LZ4Reader *reader, void *dest, uint32_t length)
+{
+    uint8_t *out = (uint8_t *)dest;
+    uint32_t total = 0;
+    
+    while(total < length) {
+        if (reader->blockPosition >= reader->blockLength) {
+            uint32_t nextIndex = reader->blockIndex + 1;
+            
+            if (nextIndex >= reader->knownBlockCount || !loadBlock(reader, nextIndex)) {
+                break;
+            }
+            
+            continue;
+        }
+        
+        uint32_t count = MIN(reader->blockLength - reader->blockPosition, length - total);
+        
+        memcpy(out + total, reader->block + reader->blockPosition, count);
+        reader->blockPosition += count;
+        total += count;
+    }
+    
+    return total;
+}
+
+// Seeks to an offset in the uncompressed data, decompressing the block it's in
+bool lz4Seek(LZ4Reader *reader, uint32_t offset)
+{
+    uint32_t index = 0;
+    
+    if (reader->blockIndex != UINT32_MAX && offset >= reader->blockStarts[reader->blockIndex]
+        && offset < reader->blockStarts[reader->blockIndex] + reader->blockLength) {
+        reader->blockPosition = offset - reader->blockStarts[reader->blockIndex];
+        return true;
+    }
+    
+    // Start from the last block known to start at or before the offset
+    for(uint32_t i = 1; i < reader->knownBlockCount && reader->blockStarts[i] <= offset; ++i) {
+        index = i;
+    }
+    
+    while(loadBlock(reader, index)) {
+        if (offset < reader->blockStarts[index] + reader->blockLength) {
+            reader->blockPosition = offset - reader->blockStarts[index];
+            return true;
+        }
+        
+        ++index;
+    }
+    
+    // Seeking to the very end is fine, anything past it isn't
+    return reader->foundEnd && offset == reader->blockStarts[index];
+}
+
+// Frees the reader's memory, but doesn't close its file
+void lz4EndReading(LZ4Reader *reader)
+{
+    free(reader->block);
+    free(reader->previousBlock);
+    free(reader->compressedBlock);
+    free(reader->blockFileOffsets);
+    free(reader->blockStarts);
+    memset(reader, 0, sizeof(LZ4Reader));
+}
@@ -0,0 +1,62 @@
+#ifndef LZ4_H
+#define LZ4_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "pd_api.h"
+
+// Reads files in the LZ4 frame format, such as those written by the lz4
+// command line tool, as a stream that can be read from and seeked in like the
+// uncompressed file. Only frames whose blocks are compressed independently of
+// each other are supported (the lz4 tool's default), so that seeking only needs
+// to decompress the block that's seeked to. The start of each block is
+// remembered as the file is read, so seeking back to an earlier part of it
+// doesn't mean starting over from the beginning, and the previously
+// decompressed block is kept around since loading an S3M alternates between
+// reading instrument headers near the start of the file and their sample data
+// further on. Checksums aren't verified.
+
+#define LZ4_FRAME_MAGIC 0x184D2204
+#define LZ4_MIN_BLOCK_SIZE_ID 4
+#define LZ4_MAX_BLOCK_SIZE_ID 7
+
+typedef struct _LZ4Reader {
+    SDFile *file;
+    uint8_t *block;
+    uint8_t *compressedBlock;
+    uint32_t maxBlockSize;
+    bool hasBlockChecksums;
+    
+    uint32_t blockIndex;
+    uint32_t blockLength;
+    uint32_t blockPosition;
+    
+    uint8_t *previousBlock;
+    uint32_t previousBlockIndex;
+    uint32_t previousBlockLength;
+    
+    // Where each block that's been found so far starts, in the file and in the
+    // uncompressed data
+    uint32_t *blockFileOffsets;
+    uint32_t *blockStarts;
+    uint32_t knownBlockCount;
+    uint32_t blockCapacity;
+    bool foundEnd;
+} LZ4Reader;
+
+void initializeLZ4(PlaydateAPI *inAPI);
+
+static inline uint32_t lz4BlockSizeForId(uint8_t id)
+{
+    return 1u << (8 + 2 * id);
+}
+
+bool lz4BeginReading(LZ4Reader *reader, SDFile *file, uint32_t maxBlockSize);
+uint32_t lz4Read(LZ4Reader *reader, void *dest, uint32_t length);
+bool lz4Seek(LZ4Reader *reader, uint32_t offset);
+void lz4EndReading(LZ4Reader *reader);
+
+int32_t lz4DecompressBlock(const uint8_t *src, uint32_t srcLength, uint8_t *dest, uint32_t destCapacity);
+
+#endif // LZ4_H
@@ -1,5 +1,7 @@
 #include "s3m.h"
 
+#include "lz4.h"
+#include "tmc.h"
 #include "tracker_music.h"
 #include "tracker_music_p.h"
 
@@ -11,16 +13,20 @@
 #endif
 static PlaydateAPI *pd = NULL;
 
+typedef struct _S3MReader {
+    SDFile *file;
+    LZ4Reader *lz4; // set when the file is LZ4 compressed
+    uint8_t *buffer;
+    uint32_t bufferOffset;
+    uint32_t bufferLength;
+    uint32_t bufferPosition;
+} S3MReader;
+
 void initializeS3M(PlaydateAPI *inAPI)
 {
     pd = inAPI;
 }
 
-static inline void * parapointerToPointer(uint8_t *rawData, uint32_t parapointer)
-{
-    return rawData + parapointer * 16;
-}
-
 static uint8_t s3mChannelPanFromData(uint8_t data)
 {
     uint8_t val = data & 0x0F;
@@ -45,7 +51,7 @@ static inline bool s3mIsNoteOff(uint8_t note) {
 
 #define S3M_EFFECT_NUM(x) (x - 'A' + 1)
 
-static uint8_t s3mEffectToEnum(uint8_t effect, uint8_t *effectVal, int patternIndex, int row)
+static uint8_t s3mEffectToEnum(uint8_t effect, uint8_t *effectVal, int patternIndex, int row, bool logWarnings)
 {
     switch(effect) {
         case 0: // appears in some poorly formed s3m files
@@ -96,8 +102,11 @@ static uint8_t s3mEffectToEnum(uint8_t effect, uint8_t *effectVal, int patternIn
                 case 0xD:
                     return kEffectNoteDelay;
                 default:
-                    printLog("Warning: s3m file contains unimplemented effect: S%X at pattern %d row %d", hi,
-                             patternIndex, row);
+                    if (logWarnings) {
+                        printLog("Warning: s3m file contains unimplemented effect: S%X at pattern %d row %d", hi,
+                                 patternIndex, row);
+                    }
+                    
                     return kEffectNone;
             }
         }
@@ -110,16 +119,152 @@ static uint8_t s3mEffectToEnum(uint8_t effect, uint8_t *effectVal, int patternIn
         case S3M_EFFECT_NUM('X'):
             return kEffectSetPanningFine;
         default:
-            printLog("Warning: s3m file contains unimplemented effect: %c (0x%02X) at pattern %d row %d",
-                     (effect - 1 + 'A'), effect, patternIndex, row);
+            if (logWarnings) {
+                printLog("Warning: s3m file contains unimplemented effect: %c (0x%02X) at pattern %d row %d",
+                         (effect - 1 + 'A'), effect, patternIndex, row);
+            }
+            
             return kEffectNone;
     }   
 }
 
-static int s3mReadChannels(TrackerMusic *music, S3MHeader *header)
+// The loader streams the file rather than reading it into memory all at once.
+// Only a small fixed buffer is used for the header, tables and packed pattern
+// data, and sample data is read straight into its final destination, so peak
+// memory use while loading is about the same as the decoded song's. LZ4
+// compressed files are decompressed a block at a time as they're read.
+
+static int s3mReaderReadFile(S3MReader *reader, void *dest, uint32_t length)
+{
+    if (reader->lz4) {
+        return lz4Read(reader->lz4, dest, length);
+    }
+    
+    return pd->file->read(reader->file, dest, length);
+}
+
+static bool s3mReaderSeek(S3MReader *reader, uint32_t offset)
+{
+    if (offset >= reader->bufferOffset && offset < reader->bufferOffset + reader->bufferLength) {
+        reader->bufferPosition = offset - reader->bufferOffset;
+        return true;
+    }
+    
+    if (reader->lz4 ? !lz4Seek(reader->lz4, offset) : pd->file->seek(reader->file, offset, SEEK_SET) != 0) {
+        return false;
+    }
+    
+    reader->bufferOffset = offset;
+    reader->bufferLength = 0;
+    reader->bufferPosition = 0;
+    return true;
+}
+
+static bool s3mReaderFill(S3MReader *reader)
+{
+    if (!reader->file) {
+        // Reading from memory, so there's nothing more to read
+        return false;
+    }
+    
+    int result = s3mReaderReadFile(reader, reader->buffer, S3M_READ_BUFFER_SIZE);
+    
+    reader->bufferOffset += reader->bufferLength;
+    reader->bufferLength = (result > 0) ? result : 0;
+    reader->bufferPosition = 0;
+    
+    return reader->bufferLength > 0;
+}
+
+static inline uint8_t s3mReadByte(S3MReader *reader)
+{
+    if (reader->bufferPosition >= reader->bufferLength && !s3mReaderFill(reader)) {
+        return 0;
+    }
+    
+    return reader->buffer[reader->bufferPosition++];
+}
+
+static uint32_t s3mRead(S3MReader *reader, void *dest, uint32_t length)
+{
+    uint8_t *out = (uint8_t *)dest;
+    uint32_t total = MIN(reader->bufferLength - reader->bufferPosition, length);
+    
+    memcpy(out, reader->buffer + reader->bufferPosition, total);
+    reader->bufferPosition += total;
+    
+    if (length - total >= S3M_READ_BUFFER_SIZE) {
+        // Large reads bypass the buffer and go directly into their destination
+        int result = s3mReaderReadFile(reader, out + total, length - total);
+        
+        reader->bufferOffset += reader->bufferLength + ((result > 0) ? result : 0);
+        reader->bufferLength = 0;
+        reader->bufferPosition = 0;
+        
+        return total + ((result > 0) ? result : 0);
+    }
+    
+    while(total < length) {
+        if (reader->bufferPosition >= reader->bufferLength && !s3mReaderFill(reader)) {
+            break;
+        }
+        
+        uint32_t count = MIN(reader->bufferLength - reader->bufferPosition, length - total);
+        memcpy(out + total, reader->buffer + reader->bufferPosition, count);
+        reader->bufferPosition += count;
+        total += count;
+    }
+    
+    return total;
+}
+
+static bool s3mReadAt(S3MReader *reader, uint32_t offset, void *dest, uint32_t length)
+{
+    return s3mReaderSeek(reader, offset) && s3mRead(reader, dest, length) == length;
+}
+
+// Sets the reader up to decompress the file as it's read if it's LZ4
+// compressed, which is checked by looking for the LZ4 frame magic number where
+// the s3m header would be
+static int s3mReaderDetectCompression(S3MReader *reader)
+{
+    uint8_t magic[4];
+    
+    if (pd->file->read(reader->file, magic, sizeof(magic)) != sizeof(magic)
+        || (magic[0] | (magic[1] << 8) | (magic[2] << 16) | ((uint32_t)magic[3] << 24)) != LZ4_FRAME_MAGIC) {
+        return (pd->file->seek(reader->file, 0, SEEK_SET) == 0) ? kMusicNoError : kMusicFileError;
+    }
+    
+    reader->lz4 = malloc(sizeof(LZ4Reader));
+    
+    if (!reader->lz4) {
+        printLog("Error: couldn't allocate memory for LZ4 reader!");
+        return kMusicMemoryError;
+    }
+    
+    if (!lz4BeginReading(reader->lz4, reader->file, S3M_LZ4_MAX_BLOCK_SIZE)) {
+        free(reader->lz4);
+        reader->lz4 = NULL;
+        return kMusicInvalidS3MError;
+    }
+    
+    printLogVerbose("Note: s3m is LZ4 compressed with a block size of %d bytes", (int)reader->lz4->maxBlockSize);
+    return kMusicNoError;
+}
+
+static int s3mReadChannels(TrackerMusic *music, S3MHeader *header, S3MReader *reader)
 {
-    uint8_t *channelPan = music->rawData + sizeof(S3MHeader) + header->orderCount + header->instrumentCount * 2
-                          + header->patternCount * 2;
+    uint8_t channelPan[S3M_MAX_CHANNELS] = {0};
+    
+    if (header->defaultPan == 252) {
+        uint32_t channelPanOffset = sizeof(S3MHeader) + header->orderCount + header->instrumentCount * 2
+                                    + header->patternCount * 2;
+        
+        if (!s3mReadAt(reader, channelPanOffset, channelPan, sizeof(channelPan))) {
+            printLog("Error: couldn't read s3m channel pan settings");
+            return kMusicInvalidS3MError;
+        }
+    }
     
     for(int i = 0; i < S3M_MAX_CHANNELS; ++i) {
         if (header->channelSettings[i] == 255 || (header->channelSettings[i] & 0x80) != 0) {
@@ -132,23 +277,25 @@ static int s3mReadChannels(TrackerMusic *music, S3MHeader *header)
         }
         
         music->channelCount = i+1;
-        music->channels[i].enabled = true;
-        music->channels[i].pan = (header->defaultPan == 252) ? s3mChannelPanFromData(channelPan[i]) : 0x20;
+        music->channelEnabled[i] = true;
+        music->channelPan[i] = (header->defaultPan == 252) ? s3mChannelPanFromData(channelPan[i]) : 0x20;
     }
     
     return kMusicNoError;
 }
 
-static void s3mReadPattern(TrackerMusic *music, PatternCell *pattern, uint8_t *data, int patternIndex)
+static void s3mReadPattern(TrackerMusic *music, PatternCell *pattern, S3MReader *reader, int patternIndex,
+                           bool logWarnings)
 {
     uint8_t row = 0;
-    uint16_t length = *((uint16_t *)data);
-    uint8_t *end = data + length;
-    data += 2;
+    uint16_t length = s3mReadByte(reader);
+    length |= ((uint16_t)s3mReadByte(reader)) << 8;
+    uint16_t consumed = 2;
     
-    while(row < ROWS_PER_PATTERN && data < end) {
+    while(row < ROWS_PER_PATTERN && consumed < length) {
         PatternCell cell = {0};
-        cell.what = *(data++);
+        cell.what = s3mReadByte(reader);
+        ++consumed;
 
         if (cell.what == 0) {
             ++row;
@@ -158,8 +305,9 @@ static void s3mReadPattern(TrackerMusic *music, PatternCell *pattern, uint8_t *d
         uint8_t channel = cell.what & (S3M_MAX_CHANNELS - 1);
 
         if (cell.what & NOTE_AND_INST_FLAG) {
-            cell.note = *(data++);
-            cell.instrument = *(data++);
+            cell.note = s3mReadByte(reader);
+            cell.instrument = s3mReadByte(reader);
+            consumed += 2;
             
             if (cell.note == 255) {
                 cell.note = 0;
@@ -171,13 +319,15 @@ static void s3mReadPattern(TrackerMusic *music, PatternCell *pattern, uint8_t *d
         }
 
         if (cell.what & VOLUME_FLAG) {
-            cell.volume = *(data++);
+            cell.volume = s3mReadByte(reader);
+            ++consumed;
         }
 
         if (cell.what & EFFECT_FLAG) {
-            cell.effect = *(data++);
-            cell.effectVal = *(data++);
-            cell.effect = s3mEffectToEnum(cell.effect, &cell.effectVal, patternIndex, row);
+            cell.effect = s3mReadByte(reader);
+            cell.effectVal = s3mReadByte(reader);
+            consumed += 2;
+            cell.effect = s3mEffectToEnum(cell.effect, &cell.effectVal, patternIndex, row, logWarnings);
             
             if (cell.effect == kEffectNone) {
                 cell.what = cell.what & (~EFFECT_FLAG);
@@ -192,29 +342,288 @@ static void s3mReadPattern(TrackerMusic *music, PatternCell *pattern, uint8_t *d
     }
 }
 
-static int s3mReadPatterns(TrackerMusic *music, S3MHeader *header)
+// Loading is split up into small units of work -- reading the header, one
+// pattern, one chunk of sample data -- so that it can be spread over several
+// frames using a TrackerMusicLoader. The synchronous loading functions just
+// run the same loader until it's done.
+
+enum {
+    kS3MStageHeader = 0,
+    kS3MStagePatterns,
+    kS3MStageOrders,
+    kS3MStageInstruments,
+    kS3MStageSampleData,
+    kS3MStageFinish,
+};
+
+typedef struct _S3MLoadState {
+    S3MReader reader;
+    S3MHeader header;
+    uint16_t *parapointers;
+    TrackerMusicLoadOptions options;
+    char *path;
+    uint8_t stage;
+    uint16_t index;
+    PatternCell *scratchPattern; // sparse storage only
+    uint32_t patternCapacity; // sparse and lazy storage only
+    uint32_t packedPatternsSize; // lazy storage only
+    uint32_t sampleDataOffset;
+    uint32_t samplePosition;
+    bool is16Bit;
+    uint32_t *usedInstruments; // only with removeUnusedData
+    uint32_t unusedBytes; // only with removeUnusedData
+    uint32_t *sampleOffsets; // paged samples only
+} S3MLoadState;
+
+// With paged samples the file is kept open once the song is loaded, and
+// instruments' samples are read from it as they're needed
+typedef struct _S3MPagedSamples {
+    S3MReader reader;
+    uint32_t *sampleOffsets; // where each instrument's sample data starts in the file
+} S3MPagedSamples;
+
+static int s3mReadAndCheckHeader(S3MHeader *header, S3MReader *reader)
 {
-    uint16_t *patternParapointers =
-        (uint16_t *)(music->rawData + sizeof(S3MHeader) + header->orderCount + header->instrumentCount * 2);
+    if (s3mRead(reader, header, sizeof(S3MHeader)) != sizeof(S3MHeader)) {
+        printLog("Error: couldn't read s3m header");
+        return kMusicInvalidS3MError;
+    }
+    
+    if (header->magicNumber1 != S3M_HEADER_MAGIC_1) {
+        printLog("Error: s3m magic number in header is incorrect: %x", header->magicNumber1);
+        return kMusicInvalidS3MError;
+    }
+    
+    if (memcmp(header->magicNumber2, S3M_HEADER_MAGIC_2, sizeof(S3M_HEADER_MAGIC_2) - 1)) {
+        printLog("Error: s3m magic number 2 in header is incorrect");
+        return kMusicInvalidS3MError;
+    }
+    
+    return kMusicNoError;
+}
 
-    music->patternCount = header->patternCount;
-    music->patterns =
-        calloc(header->patternCount * music->channelCount * ROWS_PER_PATTERN, sizeof(PatternCell));
+static int s3mReadHeader(TrackerMusic *music, S3MLoadState *state)
+{
+    S3MHeader *header = &state->header;
+    S3MReader *reader = &state->reader;
+    int headerError = s3mReadAndCheckHeader(header, reader);
+    
+    if (headerError != kMusicNoError) {
+        return headerError;
+    }
 
-    if (!music->patterns) {
-        printLog("Error: couldn't allocate memory for patterns!");
+    music->initialSpeed = header->initialSpeed;
+    music->initialTempo = header->initialTempo;
+    
+    music->orderCount = 0;
+    music->orders = malloc(MAX(header->orderCount, 1));
+    state->parapointers = malloc(MAX(header->instrumentCount + header->patternCount, 1) * sizeof(uint16_t));
+    
+    if (!music->orders || !state->parapointers) {
+        printLog("Error: couldn't allocate memory for s3m order list and parapointers!");
         return kMusicMemoryError;
     }
     
-    for (uint16_t i = 0; i < header->patternCount; ++i) {
-        if (patternParapointers[i] == 0) {
-            continue;
+    // The order list and the instrument and pattern parapointers directly
+    // follow the header
+    if (s3mRead(reader, music->orders, header->orderCount) != header->orderCount
+        || s3mRead(reader, state->parapointers, (header->instrumentCount + header->patternCount) * sizeof(uint16_t))
+               != (header->instrumentCount + header->patternCount) * sizeof(uint16_t)) {
+        printLog("Error: couldn't read s3m order list and parapointers");
+        return kMusicInvalidS3MError;
+    }
+    
+    int error = s3mReadChannels(music, header, reader);
+    
+    if (error != kMusicNoError) {
+        return error;
+    }
+    
+    music->patternCount = header->patternCount;
+    music->patternStorage = state->options.patternStorage;
+    
+    if (music->patternStorage == kPatternStorageSparse) {
+        // Each pattern is decoded into a single dense pattern's worth of
+        // memory, then its non-empty cells are appended to the sparse pattern
+        // data
+        state->scratchPattern = malloc(MAX(music->channelCount * ROWS_PER_PATTERN, 1) * sizeof(PatternCell));
+        music->patternCellOffsets = malloc(MAX(header->patternCount, 1) * sizeof(uint32_t));
+        music->patternRowOffsets = malloc(MAX(header->patternCount, 1) * (ROWS_PER_PATTERN + 1) * sizeof(uint16_t));
+        
+        if (!state->scratchPattern || !music->patternCellOffsets || !music->patternRowOffsets) {
+            printLog("Error: couldn't allocate memory for patterns!");
+            return kMusicMemoryError;
+        }
+    } else if (music->patternStorage == kPatternStorageLazy) {
+        music->packedPatternOffsets = malloc((header->patternCount + 1) * sizeof(uint32_t));
+        
+        if (!music->packedPatternOffsets) {
+            printLog("Error: couldn't allocate memory for patterns!");
+            return kMusicMemoryError;
+        }
+    } else {
+        music->patternCellCount = header->patternCount * music->channelCount * ROWS_PER_PATTERN;
+        music->patterns = calloc(MAX(music->patternCellCount, 1), sizeof(PatternCell));
+        
+        if (!music->patterns) {
+            printLog("Error: couldn't allocate memory for patterns!");
+            return kMusicMemoryError;
+        }
+    }
+    
+    return kMusicNoError;
+}
+
+static int s3mReadDensePattern(TrackerMusic *music, S3MLoadState *state, uint16_t patternIndex)
+{
+    uint16_t parapointer = state->parapointers[state->header.instrumentCount + patternIndex];
+    
+    if (parapointer == 0) {
+        return kMusicNoError;
+    }
+    
+    if (!s3mReaderSeek(&state->reader, parapointer * 16)) {
+        printLog("Error: couldn't seek to s3m pattern %d", patternIndex);
+        return kMusicInvalidS3MError;
+    }
+    
+    s3mReadPattern(music, patternAtIndex(music, patternIndex), &state->reader, patternIndex, true);
+    return kMusicNoError;
+}
+
+static int s3mReadSparsePattern(TrackerMusic *music, S3MLoadState *state, uint16_t patternIndex)
+{
+    uint16_t parapointer = state->parapointers[state->header.instrumentCount + patternIndex];
+    
+    memset(state->scratchPattern, 0, music->channelCount * ROWS_PER_PATTERN * sizeof(PatternCell));
+    
+    if (parapointer != 0) {
+        if (!s3mReaderSeek(&state->reader, parapointer * 16)) {
+            printLog("Error: couldn't seek to s3m pattern %d", patternIndex);
+            return kMusicInvalidS3MError;
+        }
+        
+        s3mReadPattern(music, state->scratchPattern, &state->reader, patternIndex, true);
+    }
+    
+    return appendSparsePattern(music, patternIndex, state->scratchPattern, &state->patternCapacity);
+}
+
+// Used as the music's decodePattern function with lazy pattern storage.
+// Warnings about unimplemented effects are only logged in verbose builds since
+// a pattern can end up being decoded many times during playback.
+static void s3mDecodePackedPattern(TrackerMusic *music, int patternIndex, PatternCell *pattern)
+{
+    uint32_t offset = music->packedPatternOffsets[patternIndex];
+    uint32_t length = music->packedPatternOffsets[patternIndex + 1] - offset;
+    S3MReader reader = {0};
+    
+    memset(pattern, 0, music->channelCount * ROWS_PER_PATTERN * sizeof(PatternCell));
+    
+    if (length == 0) {
+        return;
+    }
+    
+    reader.buffer = music->packedPatterns + offset;
+    reader.bufferLength = length;
+#if TRACKER_MUSIC_VERBOSE
+    s3mReadPattern(music, pattern, &reader, patternIndex, true);
+#else
+    s3mReadPattern(music, pattern, &reader, patternIndex, false);
+#endif
+}
+
+static int s3mReadLazyPattern(TrackerMusic *music, S3MLoadState *state, uint16_t patternIndex)
+{
+    uint16_t parapointer = state->parapointers[state->header.instrumentCount + patternIndex];
+    uint32_t size = state->packedPatternsSize;
+    uint8_t lengthData[2];
+    uint16_t length = 0;
+    
+    music->packedPatternOffsets[patternIndex] = size;
+    
+    if (parapointer == 0) {
+        return kMusicNoError;
+    }
+    
+    if (!s3mReadAt(&state->reader, parapointer * 16, lengthData, sizeof(lengthData))) {
+        printLog("Error: couldn't read s3m pattern %d", patternIndex);
+        return kMusicInvalidS3MError;
+    }
+    
+    // The packed length includes the two length bytes themselves, which are
+    // kept so that the pattern decodes the same way as from the file
+    length = lengthData[0] | (lengthData[1] << 8);
+    length = MAX(length, sizeof(lengthData));
+    
+    if (size + length > state->patternCapacity) {
+        uint32_t newCapacity = MAX(size + length, state->patternCapacity * 2);
+        uint8_t *newPackedPatterns = realloc(music->packedPatterns, newCapacity);
+        
+        if (!newPackedPatterns) {
+            printLog("Error: couldn't allocate memory for patterns!");
+            return kMusicMemoryError;
         }
+        
+        music->packedPatterns = newPackedPatterns;
+        state->patternCapacity = newCapacity;
+    }
+    
+    memcpy(music->packedPatterns + size, lengthData, sizeof(lengthData));
+    
+    uint16_t remaining = length - sizeof(lengthData);
+    uint32_t readLength = s3mRead(&state->reader, music->packedPatterns + size + sizeof(lengthData), remaining);
+    
+    if (readLength < remaining) {
+        // Truncated patterns are decoded as far as they go, same as when
+        // decoding them straight from the file
+        memset(music->packedPatterns + size + sizeof(lengthData) + readLength, 0, remaining - readLength);
+    }
+    
+    state->packedPatternsSize = size + length;
+    return kMusicNoError;
+}
+
+static int s3mReadNextPattern(TrackerMusic *music, S3MLoadState *state, uint16_t patternIndex)
+{
+    if (music->patternStorage == kPatternStorageSparse) {
+        return s3mReadSparsePattern(music, state, patternIndex);
+    } else if (music->patternStorage == kPatternStorageLazy) {
+        return s3mReadLazyPattern(music, state, patternIndex);
+    } else {
+        return s3mReadDensePattern(music, state, patternIndex);
+    }
+}
 
-        s3mReadPattern(music, patternAtIndex(music, i), music->rawData + patternParapointers[i] * 16, i);
+static int s3mFinishPatterns(TrackerMusic *music, S3MLoadState *state)
+{
+    if (music->patternStorage == kPatternStorageSparse) {
+        free(state->scratchPattern);
+        state->scratchPattern = NULL;
+        finishSparsePatterns(music);
+    } else if (music->patternStorage == kPatternStorageLazy) {
+        uint32_t size = state->packedPatternsSize;
+        
+        music->packedPatternOffsets[music->patternCount] = size;
+        
+        if (size > 0 && size < state->patternCapacity) {
+            uint8_t *packedPatterns = realloc(music->packedPatterns, size);
+            
+            if (packedPatterns) {
+                music->packedPatterns = packedPatterns;
+            }
+        }
+        
+        music->decodePattern = s3mDecodePackedPattern;
+        
+        int error = initializeLazyPatterns(music);
+        
+        if (error != kMusicNoError) {
+            return error;
+        }
     }
     
-    for(int orderIndex = 0; orderIndex < header->orderCount; ++orderIndex) {
+    for(int orderIndex = 0; orderIndex < state->header.orderCount; ++orderIndex) {
         int patternIndex = music->orders[orderIndex];
         
         if (patternIndex == 0xFE) {
@@ -229,175 +638,702 @@ static int s3mReadPatterns(TrackerMusic *music, S3MHeader *header)
         ++music->orderCount;
     }
     
-    return kMusicNoError;
-}
-
-static int s3mReadInstruments(TrackerMusic *music, S3MHeader *header)
-{
-    uint16_t *instrumentParapointers = (uint16_t *)(music->rawData + sizeof(S3MHeader) + header->orderCount);
-
-    music->instrumentCount = header->instrumentCount;
-    music->instruments = calloc(sizeof(TrackerMusicInstrument), music->instrumentCount);
+    music->instrumentCount = state->header.instrumentCount;
+    music->instruments = calloc(sizeof(TrackerMusicInstrument), MAX(music->instrumentCount, 1));
     
     if (!music->instruments) {
         printLog("Error: couldn't allocate memory for music instruments!");
         return kMusicMemoryError;
     }
     
-    for(int i = 0; i < music->instrumentCount; ++i) {
-        S3MInstrument *s3mInst = (S3MInstrument *)parapointerToPointer(music->rawData, instrumentParapointers[i]);
-        TrackerMusicInstrument *instrument = &music->instruments[i];
+    if (state->options.pagedSampleBudget > 0) {
+        state->sampleOffsets = calloc(MAX(music->instrumentCount, 1), sizeof(uint32_t));
         
-        if (s3mInst->length == 0 || s3mInst->type == 0) {
-            continue;
+        if (!state->sampleOffsets) {
+            printLog("Error: couldn't allocate memory for paged samples!");
+            return kMusicMemoryError;
         }
+    }
+    
+    return kMusicNoError;
+}
+
+// Reads an instrument's header and allocates memory for its sample data, which
+// is read afterwards with s3mReadSampleDataChunk
+static int s3mReadInstrument(TrackerMusic *music, S3MLoadState *state, uint16_t instrumentIndex)
+{
+    S3MInstrument s3mInst;
+    TrackerMusicInstrument *instrument = &music->instruments[instrumentIndex];
+    
+    if (!s3mReadAt(&state->reader, state->parapointers[instrumentIndex] * 16, &s3mInst, sizeof(S3MInstrument))) {
+        printLog("Error: couldn't read s3m instrument %d", instrumentIndex + 1);
+        return kMusicInvalidS3MError;
+    }
+    
+    if (s3mInst.length == 0 || s3mInst.type == 0) {
+        return kMusicNoError;
+    }
+    
+    if (state->usedInstruments && (state->usedInstruments[instrumentIndex / 32] & (1u << (instrumentIndex % 32))) == 0) {
+        printLogVerbose("Note: not loading unused instrument %d", instrumentIndex + 1);
         
-        if (s3mInst->type != 1) {
-            printLog("Error: only PCM instruments are supported. (Instrument %d is type %d)", i + 1, s3mInst->type);
-            return kMusicUnsupportedS3MError;
+        if (s3mInst.type == 1) {
+            state->unusedBytes += s3mInst.length * ((s3mInst.flags & S3M_16_BIT_FLAG) ? 2 : 1);
         }
         
-        bool isLooping = (s3mInst->flags & S3M_LOOPING_FLAG) != 0;
-        bool isStereo = (s3mInst->flags & S3M_STEREO_FLAG) != 0;
-        bool is16Bit = (s3mInst->flags & S3M_16_BIT_FLAG) != 0;
-        instrument->bytesPerSample = 1;
+        return kMusicNoError;
+    }
+    
+    if (s3mInst.type != 1) {
+        printLog("Error: only PCM instruments are supported. (Instrument %d is type %d)", instrumentIndex + 1,
+                 s3mInst.type);
+        return kMusicUnsupportedS3MError;
+    }
+    
+    bool isLooping = (s3mInst.flags & S3M_LOOPING_FLAG) != 0;
+    bool isStereo = (s3mInst.flags & S3M_STEREO_FLAG) != 0;
+    bool is16Bit = (s3mInst.flags & S3M_16_BIT_FLAG) != 0;
+    instrument->bytesPerSample = 1;
+    
+    if (is16Bit) {
+        instrument->sampleByteCount = s3mInst.length * 2;
+        instrument->bytesPerSample *= 2;
+        
+        if (isStereo) {
+            instrument->format = kSound16bitStereo;
+            instrument->bytesPerSample *= 2;
+        } else {
+            instrument->format = kSound16bitMono;
+        }
+    } else {
+        instrument->sampleByteCount = s3mInst.length;
         
-        if (is16Bit) {
-            instrument->sampleByteCount = s3mInst->length * 2;
+        if (isStereo) {
+            instrument->format = kSound8bitStereo;
             instrument->bytesPerSample *= 2;
+        } else {
+            instrument->format = kSound8bitMono;
+        }
+    }
+    
+    instrument->sampleRate = s3mInst.c4Rate;
+    instrument->volume = s3mInst.volume;
+    
+    if (state->options.adpcmSamples && is16Bit && !isStereo) {
+        bool optedOut = instrumentIndex < 128
+                        && (state->options.adpcmOptOut[instrumentIndex / 32] & (1u << (instrumentIndex % 32))) != 0;
+        instrument->encodeADPCM = !optedOut;
+    }
+    
+    if (isLooping) {
+        instrument->loopBegin = s3mInst.loopBegin;
+        instrument->loopEnd = s3mInst.loopEnd;
+        
+        // Once a looping sample reaches the end of its loop it never gets
+        // past it, so anything after that isn't loaded
+        if (state->options.removeUnusedData && !isStereo && instrument->loopEnd > instrument->loopBegin
+            && instrument->loopEnd * instrument->bytesPerSample < instrument->sampleByteCount) {
+            uint32_t loopEndByte = instrument->loopEnd * instrument->bytesPerSample;
             
-            if (isStereo) {
-                instrument->format = kSound16bitStereo;
-                instrument->bytesPerSample *= 2;
+            printLogVerbose("Note: not loading the %d bytes after the loop of instrument %d",
+                            (int)(instrument->sampleByteCount - loopEndByte), instrumentIndex + 1);
+            state->unusedBytes += instrument->sampleByteCount - loopEndByte;
+            instrument->sampleByteCount = loopEndByte;
+        }
+    }
+    
+    state->sampleDataOffset = ((((uint32_t)s3mInst.dataPtrHi) << 16) | (uint32_t)s3mInst.dataPtrLo) * 16;
+    
+    if (state->sampleOffsets) {
+        // The sample is read in once it's needed
+        state->sampleOffsets[instrumentIndex] = state->sampleDataOffset;
+        return kMusicNoError;
+    }
+    
+    instrument->sampleData = malloc(instrument->sampleByteCount);
+    
+    if (!instrument->sampleData) {
+        printLog("Error: couldn't allocate memory for instrument %d sample data!", instrumentIndex + 1);
+        return kMusicMemoryError;
+    }
+    
+    state->samplePosition = 0;
+    state->is16Bit = is16Bit;
+    
+    if (!s3mReaderSeek(&state->reader, state->sampleDataOffset)) {
+        printLog("Error: couldn't seek to sample data of instrument %d", instrumentIndex + 1);
+        return kMusicInvalidS3MError;
+    }
+    
+    return kMusicNoError;
+}
+
+// Converts sample data from the unsigned PCM that s3m files store to signed PCM
+static void s3mConvertSampleData(uint8_t *data, uint32_t length, bool is16Bit)
+{
+    if (!is16Bit) {
+        // Convert to signed 8-bit PCM:
+        for (uint32_t s = 0; s < length; ++s) {
+            data[s] = data[s] ^ 0x80;
+        }
+    } else {
+        uint16_t *sample16 = (uint16_t *)data;
+        
+        for (uint32_t s = 0; s < length / 2; ++s) {
+            sample16[s] = sample16[s] ^ 0x8000;
+        }
+    }
+}
+
+// Converts the readLength bytes of sample data that were read to signed PCM and
+// fills the rest of the length with silence. Some s3m files in the wild have
+// their last sample cut short. A 16-bit sample that's missing its second byte
+// is silenced too.
+static void s3mConvertTruncatedSampleData(uint8_t *data, uint32_t length, uint32_t readLength, bool is16Bit)
+{
+    if (is16Bit) {
+        readLength &= ~1u;
+    }
+    
+    s3mConvertSampleData(data, readLength, is16Bit);
+    memset(data + readLength, 0, length - readLength);
+}
+
+// Reads the next S3M_SAMPLE_CHUNK_SIZE bytes of an instrument's sample data and
+// converts them to signed PCM
+static void s3mReadSampleDataChunk(TrackerMusicInstrument *instrument, S3MLoadState *state, int instrumentIndex)
+{
+    uint32_t chunkLength = MIN(S3M_SAMPLE_CHUNK_SIZE, instrument->sampleByteCount - state->samplePosition);
+    uint8_t *chunk = instrument->sampleData + state->samplePosition;
+    uint32_t readLength = s3mRead(&state->reader, chunk, chunkLength);
+    
+    if (readLength < chunkLength) {
+        printLog("Warning: sample data of instrument %d is truncated", instrumentIndex + 1);
+        s3mConvertTruncatedSampleData(chunk, chunkLength, readLength, state->is16Bit);
+    } else {
+        s3mConvertSampleData(chunk, chunkLength, state->is16Bit);
+    }
+    
+    state->samplePosition += chunkLength;
+}
+
+// Used as the music's readPagedSample function with paged samples
+static bool s3mReadPagedSample(TrackerMusic *music, int instIndex, uint8_t *sampleData)
+{
+    S3MPagedSamples *paged = (S3MPagedSamples *)music->pagedSampleSource;
+    TrackerMusicInstrument *instrument = &music->instruments[instIndex];
+    bool is16Bit = (instrument->format == kSound16bitMono || instrument->format == kSound16bitStereo);
+    
+    if (!s3mReaderSeek(&paged->reader, paged->sampleOffsets[instIndex])) {
+        printLog("Error: couldn't seek to sample data of instrument %d", instIndex + 1);
+        return false;
+    }
+    
+    uint32_t readLength = s3mRead(&paged->reader, sampleData, instrument->sampleByteCount);
+    
+    if (readLength < instrument->sampleByteCount) {
+        // Truncated samples are padded the same way as when they're loaded up
+        // front
+        s3mConvertTruncatedSampleData(sampleData, instrument->sampleByteCount, readLength, is16Bit);
+    } else {
+        s3mConvertSampleData(sampleData, instrument->sampleByteCount, is16Bit);
+    }
+    
+    return true;
+}
+
+static void s3mClosePagedSamples(TrackerMusic *music)
+{
+    S3MPagedSamples *paged = (S3MPagedSamples *)music->pagedSampleSource;
+    
+    if (paged->reader.lz4) {
+        lz4EndReading(paged->reader.lz4);
+        free(paged->reader.lz4);
+    }
+    
+    pd->file->close(paged->reader.file);
+    free(paged->reader.buffer);
+    free(paged->sampleOffsets);
+    free(paged);
+    music->pagedSampleSource = NULL;
+}
+
+// Hands the open file over to the music so that samples can be read from it
+// after loading
+static int s3mBeginPagingSamples(TrackerMusic *music, S3MLoadState *state)
+{
+    S3MPagedSamples *paged = malloc(sizeof(S3MPagedSamples));
+    
+    if (!paged) {
+        printLog("Error: couldn't allocate memory for paged samples!");
+        return kMusicMemoryError;
+    }
+    
+    paged->reader = state->reader;
+    paged->sampleOffsets = state->sampleOffsets;
+    memset(&state->reader, 0, sizeof(S3MReader));
+    state->sampleOffsets = NULL;
+    
+    music->pagedSampleSource = paged;
+    music->readPagedSample = s3mReadPagedSample;
+    music->closePagedSampleSource = s3mClosePagedSamples;
+    
+    return initializePagedSamples(music, state->options.pagedSampleBudget);
+}
+
+// Does the next unit of work of loading an S3M file. Returns kMusicLoading
+// until the file has been completely read.
+static int s3mLoadStep(TrackerMusicLoader *loader)
+{
+    TrackerMusic *music = loader->music;
+    S3MLoadState *state = (S3MLoadState *)loader->readState;
+    int error = kMusicNoError;
+    
+    switch(state->stage) {
+        case kS3MStageHeader:
+            error = s3mReaderDetectCompression(&state->reader);
+            
+            if (error == kMusicNoError) {
+                error = s3mReadHeader(music, state);
+            }
+            
+            state->stage = kS3MStagePatterns;
+            state->index = 0;
+            break;
+            
+        case kS3MStagePatterns:
+            if (state->index < state->header.patternCount) {
+                error = s3mReadNextPattern(music, state, state->index++);
             } else {
-                instrument->format = kSound16bitMono;
+                state->stage = kS3MStageOrders;
             }
-        } else {
-            instrument->sampleByteCount = s3mInst->length;
             
-            if (isStereo) {
-                instrument->format = kSound8bitStereo;
-                instrument->bytesPerSample *= 2;
+            break;
+            
+        case kS3MStageOrders:
+            error = s3mFinishPatterns(music, state);
+            
+            if (error == kMusicNoError && state->options.removeUnusedData) {
+                state->usedInstruments = calloc((music->instrumentCount + 31) / 32 + 1, sizeof(uint32_t));
+                
+                if (!state->usedInstruments) {
+                    printLog("Error: couldn't allocate memory to find unused music data");
+                    error = kMusicMemoryError;
+                } else {
+                    error = removeUnusedTrackerMusicData(music, state->usedInstruments, &state->unusedBytes);
+                }
+            }
+            
+            state->stage = kS3MStageInstruments;
+            state->index = 0;
+            break;
+            
+        case kS3MStageInstruments:
+            if (state->index < music->instrumentCount) {
+                error = s3mReadInstrument(music, state, state->index);
+                state->stage = kS3MStageSampleData;
+            } else {
+                state->stage = kS3MStageFinish;
+            }
+            
+            break;
+            
+        case kS3MStageSampleData: {
+            TrackerMusicInstrument *instrument = &music->instruments[state->index];
+            
+            if (instrument->sampleData && state->samplePosition < instrument->sampleByteCount) {
+                s3mReadSampleDataChunk(instrument, state, state->index);
             } else {
-                instrument->format = kSound8bitMono;
+                if (instrument->sampleData && state->options.maxSampleRate > 0) {
+                    resampleTrackerMusicInstrument(music, state->index, state->options.maxSampleRate);
+                }
+                
+                state->stage = kS3MStageInstruments;
+                ++state->index;
             }
+            
+            break;
         }
-
-        instrument->sampleData = (uint8_t *)parapointerToPointer(music->rawData, (((uint32_t)s3mInst->dataPtrHi) << 16)
-                                                                                     | (uint32_t)s3mInst->dataPtrLo);
-
-        if (!(s3mInst->flags & 4)) {
-            // Convert to signed 8-bit PCM:
-            for (uint32_t s = 0; s < s3mInst->length; ++s) {
-                instrument->sampleData[s] = instrument->sampleData[s] ^ 0x80;
+            
+        case kS3MStageFinish:
+            if (state->unusedBytes > 0) {
+                printLogVerbose("Note: removing unused patterns, instruments and sample data saved %d bytes",
+                                (int)state->unusedBytes);
             }
-        } else {
-            uint16_t *sample16 = (uint16_t *)instrument->sampleData;
             
-            for (uint32_t s = 0; s < s3mInst->length; ++s) {
-                sample16[s] = sample16[s] ^ 0x8000;
+            if (music->resampleBytesSaved > 0) {
+                printLogVerbose("Note: resampling saved %d bytes in total", (int)music->resampleBytesSaved);
             }
-        }
-        
-        instrument->sampleRate = s3mInst->c4Rate;
-        instrument->volume = s3mInst->volume;
-        
-        if (isLooping) {
-            instrument->loopBegin = s3mInst->loopBegin;
-            instrument->loopEnd = s3mInst->loopEnd;
-        }
+            
+            if (state->sampleOffsets) {
+                error = s3mBeginPagingSamples(music, state);
+                
+                if (error != kMusicNoError) {
+                    return error;
+                }
+            }
+            
+            deduplicateTrackerMusicSamples(music);
+            
+            if (state->options.compactData) {
+                compactTrackerMusic(music);
+            }
+            
+            return kMusicNoError;
     }
     
-    return kMusicNoError;
+    return (error == kMusicNoError) ? kMusicLoading : error;
 }
 
-int loadMusicFromS3M(TrackerMusic *music, char *path, FileOptions mode)
+static void s3mLoadFinish(TrackerMusicLoader *loader, int result)
 {
-    FileStat stat;
-    SDFile *f;
-    S3MHeader *header;
-    int error = kMusicNoError;
+    S3MLoadState *state = (S3MLoadState *)loader->readState;
+    
+    // A result of kMusicLoading means that loading was cancelled
+    if (result != kMusicNoError && result != kMusicLoading) {
+        printLog("Error: failed to load s3m at path %s", state->path);
+    }
+    
+    if (state->reader.lz4) {
+        lz4EndReading(state->reader.lz4);
+        free(state->reader.lz4);
+    }
+    
+    // The file belongs to the music instead if its samples are paged
+    if (state->reader.file) {
+        pd->file->close(state->reader.file);
+    }
+    
+    free(state->reader.buffer);
+    free(state->parapointers);
+    free(state->scratchPattern);
+    free(state->usedInstruments);
+    free(state->sampleOffsets);
+    free(state->path);
+    free(state);
+    loader->readState = NULL;
+}
+
+// Starts loading an S3M file, which is then done a bit at a time by calling
+// stepTrackerMusicLoader. If readOnly is set then the music's audio entities
+// aren't created.
+static int s3mBeginLoading(TrackerMusicLoader *loader, TrackerMusic *music, char *path, FileOptions mode,
+                           TrackerMusicLoadOptions *options, bool readOnly)
+{
+    S3MLoadState *state;
     
     printLogVerbose("Loading: %s", path);
     
     memset(music, 0, sizeof(TrackerMusic));
+    memset(loader, 0, sizeof(TrackerMusicLoader));
+    loader->music = music;
+    loader->result = kMusicFileError;
     
-    if (pd->file->stat(path, &stat) != 0) {
-        printLog("Error: couldn't stat file at: %s", path);
-        return kMusicFileError;
+    state = calloc(1, sizeof(S3MLoadState));
+    
+    if (!state) {
+        printLog("Error: couldn't allocate memory for s3m loader!");
+        loader->result = kMusicMemoryError;
+        return loader->result;
     }
     
-    music->size = stat.size;
-    music->rawData = malloc(music->size);
+    state->reader.file = pd->file->open(path, mode);
     
-    if (!music->rawData) {
-        printLog("Error: couldn't malloc music data!");
-        freeTrackerMusic(music);
-        return kMusicMemoryError;
+    if (!state->reader.file) {
+        printLog("Error: failed to read s3m at path %s due to error: %s", path, pd->file->geterr());
+        free(state);
+        return loader->result;
     }
     
-    f = pd->file->open(path, mode);
+    state->reader.buffer = malloc(S3M_READ_BUFFER_SIZE);
+    state->path = malloc(strlen(path) + 1);
     
-    if (!f) {
-        printLog("Error: failed to read s3m at path %s due to error: %s", path, pd->file->geterr());
-        freeTrackerMusic(music);
-        return kMusicFileError;
+    if (!state->reader.buffer || !state->path) {
+        printLog("Error: couldn't malloc s3m read buffer!");
+        pd->file->close(state->reader.file);
+        free(state->reader.buffer);
+        free(state->path);
+        free(state);
+        loader->result = kMusicMemoryError;
+        return loader->result;
     }
     
-    if (pd->file->read(f, music->rawData, music->size) != music->size) {
-        printLog("Error: did not read the expected number of bytes from s3m at path %s due to error: %s", path,
-                 pd->file->geterr());
-        freeTrackerMusic(music);
-        return kMusicFileError;
+    strcpy(state->path, path);
+    
+    if (options) {
+        state->options = *options;
     }
     
-    pd->file->close(f);
+    if (readOnly) {
+        // Samples have to be read in for the music to be of any use without
+        // being played
+        state->options.pagedSampleBudget = 0;
+    } else if (state->options.pagedSampleBudget > 0) {
+        // Paged samples are played as they're read from the file
+        state->options.adpcmSamples = false;
+        state->options.maxSampleRate = 0;
+    }
     
-    header = (S3MHeader *)music->rawData;
+    beginTrackerMusicLoader(loader, music, s3mLoadStep, s3mLoadFinish, state, readOnly);
+    return kMusicNoError;
+}
+
+int beginLoadingMusicFromS3M(TrackerMusicLoader *loader, TrackerMusic *music, char *path, FileOptions mode,
+                             TrackerMusicLoadOptions *options)
+{
+    return s3mBeginLoading(loader, music, path, mode, options, false);
+}
+
+int readMusicFromS3M(TrackerMusic *music, char *path, FileOptions mode, TrackerMusicLoadOptions *options)
+{
+    TrackerMusicLoader loader;
+    int error = s3mBeginLoading(&loader, music, path, mode, options, true);
     
-    if (header->magicNumber1 != S3M_HEADER_MAGIC_1) {
-        printLog("Error: s3m magic number in header is incorrect: %x", header->magicNumber1);
-        return kMusicInvalidS3MError;
+    if (error != kMusicNoError) {
+        return error;
     }
     
-    if (memcmp(header->magicNumber2, S3M_HEADER_MAGIC_2, sizeof(S3M_HEADER_MAGIC_2) - 1)) {
-        printLog("Error: s3m magic number 2 in header is incorrect");
-        return kMusicInvalidS3MError;
+    return finishTrackerMusicLoader(&loader);
+}
+
+int loadMusicFromS3M(TrackerMusic *music, char *path, FileOptions mode)
+{
+    return loadMusicFromS3MWithOptions(music, path, mode, NULL);
+}
+
+// A hash of the load options that change what a song decodes to, so that a
+// cached song is only used with the same options it was cached with
+static uint32_t s3mLoadOptionsHash(TrackerMusicLoadOptions *options)
+{
+    uint32_t values[] = {
+        options->patternStorage, options->adpcmSamples, options->adpcmOptOut[0], options->adpcmOptOut[1],
+        options->adpcmOptOut[2], options->adpcmOptOut[3], options->maxSampleRate, options->removeUnusedData
+    };
+    uint32_t hash = 2166136261u;
+    
+    for(uint32_t i = 0; i < sizeof(values) / sizeof(values[0]); ++i) {
+        hash = (hash ^ values[i]) * 16777619u;
     }
+    
+    return hash;
+}
 
-    music->initialSpeed = header->initialSpeed;
-    music->initialTempo = header->initialTempo;
+// Loads the decoded song cached in the data folder if it's up to date, and
+// otherwise loads the S3M file and caches it. The cached song is exactly what
+// the S3M decodes to, including offset samples and ADPCM encoded samples, so
+// loading it needs nothing more than reading it in.
+static int s3mLoadThroughCache(TrackerMusic *music, char *path, FileOptions mode, TrackerMusicLoadOptions *options)
+{
+    FileStat stat;
+    TMCSourceInfo source = {0};
+    char *cachePath = NULL;
+    int error;
     
-    music->orderCount = 0;
-    music->orders = music->rawData + sizeof(S3MHeader);
+    if (pd->file->stat(path, &stat) != 0) {
+        // Let the normal loading code report the error
+        return readMusicFromS3M(music, path, mode, options);
+    }
     
-    error = s3mReadChannels(music, header);
+    source.size = stat.size;
+    source.date = stat.m_year * 10000 + stat.m_month * 100 + stat.m_day;
+    source.time = stat.m_hour * 10000 + stat.m_minute * 100 + stat.m_second;
+    source.options = s3mLoadOptionsHash(options);
     
-    if (error != kMusicNoError) {
-        freeTrackerMusic(music);
-        return error;
+    // Songs are cached under their path with slashes replaced, so that they
+    // don't need any subfolders
+    pd->system->formatString(&cachePath, "%s/%s.tmc", TRACKER_MUSIC_CACHE_FOLDER, path);
+    
+    if (!cachePath) {
+        printLog("Error: couldn't allocate memory for cache path!");
+        return kMusicMemoryError;
+    }
+    
+    for(char *c = cachePath + strlen(TRACKER_MUSIC_CACHE_FOLDER) + 1; *c; ++c) {
+        if (*c == '/') {
+            *c = '_';
+        }
     }
     
-    error = s3mReadPatterns(music, header);
+    error = readMusicFromTMCIfCurrent(music, cachePath, &source);
     
-    if (error != kMusicNoError) {
-        freeTrackerMusic(music);
-        return error;
+    if (error == kMusicNoError) {
+        if (options->compactData) {
+            compactTrackerMusic(music);
+        }
+        
+        pd->system->realloc(cachePath, 0);
+        return kMusicNoError;
     }
     
-    error = s3mReadInstruments(music, header);
+    // Compacting waits until the song's complete, as offset samples are added
+    // after it's loaded
+    TrackerMusicLoadOptions uncompactedOptions = *options;
+    uncompactedOptions.compactData = false;
+    error = readMusicFromS3M(music, path, mode, &uncompactedOptions);
+    
+    if (error == kMusicNoError) {
+        error = createTrackerMusicOffsetSamples(music);
+        
+        if (error != kMusicNoError) {
+            freeTrackerMusic(music);
+        }
+    }
+    
+    if (error == kMusicNoError) {
+        encodeTrackerMusicADPCMSamples(music);
+        pd->file->mkdir(TRACKER_MUSIC_CACHE_FOLDER);
+        
+        if (writeMusicToTMCWithSource(music, cachePath, &source) == kMusicNoError) {
+            printLogVerbose("Note: cached decoded song at %s", cachePath);
+        } else {
+            printLog("Warning: couldn't cache decoded song at %s", cachePath);
+        }
+        
+        if (options->compactData) {
+            compactTrackerMusic(music);
+        }
+    }
+    
+    pd->system->realloc(cachePath, 0);
+    return error;
+}
+
+int loadMusicFromS3MWithOptions(TrackerMusic *music, char *path, FileOptions mode, TrackerMusicLoadOptions *options)
+{
+    TrackerMusicLoader loader;
+    
+    if (options && options->cacheDecodedSong && options->patternStorage != kPatternStorageLazy
+        && options->pagedSampleBudget == 0) {
+        int error = s3mLoadThroughCache(music, path, mode, options);
+        
+        if (error != kMusicNoError) {
+            return error;
+        }
+        
+        // The music is freed if this fails
+        return createTrackerMusicAudioEntities(music);
+    }
+    
+    int error = s3mBeginLoading(&loader, music, path, mode, options, false);
     
     if (error != kMusicNoError) {
-        freeTrackerMusic(music);
         return error;
     }
     
-    error = createTrackerMusicAudioEntities(music);
+    return finishTrackerMusicLoader(&loader);
+}
+
+static int s3mReadInfo(S3MInfo *info, S3MReader *reader, uint16_t **parapointers)
+{
+    S3MHeader header;
+    uint8_t orders[256];
+    int error = s3mReaderDetectCompression(reader);
+    
+    if (error == kMusicNoError) {
+        error = s3mReadAndCheckHeader(&header, reader);
+    }
     
     if (error != kMusicNoError) {
-        freeTrackerMusic(music);
         return error;
     }
     
+    *parapointers = malloc(MAX(header.instrumentCount, 1) * sizeof(uint16_t));
+    
+    if (!*parapointers) {
+        printLog("Error: couldn't allocate memory for s3m parapointers!");
+        return kMusicMemoryError;
+    }
+    
+    // Only the instrument parapointers are needed, which directly follow the
+    // order list
+    if (header.orderCount > sizeof(orders) || s3mRead(reader, orders, header.orderCount) != header.orderCount
+        || s3mRead(reader, *parapointers, header.instrumentCount * sizeof(uint16_t))
+               != header.instrumentCount * sizeof(uint16_t)) {
+        printLog("Error: couldn't read s3m order list and parapointers");
+        return kMusicInvalidS3MError;
+    }
+    
+    memcpy(info->title, header.title, S3M_TITLE_LENGTH);
+    info->title[S3M_TITLE_LENGTH] = 0;
+    info->patternCount = header.patternCount;
+    info->instrumentCount = header.instrumentCount;
+    info->initialSpeed = header.initialSpeed;
+    info->initialTempo = header.initialTempo;
+    info->isCompressed = (reader->lz4 != NULL);
+    
+    // Like when loading, the order list ends at the first order that isn't a
+    // pattern, which is usually the end of song marker
+    while(info->orderCount < header.orderCount && orders[info->orderCount] < header.patternCount) {
+        ++info->orderCount;
+    }
+    
+    uint8_t channelCount = 0;
+    
+    for(int i = 0; i < S3M_MAX_CHANNELS; ++i) {
+        if (header.channelSettings[i] != 255 && (header.channelSettings[i] & 0x80) == 0) {
+            ++info->enabledChannelCount;
+            channelCount = i+1;
+        }
+    }
+    
+    uint32_t sampleBytes = 0;
+    
+    for(uint16_t i = 0; i < header.instrumentCount; ++i) {
+        S3MInstrument s3mInst;
+        
+        if (!s3mReadAt(reader, (*parapointers)[i] * 16, &s3mInst, sizeof(S3MInstrument))) {
+            printLog("Error: couldn't read s3m instrument %d", i + 1);
+            return kMusicInvalidS3MError;
+        }
+        
+        if (s3mInst.type == 1) {
+            sampleBytes += s3mInst.length * ((s3mInst.flags & S3M_16_BIT_FLAG) ? 2 : 1);
+        }
+    }
+    
+    // How much memory the song takes loaded with the default options, apart
+    // from its Playdate audio objects and the ops its rows are compiled into,
+    // which depend on how many of its cells aren't empty
+    info->estimatedMemory = sizeof(TrackerMusic) + info->orderCount
+                            + header.instrumentCount * sizeof(TrackerMusicInstrument)
+                            + header.patternCount * channelCount * ROWS_PER_PATTERN * sizeof(PatternCell)
+                            + header.patternCount * (sizeof(uint32_t) + (ROWS_PER_PATTERN + 1) * sizeof(uint16_t)
+                                                     + ROWS_PER_PATTERN * sizeof(uint32_t))
+                            + sampleBytes;
+    
     return kMusicNoError;
 }
+
+// Reads just enough of an S3M file to describe it: the header, order list and
+// instrument headers. Nothing is decoded and no sample data is read, so this is
+// cheap enough to call for every song in a directory.
+int readMusicInfoFromS3M(S3MInfo *info, char *path, FileOptions mode)
+{
+    S3MReader reader = {0};
+    uint16_t *parapointers = NULL;
+    
+    memset(info, 0, sizeof(S3MInfo));
+    reader.file = pd->file->open(path, mode);
+    
+    if (!reader.file) {
+        printLog("Error: failed to read s3m at path %s due to error: %s", path, pd->file->geterr());
+        return kMusicFileError;
+    }
+    
+    reader.buffer = malloc(S3M_READ_BUFFER_SIZE);
+    int error = reader.buffer ? s3mReadInfo(info, &reader, &parapointers) : kMusicMemoryError;
+    
+    if (!reader.buffer) {
+        printLog("Error: couldn't malloc s3m read buffer!");
+    }
+    
+    if (reader.lz4) {
+        lz4EndReading(reader.lz4);
+        free(reader.lz4);
+    }
+    
+    pd->file->close(reader.file);
+    free(reader.buffer);
+    free(parapointers);
+    return error;
+}
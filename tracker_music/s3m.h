@@ -1,11 +1,14 @@
 #ifndef S3M_H
 #define S3M_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #include "pd_api.h"
 
 typedef struct _TrackerMusic TrackerMusic;
+typedef struct _TrackerMusicLoadOptions TrackerMusicLoadOptions;
+typedef struct _TrackerMusicLoader TrackerMusicLoader;
 
 #define S3M_MAX_CHANNELS 32
 #define S3M_TITLE_LENGTH 28
@@ -17,6 +20,23 @@ typedef struct _TrackerMusic TrackerMusic;
 #define S3M_STEREO_FLAG 0x02
 #define S3M_16_BIT_FLAG 0x04
 
+// Size of the buffer used for reading the header, tables and packed patterns,
+// and of the chunks sample data is read and converted in while loading
+#ifndef S3M_READ_BUFFER_SIZE
+#define S3M_READ_BUFFER_SIZE 1024
+#endif
+
+#ifndef S3M_SAMPLE_CHUNK_SIZE
+#define S3M_SAMPLE_CHUNK_SIZE 8192
+#endif
+
+// The largest LZ4 block size that compressed s3m files can use, since up to
+// three blocks' worth of memory is needed while loading one.
+// Must be one of LZ4's block sizes: 64, 256, 1024 or 4096 KB.
+#ifndef S3M_LZ4_MAX_BLOCK_SIZE
+#define S3M_LZ4_MAX_BLOCK_SIZE (256 * 1024)
+#endif
+
 typedef struct _S3MHeader {
     char title[S3M_TITLE_LENGTH];
     uint8_t magicNumber1;
@@ -58,10 +78,28 @@ typedef struct _S3MInstrument {
     char magic[4];
 } __attribute__((packed)) S3MInstrument;
 
+// A description of an S3M file, as read by readMusicInfoFromS3M
+typedef struct _S3MInfo {
+    char title[S3M_TITLE_LENGTH + 1];
+    uint8_t enabledChannelCount;
+    uint16_t orderCount;
+    uint16_t patternCount;
+    uint16_t instrumentCount;
+    uint8_t initialSpeed;
+    uint8_t initialTempo;
+    uint32_t estimatedMemory; // bytes used once loaded with the default options, not counting audio objects
+    bool isCompressed; // whether the file is LZ4 compressed
+} S3MInfo;
+
 _Static_assert (sizeof(S3MHeader) == 96, "S3M header struct is wrong size");
 _Static_assert (sizeof(S3MInstrument) == 80, "S3M instrument struct is wrong size");
 
 void initializeS3M(PlaydateAPI *inAPI);
+int readMusicFromS3M(TrackerMusic *music, char *path, FileOptions mode, TrackerMusicLoadOptions *options);
 int loadMusicFromS3M(TrackerMusic *music, char *path, FileOptions mode);
+int loadMusicFromS3MWithOptions(TrackerMusic *music, char *path, FileOptions mode, TrackerMusicLoadOptions *options);
+int beginLoadingMusicFromS3M(TrackerMusicLoader *loader, TrackerMusic *music, char *path, FileOptions mode,
+                             TrackerMusicLoadOptions *options);
+int readMusicInfoFromS3M(S3MInfo *info, char *path, FileOptions mode);
 
 #endif
@@ -0,0 +1,814 @@
+#include "tmc.h"
+
+#include "tracker_music.h"
+#include "tracker_music_p.h"
+
+#define printLog pd->system->logToConsole
+#if TRACKER_MUSIC_VERBOSE
+#define printLogVerbose pd->system->logToConsole
+#else
+#define printLogVerbose(...)
+#endif
+static PlaydateAPI *pd = NULL;
+
+void initializeTMC(PlaydateAPI *inAPI)
+{
+    pd = inAPI;
+}
+
+static inline uint32_t tmcAlign(uint32_t value)
+{
+    return (value + TMC_ALIGNMENT - 1) & ~(TMC_ALIGNMENT - 1);
+}
+
+// Where a song is read from: either a file, possibly partway into it, or a
+// caller's buffer that the loaded music points into rather than copying from
+typedef struct _TMCSource {
+    SDFile *file;
+    uint32_t fileOffset;
+    uint8_t *data;
+    uint32_t size;
+} TMCSource;
+
+static bool tmcReadSection(TMCSource *source, uint32_t offset, void *dest, uint32_t length)
+{
+    if (length == 0) {
+        return true;
+    }
+    
+    if (source->data) {
+        if ((uint64_t)offset + length > source->size) {
+            return false;
+        }
+        
+        memcpy(dest, source->data + offset, length);
+        return true;
+    }
+    
+    return pd->file->seek(source->file, source->fileOffset + offset, SEEK_SET) == 0
+           && pd->file->read(source->file, dest, length) == (int)length;
+}
+
+// Sets *dest to a section of the song, which is read into newly allocated
+// memory, or when loading from memory is just a pointer into the buffer
+static int tmcLoadSection(TMCSource *source, uint32_t offset, uint32_t length, void **dest, const char *what)
+{
+    if (source->data) {
+        if ((uint64_t)offset + length > source->size) {
+            printLog("Error: tmc %s is past the end of the data", what);
+            return kMusicInvalidTMCError;
+        }
+        
+        *dest = source->data + offset;
+        return kMusicNoError;
+    }
+    
+    *dest = malloc(MAX(length, 1));
+    
+    if (!*dest) {
+        printLog("Error: couldn't allocate memory for tmc %s!", what);
+        return kMusicMemoryError;
+    }
+    
+    if (!tmcReadSection(source, offset, *dest, length)) {
+        printLog("Error: couldn't read tmc %s", what);
+        return kMusicInvalidTMCError;
+    }
+    
+    return kMusicNoError;
+}
+
+static int tmcReadInstruments(TrackerMusic *music, TMCHeader *header, TMCSource *source)
+{
+    TMCInstrument *tmcInstruments = NULL;
+    
+    music->instrumentCount = header->instrumentCount;
+    music->instruments = calloc(sizeof(TrackerMusicInstrument), MAX(music->instrumentCount, 1));
+    tmcInstruments = malloc(sizeof(TMCInstrument) * MAX(music->instrumentCount, 1));
+    
+    if (!music->instruments || !tmcInstruments) {
+        printLog("Error: couldn't allocate memory for music instruments!");
+        free(tmcInstruments);
+        return kMusicMemoryError;
+    }
+    
+    if (!tmcReadSection(source, header->instrumentsOffset, tmcInstruments,
+                        sizeof(TMCInstrument) * music->instrumentCount)) {
+        printLog("Error: couldn't read tmc instrument table");
+        free(tmcInstruments);
+        return kMusicInvalidTMCError;
+    }
+    
+    for(int i = 0; i < music->instrumentCount; ++i) {
+        TMCInstrument *tmcInst = &tmcInstruments[i];
+        TrackerMusicInstrument *instrument = &music->instruments[i];
+        
+        if ((uint64_t)tmcInst->sampleOffset + tmcInst->sampleByteCount > header->sampleDataSize
+            || (uint64_t)tmcInst->offsetSampleOffset + tmcInst->offsetSampleByteCount > header->sampleDataSize
+            || tmcInst->format > kSoundADPCMMono) {
+            printLog("Error: tmc instrument %d is invalid", i + 1);
+            free(tmcInstruments);
+            return kMusicInvalidTMCError;
+        }
+        
+        instrument->format = tmcInst->format;
+        instrument->bytesPerSample = tmcInst->bytesPerSample;
+        instrument->sampleByteCount = tmcInst->sampleByteCount;
+        instrument->sampleRate = tmcInst->sampleRate;
+        instrument->originalSampleRate = tmcInst->originalSampleRate;
+        instrument->loopBegin = tmcInst->loopBegin;
+        instrument->loopEnd = tmcInst->loopEnd;
+        instrument->volume = tmcInst->volume;
+        
+        // Each sample gets its own allocation so that it can be shared with
+        // other songs through the sample bank. Instruments whose sample is
+        // stored only once in the file share it here too.
+        for(int j = 0; j < i && tmcInst->sampleByteCount > 0; ++j) {
+            TMCInstrument *other = &tmcInstruments[j];
+            
+            if (!music->instruments[j].sharedSampleSource && other->sampleOffset == tmcInst->sampleOffset
+                && other->sampleByteCount == tmcInst->sampleByteCount && other->format == tmcInst->format
+                && other->loopBegin == tmcInst->loopBegin && other->loopEnd == tmcInst->loopEnd) {
+                instrument->sharedSampleSource = j + 1;
+                instrument->sampleData = music->instruments[j].sampleData;
+                instrument->offsetSampleData = music->instruments[j].offsetSampleData;
+                instrument->offsetSampleByteCount = music->instruments[j].offsetSampleByteCount;
+                break;
+            }
+        }
+        
+        if (instrument->sharedSampleSource) {
+            continue;
+        }
+        
+        int error = kMusicNoError;
+        
+        if (tmcInst->sampleByteCount > 0) {
+            error = tmcLoadSection(source, header->sampleDataOffset + tmcInst->sampleOffset, tmcInst->sampleByteCount,
+                                   (void **)&instrument->sampleData, "sample data");
+        }
+        
+        if (error == kMusicNoError && tmcInst->offsetSampleByteCount > 0) {
+            error = tmcLoadSection(source, header->sampleDataOffset + tmcInst->offsetSampleOffset,
+                                   tmcInst->offsetSampleByteCount, (void **)&instrument->offsetSampleData,
+                                   "sample data");
+            instrument->offsetSampleByteCount = tmcInst->offsetSampleByteCount;
+        }
+        
+        if (error != kMusicNoError) {
+            free(tmcInstruments);
+            return error;
+        }
+    }
+    
+    free(tmcInstruments);
+    return kMusicNoError;
+}
+
+static uint32_t tmcSparseRowOffsetsSize(TrackerMusic *music)
+{
+    return tmcAlign(music->patternCount * (ROWS_PER_PATTERN + 1) * sizeof(uint16_t));
+}
+
+static uint32_t tmcPatternsSize(TrackerMusic *music)
+{
+    if (music->patternStorage == kPatternStorageSparse) {
+        return music->patternCount * sizeof(uint32_t) + tmcSparseRowOffsetsSize(music)
+               + music->patternCellCount * sizeof(PatternCell);
+    }
+    
+    return music->patternCount * music->channelCount * ROWS_PER_PATTERN * sizeof(PatternCell);
+}
+
+static bool tmcSparsePatternsAreValid(TrackerMusic *music)
+{
+    for(int i = 0; i < music->patternCount; ++i) {
+        uint16_t *rowOffsets = &music->patternRowOffsets[i * (ROWS_PER_PATTERN + 1)];
+        
+        if (rowOffsets[0] != 0 || music->patternCellOffsets[i] > music->patternCellCount) {
+            return false;
+        }
+        
+        for(int row = 0; row < ROWS_PER_PATTERN; ++row) {
+            if (rowOffsets[row + 1] < rowOffsets[row] || rowOffsets[row + 1] - rowOffsets[row] > music->channelCount) {
+                return false;
+            }
+        }
+        
+        if (music->patternCellOffsets[i] + rowOffsets[ROWS_PER_PATTERN] > music->patternCellCount) {
+            return false;
+        }
+    }
+    
+    for(uint32_t i = 0; i < music->patternCellCount; ++i) {
+        if ((music->patterns[i].what & CHANNEL_MASK) >= music->channelCount) {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+static int tmcReadSparsePatterns(TrackerMusic *music, TMCHeader *header, TMCSource *source)
+{
+    uint32_t cellOffsetsSize = music->patternCount * sizeof(uint32_t);
+    uint32_t rowOffsetsSize = tmcSparseRowOffsetsSize(music);
+    uint32_t cellsSize;
+    int error;
+    
+    if (header->patternsSize < cellOffsetsSize + rowOffsetsSize
+        || (header->patternsSize - cellOffsetsSize - rowOffsetsSize) % sizeof(PatternCell) != 0) {
+        printLog("Error: tmc pattern data is the wrong size");
+        return kMusicInvalidTMCError;
+    }
+    
+    cellsSize = header->patternsSize - cellOffsetsSize - rowOffsetsSize;
+    music->patternCellCount = cellsSize / sizeof(PatternCell);
+    error = tmcLoadSection(source, header->patternsOffset, cellOffsetsSize, (void **)&music->patternCellOffsets,
+                           "patterns");
+    
+    if (error == kMusicNoError) {
+        error = tmcLoadSection(source, header->patternsOffset + cellOffsetsSize, rowOffsetsSize,
+                               (void **)&music->patternRowOffsets, "patterns");
+    }
+    
+    if (error == kMusicNoError) {
+        error = tmcLoadSection(source, header->patternsOffset + cellOffsetsSize + rowOffsetsSize, cellsSize,
+                               (void **)&music->patterns, "patterns");
+    }
+    
+    if (error != kMusicNoError) {
+        return error;
+    }
+    
+    if (!tmcSparsePatternsAreValid(music)) {
+        printLog("Error: tmc sparse pattern data is invalid");
+        return kMusicInvalidTMCError;
+    }
+    
+    return kMusicNoError;
+}
+
+static int tmcReadDensePatterns(TrackerMusic *music, TMCHeader *header, TMCSource *source)
+{
+    music->patternCellCount = music->patternCount * music->channelCount * ROWS_PER_PATTERN;
+    
+    if (header->patternsSize != tmcPatternsSize(music)) {
+        printLog("Error: tmc pattern data is the wrong size");
+        return kMusicInvalidTMCError;
+    }
+    
+    return tmcLoadSection(source, header->patternsOffset, header->patternsSize, (void **)&music->patterns,
+                          "patterns");
+}
+
+static int tmcReadMusic(TrackerMusic *music, TMCSource *source)
+{
+    TMCHeader header;
+    int error;
+    
+    if (!tmcReadSection(source, 0, &header, sizeof(TMCHeader))) {
+        printLog("Error: couldn't read tmc header");
+        return kMusicInvalidTMCError;
+    }
+    
+    if (memcmp(header.magic, TMC_MAGIC, sizeof(header.magic))) {
+        printLog("Error: tmc magic number in header is incorrect");
+        return kMusicInvalidTMCError;
+    }
+    
+    if (header.version != TMC_VERSION) {
+        printLog("Error: unsupported tmc version: %d (expected %d)", header.version, TMC_VERSION);
+        return kMusicInvalidTMCError;
+    }
+    
+    if (header.patternStorage != kTMCDensePatterns && header.patternStorage != kTMCSparsePatterns) {
+        printLog("Error: unsupported tmc pattern storage: %d", header.patternStorage);
+        return kMusicInvalidTMCError;
+    }
+    
+    if (header.channelCount > TRACKER_MUSIC_MAX_CHANNELS) {
+        printLog("Error: tmc file has more channels than maximum! (%d)", TRACKER_MUSIC_MAX_CHANNELS);
+        return kMusicTooManyChannelsError;
+    }
+    
+    music->initialSpeed = header.initialSpeed;
+    music->initialTempo = header.initialTempo;
+    music->channelCount = header.channelCount;
+    
+    for(int i = 0; i < music->channelCount; ++i) {
+        music->channelEnabled[i] = (header.channelEnabled & (1u << i)) != 0;
+        music->channelPan[i] = header.channelPan[i];
+    }
+    
+    music->orderCount = header.orderCount;
+    error = tmcLoadSection(source, header.ordersOffset, music->orderCount, (void **)&music->orders, "order list");
+    
+    if (error != kMusicNoError) {
+        return error;
+    }
+    
+    for(int i = 0; i < music->orderCount; ++i) {
+        if (music->orders[i] >= header.patternCount) {
+            printLog("Error: tmc order %d refers to nonexistent pattern %d", i, music->orders[i]);
+            return kMusicInvalidTMCError;
+        }
+    }
+    
+    error = tmcReadInstruments(music, &header, source);
+    
+    if (error != kMusicNoError) {
+        return error;
+    }
+    
+    deduplicateTrackerMusicSamples(music);
+    
+    music->patternCount = header.patternCount;
+    
+    if (header.patternStorage == kTMCSparsePatterns) {
+        music->patternStorage = kPatternStorageSparse;
+        return tmcReadSparsePatterns(music, &header, source);
+    }
+    
+    music->patternStorage = kPatternStorageDense;
+    return tmcReadDensePatterns(music, &header, source);
+}
+
+int readMusicFromTMC(TrackerMusic *music, char *path, FileOptions mode)
+{
+    TMCSource source = {0};
+    int error;
+    
+    printLogVerbose("Loading: %s", path);
+    
+    memset(music, 0, sizeof(TrackerMusic));
+    
+    source.file = pd->file->open(path, mode);
+    
+    if (!source.file) {
+        printLog("Error: failed to read tmc at path %s due to error: %s", path, pd->file->geterr());
+        return kMusicFileError;
+    }
+    
+    error = tmcReadMusic(music, &source);
+    pd->file->close(source.file);
+    
+    if (error != kMusicNoError) {
+        printLog("Error: failed to load tmc at path %s", path);
+        freeTrackerMusic(music);
+        return error;
+    }
+    
+    return kMusicNoError;
+}
+
+int loadMusicFromTMC(TrackerMusic *music, char *path, FileOptions mode)
+{
+    int error = readMusicFromTMC(music, path, mode);
+    
+    if (error != kMusicNoError) {
+        return error;
+    }
+    
+    // The music is freed if this fails
+    return createTrackerMusicAudioEntities(music);
+}
+
+// Reads a TMC file that caches a song loaded from another file, only if it was
+// made from the same version of that file with the same load options. Returns
+// kMusicFileError without logging anything if there's no such file, and
+// kMusicInvalidTMCError if it's out of date.
+int readMusicFromTMCIfCurrent(TrackerMusic *music, char *path, TMCSourceInfo *source)
+{
+    TMCSource tmcSource = {0};
+    TMCHeader header;
+    int error;
+    
+    memset(music, 0, sizeof(TrackerMusic));
+    tmcSource.file = pd->file->open(path, kFileReadData);
+    
+    if (!tmcSource.file) {
+        return kMusicFileError;
+    }
+    
+    if (!tmcReadSection(&tmcSource, 0, &header, sizeof(TMCHeader))
+        || memcmp(header.magic, TMC_MAGIC, sizeof(header.magic)) || header.version != TMC_VERSION
+        || memcmp(&header.source, source, sizeof(TMCSourceInfo))) {
+        printLogVerbose("Note: %s is out of date", path);
+        pd->file->close(tmcSource.file);
+        return kMusicInvalidTMCError;
+    }
+    
+    printLogVerbose("Loading: %s", path);
+    error = tmcReadMusic(music, &tmcSource);
+    pd->file->close(tmcSource.file);
+    
+    if (error != kMusicNoError) {
+        printLog("Error: failed to load tmc at path %s", path);
+        freeTrackerMusic(music);
+    }
+    
+    return error;
+}
+
+static int tmcReadMusicFromSource(TrackerMusic *music, TMCSource *source)
+{
+    memset(music, 0, sizeof(TrackerMusic));
+    
+    if (source->data) {
+        if (((uintptr_t)source->data & (TMC_ALIGNMENT - 1)) != 0) {
+            printLog("Error: tmc data must start on a %d byte boundary", TMC_ALIGNMENT);
+            return kMusicInvalidData;
+        }
+        
+        // The song's orders, patterns and samples point straight into the
+        // data, which freeTrackerMusic knows not to free
+        music->rawData = source->data;
+        music->size = source->size;
+        music->rawDataIsBorrowed = true;
+    }
+    
+    int error = tmcReadMusic(music, source);
+    
+    if (error != kMusicNoError) {
+        printLog("Error: failed to load tmc");
+        freeTrackerMusic(music);
+    }
+    
+    return error;
+}
+
+// Reads a song from TMC data that's already in memory without copying it: the
+// music's order list, patterns and samples point into data, which must start on
+// a 4 byte boundary and stay around, unchanged, until the music is freed
+int readMusicFromTMCData(TrackerMusic *music, uint8_t *data, uint32_t size)
+{
+    TMCSource source = {0};
+    
+    source.data = data;
+    source.size = size;
+    return tmcReadMusicFromSource(music, &source);
+}
+
+int loadMusicFromTMCData(TrackerMusic *music, uint8_t *data, uint32_t size)
+{
+    int error = readMusicFromTMCData(music, data, size);
+    
+    if (error != kMusicNoError) {
+        return error;
+    }
+    
+    return createTrackerMusicAudioEntities(music);
+}
+
+static int tmcReadArchiveSection(TrackerMusicArchive *archive, uint32_t offset, void *dest, uint32_t length)
+{
+    TMCSource source = {0};
+    
+    source.file = archive->file;
+    source.data = archive->data;
+    source.size = archive->size;
+    return tmcReadSection(&source, offset, dest, length) ? kMusicNoError : kMusicInvalidTMCError;
+}
+
+static int tmcReadArchiveIndex(TrackerMusicArchive *archive)
+{
+    TMCArchiveHeader *header = &archive->header;
+    
+    if (tmcReadArchiveSection(archive, 0, header, sizeof(TMCArchiveHeader)) != kMusicNoError
+        || memcmp(header->magic, TMC_ARCHIVE_MAGIC, sizeof(header->magic))) {
+        printLog("Error: not a tmc archive");
+        return kMusicInvalidTMCError;
+    }
+    
+    if (header->version != TMC_ARCHIVE_VERSION) {
+        printLog("Error: unsupported tmc archive version: %d (expected %d)", header->version, TMC_ARCHIVE_VERSION);
+        return kMusicInvalidTMCError;
+    }
+    
+    if (header->hashSlotCount == 0 || (header->hashSlotCount & (header->hashSlotCount - 1)) != 0) {
+        printLog("Error: tmc archive's hash table is invalid");
+        return kMusicInvalidTMCError;
+    }
+    
+    archive->entries = malloc(MAX(header->songCount, 1) * sizeof(TMCArchiveEntry));
+    archive->hashSlots = malloc(header->hashSlotCount * sizeof(uint16_t));
+    
+    if (!archive->entries || !archive->hashSlots) {
+        printLog("Error: couldn't allocate memory for tmc archive index!");
+        return kMusicMemoryError;
+    }
+    
+    if (tmcReadArchiveSection(archive, header->entriesOffset, archive->entries,
+                              header->songCount * sizeof(TMCArchiveEntry)) != kMusicNoError
+        || tmcReadArchiveSection(archive, header->hashSlotsOffset, archive->hashSlots,
+                                 header->hashSlotCount * sizeof(uint16_t)) != kMusicNoError) {
+        printLog("Error: couldn't read tmc archive index");
+        return kMusicInvalidTMCError;
+    }
+    
+    for(int i = 0; i < header->songCount; ++i) {
+        archive->entries[i].name[TMC_ARCHIVE_NAME_LENGTH - 1] = 0;
+    }
+    
+    for(uint32_t i = 0; i < header->hashSlotCount; ++i) {
+        if (archive->hashSlots[i] > header->songCount) {
+            printLog("Error: tmc archive's hash table is invalid");
+            return kMusicInvalidTMCError;
+        }
+    }
+    
+    return kMusicNoError;
+}
+
+// Opens an archive file, reading only its index. Songs are read from the file
+// when they're loaded, so it's kept open until the archive is closed.
+int openTrackerMusicArchive(TrackerMusicArchive *archive, char *path, FileOptions mode)
+{
+    memset(archive, 0, sizeof(TrackerMusicArchive));
+    archive->file = pd->file->open(path, mode);
+    
+    if (!archive->file) {
+        printLog("Error: failed to read tmc archive at path %s due to error: %s", path, pd->file->geterr());
+        return kMusicFileError;
+    }
+    
+    int error = tmcReadArchiveIndex(archive);
+    
+    if (error != kMusicNoError) {
+        closeTrackerMusicArchive(archive);
+    }
+    
+    return error;
+}
+
+// Opens an archive that's already in memory. Songs loaded from it point into
+// data rather than copying it, so it has to stay around, unchanged, until they
+// have all been freed. data must start on a 4 byte boundary.
+int openTrackerMusicArchiveData(TrackerMusicArchive *archive, uint8_t *data, uint32_t size)
+{
+    memset(archive, 0, sizeof(TrackerMusicArchive));
+    archive->data = data;
+    archive->size = size;
+    
+    int error = tmcReadArchiveIndex(archive);
+    
+    if (error != kMusicNoError) {
+        closeTrackerMusicArchive(archive);
+    }
+    
+    return error;
+}
+
+// Doesn't affect songs that have already been loaded from the archive
+void closeTrackerMusicArchive(TrackerMusicArchive *archive)
+{
+    if (archive->file) {
+        pd->file->close(archive->file);
+    }
+    
+    free(archive->entries);
+    free(archive->hashSlots);
+    memset(archive, 0, sizeof(TrackerMusicArchive));
+}
+
+// FNV-1a, which is what tmc archives hash song names with
+uint32_t tmcArchiveNameHash(const char *name)
+{
+    uint32_t hash = 2166136261u;
+    
+    while(*name) {
+        hash = (hash ^ (uint8_t)*name++) * 16777619u;
+    }
+    
+    return hash;
+}
+
+// Returns the index of the song with the given name, or -1 if there isn't one
+int findSongInTrackerMusicArchive(TrackerMusicArchive *archive, const char *name)
+{
+    uint32_t hash = tmcArchiveNameHash(name);
+    uint32_t mask = archive->header.hashSlotCount - 1;
+    
+    // Open addressing with linear probing, so this ends at the first empty slot
+    for(uint32_t i = 0; i <= mask; ++i) {
+        uint16_t slot = archive->hashSlots[(hash + i) & mask];
+        
+        if (slot == 0) {
+            break;
+        }
+        
+        TMCArchiveEntry *entry = &archive->entries[slot - 1];
+        
+        if (entry->nameHash == hash && strcmp(entry->name, name) == 0) {
+            return slot - 1;
+        }
+    }
+    
+    return -1;
+}
+
+int readMusicFromTrackerMusicArchive(TrackerMusic *music, TrackerMusicArchive *archive, int songIndex)
+{
+    TMCSource source = {0};
+    
+    if (songIndex < 0 || songIndex >= archive->header.songCount) {
+        printLog("Error: tmc archive has no song %d", songIndex);
+        memset(music, 0, sizeof(TrackerMusic));
+        return kMusicInvalidData;
+    }
+    
+    TMCArchiveEntry *entry = &archive->entries[songIndex];
+    
+    printLogVerbose("Loading: %s", entry->name);
+    
+    if (archive->data && (uint64_t)entry->offset + entry->size > archive->size) {
+        printLog("Error: tmc archive song %s is past the end of the archive", entry->name);
+        memset(music, 0, sizeof(TrackerMusic));
+        return kMusicInvalidTMCError;
+    }
+    
+    if (archive->data) {
+        source.data = archive->data + entry->offset;
+    } else {
+        source.file = archive->file;
+        source.fileOffset = entry->offset;
+    }
+    
+    source.size = entry->size;
+    return tmcReadMusicFromSource(music, &source);
+}
+
+int loadMusicFromTrackerMusicArchive(TrackerMusic *music, TrackerMusicArchive *archive, int songIndex)
+{
+    int error = readMusicFromTrackerMusicArchive(music, archive, songIndex);
+    
+    if (error != kMusicNoError) {
+        return error;
+    }
+    
+    return createTrackerMusicAudioEntities(music);
+}
+
+// Pads a section of the given length out to the next section boundary
+static bool tmcWritePadding(SDFile *f, uint32_t length)
+{
+    static const uint8_t padding[TMC_ALIGNMENT] = {0};
+    uint32_t paddingLength = tmcAlign(length) - length;
+    
+    return paddingLength == 0 || pd->file->write(f, padding, paddingLength) == (int)paddingLength;
+}
+
+static bool tmcWrite(SDFile *f, const void *data, uint32_t length)
+{
+    if (length > 0 && pd->file->write(f, data, length) != (int)length) {
+        return false;
+    }
+    
+    return tmcWritePadding(f, length);
+}
+
+// Writes out the music's decoded song data. Any offset samples that are needed
+// should already have been created (see createTrackerMusicOffsetSamples) so
+// that they're stored as well.
+int writeMusicToTMC(TrackerMusic *music, char *path)
+{
+    return writeMusicToTMCWithSource(music, path, NULL);
+}
+
+// Writes out the music like writeMusicToTMC, recording the file it was loaded
+// from so that readMusicFromTMCIfCurrent can tell whether it's out of date
+int writeMusicToTMCWithSource(TrackerMusic *music, char *path, TMCSourceInfo *source)
+{
+    TMCHeader header = {0};
+    TMCInstrument *tmcInstruments;
+    SDFile *f;
+    bool success;
+    
+    tmcInstruments = calloc(sizeof(TMCInstrument), MAX(music->instrumentCount, 1));
+    
+    if (!tmcInstruments) {
+        printLog("Error: couldn't allocate memory for tmc instrument table!");
+        return kMusicMemoryError;
+    }
+    
+    memcpy(header.magic, TMC_MAGIC, sizeof(header.magic));
+    header.version = TMC_VERSION;
+    header.patternStorage = (music->patternStorage == kPatternStorageSparse) ? kTMCSparsePatterns : kTMCDensePatterns;
+    header.initialSpeed = music->initialSpeed;
+    header.initialTempo = music->initialTempo;
+    header.channelCount = music->channelCount;
+    header.orderCount = music->orderCount;
+    header.patternCount = music->patternCount;
+    header.instrumentCount = music->instrumentCount;
+    
+    if (source) {
+        header.source = *source;
+    }
+    
+    for(int i = 0; i < music->channelCount; ++i) {
+        if (music->channelEnabled[i]) {
+            header.channelEnabled |= (1u << i);
+        }
+        
+        header.channelPan[i] = music->channelPan[i];
+    }
+    
+    header.ordersOffset = tmcAlign(sizeof(TMCHeader));
+    header.instrumentsOffset = tmcAlign(header.ordersOffset + music->orderCount);
+    header.patternsOffset = tmcAlign(header.instrumentsOffset + sizeof(TMCInstrument) * music->instrumentCount);
+    header.patternsSize = tmcPatternsSize(music);
+    header.sampleDataOffset = tmcAlign(header.patternsOffset + header.patternsSize);
+    
+    for(int i = 0; i < music->instrumentCount; ++i) {
+        TrackerMusicInstrument *instrument = &music->instruments[i];
+        TMCInstrument *tmcInst = &tmcInstruments[i];
+        
+        tmcInst->format = instrument->format;
+        tmcInst->bytesPerSample = instrument->bytesPerSample;
+        tmcInst->sampleRate = instrument->sampleRate;
+        tmcInst->originalSampleRate = instrument->originalSampleRate;
+        tmcInst->loopBegin = instrument->loopBegin;
+        tmcInst->loopEnd = instrument->loopEnd;
+        tmcInst->volume = instrument->volume;
+        
+        if (instrument->sharedSampleSource) {
+            // Shared sample data is only stored once
+            TMCInstrument *source = &tmcInstruments[instrument->sharedSampleSource - 1];
+            
+            tmcInst->sampleOffset = source->sampleOffset;
+            tmcInst->sampleByteCount = source->sampleByteCount;
+            tmcInst->offsetSampleOffset = source->offsetSampleOffset;
+            tmcInst->offsetSampleByteCount = source->offsetSampleByteCount;
+            continue;
+        }
+        
+        if (instrument->sampleData) {
+            tmcInst->sampleOffset = header.sampleDataSize;
+            tmcInst->sampleByteCount = instrument->sampleByteCount;
+            header.sampleDataSize += tmcAlign(instrument->sampleByteCount);
+        }
+        
+        if (instrument->offsetSampleData) {
+            tmcInst->offsetSampleOffset = header.sampleDataSize;
+            tmcInst->offsetSampleByteCount = instrument->offsetSampleByteCount;
+            header.sampleDataSize += tmcAlign(instrument->offsetSampleByteCount);
+        }
+    }
+    
+    f = pd->file->open(path, kFileWrite);
+    
+    if (!f) {
+        printLog("Error: failed to open %s for writing due to error: %s", path, pd->file->geterr());
+        free(tmcInstruments);
+        return kMusicFileError;
+    }
+    
+    success = tmcWrite(f, &header, sizeof(TMCHeader))
+              && tmcWrite(f, music->orders, music->orderCount)
+              && tmcWrite(f, tmcInstruments, sizeof(TMCInstrument) * music->instrumentCount);
+    
+    if (success && music->patternStorage == kPatternStorageSparse) {
+        success = tmcWrite(f, music->patternCellOffsets, music->patternCount * sizeof(uint32_t))
+                  && tmcWrite(f, music->patternRowOffsets,
+                              music->patternCount * (ROWS_PER_PATTERN + 1) * sizeof(uint16_t))
+                  && tmcWrite(f, music->patterns, music->patternCellCount * sizeof(PatternCell));
+    } else if (success && music->patternStorage == kPatternStorageLazy) {
+        // Lazily decoded patterns are written out densely, one at a time
+        uint32_t patternSize = music->channelCount * ROWS_PER_PATTERN * sizeof(PatternCell);
+        
+        for(int i = 0; success && i < music->patternCount; ++i) {
+            success = pd->file->write(f, lazyPattern(music, i), patternSize) == (int)patternSize;
+        }
+        
+        success = success && tmcWritePadding(f, header.patternsSize);
+    } else if (success) {
+        success = tmcWrite(f, music->patterns, header.patternsSize);
+    }
+    
+    for(int i = 0; success && i < music->instrumentCount; ++i) {
+        if (music->instruments[i].sharedSampleSource) {
+            continue;
+        }
+        
+        if (music->instruments[i].sampleData) {
+            success = tmcWrite(f, music->instruments[i].sampleData, music->instruments[i].sampleByteCount);
+        }
+        
+        if (success && music->instruments[i].offsetSampleData) {
+            success = tmcWrite(f, music->instruments[i].offsetSampleData,
+                               music->instruments[i].offsetSampleByteCount);
+        }
+    }
+    
+    pd->file->close(f);
+    free(tmcInstruments);
+    
+    if (!success) {
+        printLog("Error: failed to write tmc at path %s due to error: %s", path, pd->file->geterr());
+        pd->file->unlink(path, 0);
+        return kMusicFileError;
+    }
+    
+    return kMusicNoError;
+}
@@ -0,0 +1,154 @@
+#ifndef TMC_H
+#define TMC_H
+
+#include <stdint.h>
+
+#include "pd_api.h"
+
+typedef struct _TrackerMusic TrackerMusic;
+
+// TMC ("tracker music, compiled") files store a song that has already been
+// decoded from its original format, laid out the same way as it is in a
+// TrackerMusic struct, so that loading it only takes a few large reads. All
+// sections start on a 4 byte boundary and all values are little endian.
+//
+// The file layout is:
+//
+//   TMCHeader
+//   order list (orderCount bytes)
+//   instrument table (instrumentCount TMCInstrument structs)
+//   patterns (in the format given by patternStorage)
+//   sample data (signed PCM or ADPCM, including any offset samples, which are
+//   always PCM)
+//
+// Dense patterns are every cell of every pattern. Sparse patterns are:
+//
+//   cell offsets (patternCount uint32_t values)
+//   row offsets (patternCount * 65 uint16_t values, padded to 4 bytes)
+//   cells (the non-empty cells of every pattern)
+
+#define TMC_MAGIC "TMUS"
+#define TMC_VERSION 3
+#define TMC_ALIGNMENT 4
+
+enum {
+    kTMCDensePatterns = 0,
+    kTMCSparsePatterns = 1,
+};
+
+// Identifies the file a TMC file was made from, for TMC files that cache a
+// song loaded from an S3M file (see cacheDecodedSong in
+// TrackerMusicLoadOptions). All zeros otherwise.
+typedef struct _TMCSourceInfo {
+    uint32_t size;
+    uint32_t date; // modification date as YYYYMMDD
+    uint32_t time; // modification time as HHMMSS
+    uint32_t options; // hash of the load options the song was decoded with
+} __attribute__((packed)) TMCSourceInfo;
+
+typedef struct _TMCHeader {
+    char magic[4];
+    uint16_t version;
+    uint16_t patternStorage;
+    uint8_t initialSpeed;
+    uint8_t initialTempo;
+    uint8_t channelCount;
+    uint8_t unused1;
+    uint16_t orderCount;
+    uint16_t patternCount;
+    uint16_t instrumentCount;
+    uint16_t unused2;
+    uint32_t channelEnabled;
+    uint8_t channelPan[32];
+    uint32_t ordersOffset;
+    uint32_t instrumentsOffset;
+    uint32_t patternsOffset;
+    uint32_t patternsSize;
+    uint32_t sampleDataOffset;
+    uint32_t sampleDataSize;
+    TMCSourceInfo source;
+} __attribute__((packed)) TMCHeader;
+
+typedef struct _TMCInstrument {
+    uint32_t sampleOffset;
+    uint32_t sampleByteCount;
+    uint32_t offsetSampleOffset;
+    uint32_t offsetSampleByteCount;
+    uint32_t sampleRate;
+    uint32_t loopBegin;
+    uint32_t loopEnd;
+    uint32_t originalSampleRate; // 0 unless the sample was resampled when converting
+    uint8_t format;
+    uint8_t bytesPerSample;
+    uint8_t volume;
+    uint8_t unused;
+} __attribute__((packed)) TMCInstrument;
+
+// TMC archives hold several songs' TMC files, so that they can be bundled into
+// one file that's opened once, or kept in memory and loaded from without any
+// copying. The layout is:
+//
+//   TMCArchiveHeader
+//   entries (songCount TMCArchiveEntry structs)
+//   hash slots (hashSlotCount uint16_t values, padded to 4 bytes)
+//   each song's TMC file, starting on a 4 byte boundary
+//
+// Songs are found by index through the entries, or by name through the hash
+// slots, which are an open addressing hash table of the names (hashed with
+// tmcArchiveNameHash) holding each song's index + 1, or 0 for an empty slot.
+// hashSlotCount is a power of two and there's always at least one empty slot.
+
+#define TMC_ARCHIVE_MAGIC "TMCA"
+#define TMC_ARCHIVE_VERSION 1
+#define TMC_ARCHIVE_NAME_LENGTH 32
+
+typedef struct _TMCArchiveHeader {
+    char magic[4];
+    uint16_t version;
+    uint16_t songCount;
+    uint32_t hashSlotCount;
+    uint32_t entriesOffset;
+    uint32_t hashSlotsOffset;
+} __attribute__((packed)) TMCArchiveHeader;
+
+typedef struct _TMCArchiveEntry {
+    char name[TMC_ARCHIVE_NAME_LENGTH]; // null terminated
+    uint32_t nameHash;
+    uint32_t offset;
+    uint32_t size;
+} __attribute__((packed)) TMCArchiveEntry;
+
+_Static_assert (sizeof(TMCHeader) == 96, "TMC header struct is wrong size");
+_Static_assert (sizeof(TMCInstrument) == 36, "TMC instrument struct is wrong size");
+_Static_assert (sizeof(TMCArchiveHeader) == 20, "TMC archive header struct is wrong size");
+_Static_assert (sizeof(TMCArchiveEntry) == 44, "TMC archive entry struct is wrong size");
+
+// An open TMC archive. The fields are private apart from header.songCount and
+// each entry's name.
+typedef struct _TrackerMusicArchive {
+    SDFile *file;
+    uint8_t *data;
+    uint32_t size;
+    TMCArchiveHeader header;
+    TMCArchiveEntry *entries;
+    uint16_t *hashSlots;
+} TrackerMusicArchive;
+
+void initializeTMC(PlaydateAPI *inAPI);
+int readMusicFromTMC(TrackerMusic *music, char *path, FileOptions mode);
+int loadMusicFromTMC(TrackerMusic *music, char *path, FileOptions mode);
+int writeMusicToTMC(TrackerMusic *music, char *path);
+int readMusicFromTMCIfCurrent(TrackerMusic *music, char *path, TMCSourceInfo *source);
+int writeMusicToTMCWithSource(TrackerMusic *music, char *path, TMCSourceInfo *source);
+int readMusicFromTMCData(TrackerMusic *music, uint8_t *data, uint32_t size);
+int loadMusicFromTMCData(TrackerMusic *music, uint8_t *data, uint32_t size);
+
+int openTrackerMusicArchive(TrackerMusicArchive *archive, char *path, FileOptions mode);
+int openTrackerMusicArchiveData(TrackerMusicArchive *archive, uint8_t *data, uint32_t size);
+void closeTrackerMusicArchive(TrackerMusicArchive *archive);
+uint32_t tmcArchiveNameHash(const char *name);
+int findSongInTrackerMusicArchive(TrackerMusicArchive *archive, const char *name);
+int readMusicFromTrackerMusicArchive(TrackerMusic *music, TrackerMusicArchive *archive, int songIndex);
+int loadMusicFromTrackerMusicArchive(TrackerMusic *music, TrackerMusicArchive *archive, int songIndex);
+
+#endif
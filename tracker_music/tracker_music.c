@@ -1,16 +1,20 @@
 #include "tracker_music.h"
 
+#include "adpcm.h"
+#include "lz4.h"
 #include "s3m.h"
+#include "tmc.h"
 #include "tracker_music_p.h"
 
-#define MIN(a, b) ((a < b) ? a : b)
-#define MAX(a, b) ((a > b) ? a : b)
 #define kAudioSampleRate 44100
 #define kInstrumentReleaseTime 0.015f
 #define kNoteOffLeeway 1000
 #define kVolumeScale 0.125f
 #define kMinimumLoopSamples 1024
 #define kPitchSignalOffStepsThreshold 2
+#define kResampleZeroCrossings 8
+#define kResamplePhases 32
+#define kCompactAlignment 8
 
 #ifndef PLAYDATE_API_VERSION
 // NB: If PLAYDATE_API_VERSION isn't defined and set to the Playdate API's
@@ -19,17 +23,25 @@
 #define PLAYDATE_API_VERSION 0
 #endif
 
-static float volumeSignalStep(VolumeSignalData *data, int *ioSamples, float *interframeVal);
 static float panSignalStep(void *userData, int *ioSamples, float *interframeVal);
 static float pitchSignalStep(void *userData, int *ioSamples, float *interframeVal);
-static void retriggerSignalStep(RetriggerSignalData *data, int ioSamples);
 static float volumeAndRetriggerSignalStep(void *userData, int *ioSamples, float *interframeVal);
-static void setPanValue(TrackerMusic *music, uint8_t channel, float value);
-static void setPanLinearSignal(TrackerMusic *music, uint8_t channel, uint16_t mode, float value);
-static bool createInstrumentSynth(TrackerMusic *music, uint8_t channel, TrackerMusicChannelSynth *synth);
+static void setPanValue(TrackerMusicPlayer *player, uint8_t channel, float value);
+static void setPanLinearSignal(TrackerMusicPlayer *player, uint8_t channel, uint16_t mode, float value);
+static bool createInstrumentSynth(TrackerMusicPlayer *player, uint8_t channel, TrackerMusicChannelSynth *synth);
 static void createOffsetSample(TrackerMusic *music, int instIndex);
-static void createFixedLoopSample(TrackerMusicInstrument *instrument);
-static void updateTempo(TrackerMusic *music);
+static void createFixedLoopSample(TrackerMusic *music, TrackerMusicInstrument *instrument);
+static void updateTempo(TrackerMusicPlayer *player);
+static void processNextStep(TrackerMusicPlayer *player);
+static void refreshCycleTime(void);
+static void addActivePlayer(TrackerMusicPlayer *player);
+static int compileNextPatternRowOps(TrackerMusicLoader *loader);
+static void finishRowOps(TrackerMusic *music);
+static void clearQueuedMusic(TrackerMusicPlayer *player);
+static void tearDownRetiringPlayer(TrackerMusicPlayer *player);
+static bool isInRawData(TrackerMusic *music, void *ptr);
+static void addInstrumentToSampleBank(TrackerMusic *music, int instIndex);
+static void releaseInstrumentSampleBankEntry(TrackerMusicInstrument *instrument);
 
 
 #define printLog pd->system->logToConsole
@@ -40,15 +52,66 @@ static void updateTempo(TrackerMusic *music);
 #endif
 static PlaydateAPI *pd = NULL;
 
-static TrackerMusic *currentMusic = NULL;
-static float speedFactor = 1.0f;
-static _Atomic float pitchFactor = 0.0f;
+// Every sample that's used by a loaded song is kept in the sample bank, so that
+// when another song is loaded with an identical sample it uses the same copy.
+// Entries are reference counted by instrument and freed with the last one.
+struct _TrackerMusicSampleBankEntry {
+    TrackerMusicSampleBankEntry *next;
+    uint32_t hash;
+    uint32_t refCount;
+    uint8_t *sampleData;
+    SoundFormat format;
+    uint32_t sampleByteCount;
+    uint32_t loopBegin;
+    uint32_t loopEnd;
+    uint8_t *offsetSampleData;
+    uint32_t offsetSampleByteCount;
+    AudioSample *sample;
+    uint32_t sampleRate;
+};
+
+static TrackerMusicSampleBankEntry *sampleBank[TRACKER_MUSIC_SAMPLE_BANK_SIZE] = {0};
+
+// The players that are playing, and the players that queued music has taken
+// over from (see queueTrackerMusic), which are cleaned up once their last notes
+// have finished. activePlayersChanged is set whenever a player starts or stops.
+static TrackerMusicPlayer *activePlayers = NULL;
+static bool activePlayersChanged = false;
+static TrackerMusicPlayer *retiringPlayers = NULL;
+
+// The time as of the start of the processTrackerMusicCycle call that's
+// underway, if there is one, or of the last slow work it did (see
+// refreshCycleTime), and which call that is, so that the sequencer only asks
+// the Playdate for the time, and whether each synth is playing, once per cycle
+// (see sequencerTime and isSynthPlaying). Cycle 0 is never used, so
+// that a synth whose playingCycle is 0 has to be asked.
+static bool inCycle = false;
+static uint32_t cycleTime = 0;
+static uint32_t cycleNumber = 0;
+
+// How many times the Playdate has been asked for things, which is only counted
+// with TRACKER_MUSIC_VERBOSE on (see getTrackerMusicQueryCounts). The audio
+// thread's counts are only ever changed by the audio thread, so they don't need
+// to be incremented atomically.
+#if TRACKER_MUSIC_VERBOSE
+static TrackerMusicQueryCounts queryCounts = {0};
+static _Atomic uint32_t audioTimeQueries = 0;
+static _Atomic uint32_t audioTimeQueriesSaved = 0;
+#define countQuery(count) (++queryCounts.count)
+#define countAudioTimeQuery(count) \
+    atomic_store_explicit(&count, atomic_load_explicit(&count, memory_order_relaxed) + 1, memory_order_relaxed)
+#else
+#define countQuery(count)
+#define countAudioTimeQuery(count)
+#endif
 
 
 void initializeTrackerMusic(PlaydateAPI *inAPI)
 {
     pd = inAPI;
+    initializeLZ4(inAPI);
     initializeS3M(inAPI);
+    initializeTMC(inAPI);
 }
 
 static inline short clamp(short val, short minVal, short maxVal)
@@ -74,27 +137,39 @@ static inline float lerp(float u, float a, float b)
     return (b - a) * u + a;
 }
 
-static inline float changeRange(float val, float oldMin, float oldMax, float newMin, float newMax)
+// Converts a sample offset (from the offset effect) from the instrument's
+// original sample rate to its sample rate after being resampled
+static inline uint32_t instrumentSampleOffset(TrackerMusicInstrument *instrument, uint32_t offset)
 {
-    return (val - oldMin) / (oldMax - oldMin) * (newMax - newMin) + newMin;
+    if (instrument->originalSampleRate == 0) {
+        return offset;
+    }
+    
+    return (uint32_t)(((uint64_t)offset * instrument->sampleRate) / instrument->originalSampleRate);
 }
 
-static inline short modulo(short n, short M)
+// Instruments whose sample stays in the file until it's needed
+static inline bool isPagedInstrument(TrackerMusic *music, TrackerMusicInstrument *instrument)
 {
-    // Implementation of Python-style modulo that returns positive numbers for negative values of n
-    return ((n % M) + M) % M;
+    return music->readPagedSample != NULL && instrument->sampleByteCount > 0;
 }
 
-static void lockMutex(atomic_flag *lock)
+// The number of words in a bitmask with a bit for each of the music's
+// instruments
+static inline uint32_t instrumentMaskWords(TrackerMusic *music)
 {
-    while(atomic_flag_test_and_set(lock)) {
-        // wait for mutex to unlock
-    }
+    return (music->instrumentCount + 31) / 32;
+}
+
+static inline float changeRange(float val, float oldMin, float oldMax, float newMin, float newMax)
+{
+    return (val - oldMin) / (oldMax - oldMin) * (newMax - newMin) + newMin;
 }
 
-static void unlockMutex(atomic_flag *lock)
+static inline short modulo(short n, short M)
 {
-    atomic_flag_clear(lock);
+    // Implementation of Python-style modulo that returns positive numbers for negative values of n
+    return ((n % M) + M) % M;
 }
 
 static inline bool isPlayableNote(uint8_t note) {
@@ -105,117 +180,161 @@ static inline bool cellHasVolume(PatternCell *cell) {
     return (cell->what & VOLUME_FLAG) != 0 && cell->volume >= 0 && cell->volume <= 0x40;
 }
 
-static void updateTempo(TrackerMusic *music)
+static void updateTempo(TrackerMusicPlayer *player)
 {
-    music->pb.samplesPerStep = lroundf(((float)kAudioSampleRate)
-                                       / (4.0f * ((float)music->pb.tempo) * (6.0f / ((float)music->pb.speed)) / 60.0f));
-    music->pb.nextNextStepSample = music->pb.nextStepSample + music->pb.samplesPerStep;
-    //printLogVerbose("New samples per step: %ld", music->pb.samplesPerStep);
+    float stepsPerSecond = 4.0f * ((float)player->pb.tempo) * (6.0f / ((float)player->pb.speed)) / 60.0f;
+    
+    player->pb.samplesPerStep = lroundf(((float)kAudioSampleRate) / stepsPerSecond);
+    player->pb.nextNextStepSample = player->pb.nextStepSample + player->pb.samplesPerStep;
+    //printLogVerbose("New samples per step: %ld", player->pb.samplesPerStep);
 }
 
-static int createMusicChannels(TrackerMusic *music)
+static int createMusicChannel(TrackerMusicPlayer *player, int i)
 {
-    for(int i = 0; i < music->channelCount; ++i) {
-        if (!music->channels[i].enabled) {
-            continue;
-        }
-        
-        music->channels[i].soundChannel = pd->sound->channel->newChannel();
+    if (!player->channels[i].enabled) {
+        return kMusicNoError;
+    }
+    
+    player->channels[i].soundChannel = pd->sound->channel->newChannel();
 
-        if (!music->channels[i].soundChannel) {
-            printLog("Error: couldn't create SoundChannel");
-            return kMusicPlaydateSoundError;
-        }
+    if (!player->channels[i].soundChannel) {
+        printLog("Error: couldn't create SoundChannel");
+        return kMusicPlaydateSoundError;
+    }
 
-        music->channels[i].volumeController =
-            pd->sound->signal->newSignal(volumeAndRetriggerSignalStep, NULL, NULL, NULL,
-                                         &music->pb.volumeAndRetriggerSignalData[i]);
+    player->channels[i].volumeController =
+        pd->sound->signal->newSignal(volumeAndRetriggerSignalStep, NULL, NULL, NULL,
+                                     &player->pb.volumeAndRetriggerSignalData[i]);
 
-        if (!music->channels[i].volumeController) {
-            printLog("Error: couldn't create volume PDSynthSignal for channel");
-            return kMusicPlaydateSoundError;
-        }
+    if (!player->channels[i].volumeController) {
+        printLog("Error: couldn't create volume PDSynthSignal for channel");
+        return kMusicPlaydateSoundError;
+    }
 
-        music->channels[i].panController =
-            pd->sound->signal->newSignal(panSignalStep, NULL, NULL, NULL, &music->pb.panSignalData[i]);
+    player->channels[i].panController =
+        pd->sound->signal->newSignal(panSignalStep, NULL, NULL, NULL, &player->pb.panSignalData[i]);
 
-        if (!music->channels[i].panController) {
-            printLog("Error: couldn't create panning PDSynthSignal for channel");
-            return kMusicPlaydateSoundError;
-        }
+    if (!player->channels[i].panController) {
+        printLog("Error: couldn't create panning PDSynthSignal for channel");
+        return kMusicPlaydateSoundError;
+    }
 
-        music->channels[i].pitchController =
-            pd->sound->signal->newSignal(pitchSignalStep, NULL, NULL, NULL, &music->pb.pitchSignalData[i]);
+    player->channels[i].pitchController =
+        pd->sound->signal->newSignal(pitchSignalStep, NULL, NULL, NULL, &player->pb.pitchSignalData[i]);
 
-        if (!music->channels[i].pitchController) {
-            printLog("Error: couldn't create PDSynthSignal for channel pitch controller");
-            return kMusicPlaydateSoundError;
-        }
-        
-        for(int j = 0; j < TRACKER_MUSIC_INSTRUMENT_PDSYNTH_COUNT; ++j) {
-            music->channels[i].synths[j].instrument = UNSET;
-            music->channels[i].synths[j].sample = 0;
-            music->channels[i].synths[j].synth = NULL;
-        }
-        
-        if (!createInstrumentSynth(music, i, &music->channels[i].synths[0])) {
-            return kMusicPlaydateSoundError;
-        }
-        
-        if (!createInstrumentSynth(music, i, &music->channels[i].synths[1])) {
-            return kMusicPlaydateSoundError;
-        }
+    if (!player->channels[i].pitchController) {
+        printLog("Error: couldn't create PDSynthSignal for channel pitch controller");
+        return kMusicPlaydateSoundError;
+    }
+    
+    for(int j = 0; j < TRACKER_MUSIC_INSTRUMENT_PDSYNTH_COUNT; ++j) {
+        player->channels[i].synths[j].instrument = UNSET;
+        player->channels[i].synths[j].sample = 0;
+        player->channels[i].synths[j].synth = NULL;
+    }
+    
+    if (!createInstrumentSynth(player, i, &player->channels[i].synths[0])) {
+        return kMusicPlaydateSoundError;
+    }
+    
+    if (!createInstrumentSynth(player, i, &player->channels[i].synths[1])) {
+        return kMusicPlaydateSoundError;
     }
     
     return kMusicNoError;
 }
 
-static int calculateUsedInstrumentsAndOffsets(TrackerMusic *music)
+// Sets up a player of the music and adds it to the music's players, without
+// creating any of its channels yet
+static void addMusicPlayer(TrackerMusicPlayer *player, TrackerMusic *music)
 {
-    for(int orderIndex = 0; orderIndex < music->orderCount; ++orderIndex) {
-        int patternIndex = music->orders[orderIndex];
-        PatternCell *pattern = patternAtIndex(music, patternIndex);
-        int row, channel;
+    memset(player, 0, sizeof(TrackerMusicPlayer));
+    player->music = music;
+    player->speedFactor = 1.0f;
+    player->lookaheadRows = 1;
+    
+    for(int i = 0; i < music->channelCount; ++i) {
+        player->channels[i].enabled = music->channelEnabled[i];
+    }
+    
+    player->nextPlayer = music->players;
+    music->players = player;
+}
+
+static int createDefaultMusicPlayer(TrackerMusic *music)
+{
+    music->player = malloc(sizeof(TrackerMusicPlayer));
+    
+    if (!music->player) {
+        printLog("Error: couldn't allocate memory for music player!");
+        return kMusicMemoryError;
+    }
+    
+    addMusicPlayer(music->player, music);
+    return kMusicNoError;
+}
+
+// lastInstrument has each channel's last instrument, and is carried over from
+// one order to the next
+static int calculateUsedInstrumentsAndOffsetsForOrder(TrackerMusic *music, int orderIndex, uint8_t *lastInstrument)
+{
+    int patternIndex = music->orders[orderIndex];
+    int row;
+    
+    for(row = 0; row < 64; ++row) {
+        uint8_t cellCount;
+        PatternCell *cells = patternRow(music, patternIndex, row, &cellCount);
         
-        for(row = 0; row < 64; ++row) {
-            for(channel = 0; channel < music->channelCount; ++channel) {
-                if (!music->channels[channel].enabled) {
-                    continue;
-                }
-                
-                PatternCell *cell = patternCell(music, pattern, row, channel);
-                uint8_t instIndex;
-                
-                if ((cell->what & NOTE_AND_INST_FLAG) == 0) {
-                    continue;
-                }
-                
-                if (cell->instrument == 0) {
-                    instIndex = music->pb.lastInstrument[channel];
-                } else {
-                    instIndex = cell->instrument - 1;
-                    music->pb.lastInstrument[channel] = instIndex;
-                }
-                
-                if (instIndex == UNSET) {
-                    continue;
-                }
+        for(uint8_t i = 0; i < cellCount; ++i) {
+            PatternCell *cell = &cells[i];
+            uint8_t channel = cell->what & CHANNEL_MASK;
+            uint8_t instIndex;
+            
+            if ((cell->what & NOTE_AND_INST_FLAG) == 0 || !music->channelEnabled[channel]) {
+                continue;
+            }
+            
+            if (cell->instrument == 0) {
+                instIndex = lastInstrument[channel];
+            } else {
+                instIndex = cell->instrument - 1;
+                lastInstrument[channel] = instIndex;
+            }
+            
+            if (instIndex == UNSET) {
+                continue;
+            }
+            
+            if (instIndex >= music->instrumentCount) {
+                printLog("Error: cell has instrument > num instruments");
+                printLog("... pattern: %d  row: %d  channel: %d", patternIndex, row, channel);
+                return kMusicInvalidData;
+            }
+            
+            if (music->orderInstruments) {
+                uint32_t *instruments = &music->orderInstruments[orderIndex * instrumentMaskWords(music)];
+                instruments[instIndex / 32] |= 1u << (instIndex % 32);
+            }
+            
+            TrackerMusicInstrument *inst = &music->instruments[instIndex];
+            
+            if (cell->what & EFFECT_FLAG && cell->effect == kEffectOffset) {
+                bool usesOffsetSample = ((inst->loopBegin != 0 || inst->loopEnd != 0)
+                                         && instrumentSampleOffset(inst, cell->effectVal * 256) > inst->loopBegin);
                 
-                if (instIndex >= music->instrumentCount) {
-                    printLog("Error: cell has instrument > num instruments");
-                    printLog("... pattern: %d  row: %d  channel: %d", patternIndex, row, channel);
-                    return kMusicInvalidData;
+                if (usesOffsetSample && !inst->offsetSampleData) {
+                    // We're using offsetSampleByteCount as a flag to
+                    // indicate when an instrument will likely need an
+                    // offset sample created, to do that work ahead of time.
+                    inst->offsetSampleByteCount = SYNTH_DATA_UNINITIALIZED;
                 }
                 
-                TrackerMusicInstrument *inst = &music->instruments[instIndex];
-                
-                if (cell->what & EFFECT_FLAG && cell->effect == kEffectOffset) {
-                    if ((inst->loopBegin != 0 || inst->loopEnd != 0) && (cell->effectVal * 256) > inst->loopBegin) {
-                        // We're using offsetSampleByteCount as a flag to
-                        // indicate when an instrument will likely need an
-                        // offset sample created, to do that work ahead of time.
-                        inst->offsetSampleByteCount = SYNTH_DATA_UNINITIALIZED;
-                    }
+                if (!usesOffsetSample && inst->encodeADPCM) {
+                    // Playing an ADPCM sample from an offset outside of its
+                    // loop means decoding it, so it's better left as PCM
+                    printLogVerbose("Note: not encoding instrument %d as ADPCM since it's played with an offset",
+                                    instIndex + 1);
+                    inst->encodeADPCM = false;
                 }
             }
         }
@@ -224,206 +343,2208 @@ static int calculateUsedInstrumentsAndOffsets(TrackerMusic *music)
     return kMusicNoError;
 }
 
-static int createMusicInstruments(TrackerMusic *music)
+static int calculateUsedInstrumentsAndOffsets(TrackerMusic *music)
 {
-    for(int i = 0; i < music->instrumentCount; ++i) {
-        TrackerMusicInstrument *instrument = &music->instruments[i];
-        bool isStereo = SoundFormatIsStereo(instrument->format);
-        
-        // Due to a bug in the Playdate 2.5.0 API, looping samples whose loop
-        // length less than a certain number of samples -- say around 500 --
-        // will play with horrible distortion at higher notes. This bit here
-        // recreates the sample so that it's loop is extended until it is at
-        // least kMinimumLoopSamples long in order to work around the issue.
-        // This bug is fixed in API 2.6.0, so we check the current API version
-        // and conditionally include the fix if it's needed. (See
-        // playdate-tracker/demo/CMakeLists.txt for an explanation of how this
-        // macro is defined and how its value corresponds to the API version.)
-#if PLAYDATE_API_VERSION < 20600
-        if ((instrument->loopEnd != 0 || instrument->loopBegin != 0)
-            && (instrument->loopEnd - instrument->loopBegin) < kMinimumLoopSamples) {
-            printLogVerbose("Note: creating fixed looping sample for instrument %d", i);
-            createFixedLoopSample(instrument);
-        }
-#endif
-        
-        instrument->sample = pd->sound->sample->newSampleFromData(instrument->sampleData, instrument->format,
-                                                                  instrument->sampleRate / (isStereo ? 2 : 1),
-                                                                  instrument->sampleByteCount, 0);
-
-        if (!instrument->sample) {
-            printLog("Error: couldn't create AudioSample for instrument %d", i + 1);
-            return kMusicPlaydateSoundError;
-        }
+    uint8_t lastInstrument[TRACKER_MUSIC_MAX_CHANNELS] = {0};
+    
+    for(int orderIndex = 0; orderIndex < music->orderCount; ++orderIndex) {
+        int error = calculateUsedInstrumentsAndOffsetsForOrder(music, orderIndex, lastInstrument);
         
-        if (instrument->offsetSampleByteCount == SYNTH_DATA_UNINITIALIZED) {
-            createOffsetSample(music, i);
+        if (error != kMusicNoError) {
+            return error;
         }
     }
     
     return kMusicNoError;
 }
 
-int createTrackerMusicAudioEntities(TrackerMusic *music)
+static inline bool isADPCMInstrument(TrackerMusicInstrument *instrument)
+{
+    return instrument->format == kSoundADPCMMono || instrument->format == kSoundADPCMStereo;
+}
+
+// The format of an instrument's sample once decoded, which is the format its
+// offset samples are in
+static inline SoundFormat instrumentPCMFormat(TrackerMusicInstrument *instrument)
+{
+    return isADPCMInstrument(instrument) ? kSound16bitMono : instrument->format;
+}
+
+static inline uint32_t instrumentSampleLength(TrackerMusicInstrument *instrument)
 {
-    int error;
+    if (isADPCMInstrument(instrument)) {
+        return adpcmSampleCount(instrument->sampleByteCount);
+    }
     
-    error = createMusicChannels(music);
+    return instrument->sampleByteCount / instrument->bytesPerSample;
+}
+
+// Replaces an instrument's 16-bit mono sample data with ADPCM data, which is
+// about a quarter of the size. Its offset sample, if it'll need one, is made
+// first while the PCM data is still around, and stays as PCM.
+static void encodeInstrumentADPCM(TrackerMusic *music, int instIndex)
+{
+    TrackerMusicInstrument *instrument = &music->instruments[instIndex];
     
-    if (error != kMusicNoError) {
-        return error;
+    instrument->encodeADPCM = false;
+    
+    if (!instrument->sampleData || instrument->format != kSound16bitMono || instrument->sharedSampleSource) {
+        return;
     }
     
-    error = calculateUsedInstrumentsAndOffsets(music);
+    uint32_t sampleLength = instrument->sampleByteCount / instrument->bytesPerSample;
+    uint32_t encodedSize = adpcmEncodedSize(sampleLength);
+    uint8_t *encodedData = malloc(encodedSize);
     
-    if (error != kMusicNoError) {
-        return error;
+    if (!encodedData) {
+        printLog("Warning: couldn't allocate memory to encode instrument %d as ADPCM", instIndex + 1);
+        return;
     }
     
-    error = createMusicInstruments(music);
+    if (instrument->offsetSampleByteCount == SYNTH_DATA_UNINITIALIZED) {
+        createOffsetSample(music, instIndex);
+    }
     
-    if (error != kMusicNoError) {
-        return error;
+    encodeADPCM((int16_t *)instrument->sampleData, sampleLength, encodedData);
+    printLogVerbose("Note: encoded instrument %d as ADPCM, saving %d bytes", instIndex + 1,
+                    (int)(instrument->sampleByteCount - encodedSize));
+    
+    if (!isInRawData(music, instrument->sampleData)) {
+        free(instrument->sampleData);
     }
     
-    return kMusicNoError;
+    instrument->sampleData = encodedData;
+    instrument->sampleByteCount = encodedSize;
+    instrument->format = kSoundADPCMMono;
 }
 
-static bool createInstrumentSynth(TrackerMusic *music, uint8_t channel, TrackerMusicChannelSynth *synth)
+// Encodes the samples of the instruments marked to be encoded as ADPCM without
+// creating any of the Playdate audio entities, for converting music to another
+// format. Their offset samples must already have been created (see
+// createTrackerMusicOffsetSamples).
+void encodeTrackerMusicADPCMSamples(TrackerMusic *music)
 {
-    synth->synth = pd->sound->synth->newSynth();
-    
-    if (!synth->synth) {
-        printLog("Error: couldn't create PDSynth");
-        return false;
+    for(int i = 0; i < music->instrumentCount; ++i) {
+        if (music->instruments[i].encodeADPCM) {
+            encodeInstrumentADPCM(music, i);
+        }
     }
+}
+
+// Instruments that share their sample data with an earlier instrument are set
+// up after it, so they pick up any changes made to its sample (such as its loop
+// being extended) and can reuse its AudioSample if they have the same rate.
+static bool createSharedInstrumentSample(TrackerMusic *music, int instIndex)
+{
+    TrackerMusicInstrument *instrument = &music->instruments[instIndex];
+    TrackerMusicInstrument *source = &music->instruments[instrument->sharedSampleSource - 1];
+    bool isStereo = SoundFormatIsStereo(instrument->format);
     
-    pd->sound->synth->setAttackTime(synth->synth, 0.0f);
-    pd->sound->synth->setReleaseTime(synth->synth, kInstrumentReleaseTime);
+    instrument->sampleData = source->sampleData;
+    instrument->format = source->format;
+    instrument->sampleByteCount = source->sampleByteCount;
+    instrument->loopBegin = source->loopBegin;
+    instrument->loopEnd = source->loopEnd;
     
-    if (music->channels[channel].currentPitchController != NULL) {
-        pd->sound->synth->setFrequencyModulator(synth->synth,
-                                                (PDSynthSignalValue *)music->channels[channel].currentPitchController);
+    if (source->offsetSampleData || instrument->offsetSampleData) {
+        instrument->offsetSampleData = source->offsetSampleData;
+        instrument->offsetSampleByteCount = source->offsetSampleData ? source->offsetSampleByteCount
+                                                                     : SYNTH_DATA_UNINITIALIZED;
     }
     
-    pd->sound->channel->addSource(music->channels[channel].soundChannel, (SoundSource *)synth->synth);
-
-    synth->offset = 0;
-    synth->instrument = UNSET;
-    synth->sample = NULL;
+    if (instrument->sampleRate == source->sampleRate) {
+        instrument->sample = source->sample;
+    } else {
+        instrument->sample = pd->sound->sample->newSampleFromData(instrument->sampleData, instrument->format,
+                                                                  instrument->sampleRate / (isStereo ? 2 : 1),
+                                                                  instrument->sampleByteCount, 0);
+        
+        if (!instrument->sample) {
+            printLog("Error: couldn't create AudioSample for instrument %d", instIndex + 1);
+            return false;
+        }
+    }
     
     return true;
 }
 
-static void createOffsetSample(TrackerMusic *music, int instIndex)
+static int createMusicInstrument(TrackerMusic *music, int i)
 {
-    TrackerMusicInstrument *instrument = &music->instruments[instIndex];
+    TrackerMusicInstrument *instrument = &music->instruments[i];
+    bool isStereo = SoundFormatIsStereo(instrument->format);
     
-    printLogVerbose("Note: creating offset sample for instrument %d", instIndex);
+    if (instrument->sharedSampleSource) {
+        if (!createSharedInstrumentSample(music, i)) {
+            return kMusicPlaydateSoundError;
+        }
+        
+        return kMusicNoError;
+    }
     
-    uint32_t loopLength = (instrument->loopEnd - instrument->loopBegin) * instrument->bytesPerSample;
-    instrument->offsetSampleData = malloc(loopLength * 2);
-    memcpy(instrument->offsetSampleData, instrument->sampleData + instrument->loopBegin * instrument->bytesPerSample,
-            loopLength);
-    memcpy(instrument->offsetSampleData + loopLength,
-           instrument->sampleData + instrument->loopBegin * instrument->bytesPerSample, loopLength);
-    instrument->offsetSampleByteCount = 2 * loopLength;
-}
-
+    if (isPagedInstrument(music, instrument)) {
+        // The AudioSample is created when the sample is read in. Paged samples
+        // are read straight from the file each time, so they don't get the fix
+        // for short loops below.
+        return kMusicNoError;
+    }
+    
+    // Due to a bug in the Playdate 2.5.0 API, looping samples whose loop
+    // length less than a certain number of samples -- say around 500 --
+    // will play with horrible distortion at higher notes. This bit here
+    // recreates the sample so that it's loop is extended until it is at
+    // least kMinimumLoopSamples long in order to work around the issue.
+    // This bug is fixed in API 2.6.0, so we check the current API version
+    // and conditionally include the fix if it's needed. (See
+    // playdate-tracker/demo/CMakeLists.txt for an explanation of how this
+    // macro is defined and how its value corresponds to the API version.)
+    // ADPCM samples can't be fixed this way, but samples loaded from S3M files
+    // are only encoded as ADPCM after this, so it only affects TMC files.
 #if PLAYDATE_API_VERSION < 20600
-
-static void createFixedLoopSample(TrackerMusicInstrument *instrument)
-{
-    uint32_t oldLoopLength = instrument->loopEnd - instrument->loopBegin;
-    uint32_t repeatCount = (kMinimumLoopSamples / oldLoopLength) + 1;
-    uint32_t newSampleLength = (instrument->loopBegin + repeatCount * oldLoopLength);
+    if ((instrument->loopEnd != 0 || instrument->loopBegin != 0) && !isADPCMInstrument(instrument)
+        && (instrument->loopEnd - instrument->loopBegin) < kMinimumLoopSamples) {
+        printLogVerbose("Note: creating fixed looping sample for instrument %d", i);
+        createFixedLoopSample(music, instrument);
+        
+        // An offset sample that was loaded precomputed was made from the
+        // original loop, so it has to be made again from the extended one
+        if (instrument->offsetSampleData) {
+            if (!isInRawData(music, instrument->offsetSampleData)) {
+                free(instrument->offsetSampleData);
+            }
+            
+            instrument->offsetSampleData = NULL;
+            instrument->offsetSampleByteCount = SYNTH_DATA_UNINITIALIZED;
+        }
+    }
+#endif
     
-    uint8_t *fixedSample = malloc(newSampleLength * instrument->bytesPerSample);
+    if (instrument->encodeADPCM) {
+        encodeInstrumentADPCM(music, i);
+    }
     
-    memcpy(fixedSample, instrument->sampleData, instrument->loopBegin * instrument->bytesPerSample);
+    if (instrument->sampleData) {
+        addInstrumentToSampleBank(music, i);
+    }
     
-    for(uint32_t j = 0; j < repeatCount; ++j) {
-        memcpy(fixedSample + (instrument->loopBegin + j * oldLoopLength) * instrument->bytesPerSample,
-                instrument->sampleData + instrument->loopBegin * instrument->bytesPerSample,
-                oldLoopLength * instrument->bytesPerSample);
+    TrackerMusicSampleBankEntry *entry = instrument->bankEntry;
+    
+    if (entry && entry->sample && entry->sampleRate == instrument->sampleRate) {
+        instrument->sample = entry->sample;
+    } else {
+        instrument->sample = pd->sound->sample->newSampleFromData(instrument->sampleData, instrument->format,
+                                                                  instrument->sampleRate / (isStereo ? 2 : 1),
+                                                                  instrument->sampleByteCount, 0);
+        
+        if (!instrument->sample) {
+            printLog("Error: couldn't create AudioSample for instrument %d", i + 1);
+            return kMusicPlaydateSoundError;
+        }
+        
+        if (entry && !entry->sample) {
+            entry->sample = instrument->sample;
+            entry->sampleRate = instrument->sampleRate;
+        }
     }
     
-    instrument->loopEnd = newSampleLength;
-    instrument->sampleData = fixedSample;
-    instrument->sampleByteCount = newSampleLength * instrument->bytesPerSample;
+    return kMusicNoError;
 }
 
-#endif
+// Creates ahead of time the offset samples that the music is likely to need,
+// without creating any of the Playdate audio entities. Used when converting
+// music to another format so that its offset samples can be stored with it.
+int createTrackerMusicOffsetSamples(TrackerMusic *music)
+{
+    int error = calculateUsedInstrumentsAndOffsets(music);
+    
+    if (error != kMusicNoError) {
+        return error;
+    }
+    
+    for(int i = 0; i < music->instrumentCount; ++i) {
+        if (music->instruments[i].offsetSampleByteCount == SYNTH_DATA_UNINITIALIZED) {
+            createOffsetSample(music, i);
+        }
+    }
+    
+    return kMusicNoError;
+}
 
-static bool isInRawData(TrackerMusic *music, void *ptr)
+enum {
+    kLoaderStageRead,
+    kLoaderStageChannels,
+    kLoaderStageScan,
+    kLoaderStageRows,
+    kLoaderStageInstruments,
+    kLoaderStageOffsetSamples,
+    kLoaderStageDone
+};
+
+void beginTrackerMusicLoader(TrackerMusicLoader *loader, TrackerMusic *music, int (*readStep)(TrackerMusicLoader *),
+                             void (*readFinish)(TrackerMusicLoader *, int), void *readState, bool readOnly)
 {
-    return (uint8_t *)ptr >= music->rawData && (uint8_t *)ptr < (music->rawData + music->size);
+    loader->music = music;
+    loader->readStep = readStep;
+    loader->readFinish = readFinish;
+    loader->readState = readState;
+    loader->readOnly = readOnly;
+    loader->stage = readStep ? kLoaderStageRead : kLoaderStageChannels;
+    loader->index = 0;
+    loader->result = kMusicLoading;
+    memset(loader->lastInstrument, 0, sizeof(loader->lastInstrument));
 }
 
-void freeTrackerMusic(TrackerMusic *music)
+static void endTrackerMusicLoaderRead(TrackerMusicLoader *loader, int result)
 {
-    int i, j;
+    if (loader->readFinish) {
+        loader->readFinish(loader, result);
+        loader->readFinish = NULL;
+    }
     
-    if (currentMusic == music) {
-        stopTrackerMusic();
+    loader->readState = NULL;
+}
+
+static void finishTrackerMusicLoaderWithResult(TrackerMusicLoader *loader, int result)
+{
+    if (result != kMusicNoError) {
+        freeTrackerMusic(loader->music);
     }
     
-    printLogVerbose("Freeing music");
+    loader->stage = kLoaderStageDone;
+    loader->result = result;
+}
+
+static void advanceTrackerMusicLoaderStage(TrackerMusicLoader *loader)
+{
+    ++loader->stage;
+    loader->index = 0;
+}
+
+// Does one unit of loading work: reading a part of the file, compiling the rows
+// of one pattern, or creating the audio entities for one channel or instrument.
+static void stepTrackerMusicLoaderUnit(TrackerMusicLoader *loader)
+{
+    TrackerMusic *music = loader->music;
+    int error = kMusicNoError;
     
-    if (music->instruments) {
-        for(i = 0; i < music->instrumentCount; ++i) {
-            if (music->instruments[i].sampleData) {
-                if (!isInRawData(music, music->instruments[i].sampleData)) {
-                    free(music->instruments[i].sampleData);
-                }
-            }
+    switch(loader->stage) {
+        case kLoaderStageRead:
+            error = loader->readStep(loader);
             
-            if (music->instruments[i].sample) {
-                pd->sound->sample->freeSample(music->instruments[i].sample);
+            if (error == kMusicLoading) {
+                return;
             }
             
-            if (music->instruments[i].offsetSampleData) {
-                free(music->instruments[i].offsetSampleData);
+            endTrackerMusicLoaderRead(loader, error);
+            
+            if (error == kMusicNoError && loader->readOnly) {
+                loader->stage = kLoaderStageDone;
+                loader->result = kMusicNoError;
+                return;
             }
-        }
+            
+            advanceTrackerMusicLoaderStage(loader);
+            break;
+            
+        case kLoaderStageChannels:
+            if (!music->player) {
+                error = createDefaultMusicPlayer(music);
+            } else if (loader->index < music->channelCount) {
+                error = createMusicChannel(music->player, loader->index++);
+            } else {
+                advanceTrackerMusicLoaderStage(loader);
+            }
+            break;
+            
+        case kLoaderStageScan:
+            if (loader->index < music->orderCount) {
+                error = calculateUsedInstrumentsAndOffsetsForOrder(music, loader->index++, loader->lastInstrument);
+            } else {
+                advanceTrackerMusicLoaderStage(loader);
+            }
+            break;
+            
+        case kLoaderStageRows:
+            // Lazy storage compiles each pattern's rows when it's decoded
+            if (music->patternStorage != kPatternStorageLazy && loader->index < music->patternCount) {
+                error = compileNextPatternRowOps(loader);
+            } else {
+                if (music->patternStorage != kPatternStorageLazy) {
+                    finishRowOps(music);
+                }
+                
+                advanceTrackerMusicLoaderStage(loader);
+            }
+            break;
+            
+        case kLoaderStageInstruments:
+            if (loader->index < music->instrumentCount) {
+                error = createMusicInstrument(music, loader->index++);
+            } else {
+                advanceTrackerMusicLoaderStage(loader);
+            }
+            break;
+            
+        case kLoaderStageOffsetSamples:
+            // Skip past the instruments that don't need an offset sample
+            // without counting them as a unit of work. Paged instruments get
+            // theirs when their sample is read in.
+            while(loader->index < music->instrumentCount
+                  && (music->instruments[loader->index].offsetSampleByteCount != SYNTH_DATA_UNINITIALIZED
+                      || isPagedInstrument(music, &music->instruments[loader->index]))) {
+                ++loader->index;
+            }
+            
+            if (loader->index < music->instrumentCount) {
+                createOffsetSample(music, loader->index++);
+            } else {
+                finishTrackerMusicLoaderWithResult(loader, kMusicNoError);
+            }
+            break;
+    }
+    
+    if (error != kMusicNoError) {
+        finishTrackerMusicLoaderWithResult(loader, error);
+    }
+}
+
+// Continues loading for roughly the given number of microseconds, and returns
+// kMusicLoading if there is more loading left to do, otherwise the result of
+// loading. At least one unit of work is done on each call, and a single unit
+// (such as converting a large sample) can take longer than the time given.
+int stepTrackerMusicLoader(TrackerMusicLoader *loader, uint32_t microseconds)
+{
+    float start = pd->system->getElapsedTime();
+    float budget = microseconds / 1000000.0f;
+    
+    while(loader->result == kMusicLoading) {
+        stepTrackerMusicLoaderUnit(loader);
+        
+        if (pd->system->getElapsedTime() - start >= budget) {
+            break;
+        }
+    }
+    
+    return loader->result;
+}
+
+int finishTrackerMusicLoader(TrackerMusicLoader *loader)
+{
+    while(loader->result == kMusicLoading) {
+        stepTrackerMusicLoaderUnit(loader);
+    }
+    
+    return loader->result;
+}
+
+bool isTrackerMusicLoaderDone(TrackerMusicLoader *loader)
+{
+    return loader->result != kMusicLoading;
+}
+
+// Stops loading and frees everything loaded so far. Does nothing if loading
+// has already finished, in which case the music must be freed as usual.
+void cancelTrackerMusicLoader(TrackerMusicLoader *loader)
+{
+    if (loader->result != kMusicLoading) {
+        return;
+    }
+    
+    if (loader->stage == kLoaderStageRead) {
+        endTrackerMusicLoaderRead(loader, kMusicLoading);
+    }
+    
+    finishTrackerMusicLoaderWithResult(loader, kMusicLoadCancelled);
+}
+
+int createTrackerMusicAudioEntities(TrackerMusic *music)
+{
+    TrackerMusicLoader loader;
+    
+    beginTrackerMusicLoader(&loader, music, NULL, NULL, NULL, false);
+    return finishTrackerMusicLoader(&loader);
+}
+
+static bool createInstrumentSynth(TrackerMusicPlayer *player, uint8_t channel, TrackerMusicChannelSynth *synth)
+{
+    synth->synth = pd->sound->synth->newSynth();
+    
+    if (!synth->synth) {
+        printLog("Error: couldn't create PDSynth");
+        return false;
+    }
+    
+    pd->sound->synth->setAttackTime(synth->synth, 0.0f);
+    pd->sound->synth->setReleaseTime(synth->synth, kInstrumentReleaseTime);
+    
+    if (player->channels[channel].currentPitchController != NULL) {
+        pd->sound->synth->setFrequencyModulator(synth->synth,
+                                                (PDSynthSignalValue *)player->channels[channel].currentPitchController);
+    }
+    
+    pd->sound->channel->addSource(player->channels[channel].soundChannel, (SoundSource *)synth->synth);
+
+    synth->offset = 0;
+    synth->instrument = UNSET;
+    synth->sample = NULL;
+    
+    return true;
+}
+
+static void createOffsetSample(TrackerMusic *music, int instIndex)
+{
+    TrackerMusicInstrument *instrument = &music->instruments[instIndex];
+    
+    if (instrument->sharedSampleSource) {
+        // The offset sample is shared along with the rest of the sample data
+        TrackerMusicInstrument *source = &music->instruments[instrument->sharedSampleSource - 1];
+        
+        if (!source->offsetSampleData) {
+            createOffsetSample(music, instrument->sharedSampleSource - 1);
+        }
+        
+        instrument->offsetSampleData = source->offsetSampleData;
+        instrument->offsetSampleByteCount = source->offsetSampleByteCount;
+        return;
+    }
+    
+    if (instrument->bankEntry && instrument->bankEntry->offsetSampleData) {
+        instrument->offsetSampleData = instrument->bankEntry->offsetSampleData;
+        instrument->offsetSampleByteCount = instrument->bankEntry->offsetSampleByteCount;
+        return;
+    }
+    
+    printLogVerbose("Note: creating offset sample for instrument %d", instIndex);
+    
+    uint32_t loopLength = (instrument->loopEnd - instrument->loopBegin) * instrument->bytesPerSample;
+    instrument->offsetSampleData = malloc(loopLength * 2);
+    
+    if (isADPCMInstrument(instrument)) {
+        decodeADPCM(instrument->sampleData, instrument->sampleByteCount, instrument->loopBegin,
+                    instrument->loopEnd - instrument->loopBegin, (int16_t *)instrument->offsetSampleData);
+    } else {
+        memcpy(instrument->offsetSampleData, instrument->sampleData + instrument->loopBegin * instrument->bytesPerSample,
+                loopLength);
+    }
+    
+    memcpy(instrument->offsetSampleData + loopLength, instrument->offsetSampleData, loopLength);
+    instrument->offsetSampleByteCount = 2 * loopLength;
+    
+    if (instrument->bankEntry) {
+        instrument->bankEntry->offsetSampleData = instrument->offsetSampleData;
+        instrument->bankEntry->offsetSampleByteCount = instrument->offsetSampleByteCount;
+    }
+}
+
+#if PLAYDATE_API_VERSION < 20600
+
+static void createFixedLoopSample(TrackerMusic *music, TrackerMusicInstrument *instrument)
+{
+    uint32_t oldLoopLength = instrument->loopEnd - instrument->loopBegin;
+    uint32_t repeatCount = (kMinimumLoopSamples / oldLoopLength) + 1;
+    uint32_t newSampleLength = (instrument->loopBegin + repeatCount * oldLoopLength);
+    
+    uint8_t *fixedSample = malloc(newSampleLength * instrument->bytesPerSample);
+    
+    memcpy(fixedSample, instrument->sampleData, instrument->loopBegin * instrument->bytesPerSample);
+    
+    for(uint32_t j = 0; j < repeatCount; ++j) {
+        memcpy(fixedSample + (instrument->loopBegin + j * oldLoopLength) * instrument->bytesPerSample,
+                instrument->sampleData + instrument->loopBegin * instrument->bytesPerSample,
+                oldLoopLength * instrument->bytesPerSample);
+    }
+    
+    if (!isInRawData(music, instrument->sampleData)) {
+        free(instrument->sampleData);
+    }
+    
+    instrument->loopEnd = newSampleLength;
+    instrument->sampleData = fixedSample;
+    instrument->sampleByteCount = newSampleLength * instrument->bytesPerSample;
+}
+
+#endif
+
+// Reads the sample at the given index of an instrument's sample as it would be
+// played, so past the end of its loop the loop repeats
+static inline float resampleInput(TrackerMusicInstrument *instrument, int64_t index, uint32_t sampleLength)
+{
+    bool isLooping = (instrument->loopBegin != 0 || instrument->loopEnd != 0);
+    
+    if (index < 0) {
+        return 0.0f;
+    }
+    
+    if (isLooping && index >= instrument->loopEnd && instrument->loopEnd > instrument->loopBegin) {
+        index = instrument->loopBegin + (index - instrument->loopBegin) % (instrument->loopEnd - instrument->loopBegin);
+    }
+    
+    if (index >= sampleLength) {
+        return 0.0f;
+    }
+    
+    if (instrument->bytesPerSample == 2) {
+        return ((int16_t *)instrument->sampleData)[index];
+    }
+    
+    return ((int8_t *)instrument->sampleData)[index];
+}
+
+// Band-limits and decimates a mono sample whose rate is above maxSampleRate
+// down to that rate using a windowed sinc filter, and rescales its rate and
+// loop points to match. A looping sample's new rate is adjusted slightly so
+// that its loop is a whole number of samples long and stays in tune. Returns
+// the number of bytes saved.
+uint32_t resampleTrackerMusicInstrument(TrackerMusic *music, int instIndex, uint32_t maxSampleRate)
+{
+    TrackerMusicInstrument *instrument = &music->instruments[instIndex];
+    bool isLooping = (instrument->loopBegin != 0 || instrument->loopEnd != 0);
+    
+    if (!instrument->sampleData || instrument->sampleRate <= maxSampleRate || SoundFormatIsStereo(instrument->format)
+        || (instrument->format != kSound8bitMono && instrument->format != kSound16bitMono)) {
+        return 0;
+    }
+    
+    uint32_t sampleLength = instrument->sampleByteCount / instrument->bytesPerSample;
+    uint32_t newSampleRate = maxSampleRate;
+    uint32_t newLoopLength = 0;
+    uint64_t step; // input samples per output sample, as 32.32 fixed point
+    
+    if (isLooping && instrument->loopEnd > instrument->loopBegin) {
+        uint32_t loopLength = instrument->loopEnd - instrument->loopBegin;
+        newLoopLength = MAX(1, (uint32_t)(((uint64_t)loopLength * maxSampleRate) / instrument->sampleRate));
+        step = ((uint64_t)loopLength << 32) / newLoopLength;
+        newSampleRate = (uint32_t)(((uint64_t)instrument->sampleRate * newLoopLength + loopLength / 2) / loopLength);
+    } else {
+        step = ((uint64_t)instrument->sampleRate << 32) / maxSampleRate;
+    }
+    
+    uint32_t newLoopBegin = (uint32_t)(((uint64_t)instrument->loopBegin << 32) / step);
+    uint32_t newLoopEnd = (newLoopLength > 0) ? newLoopBegin + newLoopLength
+                                              : (uint32_t)(((uint64_t)instrument->loopEnd << 32) / step);
+    uint32_t newSampleLength = MAX(newLoopEnd, (uint32_t)(((uint64_t)sampleLength << 32) / step));
+    
+    if (newSampleLength == 0) {
+        newSampleLength = 1;
+    }
+    
+    uint8_t *newSampleData = malloc(newSampleLength * instrument->bytesPerSample);
+    
+    // The filter's cutoff is the new Nyquist frequency, in cycles per input
+    // sample, and its taps for each fractional input position are worked out
+    // ahead of time
+    float cutoff = 0.5f * (float)((double)(1ULL << 32) / (double)step);
+    float halfWidth = kResampleZeroCrossings / (2.0f * cutoff);
+    int halfTaps = (int)ceilf(halfWidth);
+    int tapCount = 2 * halfTaps + 1;
+    float *taps = malloc(kResamplePhases * tapCount * sizeof(float));
+    
+    if (!newSampleData || !taps) {
+        printLog("Warning: couldn't allocate memory to resample instrument %d", instIndex + 1);
+        free(newSampleData);
+        free(taps);
+        return 0;
+    }
+    
+    for(int phase = 0; phase < kResamplePhases; ++phase) {
+        float *phaseTaps = &taps[phase * tapCount];
+        float sum = 0.0f;
+        
+        for(int i = 0; i < tapCount; ++i) {
+            float distance = (float)(i - halfTaps) - (float)phase / kResamplePhases;
+            float x = distance / halfWidth;
+            float tap = 0.0f;
+            
+            if (x > -1.0f && x < 1.0f) {
+                float window = 0.42f + 0.5f * cosf(((float)M_PI) * x) + 0.08f * cosf(2.0f * ((float)M_PI) * x);
+                float sincArg = 2.0f * cutoff * distance;
+                tap = window * ((sincArg == 0.0f) ? 1.0f : sinf(((float)M_PI) * sincArg) / (((float)M_PI) * sincArg));
+            }
+            
+            phaseTaps[i] = tap;
+            sum += tap;
+        }
+        
+        for(int i = 0; i < tapCount; ++i) {
+            phaseTaps[i] /= sum;
+        }
+    }
+    
+    for(uint32_t i = 0; i < newSampleLength; ++i) {
+        uint64_t position = (uint64_t)i * step;
+        int64_t index = (int64_t)(position >> 32);
+        uint32_t phase = (uint32_t)((((position & 0xFFFFFFFF) * kResamplePhases) + 0x80000000) >> 32);
+        
+        if (phase == kResamplePhases) {
+            phase = 0;
+            ++index;
+        }
+        
+        float *phaseTaps = &taps[phase * tapCount];
+        float value = 0.0f;
+        
+        for(int j = 0; j < tapCount; ++j) {
+            value += phaseTaps[j] * resampleInput(instrument, index + j - halfTaps, sampleLength);
+        }
+        
+        if (instrument->bytesPerSample == 2) {
+            ((int16_t *)newSampleData)[i] = (int16_t)clampf(roundf(value), -32768.0f, 32767.0f);
+        } else {
+            ((int8_t *)newSampleData)[i] = (int8_t)clampf(roundf(value), -128.0f, 127.0f);
+        }
+    }
+    
+    free(taps);
+    
+    uint32_t bytesSaved = instrument->sampleByteCount - newSampleLength * instrument->bytesPerSample;
+    printLogVerbose("Note: resampled instrument %d from %d Hz to %d Hz, saving %d bytes", instIndex + 1,
+                    (int)instrument->sampleRate, (int)newSampleRate, (int)bytesSaved);
+    
+    if (!isInRawData(music, instrument->sampleData)) {
+        free(instrument->sampleData);
+    }
+    
+    if (instrument->originalSampleRate == 0) {
+        instrument->originalSampleRate = instrument->sampleRate;
+    }
+    
+    instrument->sampleData = newSampleData;
+    instrument->sampleByteCount = newSampleLength * instrument->bytesPerSample;
+    instrument->sampleRate = newSampleRate;
+    
+    instrument->loopBegin = newLoopBegin;
+    instrument->loopEnd = newLoopEnd;
+    
+    music->resampleBytesSaved += bytesSaved;
+    return bytesSaved;
+}
+
+// The types of row op other than channel effects, whose type is their effect
+enum {
+    kRowOpSetVolume = kEffectPatternBreak + 1,
+    kRowOpSetPanning, // from the volume column
+    kRowOpNote,
+    kRowOpSetSpeed,
+    kRowOpPositionJump,
+    kRowOpPatternBreak,
+    kRowOpSetTempo,
+    kRowOpSlideTempoDown,
+    kRowOpSlideTempoUp,
+};
+
+enum {
+    // The effect value is 0, and the effect uses the channel's last effect
+    // value in its place
+    kRowOpRecallsEffectVal = 0x01,
+    // The effect value isn't 0, and becomes the channel's last effect value
+    kRowOpStoresEffectVal = 0x02,
+    kRowOpHasNote = 0x04, // the cell has a note or instrument
+    kRowOpTriggersNote = 0x08, // the cell has a note that can be played
+    kRowOpHasVolume = 0x10, // the cell sets the volume
+    kRowOpOffset = 0x20, // the cell's effect is an offset
+    kRowOpNoteDelay = 0x40, // the cell's effect is a note delay
+    kRowOpTonePortamento = 0x80, // the cell's effect is a tone portamento
+};
+
+// A cell can have a control effect, a volume, a note and a channel effect
+#define MAX_ROW_OPS_PER_CELL 4
+
+static bool effectRecallsLastEffectVal(uint8_t effect)
+{
+    switch(effect) {
+        case kEffectVolumeSlide:
+        case kEffectPortamentoDown:
+        case kEffectPortamentoUp:
+        case kEffectVolumeSlideAndVibrato:
+        case kEffectVolumeSlideAndTonePortamento:
+        case kEffectRetrigger:
+        case kEffectTremor:
+        case kEffectTremolo:
+        case kEffectArpeggio:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static TrackerMusicRowOp * addRowOp(TrackerMusicRowOp *ops, uint16_t *opCount, uint8_t type, uint8_t channel,
+                                    uint8_t value)
+{
+    TrackerMusicRowOp *op = &ops[(*opCount)++];
+    
+    memset(op, 0, sizeof(TrackerMusicRowOp));
+    op->type = type;
+    op->channel = channel;
+    op->value = value;
+    return op;
+}
+
+// Compiles a row's cells into ops and returns how many there are. ops must have
+// room for MAX_ROW_OPS_PER_CELL ops per cell. channels gets a bitmask of the
+// channels that have cells in the row.
+static uint16_t compileRowOps(TrackerMusic *music, PatternCell *cells, uint8_t cellCount, TrackerMusicRowOp *ops,
+                              uint32_t *channels)
+{
+    uint16_t opCount = 0;
+    
+    (*channels) = 0;
+    
+    // Control effects go first, since they can change when the next row starts
+    for(uint8_t i = 0; i < cellCount; ++i) {
+        PatternCell *cell = &cells[i];
+        uint8_t channel = cell->what & CHANNEL_MASK;
+        
+        if ((cell->what & EFFECT_FLAG) == 0 || !music->channelEnabled[channel]) {
+            continue;
+        }
+        
+        switch(cell->effect) {
+            case kEffectSetSpeed:
+                addRowOp(ops, &opCount, kRowOpSetSpeed, channel, cell->effectVal);
+                break;
+            case kEffectPositionJump:
+                addRowOp(ops, &opCount, kRowOpPositionJump, channel, cell->effectVal);
+                break;
+            case kEffectPatternBreak:
+                addRowOp(ops, &opCount, kRowOpPatternBreak, channel, clamp(cell->effectVal, 0, 63));
+                break;
+            case kEffectSetTempo:
+                if ((cell->effectVal & 0xF0) == 0x00) {
+                    addRowOp(ops, &opCount, kRowOpSlideTempoDown, channel, cell->effectVal & 0x0F);
+                } else if ((cell->effectVal & 0xF0) == 0x10) {
+                    addRowOp(ops, &opCount, kRowOpSlideTempoUp, channel, cell->effectVal & 0x0F);
+                } else {
+                    addRowOp(ops, &opCount, kRowOpSetTempo, channel, cell->effectVal);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    
+    for(uint8_t i = 0; i < cellCount; ++i) {
+        PatternCell *cell = &cells[i];
+        uint8_t channel = cell->what & CHANNEL_MASK;
+        bool hasEffect = (cell->what & EFFECT_FLAG) != 0;
+        
+        if (cell->what == 0 || !music->channelEnabled[channel]) {
+            continue;
+        }
+        
+        (*channels) |= (1u << channel);
+        
+        if ((cell->what & VOLUME_FLAG) != 0) {
+            if (cell->volume <= 0x40) {
+                addRowOp(ops, &opCount, kRowOpSetVolume, channel, cell->volume);
+            } else if (cell->volume >= 0x80 && cell->volume <= 0xc0) {
+                addRowOp(ops, &opCount, kRowOpSetPanning, channel, cell->volume - 0x80);
+            }
+        }
+        
+        if ((cell->what & NOTE_AND_INST_FLAG) != 0) {
+            TrackerMusicRowOp *op = addRowOp(ops, &opCount, kRowOpNote, channel, cell->note);
+            op->instrument = cell->instrument;
+            
+            if (cellHasVolume(cell)) {
+                op->flags |= kRowOpHasVolume;
+            }
+            
+            if (hasEffect && cell->effect == kEffectOffset) {
+                op->flags |= kRowOpOffset;
+                op->noteEffectVal = cell->effectVal;
+            } else if (hasEffect && cell->effect == kEffectNoteDelay) {
+                op->flags |= kRowOpNoteDelay;
+                op->noteEffectVal = cell->effectVal;
+            } else if (hasEffect && cell->effect == kEffectTonePortamento) {
+                op->flags |= kRowOpTonePortamento;
+            }
+        }
+        
+        if (hasEffect) {
+            TrackerMusicRowOp *op = addRowOp(ops, &opCount, cell->effect, channel, cell->effectVal);
+            op->hi = (cell->effectVal & 0xF0) >> 4;
+            op->lo = cell->effectVal & 0x0F;
+            
+            if ((cell->what & NOTE_AND_INST_FLAG) != 0) {
+                op->flags |= kRowOpHasNote;
+                
+                if (isPlayableNote(cell->note)) {
+                    op->flags |= kRowOpTriggersNote;
+                }
+            }
+            
+            if (cell->effect != kEffectNone && cell->effectVal != 0) {
+                op->flags |= kRowOpStoresEffectVal;
+            } else if (cell->effect != kEffectNone && effectRecallsLastEffectVal(cell->effect)) {
+                op->flags |= kRowOpRecallsEffectVal;
+            }
+        }
+    }
+    
+    return opCount;
+}
+
+// Compiles every row of a pattern, adding the ops to the end of *ops, which
+// has room for *capacity ops and is reallocated if it needs more. pattern is
+// the pattern's cells in dense form, or NULL to get them with patternRow.
+// rowOffsets gets where each row's ops start, counting from where the
+// pattern's ops start, and rowChannels gets each row's channels.
+static int compilePatternRowOps(TrackerMusic *music, int patternIndex, PatternCell *pattern, TrackerMusicRowOp **ops,
+                                uint32_t *opCount, uint32_t *capacity, uint16_t *rowOffsets, uint32_t *rowChannels)
+{
+    uint32_t start = *opCount;
+    
+    for(int row = 0; row < ROWS_PER_PATTERN; ++row) {
+        uint8_t cellCount = music->channelCount;
+        PatternCell *cells = pattern ? patternCell(music, pattern, row, 0)
+                                     : patternRow(music, patternIndex, row, &cellCount);
+        uint32_t needed = (*opCount) + cellCount * MAX_ROW_OPS_PER_CELL;
+        
+        if (needed > *capacity) {
+            uint32_t newCapacity = MAX(needed, (*capacity) * 2);
+            TrackerMusicRowOp *newOps = realloc(*ops, newCapacity * sizeof(TrackerMusicRowOp));
+            
+            if (!newOps) {
+                printLog("Error: couldn't allocate memory for compiled rows!");
+                return kMusicMemoryError;
+            }
+            
+            (*ops) = newOps;
+            (*capacity) = newCapacity;
+        }
+        
+        rowOffsets[row] = (*opCount) - start;
+        (*opCount) += compileRowOps(music, cells, cellCount, &(*ops)[*opCount], &rowChannels[row]);
+    }
+    
+    rowOffsets[ROWS_PER_PATTERN] = (*opCount) - start;
+    return kMusicNoError;
+}
+
+static bool isPatternInOrders(TrackerMusic *music, int patternIndex)
+{
+    for(int i = 0; i < music->orderCount; ++i) {
+        if (music->orders[i] == patternIndex) {
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+// Compiles the rows of the loader's next pattern. Patterns that aren't in the
+// order list can never be played, so their rows are left empty.
+static int compileNextPatternRowOps(TrackerMusicLoader *loader)
+{
+    TrackerMusic *music = loader->music;
+    int patternIndex = loader->index++;
+    
+    if (patternIndex == 0) {
+        music->patternOpOffsets = calloc(music->patternCount, sizeof(uint32_t));
+        music->rowOpOffsets = calloc(music->patternCount * (ROWS_PER_PATTERN + 1), sizeof(uint16_t));
+        music->rowChannels = calloc(music->patternCount * ROWS_PER_PATTERN, sizeof(uint32_t));
+        music->rowOpCount = 0;
+        loader->rowOpCapacity = 0;
+        
+        if (!music->patternOpOffsets || !music->rowOpOffsets || !music->rowChannels) {
+            printLog("Error: couldn't allocate memory for compiled rows!");
+            return kMusicMemoryError;
+        }
+    }
+    
+    music->patternOpOffsets[patternIndex] = music->rowOpCount;
+    
+    if (!isPatternInOrders(music, patternIndex)) {
+        return kMusicNoError;
+    }
+    
+    return compilePatternRowOps(music, patternIndex, NULL, &music->rowOps, &music->rowOpCount, &loader->rowOpCapacity,
+                                &music->rowOpOffsets[patternIndex * (ROWS_PER_PATTERN + 1)],
+                                &music->rowChannels[patternIndex * ROWS_PER_PATTERN]);
+}
+
+static void finishRowOps(TrackerMusic *music)
+{
+    TrackerMusicRowOp *ops = realloc(music->rowOps, MAX(music->rowOpCount, 1) * sizeof(TrackerMusicRowOp));
+    
+    if (ops) {
+        music->rowOps = ops;
+    }
+    
+    printLogVerbose("Note: compiled rows use %d bytes",
+                    (int)(music->rowOpCount * sizeof(TrackerMusicRowOp)
+                          + music->patternCount * (sizeof(uint32_t) + (ROWS_PER_PATTERN + 1) * sizeof(uint16_t)
+                                                   + ROWS_PER_PATTERN * sizeof(uint32_t))));
+}
+
+// Sparse pattern storage is built up one pattern at a time, as each pattern is
+// decoded, to avoid ever needing memory for every pattern in dense form.
+// patternCellOffsets and patternRowOffsets must already be allocated for
+// patternCount patterns, and patterns must be appended in order.
+int appendSparsePattern(TrackerMusic *music, int patternIndex, PatternCell *pattern, uint32_t *capacity)
+{
+    uint16_t *rowOffsets = &music->patternRowOffsets[patternIndex * (ROWS_PER_PATTERN + 1)];
+    uint16_t cellCount = 0;
+    
+    for(int row = 0; row < ROWS_PER_PATTERN; ++row) {
+        for(int channel = 0; channel < music->channelCount; ++channel) {
+            PatternCell *cell = patternCell(music, pattern, row, channel);
+            
+            if (cell->what != 0 && music->channelEnabled[channel]) {
+                ++cellCount;
+            }
+        }
+    }
+    
+    if (music->patternCellCount + cellCount > *capacity) {
+        uint32_t newCapacity = MAX(music->patternCellCount + cellCount, (*capacity) * 2);
+        PatternCell *newPatterns = realloc(music->patterns, newCapacity * sizeof(PatternCell));
+        
+        if (!newPatterns) {
+            printLog("Error: couldn't allocate memory for patterns!");
+            return kMusicMemoryError;
+        }
+        
+        music->patterns = newPatterns;
+        (*capacity) = newCapacity;
+    }
+    
+    music->patternCellOffsets[patternIndex] = music->patternCellCount;
+    cellCount = 0;
+    
+    for(int row = 0; row < ROWS_PER_PATTERN; ++row) {
+        rowOffsets[row] = cellCount;
+        
+        for(int channel = 0; channel < music->channelCount; ++channel) {
+            PatternCell *cell = patternCell(music, pattern, row, channel);
+            
+            if (cell->what != 0 && music->channelEnabled[channel]) {
+                music->patterns[music->patternCellCount + cellCount++] = *cell;
+            }
+        }
+    }
+    
+    rowOffsets[ROWS_PER_PATTERN] = cellCount;
+    music->patternCellCount += cellCount;
+    
+    return kMusicNoError;
+}
+
+void finishSparsePatterns(TrackerMusic *music)
+{
+    PatternCell *patterns = realloc(music->patterns, MAX(music->patternCellCount, 1) * sizeof(PatternCell));
+    
+    if (patterns) {
+        music->patterns = patterns;
+    }
+    
+    printLogVerbose("Note: sparse patterns use %d bytes, dense would be %d bytes",
+                    (int)(music->patternCellCount * sizeof(PatternCell)
+                          + music->patternCount * (sizeof(uint32_t) + (ROWS_PER_PATTERN + 1) * sizeof(uint16_t))),
+                    (int)(music->patternCount * music->channelCount * ROWS_PER_PATTERN * sizeof(PatternCell)));
+}
+
+// With lazy storage, music->patterns holds TRACKER_MUSIC_PATTERN_CACHE_SIZE
+// decoded patterns, and packed patterns are decoded into it using the least
+// recently used slot as they're needed. packedPatterns, packedPatternOffsets
+// and decodePattern must already be set up.
+int initializeLazyPatterns(TrackerMusic *music)
+{
+    music->patterns = malloc(MAX(TRACKER_MUSIC_PATTERN_CACHE_SIZE * music->channelCount * ROWS_PER_PATTERN, 1)
+                             * sizeof(PatternCell));
+    music->rowOpOffsets = calloc(TRACKER_MUSIC_PATTERN_CACHE_SIZE * (ROWS_PER_PATTERN + 1), sizeof(uint16_t));
+    music->rowChannels = calloc(TRACKER_MUSIC_PATTERN_CACHE_SIZE * ROWS_PER_PATTERN, sizeof(uint32_t));
+    
+    if (!music->patterns || !music->rowOpOffsets || !music->rowChannels) {
+        printLog("Error: couldn't allocate memory for patterns!");
+        return kMusicMemoryError;
+    }
+    
+    for(int i = 0; i < TRACKER_MUSIC_PATTERN_CACHE_SIZE; ++i) {
+        music->cachedPatterns[i] = UINT16_MAX;
+        music->cachedPatternLastUse[i] = 0;
+        music->cachedPatternOps[i] = NULL;
+        music->cachedPatternOpCapacity[i] = 0;
+    }
+    
+    music->patternCacheClock = 0;
+    music->patternCellCount = TRACKER_MUSIC_PATTERN_CACHE_SIZE * music->channelCount * ROWS_PER_PATTERN;
+    
+    printLogVerbose("Note: lazy patterns use %d bytes, dense would be %d bytes",
+                    (int)(music->patternCellCount * sizeof(PatternCell) + music->packedPatternOffsets[music->patternCount]
+                          + (music->patternCount + 1) * sizeof(uint32_t)),
+                    (int)(music->patternCount * music->channelCount * ROWS_PER_PATTERN * sizeof(PatternCell)));
+    
+    return kMusicNoError;
+}
+
+static int findCachedPattern(TrackerMusic *music, int patternIndex)
+{
+    for(int i = 0; i < TRACKER_MUSIC_PATTERN_CACHE_SIZE; ++i) {
+        if (music->cachedPatterns[i] == patternIndex) {
+            return i;
+        }
+    }
+    
+    return -1;
+}
+
+static int decodeLazyPattern(TrackerMusic *music, int patternIndex)
+{
+    int slot = 0;
+    
+    for(int i = 1; i < TRACKER_MUSIC_PATTERN_CACHE_SIZE; ++i) {
+        if (music->cachedPatternLastUse[i] < music->cachedPatternLastUse[slot]) {
+            slot = i;
+        }
+    }
+    
+    printLogVerbose("Note: decoding pattern %d into cache slot %d", patternIndex, slot);
+    
+    music->cachedPatterns[slot] = patternIndex;
+    music->decodePattern(music, patternIndex, patternAtIndex(music, slot));
+    
+    // The slot's ops buffer is kept from one pattern to the next, and only
+    // grows when a pattern needs more ops than it has room for
+    uint16_t *rowOffsets = &music->rowOpOffsets[slot * (ROWS_PER_PATTERN + 1)];
+    uint32_t *rowChannels = &music->rowChannels[slot * ROWS_PER_PATTERN];
+    uint32_t opCount = 0;
+    
+    if (compilePatternRowOps(music, patternIndex, patternAtIndex(music, slot), &music->cachedPatternOps[slot], &opCount,
+                             &music->cachedPatternOpCapacity[slot], rowOffsets, rowChannels) != kMusicNoError) {
+        memset(rowOffsets, 0, (ROWS_PER_PATTERN + 1) * sizeof(uint16_t));
+        memset(rowChannels, 0, ROWS_PER_PATTERN * sizeof(uint32_t));
+    }
+    
+    refreshCycleTime();
+    return slot;
+}
+
+int lazyPatternSlot(TrackerMusic *music, int patternIndex)
+{
+    int slot = findCachedPattern(music, patternIndex);
+    
+    if (slot < 0) {
+        slot = decodeLazyPattern(music, patternIndex);
+    }
+    
+    music->cachedPatternLastUse[slot] = ++music->patternCacheClock;
+    return slot;
+}
+
+// Decodes the pattern for the order after the one that's playing, if it isn't
+// already, so that it's ready by the time it's reached. Since the pattern
+// that's playing was just used, it's never the one that gets evicted.
+static void prefetchNextOrderPattern(TrackerMusicPlayer *player)
+{
+    TrackerMusic *music = player->music;
+    int orderIndex = player->pb.nextOrderIndex + 1;
+    
+    if (orderIndex >= music->orderCount || findCachedPattern(music, music->orders[orderIndex]) >= 0) {
+        return;
+    }
+    
+    int slot = decodeLazyPattern(music, music->orders[orderIndex]);
+    
+    // Not counted as a use, but shouldn't be evicted before it's been played
+    music->cachedPatternLastUse[slot] = music->patternCacheClock;
+}
+
+// With paged samples, instruments' samples stay in the file until they're
+// needed, and are read in with readPagedSample. orderInstruments has a bitmask
+// for each order of the instruments it triggers, which is filled in while the
+// music's audio entities are created and used to read samples ahead of time
+// and to avoid freeing the ones that are about to be played. readPagedSample,
+// pagedSampleSource and closePagedSampleSource must already be set up.
+int initializePagedSamples(TrackerMusic *music, uint32_t budget)
+{
+    uint32_t words = instrumentMaskWords(music);
+    
+    music->orderInstruments = calloc(MAX(music->orderCount * words, 1), sizeof(uint32_t));
+    music->neededInstruments = calloc(MAX(words, 1), sizeof(uint32_t));
+    
+    if (!music->orderInstruments || !music->neededInstruments) {
+        printLog("Error: couldn't allocate memory for paged samples!");
+        return kMusicMemoryError;
+    }
+    
+    music->pagedSampleBudget = budget;
+    music->pagedSampleClock = 0;
+    return kMusicNoError;
+}
+
+static inline bool isInstrumentNeeded(TrackerMusic *music, int instIndex)
+{
+    return (music->neededInstruments[instIndex / 32] & (1u << (instIndex % 32))) != 0;
+}
+
+// Marks the instruments that are triggered by the given order or the
+// TRACKER_MUSIC_SAMPLE_PREFETCH_ORDERS orders after it
+static void addNeededInstrumentsForOrder(TrackerMusic *music, int orderIndex)
+{
+    uint32_t words = instrumentMaskWords(music);
+    
+    for(int i = 0; i <= TRACKER_MUSIC_SAMPLE_PREFETCH_ORDERS && i < music->orderCount; ++i) {
+        uint32_t *instruments = &music->orderInstruments[((orderIndex + i) % music->orderCount) * words];
+        
+        for(uint32_t j = 0; j < words; ++j) {
+            music->neededInstruments[j] |= instruments[j];
+        }
+    }
+}
+
+// Marks the instruments that each of the music's players that's playing is
+// about to need: the ones its upcoming orders trigger, along with the last
+// instrument on each channel, which notes without an instrument play
+static void findNeededInstruments(TrackerMusic *music)
+{
+    memset(music->neededInstruments, 0, instrumentMaskWords(music) * sizeof(uint32_t));
+    
+    for(TrackerMusicPlayer *player = music->players; player; player = player->nextPlayer) {
+        if (!player->playing) {
+            continue;
+        }
+        
+        addNeededInstrumentsForOrder(music, player->pb.nextOrderIndex);
+        
+        for(int channel = 0; channel < music->channelCount; ++channel) {
+            uint8_t instIndex = player->pb.lastInstrument[channel];
+            
+            if (instIndex < music->instrumentCount) {
+                music->neededInstruments[instIndex / 32] |= 1u << (instIndex % 32);
+            }
+        }
+    }
+}
+
+static uint32_t pagedSampleBytes(TrackerMusic *music)
+{
+    uint32_t bytes = 0;
+    
+    for(int i = 0; i < music->instrumentCount; ++i) {
+        TrackerMusicInstrument *instrument = &music->instruments[i];
+        
+        if (isPagedInstrument(music, instrument) && instrument->sampleData) {
+            bytes += instrument->sampleByteCount + (instrument->offsetSampleData ? instrument->offsetSampleByteCount : 0);
+        }
+    }
+    
+    return bytes;
+}
+
+// The current time, which during processTrackerMusicCycle is the time the cycle
+// started at, or finished its last slow work at
+static uint32_t sequencerTime(void)
+{
+    if (inCycle) {
+        countQuery(sequencerTimeQueriesSaved);
+        return cycleTime;
+    }
+    
+    countQuery(sequencerTimeQueries);
+    return pd->sound->getCurrentTime();
+}
+
+// Reads the time again after work that can take a while, such as reading a
+// paged sample from its file, decoding a pattern or loading queued music, so
+// that the rest of the cycle doesn't work from a time that's out of date
+static void refreshCycleTime(void)
+{
+    if (inCycle) {
+        countQuery(sequencerTimeQueries);
+        cycleTime = pd->sound->getCurrentTime();
+    }
+}
+
+// Whether the synth is playing, which during processTrackerMusicCycle is only
+// asked once per cycle unless the synth is played or stopped in the meantime
+static bool isSynthPlaying(TrackerMusicChannelSynth *synth)
+{
+    if (inCycle && synth->playingCycle == cycleNumber) {
+        countQuery(synthPlayingQueriesSaved);
+        return synth->playing;
+    }
+    
+    countQuery(synthPlayingQueries);
+    bool playing = pd->sound->synth->isPlaying(synth->synth);
+    
+    if (inCycle) {
+        synth->playing = playing;
+        synth->playingCycle = cycleNumber;
+    }
+    
+    return playing;
+}
+
+// Has every synth be asked whether it's playing again, after a lot of them have
+// been stopped at once
+static void forgetSynthPlayingStates(void)
+{
+    if (++cycleNumber == 0) {
+        cycleNumber = 1;
+    }
+}
+
+// Whether a synth of one of the music's players could still be playing the
+// instrument's sample, or is about to, in which case the sample can't be freed
+static bool isInstrumentSampleInUse(TrackerMusic *music, int instIndex, uint32_t currentTime)
+{
+    uint32_t lastNoteOn, lastNoteOff;
+    
+    for(TrackerMusicPlayer *player = music->players; player; player = player->nextPlayer) {
+        for(int channel = 0; channel < music->channelCount; ++channel) {
+            for(int i = 0; i < TRACKER_MUSIC_INSTRUMENT_PDSYNTH_COUNT; ++i) {
+                TrackerMusicChannelSynth *synth = &player->channels[channel].synths[i];
+                
+                if (!synth->synth || synth->instrument != instIndex) {
+                    continue;
+                }
+                
+                // The channel's last synth can still be retriggered or slid
+                if (synth == player->pb.lastSynth[channel] || isSynthPlaying(synth)) {
+                    return true;
+                }
+                
+                getSynthLastNoteOnAndOffTimes(synth, &lastNoteOn, &lastNoteOff);
+                
+                if (currentTime <= lastNoteOn || currentTime <= lastNoteOff + kNoteOffLeeway) {
+                    return true;
+                }
+            }
+        }
+    }
+    
+    return false;
+}
+
+// Frees an instrument's sample, and its offset sample, until it's needed again.
+// Synths that were last set up with the instrument, by any of the music's
+// players, are cleared so that they're set up again with its new sample when
+// it's next played.
+static void evictPagedSample(TrackerMusic *music, int instIndex)
+{
+    TrackerMusicInstrument *instrument = &music->instruments[instIndex];
+    
+    printLogVerbose("Note: freeing paged sample of instrument %d", instIndex + 1);
+    
+    for(TrackerMusicPlayer *player = music->players; player; player = player->nextPlayer) {
+        for(int channel = 0; channel < music->channelCount; ++channel) {
+            for(int i = 0; i < TRACKER_MUSIC_INSTRUMENT_PDSYNTH_COUNT; ++i) {
+                TrackerMusicChannelSynth *synth = &player->channels[channel].synths[i];
+                
+                if (synth->instrument != instIndex) {
+                    continue;
+                }
+                
+                if (synth->sample) {
+                    pd->sound->sample->freeSample(synth->sample);
+                    synth->sample = NULL;
+                }
+                
+                synth->instrument = UNSET;
+                synth->offset = 0;
+            }
+        }
+    }
+    
+    if (instrument->sample) {
+        pd->sound->sample->freeSample(instrument->sample);
+        instrument->sample = NULL;
+    }
+    
+    free(instrument->sampleData);
+    instrument->sampleData = NULL;
+    
+    if (instrument->offsetSampleData) {
+        // Made again when the sample is next read in
+        free(instrument->offsetSampleData);
+        instrument->offsetSampleData = NULL;
+        instrument->offsetSampleByteCount = SYNTH_DATA_UNINITIALIZED;
+    }
+}
+
+// Frees the least recently played samples until there's room for the given
+// number of bytes within the budget. Samples that the upcoming orders need or
+// that are still in use are never freed, so if they need more than the budget
+// then it's exceeded.
+static void makeRoomForPagedSample(TrackerMusic *music, uint32_t size)
+{
+    uint32_t bytes = pagedSampleBytes(music);
+    uint32_t currentTime = sequencerTime();
+    
+    while(bytes + size > music->pagedSampleBudget) {
+        int oldest = -1;
+        
+        for(int i = 0; i < music->instrumentCount; ++i) {
+            TrackerMusicInstrument *instrument = &music->instruments[i];
+            
+            if (!isPagedInstrument(music, instrument) || !instrument->sampleData || isInstrumentNeeded(music, i)
+                || (oldest >= 0 && instrument->pagedLastUse >= music->instruments[oldest].pagedLastUse)
+                || isInstrumentSampleInUse(music, i, currentTime)) {
+                continue;
+            }
+            
+            oldest = i;
+        }
+        
+        if (oldest < 0) {
+            printLogVerbose("Note: paged samples need %d bytes, which is over budget", (int)(bytes + size));
+            return;
+        }
+        
+        bytes -= music->instruments[oldest].sampleByteCount;
+        
+        if (music->instruments[oldest].offsetSampleData) {
+            bytes -= music->instruments[oldest].offsetSampleByteCount;
+        }
+        
+        evictPagedSample(music, oldest);
+    }
+}
+
+// Reads in an instrument's sample and creates its AudioSample and, if it's
+// likely to need one, its offset sample. neededInstruments must be up to date
+// so that none of the samples that are about to be played are freed to make
+// room for it.
+static bool pageInInstrumentSample(TrackerMusic *music, int instIndex)
+{
+    TrackerMusicInstrument *instrument = &music->instruments[instIndex];
+    bool isStereo = SoundFormatIsStereo(instrument->format);
+    uint32_t size = instrument->sampleByteCount;
+    
+    if (instrument->offsetSampleByteCount == SYNTH_DATA_UNINITIALIZED) {
+        size += (instrument->loopEnd - instrument->loopBegin) * instrument->bytesPerSample * 2;
+    }
+    
+    makeRoomForPagedSample(music, size);
+    printLogVerbose("Note: reading paged sample of instrument %d", instIndex + 1);
+    
+    instrument->sampleData = malloc(instrument->sampleByteCount);
+    
+    if (!instrument->sampleData) {
+        printLog("Error: couldn't allocate memory for instrument %d sample data!", instIndex + 1);
+        return false;
+    }
+    
+    bool read = music->readPagedSample(music, instIndex, instrument->sampleData);
+    refreshCycleTime();
+    
+    if (read) {
+        instrument->sample = pd->sound->sample->newSampleFromData(instrument->sampleData, instrument->format,
+                                                                  instrument->sampleRate / (isStereo ? 2 : 1),
+                                                                  instrument->sampleByteCount, 0);
+        
+        if (!instrument->sample) {
+            printLog("Error: couldn't create AudioSample for instrument %d", instIndex + 1);
+        }
+    }
+    
+    if (!instrument->sample) {
+        free(instrument->sampleData);
+        instrument->sampleData = NULL;
+        return false;
+    }
+    
+    if (instrument->offsetSampleByteCount == SYNTH_DATA_UNINITIALIZED) {
+        createOffsetSample(music, instIndex);
+    }
+    
+    instrument->pagedLastUse = ++music->pagedSampleClock;
+    return true;
+}
+
+// Makes sure an instrument's sample is loaded before it's played. Samples are
+// normally read ahead of time, but the position can be set to anywhere and the
+// order an instrument is first needed in can't always be predicted.
+static bool usePagedSample(TrackerMusic *music, int instIndex)
+{
+    TrackerMusicInstrument *instrument = &music->instruments[instIndex];
+    
+    if (!isPagedInstrument(music, instrument)) {
+        return true;
+    }
+    
+    if (!instrument->sampleData) {
+        printLogVerbose("Note: instrument %d's sample wasn't read in ahead of time", instIndex + 1);
+        findNeededInstruments(music);
+        
+        if (!pageInInstrumentSample(music, instIndex)) {
+            return false;
+        }
+    }
+    
+    instrument->pagedLastUse = ++music->pagedSampleClock;
+    return true;
+}
+
+// Reads in the sample of one instrument that the order the player is playing or
+// one of the ones after it triggers, if any of them aren't loaded yet, nearest
+// order first. Only one is read per call so that the work is spread out over
+// the cycles that have time to spare.
+static void prefetchPagedSamples(TrackerMusicPlayer *player)
+{
+    TrackerMusic *music = player->music;
+    uint32_t words = instrumentMaskWords(music);
+    
+    findNeededInstruments(music);
+    
+    for(int i = 0; i <= TRACKER_MUSIC_SAMPLE_PREFETCH_ORDERS && i < music->orderCount; ++i) {
+        uint32_t *instruments = &music->orderInstruments[((player->pb.nextOrderIndex + i) % music->orderCount) * words];
+        
+        for(int j = 0; j < music->instrumentCount; ++j) {
+            if ((instruments[j / 32] & (1u << (j % 32))) && isPagedInstrument(music, &music->instruments[j])
+                && !music->instruments[j].sampleData) {
+                pageInInstrumentSample(music, j);
+                return;
+            }
+        }
+    }
+}
+
+// Reads in the samples of all of the instruments that an order triggers, for
+// when playback is about to start from it
+static void readPagedSamplesForOrder(TrackerMusic *music, int orderIndex)
+{
+    if (orderIndex >= music->orderCount) {
+        return;
+    }
+    
+    uint32_t *instruments = &music->orderInstruments[orderIndex * instrumentMaskWords(music)];
+    
+    findNeededInstruments(music);
+    addNeededInstrumentsForOrder(music, orderIndex);
+    
+    for(int i = 0; i < music->instrumentCount; ++i) {
+        if ((instruments[i / 32] & (1u << (i % 32))) && isPagedInstrument(music, &music->instruments[i])
+            && !music->instruments[i].sampleData) {
+            pageInInstrumentSample(music, i);
+        }
+    }
+}
+
+// Plays through the song's patterns the way the music would, following
+// position jumps and pattern breaks, and sets the bit of each instrument that a
+// reachable row triggers. Since the position can be set to the start of any
+// order, every order is a starting point, but rows that a pattern break always
+// skips over aren't reachable.
+static int findUsedInstruments(TrackerMusic *music, uint32_t *usedInstruments)
+{
+    uint32_t rowCount = music->orderCount * ROWS_PER_PATTERN;
+    uint8_t *visitedRows = calloc(MAX((rowCount + 7) / 8, 1), 1);
+    
+    if (!visitedRows) {
+        printLog("Error: couldn't allocate memory to find unused music data");
+        return kMusicMemoryError;
+    }
+    
+    for(int startOrderIndex = 0; startOrderIndex < music->orderCount; ++startOrderIndex) {
+        int orderIndex = startOrderIndex;
+        int row = 0;
+        
+        while(orderIndex < music->orderCount) {
+            uint32_t rowIndex = orderIndex * ROWS_PER_PATTERN + row;
+            
+            if (visitedRows[rowIndex / 8] & (1 << (rowIndex % 8))) {
+                break;
+            }
+            
+            visitedRows[rowIndex / 8] |= 1 << (rowIndex % 8);
+            
+            int nextOrderIndex = -1, nextRow = -1;
+            uint8_t cellCount;
+            PatternCell *cells = patternRow(music, music->orders[orderIndex], row, &cellCount);
+            
+            for(uint8_t i = 0; i < cellCount; ++i) {
+                PatternCell *cell = &cells[i];
+                
+                if (cell->what == 0 || !music->channelEnabled[cell->what & CHANNEL_MASK]) {
+                    continue;
+                }
+                
+                if ((cell->what & NOTE_AND_INST_FLAG) && cell->instrument > 0
+                    && cell->instrument <= music->instrumentCount) {
+                    usedInstruments[(cell->instrument - 1) / 32] |= 1u << ((cell->instrument - 1) % 32);
+                }
+                
+                if ((cell->what & EFFECT_FLAG) == 0) {
+                    continue;
+                }
+                
+                // Same as processMusicControlEffect
+                if (cell->effect == kEffectPositionJump) {
+                    nextOrderIndex = cell->effectVal;
+                    
+                    if (nextRow < 0) {
+                        nextRow = 0;
+                    }
+                } else if (cell->effect == kEffectPatternBreak) {
+                    if (nextOrderIndex < 0) {
+                        nextOrderIndex = orderIndex + 1;
+                    }
+                    
+                    nextRow = clamp(cell->effectVal, 0, 63);
+                }
+            }
+            
+            if (nextOrderIndex < 0 || nextRow < 0) {
+                nextOrderIndex = (row < 63) ? orderIndex : orderIndex + 1;
+                nextRow = (row < 63) ? row + 1 : 0;
+            }
+            
+            orderIndex = nextOrderIndex;
+            row = nextRow;
+        }
+    }
+    
+    free(visitedRows);
+    return kMusicNoError;
+}
+
+// Drops the patterns that aren't in the order list and renumbers the rest.
+// Returns how many bytes were freed.
+static uint32_t removeUnusedPatterns(TrackerMusic *music)
+{
+    uint16_t *newIndexes = malloc(MAX(music->patternCount, 1) * sizeof(uint16_t));
+    uint16_t patternCount = 0;
+    uint32_t bytesFreed = 0;
+    
+    if (!newIndexes) {
+        return 0;
+    }
+    
+    for(int i = 0; i < music->patternCount; ++i) {
+        newIndexes[i] = UINT16_MAX;
+    }
+    
+    for(int orderIndex = 0; orderIndex < music->orderCount; ++orderIndex) {
+        newIndexes[music->orders[orderIndex]] = 0;
+    }
+    
+    for(int i = 0; i < music->patternCount; ++i) {
+        if (newIndexes[i] == UINT16_MAX) {
+            printLogVerbose("Note: removing unused pattern %d", i);
+            continue;
+        }
+        
+        newIndexes[i] = patternCount++;
+    }
+    
+    if (patternCount == music->patternCount) {
+        free(newIndexes);
+        return 0;
+    }
+    
+    if (music->patternStorage == kPatternStorageSparse) {
+        uint32_t cellCount = 0;
+        
+        for(int i = 0; i < music->patternCount; ++i) {
+            uint16_t *rowOffsets = &music->patternRowOffsets[i * (ROWS_PER_PATTERN + 1)];
+            uint32_t patternCellCount = rowOffsets[ROWS_PER_PATTERN];
+            
+            if (newIndexes[i] == UINT16_MAX) {
+                continue;
+            }
+            
+            memmove(&music->patterns[cellCount], &music->patterns[music->patternCellOffsets[i]],
+                    patternCellCount * sizeof(PatternCell));
+            memmove(&music->patternRowOffsets[newIndexes[i] * (ROWS_PER_PATTERN + 1)], rowOffsets,
+                    (ROWS_PER_PATTERN + 1) * sizeof(uint16_t));
+            music->patternCellOffsets[newIndexes[i]] = cellCount;
+            cellCount += patternCellCount;
+        }
+        
+        bytesFreed = (music->patternCellCount - cellCount) * sizeof(PatternCell)
+                     + (music->patternCount - patternCount) * (sizeof(uint32_t)
+                                                               + (ROWS_PER_PATTERN + 1) * sizeof(uint16_t));
+        music->patternCellCount = cellCount;
+        
+        PatternCell *patterns = realloc(music->patterns, MAX(cellCount, 1) * sizeof(PatternCell));
+        uint32_t *cellOffsets = realloc(music->patternCellOffsets, MAX(patternCount, 1) * sizeof(uint32_t));
+        uint16_t *rowOffsets = realloc(music->patternRowOffsets,
+                                       MAX(patternCount, 1) * (ROWS_PER_PATTERN + 1) * sizeof(uint16_t));
+        
+        music->patterns = patterns ? patterns : music->patterns;
+        music->patternCellOffsets = cellOffsets ? cellOffsets : music->patternCellOffsets;
+        music->patternRowOffsets = rowOffsets ? rowOffsets : music->patternRowOffsets;
+    } else if (music->patternStorage == kPatternStorageLazy) {
+        uint32_t size = 0;
+        
+        for(int i = 0; i < music->patternCount; ++i) {
+            uint32_t offset = music->packedPatternOffsets[i];
+            uint32_t length = music->packedPatternOffsets[i + 1] - offset;
+            
+            if (newIndexes[i] == UINT16_MAX) {
+                continue;
+            }
+            
+            memmove(music->packedPatterns + size, music->packedPatterns + offset, length);
+            music->packedPatternOffsets[newIndexes[i]] = size;
+            size += length;
+        }
+        
+        bytesFreed = (music->packedPatternOffsets[music->patternCount] - size)
+                     + (music->patternCount - patternCount) * sizeof(uint32_t);
+        music->packedPatternOffsets[patternCount] = size;
+        
+        uint8_t *packedPatterns = realloc(music->packedPatterns, MAX(size, 1));
+        
+        music->packedPatterns = packedPatterns ? packedPatterns : music->packedPatterns;
+        
+        // The cache is indexed by pattern, so anything in it is out of date
+        for(int i = 0; i < TRACKER_MUSIC_PATTERN_CACHE_SIZE; ++i) {
+            music->cachedPatterns[i] = UINT16_MAX;
+            music->cachedPatternLastUse[i] = 0;
+        }
+    } else {
+        uint32_t patternSize = music->channelCount * ROWS_PER_PATTERN;
+        
+        for(int i = 0; i < music->patternCount; ++i) {
+            if (newIndexes[i] != UINT16_MAX) {
+                memmove(patternAtIndex(music, newIndexes[i]), patternAtIndex(music, i),
+                        patternSize * sizeof(PatternCell));
+            }
+        }
+        
+        bytesFreed = (music->patternCount - patternCount) * patternSize * sizeof(PatternCell);
+        music->patternCellCount = patternCount * patternSize;
+        
+        PatternCell *patterns = realloc(music->patterns, MAX(music->patternCellCount, 1) * sizeof(PatternCell));
+        
+        music->patterns = patterns ? patterns : music->patterns;
+    }
+    
+    for(int orderIndex = 0; orderIndex < music->orderCount; ++orderIndex) {
+        music->orders[orderIndex] = newIndexes[music->orders[orderIndex]];
+    }
+    
+    music->patternCount = patternCount;
+    free(newIndexes);
+    return bytesFreed;
+}
+
+// Removes the patterns that are never played and works out which instruments
+// are ever triggered, setting their bits in usedInstruments, which must have a
+// bit for each instrument. Instruments whose bits are left clear don't need
+// their samples loaded. bytesFreed is added to.
+int removeUnusedTrackerMusicData(TrackerMusic *music, uint32_t *usedInstruments, uint32_t *bytesFreed)
+{
+    int error = findUsedInstruments(music, usedInstruments);
+    
+    if (error != kMusicNoError) {
+        return error;
+    }
+    
+    (*bytesFreed) += removeUnusedPatterns(music);
+    return kMusicNoError;
+}
+
+static uint32_t hashInstrumentSample(TrackerMusicInstrument *instrument)
+{
+    // FNV-1a over the sample data and the settings that affect how it's used
+    uint32_t hash = 2166136261u;
+    uint32_t settings[4] = {instrument->format, instrument->sampleByteCount, instrument->loopBegin,
+                            instrument->loopEnd};
+    
+    for(uint32_t i = 0; i < sizeof(settings); ++i) {
+        hash = (hash ^ ((uint8_t *)settings)[i]) * 16777619u;
+    }
+    
+    for(uint32_t i = 0; i < instrument->sampleByteCount; ++i) {
+        hash = (hash ^ instrument->sampleData[i]) * 16777619u;
+    }
+    
+    return hash;
+}
+
+static bool instrumentSamplesMatch(TrackerMusicInstrument *a, TrackerMusicInstrument *b)
+{
+    if (a->format != b->format || a->sampleByteCount != b->sampleByteCount || a->loopBegin != b->loopBegin
+        || a->loopEnd != b->loopEnd) {
+        return false;
+    }
+    
+    return a->sampleData == b->sampleData || memcmp(a->sampleData, b->sampleData, a->sampleByteCount) == 0;
+}
+
+// Many songs use the same sample for several instruments, for instance with
+// different default volumes or sample rates. Each of those instruments is
+// pointed at the sample data of the first one, and the duplicates are freed.
+// Samples are only hashed when there's another instrument they could match.
+void deduplicateTrackerMusicSamples(TrackerMusic *music)
+{
+    uint32_t *hashes = calloc(MAX(music->instrumentCount, 1), sizeof(uint32_t));
+    bool *hashed = calloc(MAX(music->instrumentCount, 1), sizeof(bool));
+    uint32_t savedBytes = 0;
+    
+    if (!hashes || !hashed) {
+        // Not an error, the samples just won't be shared
+        free(hashes);
+        free(hashed);
+        return;
+    }
+    
+    for(int i = 1; i < music->instrumentCount; ++i) {
+        TrackerMusicInstrument *instrument = &music->instruments[i];
+        
+        if (!instrument->sampleData || instrument->sharedSampleSource) {
+            continue;
+        }
+        
+        for(int j = 0; j < i; ++j) {
+            TrackerMusicInstrument *source = &music->instruments[j];
+            
+            if (!source->sampleData || source->sharedSampleSource || source->format != instrument->format
+                || source->sampleByteCount != instrument->sampleByteCount) {
+                continue;
+            }
+            
+            if (source->sampleData != instrument->sampleData) {
+                if (!hashed[i]) {
+                    hashes[i] = hashInstrumentSample(instrument);
+                    hashed[i] = true;
+                }
+                
+                if (!hashed[j]) {
+                    hashes[j] = hashInstrumentSample(source);
+                    hashed[j] = true;
+                }
+                
+                if (hashes[i] != hashes[j]) {
+                    continue;
+                }
+            }
+            
+            if (!instrumentSamplesMatch(source, instrument)) {
+                continue;
+            }
+            
+            printLogVerbose("Note: instrument %d uses the same sample as instrument %d", i + 1, j + 1);
+            
+            if (instrument->sampleData != source->sampleData && !isInRawData(music, instrument->sampleData)) {
+                free(instrument->sampleData);
+            }
+            
+            // An offset sample that was loaded precomputed is kept if it's
+            // the only one
+            if (instrument->offsetSampleData && instrument->offsetSampleData != source->offsetSampleData) {
+                if (!source->offsetSampleData) {
+                    source->offsetSampleData = instrument->offsetSampleData;
+                    source->offsetSampleByteCount = instrument->offsetSampleByteCount;
+                } else if (!isInRawData(music, instrument->offsetSampleData)) {
+                    free(instrument->offsetSampleData);
+                }
+            }
+            
+            instrument->sampleData = source->sampleData;
+            instrument->offsetSampleData = source->offsetSampleData;
+            instrument->offsetSampleByteCount = source->offsetSampleData ? source->offsetSampleByteCount : 0;
+            instrument->sharedSampleSource = j + 1;
+            savedBytes += instrument->sampleByteCount;
+            break;
+        }
+    }
+    
+    if (savedBytes > 0) {
+        printLogVerbose("Note: sharing identical instrument samples saved %d bytes", (int)savedBytes);
+    }
+    
+    free(hashes);
+    free(hashed);
+}
+
+// Points the instrument at the sample bank's copy of its sample, adding it to
+// the bank if it isn't there yet. Samples that can't be added (because they're
+// part of the music's raw data, or there's no memory for a new entry) are just
+// left as they are.
+static void addInstrumentToSampleBank(TrackerMusic *music, int instIndex)
+{
+    TrackerMusicInstrument *instrument = &music->instruments[instIndex];
+    uint32_t hash = hashInstrumentSample(instrument);
+    TrackerMusicSampleBankEntry **bucket = &sampleBank[hash % TRACKER_MUSIC_SAMPLE_BANK_SIZE];
+    TrackerMusicSampleBankEntry *entry;
+    
+    for(entry = *bucket; entry != NULL; entry = entry->next) {
+        if (entry->hash == hash && entry->format == instrument->format
+            && entry->sampleByteCount == instrument->sampleByteCount && entry->loopBegin == instrument->loopBegin
+            && entry->loopEnd == instrument->loopEnd
+            && memcmp(entry->sampleData, instrument->sampleData, entry->sampleByteCount) == 0) {
+            break;
+        }
+    }
+    
+    if (entry) {
+        printLogVerbose("Note: instrument %d uses a sample that's already loaded, saving %d bytes", instIndex + 1,
+                        (int)instrument->sampleByteCount);
+        
+        if (!isInRawData(music, instrument->sampleData)) {
+            free(instrument->sampleData);
+        }
+        
+        if (instrument->offsetSampleData) {
+            if (!entry->offsetSampleData && !isInRawData(music, instrument->offsetSampleData)) {
+                entry->offsetSampleData = instrument->offsetSampleData;
+                entry->offsetSampleByteCount = instrument->offsetSampleByteCount;
+            } else if (!isInRawData(music, instrument->offsetSampleData)) {
+                free(instrument->offsetSampleData);
+            }
+        }
+        
+        ++entry->refCount;
+    } else {
+        if (isInRawData(music, instrument->sampleData)
+            || (instrument->offsetSampleData && isInRawData(music, instrument->offsetSampleData))) {
+            return;
+        }
+        
+        entry = calloc(1, sizeof(TrackerMusicSampleBankEntry));
+        
+        if (!entry) {
+            return;
+        }
+        
+        entry->hash = hash;
+        entry->refCount = 1;
+        entry->sampleData = instrument->sampleData;
+        entry->format = instrument->format;
+        entry->sampleByteCount = instrument->sampleByteCount;
+        entry->loopBegin = instrument->loopBegin;
+        entry->loopEnd = instrument->loopEnd;
+        entry->offsetSampleData = instrument->offsetSampleData;
+        entry->offsetSampleByteCount = instrument->offsetSampleData ? instrument->offsetSampleByteCount : 0;
+        entry->next = *bucket;
+        *bucket = entry;
+    }
+    
+    instrument->bankEntry = entry;
+    instrument->sampleData = entry->sampleData;
+    
+    if (entry->offsetSampleData) {
+        instrument->offsetSampleData = entry->offsetSampleData;
+        instrument->offsetSampleByteCount = entry->offsetSampleByteCount;
+    } else if (instrument->offsetSampleData) {
+        instrument->offsetSampleData = NULL;
+        instrument->offsetSampleByteCount = SYNTH_DATA_UNINITIALIZED;
+    }
+}
+
+static void releaseInstrumentSampleBankEntry(TrackerMusicInstrument *instrument)
+{
+    TrackerMusicSampleBankEntry *entry = instrument->bankEntry;
+    
+    if (instrument->sample && instrument->sample != entry->sample) {
+        pd->sound->sample->freeSample(instrument->sample);
+    }
+    
+    instrument->bankEntry = NULL;
+    instrument->sample = NULL;
+    instrument->sampleData = NULL;
+    instrument->offsetSampleData = NULL;
+    
+    if (--entry->refCount > 0) {
+        return;
+    }
+    
+    TrackerMusicSampleBankEntry **link = &sampleBank[entry->hash % TRACKER_MUSIC_SAMPLE_BANK_SIZE];
+    
+    while(*link != entry) {
+        link = &(*link)->next;
+    }
+    
+    *link = entry->next;
+    
+    if (entry->sample) {
+        pd->sound->sample->freeSample(entry->sample);
+    }
+    
+    free(entry->sampleData);
+    free(entry->offsetSampleData);
+    free(entry);
+}
+
+static inline uint32_t compactedSize(uint32_t size)
+{
+    // Every piece takes up some room so that none of them point at the end of
+    // the block, which isInRawData wouldn't count as being part of it
+    return (MAX(size, 1) + kCompactAlignment - 1) & ~(kCompactAlignment - 1);
+}
+
+// Copies a piece of the music's data into the compacted block and frees the
+// original
+static void * moveIntoCompactedBlock(TrackerMusic *music, uint32_t *offset, void *data, uint32_t size)
+{
+    if (!data) {
+        return NULL;
+    }
+    
+    void *dest = music->rawData + (*offset);
+    
+    memcpy(dest, data, size);
+    free(data);
+    (*offset) += compactedSize(size);
+    return dest;
+}
+
+// Whether an instrument's sample data is going to be replaced when its audio
+// entities are created, in which case it isn't worth compacting
+static bool instrumentSampleWillBeReplaced(TrackerMusicInstrument *instrument)
+{
+    if (instrument->encodeADPCM) {
+        return true;
+    }
+    
+#if PLAYDATE_API_VERSION < 20600
+    if ((instrument->loopEnd != 0 || instrument->loopBegin != 0) && !isADPCMInstrument(instrument)
+        && (instrument->loopEnd - instrument->loopBegin) < kMinimumLoopSamples) {
+        return true;
+    }
+#endif
+    
+    return false;
+}
+
+static bool shouldCompactInstrumentSample(TrackerMusicInstrument *instrument)
+{
+    return instrument->sampleData && !instrument->sharedSampleSource && !instrument->bankEntry
+           && !instrumentSampleWillBeReplaced(instrument);
+}
+
+// Moves all of the music's song data (its order list, instruments, patterns and
+// samples) into a single block of exactly the size needed, which becomes the
+// music's rawData, and frees the separate allocations they were in. This gets
+// rid of any room that was left over from loading and of the heap's overhead
+// for each allocation. Must be done before the music's audio entities are
+// created. Samples in the block aren't shared with other songs through the
+// sample bank.
+void compactTrackerMusic(TrackerMusic *music)
+{
+    uint32_t ordersSize = music->orderCount;
+    uint32_t instrumentsSize = music->instrumentCount * sizeof(TrackerMusicInstrument);
+    uint32_t patternsSize = music->patternCellCount * sizeof(PatternCell);
+    uint32_t cellOffsetsSize = music->patternCount * sizeof(uint32_t);
+    uint32_t rowOffsetsSize = music->patternCount * (ROWS_PER_PATTERN + 1) * sizeof(uint16_t);
+    uint32_t packedPatternsSize = music->packedPatternOffsets ? music->packedPatternOffsets[music->patternCount] : 0;
+    uint32_t packedOffsetsSize = (music->patternCount + 1) * sizeof(uint32_t);
+    uint32_t size = 0;
+    uint32_t offset = 0;
+    
+    if (music->rawData) {
+        return;
+    }
+    
+    size += compactedSize(ordersSize) + compactedSize(instrumentsSize) + compactedSize(patternsSize);
+    
+    if (music->patternCellOffsets) {
+        size += compactedSize(cellOffsetsSize) + compactedSize(rowOffsetsSize);
+    }
+    
+    if (music->packedPatterns) {
+        size += compactedSize(packedPatternsSize) + compactedSize(packedOffsetsSize);
+    }
+    
+    for(int i = 0; i < music->instrumentCount; ++i) {
+        TrackerMusicInstrument *instrument = &music->instruments[i];
         
-        if (!isInRawData(music, music->instruments)) {
-            free(music->instruments);
+        if (shouldCompactInstrumentSample(instrument)) {
+            size += compactedSize(instrument->sampleByteCount);
+            
+            if (instrument->offsetSampleData) {
+                size += compactedSize(instrument->offsetSampleByteCount);
+            }
         }
+    }
+    
+    music->rawData = malloc(size);
+    
+    if (!music->rawData) {
+        printLog("Warning: couldn't allocate memory to compact music");
+        return;
+    }
+    
+    music->size = size;
+    music->orders = moveIntoCompactedBlock(music, &offset, music->orders, ordersSize);
+    music->instruments = moveIntoCompactedBlock(music, &offset, music->instruments, instrumentsSize);
+    music->patterns = moveIntoCompactedBlock(music, &offset, music->patterns, patternsSize);
+    
+    if (music->patternCellOffsets) {
+        music->patternCellOffsets = moveIntoCompactedBlock(music, &offset, music->patternCellOffsets, cellOffsetsSize);
+        music->patternRowOffsets = moveIntoCompactedBlock(music, &offset, music->patternRowOffsets, rowOffsetsSize);
+    }
+    
+    if (music->packedPatterns) {
+        music->packedPatterns = moveIntoCompactedBlock(music, &offset, music->packedPatterns, packedPatternsSize);
+        music->packedPatternOffsets = moveIntoCompactedBlock(music, &offset, music->packedPatternOffsets,
+                                                             packedOffsetsSize);
+    }
+    
+    for(int i = 0; i < music->instrumentCount; ++i) {
+        TrackerMusicInstrument *instrument = &music->instruments[i];
         
-        music->instruments = NULL;
+        if (instrument->sharedSampleSource) {
+            TrackerMusicInstrument *source = &music->instruments[instrument->sharedSampleSource - 1];
+            
+            instrument->sampleData = source->sampleData;
+            instrument->offsetSampleData = source->offsetSampleData;
+        } else if (shouldCompactInstrumentSample(instrument)) {
+            instrument->sampleData = moveIntoCompactedBlock(music, &offset, instrument->sampleData,
+                                                            instrument->sampleByteCount);
+            instrument->offsetSampleData = moveIntoCompactedBlock(music, &offset, instrument->offsetSampleData,
+                                                                  instrument->offsetSampleByteCount);
+        }
+    }
+    
+    printLogVerbose("Note: compacted music into a single block of %d bytes", (int)size);
+}
+
+static bool isInRawData(TrackerMusic *music, void *ptr)
+{
+    return (uint8_t *)ptr >= music->rawData && (uint8_t *)ptr < (music->rawData + music->size);
+}
+
+// Creates another player of music whose audio entities have been created. It
+// plays the music independently of the music's own player, but shares its
+// patterns and samples. Must be freed with freeTrackerMusicPlayer, which
+// freeTrackerMusic does for any of the music's players that are left.
+int createTrackerMusicPlayer(TrackerMusicPlayer *player, TrackerMusic *music)
+{
+    if (!music->player) {
+        printLog("Error: can't create a player for music whose audio entities haven't been created");
+        return kMusicInvalidData;
+    }
+    
+    addMusicPlayer(player, music);
+    
+    for(int i = 0; i < music->channelCount; ++i) {
+        int error = createMusicChannel(player, i);
+        
+        if (error != kMusicNoError) {
+            freeTrackerMusicPlayer(player);
+            return error;
+        }
+    }
+    
+    return kMusicNoError;
+}
+
+// Stops the player and frees its audio entities. The music's own player is
+// freed along with the music, and shouldn't be freed separately.
+void freeTrackerMusicPlayer(TrackerMusicPlayer *player)
+{
+    TrackerMusic *music = player->music;
+    
+    if (!music) {
+        return;
     }
     
-    for(i = 0; i < TRACKER_MUSIC_MAX_CHANNELS; ++i) {
-        if (music->channels[i].volumeController) {
-            pd->sound->signal->freeSignal(music->channels[i].volumeController);
-            music->channels[i].volumeController = NULL;
+    player->freeMusicWhenRetired = false;
+    stopTrackerMusic(player);
+    
+    for(int i = 0; i < TRACKER_MUSIC_MAX_CHANNELS; ++i) {
+        TrackerMusicChannel *channel = &player->channels[i];
+        
+        if (channel->volumeController) {
+            pd->sound->signal->freeSignal(channel->volumeController);
+            channel->volumeController = NULL;
         }
         
-        if (music->channels[i].panController) {
-            pd->sound->signal->freeSignal(music->channels[i].panController);
-            music->channels[i].panController = NULL;
+        if (channel->panController) {
+            pd->sound->signal->freeSignal(channel->panController);
+            channel->panController = NULL;
         }
         
-        if (music->channels[i].pitchController) {
-            pd->sound->signal->freeSignal(music->channels[i].pitchController);
+        if (channel->pitchController) {
+            pd->sound->signal->freeSignal(channel->pitchController);
+            channel->pitchController = NULL;
         }
         
-        for(j = 0; j < TRACKER_MUSIC_INSTRUMENT_PDSYNTH_COUNT; ++j) {
-            if (music->channels[i].synths[j].synth) {
-                pd->sound->synth->freeSynth(music->channels[i].synths[j].synth);
+        for(int j = 0; j < TRACKER_MUSIC_INSTRUMENT_PDSYNTH_COUNT; ++j) {
+            if (channel->synths[j].synth) {
+                pd->sound->synth->freeSynth(channel->synths[j].synth);
+                channel->synths[j].synth = NULL;
+            }
+            
+            if (channel->synths[j].sample) {
+                pd->sound->sample->freeSample(channel->synths[j].sample);
+                channel->synths[j].sample = NULL;
             }
+        }
         
-            if (music->channels[i].synths[j].sample) {
-                pd->sound->sample->freeSample(music->channels[i].synths[j].sample);
+        if (channel->soundChannel) {
+            pd->sound->channel->freeChannel(channel->soundChannel);
+            channel->soundChannel = NULL;
+        }
+    }
+    
+    for(TrackerMusicPlayer **link = &music->players; *link; link = &(*link)->nextPlayer) {
+        if (*link == player) {
+            *link = player->nextPlayer;
+            break;
+        }
+    }
+    
+    player->music = NULL;
+}
+
+void freeTrackerMusic(TrackerMusic *music)
+{
+    int i;
+    
+    for(TrackerMusicPlayer *player = activePlayers; player; player = player->nextActivePlayer) {
+        if (player->queuedMusic == music) {
+            clearQueuedMusic(player);
+        }
+    }
+    
+    // The players go first, since their synths can be using the instruments'
+    // samples
+    while(music->players) {
+        freeTrackerMusicPlayer(music->players);
+    }
+    
+    free(music->player);
+    music->player = NULL;
+    
+    printLogVerbose("Freeing music");
+    
+    if (music->instruments) {
+        // Instruments that share sample data with an earlier instrument are
+        // freed first so that the one they share with is still around
+        for(i = music->instrumentCount - 1; i >= 0; --i) {
+            if (music->instruments[i].sharedSampleSource) {
+                TrackerMusicInstrument *source = &music->instruments[music->instruments[i].sharedSampleSource - 1];
+                
+                if (music->instruments[i].sample && music->instruments[i].sample != source->sample) {
+                    pd->sound->sample->freeSample(music->instruments[i].sample);
+                }
+                
+                continue;
+            }
+            
+            if (music->instruments[i].bankEntry) {
+                releaseInstrumentSampleBankEntry(&music->instruments[i]);
+                continue;
+            }
+            
+            if (music->instruments[i].sampleData) {
+                if (!isInRawData(music, music->instruments[i].sampleData)) {
+                    free(music->instruments[i].sampleData);
+                }
+            }
+            
+            if (music->instruments[i].sample) {
+                pd->sound->sample->freeSample(music->instruments[i].sample);
+            }
+            
+            if (music->instruments[i].offsetSampleData) {
+                if (!isInRawData(music, music->instruments[i].offsetSampleData)) {
+                    free(music->instruments[i].offsetSampleData);
+                }
             }
         }
         
-        if (music->channels[i].soundChannel) {
-            pd->sound->channel->freeChannel(music->channels[i].soundChannel);
-            music->channels[i].soundChannel = NULL;
+        if (!isInRawData(music, music->instruments)) {
+            free(music->instruments);
         }
         
+        music->instruments = NULL;
     }
     
     if (music->patterns) {
@@ -434,69 +2555,428 @@ void freeTrackerMusic(TrackerMusic *music)
         music->patterns = NULL;
     }
     
+    if (music->patternCellOffsets) {
+        if (!isInRawData(music, music->patternCellOffsets)) {
+            free(music->patternCellOffsets);
+        }
+        
+        music->patternCellOffsets = NULL;
+    }
+    
+    if (music->patternRowOffsets) {
+        if (!isInRawData(music, music->patternRowOffsets)) {
+            free(music->patternRowOffsets);
+        }
+        
+        music->patternRowOffsets = NULL;
+    }
+    
+    free(music->rowOps);
+    music->rowOps = NULL;
+    music->rowOpCount = 0;
+    free(music->patternOpOffsets);
+    music->patternOpOffsets = NULL;
+    free(music->rowOpOffsets);
+    music->rowOpOffsets = NULL;
+    free(music->rowChannels);
+    music->rowChannels = NULL;
+    
+    for(i = 0; i < TRACKER_MUSIC_PATTERN_CACHE_SIZE; ++i) {
+        free(music->cachedPatternOps[i]);
+        music->cachedPatternOps[i] = NULL;
+        music->cachedPatternOpCapacity[i] = 0;
+    }
+    
+    if (music->packedPatterns) {
+        if (!isInRawData(music, music->packedPatterns)) {
+            free(music->packedPatterns);
+        }
+        
+        music->packedPatterns = NULL;
+    }
+    
+    if (music->packedPatternOffsets) {
+        if (!isInRawData(music, music->packedPatternOffsets)) {
+            free(music->packedPatternOffsets);
+        }
+        
+        music->packedPatternOffsets = NULL;
+    }
+    
     if (music->orders) {
         if (!isInRawData(music, music->orders)) {
             free(music->orders);
         }
-        
-        music->orders = NULL;
-    }
-    
-    if (music->rawData) {
-        free(music->rawData);
-        music->rawData = NULL;
+        
+        music->orders = NULL;
+    }
+    
+    if (music->closePagedSampleSource) {
+        music->closePagedSampleSource(music);
+        music->closePagedSampleSource = NULL;
+        music->readPagedSample = NULL;
+    }
+    
+    free(music->orderInstruments);
+    free(music->neededInstruments);
+    music->orderInstruments = NULL;
+    music->neededInstruments = NULL;
+    
+    if (music->rawData) {
+        if (!music->rawDataIsBorrowed) {
+            free(music->rawData);
+        }
+        
+        music->rawData = NULL;
+    }
+}
+
+// Sets the player up to start playing at the sample `when`, without stopping
+// anything that's already playing
+static void startTrackerMusic(TrackerMusicPlayer *player, uint32_t when)
+{
+    TrackerMusic *music = player->music;
+    
+    addActivePlayer(player);
+    memset(&player->pb, 0, sizeof(player->pb));
+    
+    player->pb.speed = music->initialSpeed;
+    player->pb.tempo = music->initialTempo;
+    updateTempo(player);
+    player->pb.nextStepSample = when;
+    player->pb.nextNextStepSample = player->pb.nextStepSample + player->pb.samplesPerStep;
+    player->pb.nextOrderIndex = player->pb.nextNextOrderIndex = 0;
+    player->pb.nextRow = player->pb.nextNextRow = 0;
+    
+    memset(player->pb.lastNote, UNSET, sizeof(player->pb.lastNote));
+    memset(player->pb.lastPlayedNote, UNSET, sizeof(player->pb.lastPlayedNote));
+    memset(player->pb.lastInstrument, UNSET, sizeof(player->pb.lastInstrument));
+    memset(player->pb.lastPlayedInstrument, UNSET, sizeof(player->pb.lastPlayedInstrument));
+    memset(player->pb.lastVolume, UNSET, sizeof(player->pb.lastVolume));
+    memset(player->pb.pitchSignalOffSteps, UINT8_MAX, sizeof(player->pb.pitchSignalOffSteps));
+    memset(player->pb.pitchSignalValueIsZero, true, sizeof(player->pb.pitchSignalValueIsZero));
+    
+    for(int i = 0; i < music->channelCount; ++i) {
+        if (!player->channels[i].enabled) {
+            continue;
+        }
+        
+        pd->sound->channel->setPanModulator(player->channels[i].soundChannel,
+                                            (PDSynthSignalValue *)player->channels[i].panController);
+        pd->sound->channel->setVolumeModulator(player->channels[i].soundChannel,
+                                               (PDSynthSignalValue *)player->channels[i].volumeController);
+        player->pb.volumeAndRetriggerSignalData[i].volumeData.globalVolume = 1.0f;
+        player->pb.volumeAndRetriggerSignalData[i].volumeData.publishedGlobalVolume = 1.0f;
+        player->pb.pitchSignalData[i].pitchFactor = player->pitchFactor;
+        player->pb.lastPan[i] = music->channelPan[i];
+        player->pb.activeChannels |= (1u << i);
+        setPanValue(player, i, (float)music->channelPan[i]);
+    }
+}
+
+static void addActivePlayer(TrackerMusicPlayer *player)
+{
+    if (player->playing) {
+        return;
+    }
+    
+    player->playing = true;
+    player->nextActivePlayer = activePlayers;
+    activePlayers = player;
+    activePlayersChanged = true;
+}
+
+static void removeActivePlayer(TrackerMusicPlayer *player)
+{
+    for(TrackerMusicPlayer **link = &activePlayers; *link; link = &(*link)->nextActivePlayer) {
+        if (*link == player) {
+            *link = player->nextActivePlayer;
+            break;
+        }
+    }
+    
+    player->playing = false;
+    player->nextActivePlayer = NULL;
+    activePlayersChanged = true;
+}
+
+// Starts every player on the same sample, so that they stay sample-locked to
+// each other for as long as they all play at the same speed. Players that were
+// already playing start over.
+void playTrackerMusicPlayers(TrackerMusicPlayer **players, int count, uint32_t when)
+{
+    printLogVerbose("Playing music...");
+    
+    uint32_t currentTime = sequencerTime();
+    
+    if (when < currentTime) {
+        when = currentTime;
+    }
+    
+    for(int i = 0; i < count; ++i) {
+        TrackerMusicPlayer *player = players[i];
+        
+        if (player->retiring) {
+            player->freeMusicWhenRetired = false;
+            tearDownRetiringPlayer(player);
+        }
+        
+        stopTrackerMusic(player);
+        player->speedFactor = 1.0f;
+        player->pitchFactor = 0.0f;
+        startTrackerMusic(player, when);
+    }
+    
+    for(int i = 0; i < count; ++i) {
+        if (players[i]->music->readPagedSample) {
+            readPagedSamplesForOrder(players[i]->music, 0);
+        }
+    }
+}
+
+void playTrackerMusicPlayer(TrackerMusicPlayer *player, uint32_t when)
+{
+    playTrackerMusicPlayers(&player, 1, when);
+}
+
+// Plays the music with its own player
+void playTrackerMusic(TrackerMusic *music, uint32_t when)
+{
+    if (!music->player) {
+        printLog("Error: can't play music whose audio entities haven't been created");
+        return;
+    }
+    
+    playTrackerMusicPlayer(music->player, when);
+}
+
+// Queues music to take over from the player, starting on the exact sample that
+// the player reaches the given order and row (or its end, whichever comes
+// first). The music takes over with its own player. If loader isn't NULL then
+// it's the loader that's still loading the queued music, and it's stepped
+// during calls to processTrackerMusicCycle that have time to spare. If
+// freeCurrentMusic is set then the player's music is freed once its last notes
+// have finished. If the player isn't playing then the music starts straight
+// away, and the player's music is freed straight away too.
+void queueTrackerMusic(TrackerMusicPlayer *player, TrackerMusic *music, TrackerMusicLoader *loader, uint8_t orderIndex,
+                       uint8_t row, bool freeCurrentMusic)
+{
+    if (loader && isTrackerMusicLoaderDone(loader)) {
+        if (loader->result != kMusicNoError) {
+            printLog("Error: can't queue music that failed to load");
+            return;
+        }
+        
+        loader = NULL;
+    }
+    
+    if (!player || !player->playing) {
+        if (loader && finishTrackerMusicLoader(loader) != kMusicNoError) {
+            return;
+        }
+        
+        // A player that's stopped playing but still has notes fading out frees
+        // its music once they've finished, the same as after a hand-off
+        if (player && freeCurrentMusic && player->music && player->music != music) {
+            if (player->retiring) {
+                player->freeMusicWhenRetired = true;
+            } else {
+                freeTrackerMusic(player->music);
+            }
+        }
+        
+        playTrackerMusic(music, 0);
+        return;
+    }
+    
+    player->queuedMusic = music;
+    player->queuedMusicLoader = loader;
+    player->queuedOrderIndex = orderIndex;
+    player->queuedRow = row;
+    player->freeMusicOnHandOff = freeCurrentMusic;
+}
+
+bool isTrackerMusicQueued(TrackerMusicPlayer *player)
+{
+    return player && player->queuedMusic != NULL;
+}
+
+static void clearQueuedMusic(TrackerMusicPlayer *player)
+{
+    player->queuedMusic = NULL;
+    player->queuedMusicLoader = NULL;
+}
+
+static void stepQueuedMusicLoader(TrackerMusicPlayer *player)
+{
+    int result = stepTrackerMusicLoader(player->queuedMusicLoader, TRACKER_MUSIC_QUEUED_LOAD_MICROSECONDS);
+    refreshCycleTime();
+    
+    if (result == kMusicLoading) {
+        return;
+    }
+    
+    player->queuedMusicLoader = NULL;
+    
+    if (result != kMusicNoError) {
+        printLog("Error: queued music failed to load");
+        clearQueuedMusic(player);
+    }
+}
+
+// Returns whether the queued music can take over. If it's still loading then it
+// has to be finished now, since the hand-off can't wait.
+static bool prepareQueuedMusic(TrackerMusicPlayer *player)
+{
+    if (player->queuedMusicLoader) {
+        printLogVerbose("Note: finishing loading queued music at hand-off");
+        
+        int result = finishTrackerMusicLoader(player->queuedMusicLoader);
+        refreshCycleTime();
+        
+        if (result != kMusicNoError) {
+            printLog("Error: queued music failed to load");
+            clearQueuedMusic(player);
+            return false;
+        }
+        
+        player->queuedMusicLoader = NULL;
+    }
+    
+    return player->queuedMusic != NULL;
+}
+
+static void retirePlayer(TrackerMusicPlayer *player, uint32_t endSample, bool freeMusic)
+{
+    player->retiring = true;
+    player->retiringEndSample = endSample;
+    player->freeMusicWhenRetired = freeMusic;
+    player->nextRetiringPlayer = retiringPlayers;
+    retiringPlayers = player;
+}
+
+static void tearDownRetiringPlayer(TrackerMusicPlayer *player)
+{
+    for(TrackerMusicPlayer **link = &retiringPlayers; *link; link = &(*link)->nextRetiringPlayer) {
+        if (*link == player) {
+            *link = player->nextRetiringPlayer;
+            break;
+        }
+    }
+    
+    player->retiring = false;
+    player->nextRetiringPlayer = NULL;
+    
+    for(int i = 0; i < player->music->channelCount; ++i) {
+        if (!player->channels[i].enabled) {
+            continue;
+        }
+        
+        pd->sound->channel->setPanModulator(player->channels[i].soundChannel, NULL);
+        pd->sound->channel->setVolumeModulator(player->channels[i].soundChannel, NULL);
+        
+        for(int j = 0; j < TRACKER_MUSIC_INSTRUMENT_PDSYNTH_COUNT; ++j) {
+            if (player->channels[i].synths[j].synth) {
+                pd->sound->synth->stop(player->channels[i].synths[j].synth);
+                pd->sound->synth->setFrequencyModulator(player->channels[i].synths[j].synth, NULL);
+            }
+        }
+    }
+    
+    forgetSynthPlayingStates();
+    
+    if (player->freeMusicWhenRetired) {
+        freeTrackerMusic(player->music);
+    }
+}
+
+static void tearDownFinishedRetiringPlayers(uint32_t currentTime)
+{
+    TrackerMusicPlayer *player = retiringPlayers;
+    
+    // Freeing a player's music can tear down other retiring players too, so
+    // start over after each one
+    while(player) {
+        if ((int32_t)(currentTime - player->retiringEndSample) >= 0) {
+            tearDownRetiringPlayer(player);
+            player = retiringPlayers;
+        } else {
+            player = player->nextRetiringPlayer;
+        }
     }
 }
 
-void playTrackerMusic(TrackerMusic *music, uint32_t when)
+// Stops the player at the sample `when` and starts the queued music's player on
+// that same sample. The queued music's first row is processed right away so
+// that it's scheduled with the same lookahead as any other row. Everything else
+// about the old player is left until it's finished playing, and is then cleaned
+// up in a cycle that has time to spare.
+static void handOffToQueuedMusic(TrackerMusicPlayer *player, uint32_t when)
 {
-    printLogVerbose("Playing music...");
-    stopTrackerMusic();
+    TrackerMusic *music = player->music;
+    TrackerMusicPlayer *next = player->queuedMusic->player;
+    bool freeMusic = player->freeMusicOnHandOff && player->music != next->music;
+    float volume = -1.0f;
     
-    currentMusic = music;
-    memset(&music->pb, 0, sizeof(music->pb));
-    uint32_t currentTime = pd->sound->getCurrentTime();
+    printLogVerbose("Note: handing off to queued music at sample %d", when);
+    clearQueuedMusic(player);
     
-    if (when < currentTime) {
-        when = currentTime;
+    for(int i = 0; i < music->channelCount; ++i) {
+        if (!player->channels[i].enabled) {
+            continue;
+        }
+        
+        if (volume < 0.0f) {
+            volume = pd->sound->channel->getVolume(player->channels[i].soundChannel);
+        }
+        
+        for(int j = 0; j < TRACKER_MUSIC_INSTRUMENT_PDSYNTH_COUNT; ++j) {
+            if (player->channels[i].synths[j].synth) {
+                pd->sound->synth->noteOff(player->channels[i].synths[j].synth, when);
+            }
+        }
     }
     
-    speedFactor = 1.0f;
-    pitchFactor = 0.0f;
-    music->pb.speed = music->initialSpeed;
-    music->pb.tempo = music->initialTempo;
-    updateTempo(music);
-    music->pb.nextStepSample = when;
-    music->pb.nextNextStepSample = music->pb.nextStepSample + music->pb.samplesPerStep;
-    music->pb.nextOrderIndex = music->pb.nextNextOrderIndex = 0;
-    music->pb.nextRow = music->pb.nextNextRow = 0;
-    
-    memset(music->pb.lastNote, UNSET, sizeof(music->pb.lastNote));
-    memset(music->pb.lastPlayedNote, UNSET, sizeof(music->pb.lastPlayedNote));
-    memset(music->pb.lastInstrument, UNSET, sizeof(music->pb.lastInstrument));
-    memset(music->pb.lastPlayedInstrument, UNSET, sizeof(music->pb.lastPlayedInstrument));
-    memset(music->pb.lastVolume, UNSET, sizeof(music->pb.lastVolume));
-    memset(music->pb.pitchSignalOffSteps, kPitchSignalOffStepsThreshold, sizeof(music->pb.pitchSignalOffSteps));
-    memset(music->pb.pitchSignalValueIsZero, true, sizeof(music->pb.pitchSignalValueIsZero));
+    forgetSynthPlayingStates();
     
-    for(int i = 0; i < music->channelCount; ++i) {
-        if (!music->channels[i].enabled) {
-            continue;
+    if (next->retiring) {
+        next->freeMusicWhenRetired = false;
+        tearDownRetiringPlayer(next);
+    }
+    
+    // Music that's queued to follow itself just starts over
+    if (next != player) {
+        if (next->playing) {
+            stopTrackerMusicAt(next, when);
         }
         
-        pd->sound->channel->setPanModulator(music->channels[i].soundChannel,
-                                            (PDSynthSignalValue *)music->channels[i].panController);
-        pd->sound->channel->setVolumeModulator(music->channels[i].soundChannel,
-                                               (PDSynthSignalValue *)music->channels[i].volumeController);
-        music->pb.volumeAndRetriggerSignalData[i].volumeData.globalVolume = 1.0f;
-        music->pb.lastPan[i] = music->channels[i].pan;
-        setPanValue(music, i, (float)music->channels[i].pan);
+        removeActivePlayer(player);
+        retirePlayer(player, when + (uint32_t)(kInstrumentReleaseTime * kAudioSampleRate) + kNoteOffLeeway, freeMusic);
+        next->speedFactor = player->speedFactor;
+        next->pitchFactor = player->pitchFactor;
+        next->lookaheadRows = player->lookaheadRows;
+        next->lookaheadMilliseconds = player->lookaheadMilliseconds;
     }
+    
+    startTrackerMusic(next, when);
+    
+    if (volume >= 0.0f) {
+        for(int i = 0; i < next->music->channelCount; ++i) {
+            if (next->channels[i].enabled) {
+                pd->sound->channel->setVolume(next->channels[i].soundChannel, volume);
+            }
+        }
+    }
+    
+    // startTrackerMusic leaves the first row for one step after `when`, so
+    // bring it back to `when` itself
+    next->pb.nextNextStepSample = when;
+    processNextStep(next);
 }
 
-static uint32_t ticksToSamples(TrackerMusic *music, uint16_t ticks)
+static uint32_t ticksToSamples(TrackerMusicPlayer *player, uint16_t ticks)
 {
-    return ticks * music->pb.samplesPerStep / music->pb.speed;
+    return ticks * player->pb.samplesPerStep / player->pb.speed;
 }
 
 // We need to be careful about scheduling both note on and note off events for a
@@ -507,58 +2987,111 @@ static uint32_t ticksToSamples(TrackerMusic *music, uint16_t ticks)
 // that, we don't schedule any note on events within 1000 samples of a note off,
 // and instead will use a different PDSynth.
 
-// Because we're accessing lastNoteOn / lastNoteOff in both the audio and main
-// threads, we need a locking mechanism. And since these functions are being
-// called from the Playdate audio thread, we're going to do as little work as
-// possible while the mutex is locked, and be sure not to call any Playdate API
-// functions.
+// Because we're accessing the last note on / note off times in both the audio
+// and main threads, and the audio thread can't wait on a main thread that might
+// not be running, they're changed without any locking. Each synth has four
+// copies of them: the main thread only ever writes to the first two and the
+// audio thread only to the other two, each thread alternating between its pair
+// so that it never writes to the copy that's current. Once a thread has written
+// its copy it makes it the current one by swapping it into noteTimesIndex,
+// which holds the current copy's index in its lowest two bits and a count of
+// changes in the rest. If the other thread changed the times in the meantime,
+// the swap fails and the change is worked out again from the new times.
+// Readers copy the current copy and then check that it's still current, since
+// it could have been rewritten while they were copying it otherwise.
+//
+// That makes it lock-free but not wait-free: neither thread ever waits for the
+// other to finish something, but a thread has to go around again each time the
+// other one changes the times while it's in the middle of using them, so how
+// many times it goes around isn't bounded. In practice it's almost always once.
+// tools/synthstress.c hammers this from two host threads.
+
+#define SYNTH_NOTE_TIMES_COPY_MASK 0x3
+
+static SynthNoteTimes loadSynthNoteTimes(TrackerMusicChannelSynth *synth, uint32_t *index)
+{
+    SynthNoteTimes times;
+    uint32_t currentIndex = atomic_load_explicit(&synth->noteTimesIndex, memory_order_acquire);
+    
+    do {
+        (*index) = currentIndex;
+        times = synth->noteTimes[currentIndex & SYNTH_NOTE_TIMES_COPY_MASK];
+        atomic_thread_fence(memory_order_acquire);
+        currentIndex = atomic_load_explicit(&synth->noteTimesIndex, memory_order_relaxed);
+    } while(currentIndex != (*index));
+    
+    return times;
+}
+
+// Makes times the synth's current note times if they haven't changed since
+// they were loaded as index, and otherwise returns false
+static bool storeSynthNoteTimes(TrackerMusicChannelSynth *synth, uint32_t index, SynthNoteTimes *times,
+                                bool audioThread)
+{
+    uint32_t firstCopy = audioThread ? 2 : 0;
+    uint32_t copy = ((index & SYNTH_NOTE_TIMES_COPY_MASK) == firstCopy) ? firstCopy + 1 : firstCopy;
+    
+    synth->noteTimes[copy] = (*times);
+    
+    return atomic_compare_exchange_strong_explicit(&synth->noteTimesIndex, &index,
+                                                   ((index & ~SYNTH_NOTE_TIMES_COPY_MASK)
+                                                    + SYNTH_NOTE_TIMES_COPY_MASK + 1) | copy,
+                                                   memory_order_release, memory_order_relaxed);
+}
 
-static bool _checkNoteOffAndSetNoteOnTime(TrackerMusicChannelSynth *synth, float freq, uint32_t when,
-                                          uint32_t currentTime, float *length)
+static bool _checkNoteOffForNoteOn(uint32_t lastNoteOff, uint32_t when, uint32_t currentTime, float *length)
 {
-    if (currentTime < synth->lastNoteOff) {
-        if (when >= synth->lastNoteOff + kNoteOffLeeway) {
+    if (currentTime < lastNoteOff) {
+        if (when >= lastNoteOff + kNoteOffLeeway) {
             return false;
         }
         
         // Because we already have a note off event scheduled, we can replace it
         // with a note on event of finite length, since we know when we need the
         // note to stop already.
-        (*length) = (synth->lastNoteOff - when) / ((float)kAudioSampleRate);
+        (*length) = (lastNoteOff - when) / ((float)kAudioSampleRate);
     } else {
         (*length) = -1.0f;
     }
     
-    synth->lastNoteOn = when;
-    synth->lastNoteOnFreq = freq;
-    
     return true;
 }
 
-static void playSynthNote(TrackerMusicChannelSynth *synth, float freq, uint32_t when)
+// audioThread is whether this is being called from the Playdate audio thread
+void playSynthNote(TrackerMusicChannelSynth *synth, float freq, uint32_t when, uint32_t currentTime, bool audioThread)
 {
-    uint32_t currentTime = pd->sound->getCurrentTime();
+    SynthNoteTimes times;
+    uint32_t index;
     float length = 0.0f;
-    bool canPlay;
     
-    lockMutex(&synth->mutex);
-    canPlay = _checkNoteOffAndSetNoteOnTime(synth, freq, when, currentTime, &length);
-    unlockMutex(&synth->mutex);
+    do {
+        times = loadSynthNoteTimes(synth, &index);
+        
+        if (!_checkNoteOffForNoteOn(times.noteOff, when, currentTime, &length)) {
+            printLog("Error: tried to play synth when it already has a scheduled note off, or too close to recent "
+                     "note off");
+            printLog("    lastNoteOff: %d    when: %d", times.noteOff, when);
+            return;
+        }
+        
+        times.noteOn = when;
+        times.noteOnFreq = freq;
+    } while(!storeSynthNoteTimes(synth, index, &times, audioThread));
     
-    if (!canPlay) {
-        printLog("Error: tried to play synth when it already has a scheduled note off, or too close to recent note off");
-        printLog("    lastNoteOff: %d    when: %d", synth->lastNoteOff, when);
-        return;
+    if (!audioThread) {
+        synth->playingCycle = 0;
     }
     
     pd->sound->synth->playNote(synth->synth, freq, 1.0, length, when);
 }
 
-static bool _checkNoteOnAndSetNoteOffTime(TrackerMusicChannelSynth *synth, uint32_t when, uint32_t currentTime,
-                                          uint32_t *noteOnTime, float *length)
+static bool _checkNoteOnForNoteOff(uint32_t lastNoteOn, uint32_t when, uint32_t currentTime, uint32_t *noteOnTime,
+                                   float *length)
 {
-    if (pd->sound->getCurrentTime() < synth->lastNoteOn) {
-        if (when <= synth->lastNoteOn) {
+    (*noteOnTime) = 0;
+    
+    if (currentTime < lastNoteOn) {
+        if (when <= lastNoteOn) {
             return false;
         }
         
@@ -567,45 +3100,49 @@ static bool _checkNoteOnAndSetNoteOffTime(TrackerMusicChannelSynth *synth, uint3
         // scheduled at a time) we can schedule a new note on event with a
         // finite duration, making it so that it'll stop playing when we
         // would've scheduled a note off event.
-        (*noteOnTime) = synth->lastNoteOn;
-        (*length) = (when - synth->lastNoteOn) / ((float)kAudioSampleRate);
+        (*noteOnTime) = lastNoteOn;
+        (*length) = (when - lastNoteOn) / ((float)kAudioSampleRate);
     }
     
-    synth->lastNoteOff = when;
-    
     return true;
 }
 
-static void releaseSynthNote(TrackerMusicChannelSynth *synth, uint32_t when)
+// Only ever called from the main thread
+void releaseSynthNote(TrackerMusicChannelSynth *synth, uint32_t when)
 {
-    uint32_t currentTime = pd->sound->getCurrentTime();
+    uint32_t currentTime = sequencerTime();
+    SynthNoteTimes times;
+    uint32_t index;
     uint32_t noteOnTime = 0;
     float length = 0;
-    bool canRelease;
     
-    lockMutex(&synth->mutex);
-    canRelease = _checkNoteOnAndSetNoteOffTime(synth, when, currentTime, &noteOnTime, &length);
-    unlockMutex(&synth->mutex);
+    do {
+        times = loadSynthNoteTimes(synth, &index);
+        
+        if (!_checkNoteOnForNoteOff(times.noteOn, when, currentTime, &noteOnTime, &length)) {
+            printLog("Error: tried to release note before the note is already scheduled to play");
+            return;
+        }
+        
+        times.noteOff = when;
+    } while(!storeSynthNoteTimes(synth, index, &times, false));
     
-    if (!canRelease) {
-        printLog("Error: tried to release note before the note is already scheduled to play");
-        return;
-    }
+    synth->playingCycle = 0;
     
     if (noteOnTime != 0) {
-        pd->sound->synth->playNote(synth->synth, synth->lastNoteOnFreq, 1.0, length, noteOnTime);
+        pd->sound->synth->playNote(synth->synth, times.noteOnFreq, 1.0, length, noteOnTime);
     } else {
         pd->sound->synth->noteOff(synth->synth, when);
     }
 }
 
-// These need to be accessed while the synth's mutex is locked:
-static void getSynthLastNoteOnAndOffTimes(TrackerMusicChannelSynth *synth, uint32_t *noteOn, uint32_t *noteOff)
+void getSynthLastNoteOnAndOffTimes(TrackerMusicChannelSynth *synth, uint32_t *noteOn, uint32_t *noteOff)
 {
-    lockMutex(&synth->mutex);
-    (*noteOn) = synth->lastNoteOn;
-    (*noteOff) = synth->lastNoteOff;
-    unlockMutex(&synth->mutex);
+    uint32_t index;
+    SynthNoteTimes times = loadSynthNoteTimes(synth, &index);
+    
+    (*noteOn) = times.noteOn;
+    (*noteOff) = times.noteOff;
 }
 
 #define SCREAM_TRACKER_AMIGA_CLOCK_RATE 3579264.0f
@@ -626,17 +3163,76 @@ static inline float amigaPeriodToFrequency(float period, float sampleRate)
     return frequencyToAmigaPeriod(period, sampleRate);
 }
 
-static bool calculateSignalStep(SignalDataHeader *header, int ioSamples, uint32_t *frameStart, uint32_t *frameEnd)
+static inline uint8_t followingSignalStepIndex(uint8_t index)
+{
+    return (index + 1) % (2 * TRACKER_MUSIC_SIGNAL_STEP_SLOTS);
+}
+
+// The number of steps in a signal's queue between the two indices
+static inline uint8_t signalStepCount(uint8_t writeIndex, uint8_t readIndex)
+{
+    return (writeIndex + 2 * TRACKER_MUSIC_SIGNAL_STEP_SLOTS - readIndex) % (2 * TRACKER_MUSIC_SIGNAL_STEP_SLOTS);
+}
+
+static inline BaseSignalStepData * signalStepSlot(SignalDataHeader *header, uint8_t index)
+{
+    return (BaseSignalStepData *)((uint8_t *)header + header->queueOffset
+                                  + (index % TRACKER_MUSIC_SIGNAL_STEP_SLOTS) * header->stepDataSize);
+}
+
+// Big enough for any signal's step data
+typedef union _AnySignalStepData {
+    BaseSignalStepData base;
+    VolumeSignalStepData volume;
+    RetriggerSignalStepData retrigger;
+    LinearSignalStepData linear;
+    PitchSignalStepData pitch;
+} AnySignalStepData;
+
+// The time at the start of the audio frame that a signal callback is running
+// for. The Playdate only gets asked for it the first time one of the callback's
+// signals needs it, so that signals that share a callback (and the notes they
+// retrigger) share a single time, and signals with nothing to do don't ask.
+typedef struct _AudioFrameClock {
+    uint32_t time;
+    bool known;
+} AudioFrameClock;
+
+static uint32_t audioFrameTime(AudioFrameClock *clock)
+{
+    if (clock->known) {
+        countAudioTimeQuery(audioTimeQueriesSaved);
+        return clock->time;
+    }
+    
+    countAudioTimeQuery(audioTimeQueries);
+    clock->time = pd->sound->getCurrentTime();
+    clock->known = true;
+    return clock->time;
+}
+
+// Called for every step that's taken from a signal's queue, including ones that
+// are replaced by a later step straight away, for anything a step does that has
+// to last beyond the step itself
+typedef void (*SignalStepTakenFunc)(SignalDataHeader *header, BaseSignalStepData *step);
+
+static bool calculateSignalStep(SignalDataHeader *header, int ioSamples, AudioFrameClock *clock,
+                                uint32_t *frameStart, uint32_t *frameEnd, SignalStepTakenFunc stepTaken)
 {
+    // Pairs with the release in publishSignalStep, so that the steps up to
+    // writeIndex, along with stepDataSize and the offsets, are all filled in
+    uint8_t writeIndex = atomic_load_explicit(&header->writeIndex, memory_order_acquire);
+    uint8_t readIndex = atomic_load_explicit(&header->readIndex, memory_order_acquire);
+    
     // A lot of the time these signals aren't going to do anything
     // but output their last value, so if that's the case, we want
     // to figure it out as fast as possible to avoid using extra
     // CPU cycles
-    if (header->processedStepId == header->nextStepId) {
+    if (!header->stepping && readIndex == writeIndex) {
         return false;
     }
     
-    (*frameStart) = pd->sound->getCurrentTime();
+    (*frameStart) = audioFrameTime(clock);
     (*frameEnd) = (*frameStart) + ioSamples;
     
     // Uninitialized
@@ -645,38 +3241,49 @@ static bool calculateSignalStep(SignalDataHeader *header, int ioSamples, uint32_
     }
     
     BaseSignalStepData *current = (BaseSignalStepData *)((uint8_t *)header + header->currentOffset);
-    BaseSignalStepData *next = (BaseSignalStepData *)((uint8_t *)header + header->nextOffset);
-    
-    if ((*frameEnd) >= current->stepEnd && header->processedStepId != header->currentStepId) {
-        header->processedStepId = header->currentStepId;
-    }
-    
-    // Handle transition point. Error cases ideally shouldn't happen, but we
-    // must assume they are possible and try to handle them as robustly as
-    // possible.
-    //  |   cur?   |   next   | 
-    //           ^  ^
-    //  |   cur?   |   next   | 
-    //                 ^  ^            <-- error case
-    //  |   cue?   |   next   | 
-    //                       ^  ^      <-- error case
-    //  |   cur?   |   next   | 
-    //                           ^  ^  <-- error case
-    if (header->currentStepId != header->nextStepId && (*frameEnd) >= next->stepStart) {
-        header->currentStepId = header->nextStepId;
-        memcpy(current, next, header->stepDataSize);
-        
-        // Blank out all the step data except the stepStart, stepEnd:
-        next->mode = kSignalModeNone;
-        next->set = false;
-        next->setValue = 0;
-        memset(((uint8_t *)next) + sizeof(BaseSignalStepData), 0, header->stepDataSize - sizeof(BaseSignalStepData));
+    
+    if ((*frameEnd) >= current->stepEnd) {
+        header->stepping = false;
+    }
+    
+    // Take every step that's been reached. Normally that's at most one, but if
+    // the audio thread has fallen behind, or the signal hasn't been used for a
+    // while, then the earlier ones are replaced by the later ones straight away
+    // and only what they set is kept.
+    while(readIndex != writeIndex) {
+        BaseSignalStepData *next = signalStepSlot(header, readIndex);
+        AnySignalStepData step;
+        
+        if ((*frameEnd) < next->stepStart) {
+            break;
+        }
+        
+        memcpy(&step, next, header->stepDataSize);
+        
+        // Hands the slot back to the main thread. If the main thread has taken
+        // the step back in the meantime to make room (see publishSignalStep),
+        // then what was copied may be partly overwritten and is thrown away.
+        if (!atomic_compare_exchange_strong_explicit(&header->readIndex, &readIndex,
+                                                     followingSignalStepIndex(readIndex),
+                                                     memory_order_acq_rel, memory_order_acquire)) {
+            continue;
+        }
         
+        readIndex = followingSignalStepIndex(readIndex);
+        memcpy(current, &step, header->stepDataSize);
         header->newStep = true;
+        header->stepping = true;
         
-        if (current->set) {
+        // Every step carries the last value that was set, so if a step that
+        // set it was taken back by the main thread, the value still applies
+        if (current->setCount != header->takenSetCount) {
+            header->takenSetCount = current->setCount;
             header->value = current->setValue;
         }
+        
+        if (stepTaken) {
+            stepTaken(header, current);
+        }
     }
     
     return true;
@@ -908,20 +3515,25 @@ static float calculateFluctuatingSignal(SignalDataHeader *base, FluctuatingSigna
     }
 }
 
-static float volumeSignalStep(VolumeSignalData *data, int *ioSamples, float *interframeVal)
+static void volumeSignalStepTaken(SignalDataHeader *header, BaseSignalStepData *step)
+{
+    VolumeSignalData *data = (VolumeSignalData *)header;
+    VolumeSignalStepData *volumeStep = (VolumeSignalStepData *)step;
+    
+    // Every volume step carries the global volume (see publishVolumeSignalStep)
+    data->globalVolume = volumeStep->globalVolume;
+}
+
+static float volumeSignalStep(VolumeSignalData *data, int *ioSamples, AudioFrameClock *clock, float *interframeVal)
 {
     uint32_t frameStart = 0, frameEnd = 0;
     bool setInterframeVal = false;
     float result = 0.0f;
     
-    if (!calculateSignalStep(&data->header, *ioSamples, &frameStart, &frameEnd)) {
+    if (!calculateSignalStep(&data->header, *ioSamples, clock, &frameStart, &frameEnd, volumeSignalStepTaken)) {
         return data->header.cachedResult;
     }
     
-    if (data->header.newStep && data->current.setGlobalVolume) {
-        data->globalVolume = data->current.globalVolume;
-    }
-    
     switch(data->current.base.mode) {
         case kSignalModeNone:
             result = data->header.value;
@@ -957,11 +3569,11 @@ static float volumeSignalStep(VolumeSignalData *data, int *ioSamples, float *int
     return data->header.cachedResult;
 }
 
-static void retriggerSignalStep(RetriggerSignalData *data, int ioSamples)
+static void retriggerSignalStep(RetriggerSignalData *data, int ioSamples, AudioFrameClock *clock)
 {
     uint32_t frameStart = 0, frameEnd = 0;
     
-    if (!calculateSignalStep(&data->header, ioSamples, &frameStart, &frameEnd)) {
+    if (!calculateSignalStep(&data->header, ioSamples, clock, &frameStart, &frameEnd, NULL)) {
         return;
     }
     
@@ -978,7 +3590,7 @@ static void retriggerSignalStep(RetriggerSignalData *data, int ioSamples)
     // We're being naughty here and using the audio thread to schedule playing
     // notes, since we can't rely on processTrackerMusicCycle() being called
     // quickly enough. (Is this allowed?)
-    playSynthNote(current->synth, current->frequency, current->nextRetriggerSample);
+    playSynthNote(current->synth, current->frequency, current->nextRetriggerSample, audioFrameTime(clock), true);
     
     current->lastRetriggerSample = current->nextRetriggerSample;
     current->nextRetriggerSample += current->retriggerSampleCount;
@@ -987,17 +3599,19 @@ static void retriggerSignalStep(RetriggerSignalData *data, int ioSamples)
 static float volumeAndRetriggerSignalStep(void *userData, int *ioSamples, float *interframeVal)
 {
     VolumeAndRetriggerSignalData *data = (VolumeAndRetriggerSignalData *)userData;
+    AudioFrameClock clock = {0};
     
-    retriggerSignalStep(&data->retriggerData, *ioSamples);
-    return volumeSignalStep(&data->volumeData, ioSamples, interframeVal);
+    retriggerSignalStep(&data->retriggerData, *ioSamples, &clock);
+    return volumeSignalStep(&data->volumeData, ioSamples, &clock, interframeVal);
 }
 
 static float panSignalStep(void *userData, int *ioSamples, float *interframeVal)
 {
     PanSignalData *data = (PanSignalData *)userData;
+    AudioFrameClock clock = {0};
     uint32_t frameStart = 0, frameEnd = 0;
     
-    if (!calculateSignalStep(&data->header, *ioSamples, &frameStart, &frameEnd)) {
+    if (!calculateSignalStep(&data->header, *ioSamples, &clock, &frameStart, &frameEnd, NULL)) {
         return data->header.cachedResult;
     }
     
@@ -1016,10 +3630,11 @@ static float panSignalStep(void *userData, int *ioSamples, float *interframeVal)
 static float pitchSignalStep(void *userData, int *ioSamples, float *interframeVal)
 {
     PitchSignalData *data = (PitchSignalData *)userData;
+    AudioFrameClock clock = {0};
     uint32_t frameStart = 0, frameEnd = 0;
     
-    if (!calculateSignalStep(&data->header, *ioSamples, &frameStart, &frameEnd)) {
-        return data->header.cachedResult + pitchFactor;
+    if (!calculateSignalStep(&data->header, *ioSamples, &clock, &frameStart, &frameEnd, NULL)) {
+        return data->header.cachedResult + data->pitchFactor;
     }
     
     // The way we store the cached result is a bit unusual here. Because pitch
@@ -1056,8 +3671,8 @@ static float pitchSignalStep(void *userData, int *ioSamples, float *interframeVa
             
             float targetPeriod =
                 (current->targetFrequency != 0)
-                    ? (frequencyToAmigaPeriod(current->targetFrequency, data->sampleRate)
-                    - frequencyToAmigaPeriod(current->frequency, data->sampleRate))
+                    ? (frequencyToAmigaPeriod(current->targetFrequency, current->sampleRate)
+                    - frequencyToAmigaPeriod(current->frequency, current->sampleRate))
                     : 0;
             
             if (current->targetFrequency != 0 && data->header.newStep) {
@@ -1100,12 +3715,12 @@ static float pitchSignalStep(void *userData, int *ioSamples, float *interframeVa
 
     if (resultPeriods == 0.0f) {
         data->header.cachedResult = 0.0f;
-        return pitchFactor;
+        return data->pitchFactor;
     }
     
-    float currentPitchPeriod = frequencyToAmigaPeriod(current->frequency, data->sampleRate);
+    float currentPitchPeriod = frequencyToAmigaPeriod(current->frequency, current->sampleRate);
     float newPitchPeriod = clampf(currentPitchPeriod + resultPeriods, 1, 2000);
-    float newFrequency = amigaPeriodToFrequency(newPitchPeriod, data->sampleRate);
+    float newFrequency = amigaPeriodToFrequency(newPitchPeriod, current->sampleRate);
     
     (*resultPtr) = log2f(newFrequency / current->frequency);
     
@@ -1113,54 +3728,107 @@ static float pitchSignalStep(void *userData, int *ioSamples, float *interframeVa
         (*interframeVal) = (*resultPtr);
     }
     
-    return (*resultPtr) + pitchFactor;
+    return (*resultPtr) + data->pitchFactor;
 }
 
-static void setNextBaseSignalData(TrackerMusic *music, SignalDataHeader *header, BaseSignalStepData *current,
-                                  BaseSignalStepData *next, uint16_t stepDataSize)
+// The slot of a signal's step data that the main thread fills in next
+#define nextSignalStep(data) \
+    (&(data)->queue[atomic_load_explicit(&(data)->header.writeIndex, memory_order_relaxed) \
+                    % TRACKER_MUSIC_SIGNAL_STEP_SLOTS])
+
+// next must be the signal's nextSignalStep
+static void setNextBaseSignalData(TrackerMusicPlayer *player, SignalDataHeader *header, BaseSignalStepData *current,
+                                         BaseSignalStepData *next, uint16_t stepDataSize)
 {
     header->stepDataSize = stepDataSize;
     header->currentOffset = (uint8_t *)current - (uint8_t *)header;
-    header->nextOffset = (uint8_t *)next - (uint8_t *)header;
+    header->queueOffset = (uint8_t *)next - (uint8_t *)header
+        - (atomic_load_explicit(&header->writeIndex, memory_order_relaxed) % TRACKER_MUSIC_SIGNAL_STEP_SLOTS)
+        * stepDataSize;
     
-    next->stepStart = music->pb.nextStepSample;
-    next->stepEnd = music->pb.nextNextStepSample;
+    next->stepStart = player->pb.nextStepSample;
+    next->stepEnd = player->pb.nextNextStepSample;
 }
 
-static void maybeIncrementSignalDataStepId(TrackerMusic *music, SignalDataHeader *header, BaseSignalStepData *next)
+// Hands the step that's been filled in for the row being processed, if there is
+// one, to the audio thread, and gets the slot for the next step ready
+static void publishSignalStep(TrackerMusicPlayer *player, SignalDataHeader *header)
 {
-    if (next->stepStart != music->pb.nextStepSample) {
+    // Uninitialized
+    if (header->stepDataSize == 0) {
+        return;
+    }
+    
+    uint8_t writeIndex = atomic_load_explicit(&header->writeIndex, memory_order_relaxed);
+    uint8_t readIndex = atomic_load_explicit(&header->readIndex, memory_order_acquire);
+    BaseSignalStepData *step = signalStepSlot(header, writeIndex);
+    
+    if (step->stepStart != player->pb.nextStepSample) {
         return;
     }
     
-    // nextStepId should always be the last thing that gets changed, since it's
-    // what's being used to check if the "next" data is ready to be copied to the
-    // current data in the effects processing thread. Assignment to it should be
-    // atomic!
+    // The value that was set last goes along with every step, so that it's kept
+    // even if the step that set it is taken back below
+    if (step->set) {
+        header->publishedSetCount++;
+        header->publishedSetValue = step->setValue;
+    }
+    
+    step->setCount = header->publishedSetCount;
+    step->setValue = header->publishedSetValue;
+    
+    // The slot after this one is still in use if the ring is full. That only
+    // happens when the audio thread hasn't taken any of the signal's steps for
+    // longer than the most rows that can be scheduled ahead (such as when none
+    // of the channel's synths are playing), so its oldest step has been reached
+    // and would have been replaced by a later one anyway. It's taken back to
+    // make room, unless the audio thread takes it first. All that's lost is how
+    // the signal changes while the step lasts. The value the step set, and the
+    // global volume for the volume signal, are carried by the later steps.
+    if (signalStepCount(writeIndex, readIndex) >= TRACKER_MUSIC_SIGNAL_STEP_SLOTS - 1) {
+        atomic_compare_exchange_strong_explicit(&header->readIndex, &readIndex, followingSignalStepIndex(readIndex),
+                                                memory_order_acq_rel, memory_order_acquire);
+    }
+    
+    // writeIndex should always be the last thing about the step that gets
+    // changed, since it's what tells the audio thread that the step is ready
+    writeIndex = followingSignalStepIndex(writeIndex);
+    atomic_store_explicit(&header->writeIndex, writeIndex, memory_order_release);
     
-    // newId might overflow and wrap back to 0, which indicates uninitialized,
-    // so we need to make sure we never set it to that. The IDs just let
-    // VolumeSignalStep know that there's new data to process by having
-    // nextStepId be a different value than currentStepId
+    // Blank out all the step data except the stepStart, stepEnd, so that the
+    // slot is ready to be filled in
+    BaseSignalStepData *next = signalStepSlot(header, writeIndex);
     
-    uint16_t newId = header->nextStepId + 1;
+    next->mode = kSignalModeNone;
+    next->set = false;
+    next->setValue = 0;
+    memset(((uint8_t *)next) + sizeof(BaseSignalStepData), 0, header->stepDataSize - sizeof(BaseSignalStepData));
+}
+
+// Like publishSignalStep, but also has the step carry the global volume, so
+// that it's kept even if the step that changed it is taken back
+static void publishVolumeSignalStep(TrackerMusicPlayer *player, VolumeSignalData *data)
+{
+    VolumeSignalStepData *next = nextSignalStep(data);
     
-    if (newId == 0) {
-        newId = 1;
+    if (next->setGlobalVolume) {
+        data->publishedGlobalVolume = next->globalVolume;
+    } else {
+        next->globalVolume = data->publishedGlobalVolume;
     }
     
-    header->nextStepId = newId;
+    publishSignalStep(player, &data->header);
 }
 
-static void setNextSignalValue(TrackerMusic *music, SignalDataHeader *header, BaseSignalStepData *current,
-                               BaseSignalStepData *next, uint16_t stepDataSize, float value)
+static void setNextSignalValue(TrackerMusicPlayer *player, SignalDataHeader *header, BaseSignalStepData *current,
+                                      BaseSignalStepData *next, uint16_t stepDataSize, float value)
 {
     next->set = true;
     next->setValue = value;
-    setNextBaseSignalData(music, header, (BaseSignalStepData *)current, (BaseSignalStepData *)next, stepDataSize);
+    setNextBaseSignalData(player, header, (BaseSignalStepData *)current, (BaseSignalStepData *)next, stepDataSize);
 }
 
-static void setNextLinearSignalData(TrackerMusic *music, SignalDataHeader *header, LinearSignalData *linearData,
+static void setNextLinearSignalData(TrackerMusicPlayer *player, SignalDataHeader *header, LinearSignalData *linearData,
                                     LinearSignalStepData *current, LinearSignalStepData *next, uint16_t stepDataSize,
                                     uint16_t mode, float value, float minValue, float maxValue)
 {
@@ -1169,27 +3837,27 @@ static void setNextLinearSignalData(TrackerMusic *music, SignalDataHeader *heade
     next->mode = mode;
     next->adjustment = value;
 
-    setNextBaseSignalData(music, header, (BaseSignalStepData *)current, (BaseSignalStepData *)next, stepDataSize);
+    setNextBaseSignalData(player, header, (BaseSignalStepData *)current, (BaseSignalStepData *)next, stepDataSize);
 }
 
-static void setNextWaveformSignalData(TrackerMusic *music, SignalDataHeader *header, WaveformSignalData *waveformData,
-                                      WaveformSignalStepData *current, WaveformSignalStepData *next,
-                                      uint16_t stepDataSize, float pointsPerTick, float depth, bool reset,
-                                      uint8_t waveformType)
+static void setNextWaveformSignalData(TrackerMusicPlayer *player, SignalDataHeader *header,
+                                      WaveformSignalData *waveformData, WaveformSignalStepData *current,
+                                      WaveformSignalStepData *next, uint16_t stepDataSize, float pointsPerTick,
+                                      float depth, bool reset, uint8_t waveformType)
 {
     next->mode = kSignalModeWaveform;
-    next->speed = (music->pb.speed - 1) * pointsPerTick;
+    next->speed = (player->pb.speed - 1) * pointsPerTick;
     next->depth = depth;
     next->reset = reset;
     next->type = waveformType;
     
-    setNextBaseSignalData(music, header, (BaseSignalStepData *)current, (BaseSignalStepData *)next, stepDataSize);
+    setNextBaseSignalData(player, header, (BaseSignalStepData *)current, (BaseSignalStepData *)next, stepDataSize);
 }
 
-static void setNextFluctuatingSignalData(TrackerMusic *music, SignalDataHeader *header,
-                                         FluctuatingSignalStepData *current, FluctuatingSignalStepData *next,
-                                         uint16_t stepDataSize, float value1, float value2, float value3,
-                                         uint32_t sampleCount)
+static void setNextFluctuatingSignalData(TrackerMusicPlayer *player, SignalDataHeader *header,
+                                                FluctuatingSignalStepData *current, FluctuatingSignalStepData *next,
+                                                uint16_t stepDataSize, float value1, float value2, float value3,
+                                                uint32_t sampleCount)
 {
     next->mode = kSignalModeFluctuating;
     next->fluctuationSampleCount = sampleCount;
@@ -1197,7 +3865,7 @@ static void setNextFluctuatingSignalData(TrackerMusic *music, SignalDataHeader *
     next->values[1] = value2;
     next->values[2] = value3;
     
-    setNextBaseSignalData(music, header, (BaseSignalStepData *)current, (BaseSignalStepData *)next, stepDataSize);
+    setNextBaseSignalData(player, header, (BaseSignalStepData *)current, (BaseSignalStepData *)next, stepDataSize);
 }
 
 // NB: Because we want to avoid as much calculation as we can in the signal
@@ -1215,149 +3883,167 @@ static inline float toClampedPlaydateVolume(float val)
     return clampf(toPlaydateVolume(val), 0.0f, 1.0f);
 }
 
-static void setVolumeValue(TrackerMusic *music, uint8_t channel, float value)
+static void setVolumeValue(TrackerMusicPlayer *player, uint8_t channel, float value)
 {
-    VolumeSignalData *data = &music->pb.volumeAndRetriggerSignalData[channel].volumeData;
-    setNextSignalValue(music, &data->header, (BaseSignalStepData *)&data->current, (BaseSignalStepData *)&data->next,
+    VolumeSignalData *data = &player->pb.volumeAndRetriggerSignalData[channel].volumeData;
+    VolumeSignalStepData *next = nextSignalStep(data);
+    setNextSignalValue(player, &data->header, (BaseSignalStepData *)&data->current, (BaseSignalStepData *)next,
                        sizeof(data->current), toClampedPlaydateVolume(value));
 }
 
-static void setVolumeLinearSignal(TrackerMusic *music, uint8_t channel, uint16_t mode, float value)
+static void setVolumeLinearSignal(TrackerMusicPlayer *player, uint8_t channel, uint16_t mode, float value)
 {
-    VolumeSignalData *data = &music->pb.volumeAndRetriggerSignalData[channel].volumeData;
-    setNextLinearSignalData(music, &data->header, &data->linearData, (LinearSignalStepData *)&data->current,
-                            (LinearSignalStepData *)&data->next, sizeof(data->current), mode, toPlaydateVolume(value),
+    VolumeSignalData *data = &player->pb.volumeAndRetriggerSignalData[channel].volumeData;
+    VolumeSignalStepData *next = nextSignalStep(data);
+    setNextLinearSignalData(player, &data->header, &data->linearData, (LinearSignalStepData *)&data->current,
+                            (LinearSignalStepData *)next, sizeof(data->current), mode, toPlaydateVolume(value),
                             0.0f, 1.0f);
 }
 
-static void setVolumeWaveformSignal(TrackerMusic *music, uint8_t channel, float speed, float depth, bool reset)
+static void setVolumeWaveformSignal(TrackerMusicPlayer *player, uint8_t channel, float speed, float depth, bool reset)
 {
-    VolumeSignalData *data = &music->pb.volumeAndRetriggerSignalData[channel].volumeData;
-    setNextWaveformSignalData(music, &data->header, &data->waveformData, (WaveformSignalStepData *)&data->current,
-                              (WaveformSignalStepData *)&data->next, sizeof(data->current), speed,
-                              toPlaydateVolume(depth), reset, music->pb.tremoloWaveform[channel]);
+    VolumeSignalData *data = &player->pb.volumeAndRetriggerSignalData[channel].volumeData;
+    VolumeSignalStepData *next = nextSignalStep(data);
+    setNextWaveformSignalData(player, &data->header, &data->waveformData, (WaveformSignalStepData *)&data->current,
+                              (WaveformSignalStepData *)next, sizeof(data->current), speed,
+                              toPlaydateVolume(depth), reset, player->pb.tremoloWaveform[channel]);
 }
 
-static void setVolumeSteppedSignal(TrackerMusic *music, uint8_t channel, float stepWidth, char operator, float adjustment)
+static void setVolumeSteppedSignal(TrackerMusicPlayer *player, uint8_t channel, float stepWidth, char operator,
+                                   float adjustment)
 {
-    VolumeSignalData *data = &music->pb.volumeAndRetriggerSignalData[channel].volumeData;
-    data->next.base.mode = kSignalModeStepped;
-    data->next.stepped.stepWidth = stepWidth;
-    data->next.stepped.operator = operator;
-    data->next.stepped.adjustment = (operator == '+') ? toPlaydateVolume(adjustment) : adjustment;
-
-    setNextBaseSignalData(music, &data->header, (BaseSignalStepData *)&data->current, (BaseSignalStepData *)&data->next,
-                          sizeof(data->current));
+    VolumeSignalData *data = &player->pb.volumeAndRetriggerSignalData[channel].volumeData;
+    VolumeSignalStepData *next = nextSignalStep(data);
+    next->base.mode = kSignalModeStepped;
+    next->stepped.stepWidth = stepWidth;
+    next->stepped.operator = operator;
+    next->stepped.adjustment = (operator == '+') ? toPlaydateVolume(adjustment) : adjustment;
+
+    setNextBaseSignalData(player, &data->header, (BaseSignalStepData *)&data->current,
+                          (BaseSignalStepData *)next, sizeof(data->current));
 }
 
-static void setVolumeFlippingSignal(TrackerMusic *music, uint8_t channel, bool reset, uint8_t onTickCount,
-                                    uint8_t offTickCount)
+static void setVolumeFlippingSignal(TrackerMusicPlayer *player, uint8_t channel, bool reset, uint8_t onTickCount,
+                                           uint8_t offTickCount)
 {
-    VolumeSignalData *data = &music->pb.volumeAndRetriggerSignalData[channel].volumeData;
+    VolumeSignalData *data = &player->pb.volumeAndRetriggerSignalData[channel].volumeData;
+    VolumeSignalStepData *next = nextSignalStep(data);
     
-    data->next.flipping.mode = kSignalModeFlipping;
-    data->next.flipping.reset = reset;
-    data->next.flipping.onSampleCount = ticksToSamples(music, onTickCount);
-    data->next.flipping.offSampleCount = ticksToSamples(music, offTickCount);
+    next->flipping.mode = kSignalModeFlipping;
+    next->flipping.reset = reset;
+    next->flipping.onSampleCount = ticksToSamples(player, onTickCount);
+    next->flipping.offSampleCount = ticksToSamples(player, offTickCount);
     
-    setNextBaseSignalData(music, &data->header, (BaseSignalStepData *)&data->current, (BaseSignalStepData *)&data->next,
-                          sizeof(data->current));
+    setNextBaseSignalData(player, &data->header, (BaseSignalStepData *)&data->current,
+                          (BaseSignalStepData *)next, sizeof(data->current));
 }
 
-static void setPanValue(TrackerMusic *music, uint8_t channel, float value)
+static void setPanValue(TrackerMusicPlayer *player, uint8_t channel, float value)
 {
-    PanSignalData *data = &music->pb.panSignalData[channel];
-    setNextSignalValue(music, &data->header, (BaseSignalStepData *)&data->current, (BaseSignalStepData *)&data->next,
+    PanSignalData *data = &player->pb.panSignalData[channel];
+    LinearSignalStepData *next = nextSignalStep(data);
+    setNextSignalValue(player, &data->header, (BaseSignalStepData *)&data->current, (BaseSignalStepData *)next,
                        sizeof(data->current), value);
 }
 
-static void setPanLinearSignal(TrackerMusic *music, uint8_t channel, uint16_t mode, float value)
+static void setPanLinearSignal(TrackerMusicPlayer *player, uint8_t channel, uint16_t mode, float value)
 {
-    PanSignalData *data = &music->pb.panSignalData[channel];
+    PanSignalData *data = &player->pb.panSignalData[channel];
+    LinearSignalStepData *next = nextSignalStep(data);
     
     //printLogVerbose("... update pan chan: %d  mode: %d  value: %f", channel, mode, (double)value);
-    setNextLinearSignalData(music, &data->header, &data->linearData, &data->current,
-                            (LinearSignalStepData *)&data->next, sizeof(data->current), mode, value, 0, 256);
+    setNextLinearSignalData(player, &data->header, &data->linearData, &data->current,
+                            (LinearSignalStepData *)next, sizeof(data->current), mode, value, 0, 256);
 }
 
-static void setPitchValue(TrackerMusic *music, uint8_t instrument, uint8_t channel, float value)
+static void setPitchValue(TrackerMusicPlayer *player, uint8_t instrument, uint8_t channel, float value)
 {
-    PitchSignalData *data = &music->pb.pitchSignalData[channel];
-    data->sampleRate = music->instruments[instrument].sampleRate;
+    TrackerMusic *music = player->music;
+    PitchSignalData *data = &player->pb.pitchSignalData[channel];
+    PitchSignalStepData *next = nextSignalStep(data);
+    next->sampleRate = music->instruments[instrument].sampleRate;
     
-    setNextSignalValue(music, &data->header, (BaseSignalStepData *)&data->current, (BaseSignalStepData *)&data->next,
+    setNextSignalValue(player, &data->header, (BaseSignalStepData *)&data->current, (BaseSignalStepData *)next,
                        sizeof(data->current), value);
 }
 
-static void setPitchLinearSignal(TrackerMusic *music, uint8_t instrument, uint8_t channel, uint16_t mode, float value,
-                                 float targetFrequency)
+static void setPitchLinearSignal(TrackerMusicPlayer *player, uint8_t instrument, uint8_t channel, uint16_t mode,
+                                 float value, float targetFrequency)
 {
-    PitchSignalData *data = &music->pb.pitchSignalData[channel];
+    TrackerMusic *music = player->music;
+    PitchSignalData *data = &player->pb.pitchSignalData[channel];
+    PitchSignalStepData *next = nextSignalStep(data);
     
-    data->next.frequency = pd_noteToFrequency(music->pb.lastPlayedNote[channel]);
-    data->next.targetFrequency = targetFrequency;
-    data->sampleRate = music->instruments[instrument].sampleRate;
+    next->frequency = pd_noteToFrequency(player->pb.lastPlayedNote[channel]);
+    next->targetFrequency = targetFrequency;
+    next->sampleRate = music->instruments[instrument].sampleRate;
 
-    setNextLinearSignalData(music, &data->header, &data->linearData, (LinearSignalStepData *)&data->current,
-                            (LinearSignalStepData *)&data->next, sizeof(data->current), mode, value, -3000, 3000);
+    setNextLinearSignalData(player, &data->header, &data->linearData, (LinearSignalStepData *)&data->current,
+                            (LinearSignalStepData *)next, sizeof(data->current), mode, value, -3000, 3000);
 }
 
-static void setPitchWaveformSignal(TrackerMusic *music, uint8_t instrument, uint8_t channel, float speed, float depth,
-                                   bool reset)
+static void setPitchWaveformSignal(TrackerMusicPlayer *player, uint8_t instrument, uint8_t channel, float speed,
+                                   float depth, bool reset)
 {
-    PitchSignalData *data = &music->pb.pitchSignalData[channel];
+    TrackerMusic *music = player->music;
+    PitchSignalData *data = &player->pb.pitchSignalData[channel];
+    PitchSignalStepData *next = nextSignalStep(data);
     
-    data->next.frequency = pd_noteToFrequency(music->pb.lastPlayedNote[channel]);
-    data->next.targetFrequency = 0;
-    data->sampleRate = music->instruments[instrument].sampleRate;
+    next->frequency = pd_noteToFrequency(player->pb.lastPlayedNote[channel]);
+    next->targetFrequency = 0;
+    next->sampleRate = music->instruments[instrument].sampleRate;
 
-    data->next.base.set = reset;
-    data->next.base.setValue = 0.0f;
+    next->base.set = reset;
+    next->base.setValue = 0.0f;
     
     //printLogVerbose("... update pitch vibrato chan: %d  speed: %f  depth: %f", channel, (double)speed, (double)depth);
-    setNextWaveformSignalData(music, &data->header, &data->waveformData, (WaveformSignalStepData *)&data->current,
-                              (WaveformSignalStepData *)&data->next, sizeof(data->current), speed, depth, reset,
-                              music->pb.vibratoWaveform[channel]);
+    setNextWaveformSignalData(player, &data->header, &data->waveformData, (WaveformSignalStepData *)&data->current,
+                              (WaveformSignalStepData *)next, sizeof(data->current), speed, depth, reset,
+                              player->pb.vibratoWaveform[channel]);
 }
 
-static void setPitchFluctuationSignal(TrackerMusic *music, int instrument, uint8_t channel, float periods1,
-                                      float periods2, uint32_t sampleCount)
+static void setPitchFluctuationSignal(TrackerMusicPlayer *player, int instrument, uint8_t channel, float periods1,
+                                             float periods2, uint32_t sampleCount)
 {
-    PitchSignalData *data = &music->pb.pitchSignalData[channel];
+    TrackerMusic *music = player->music;
+    PitchSignalData *data = &player->pb.pitchSignalData[channel];
+    PitchSignalStepData *next = nextSignalStep(data);
     
-    data->next.frequency = pd_noteToFrequency(music->pb.lastPlayedNote[channel]);
-    data->next.targetFrequency = 0;
-    data->sampleRate = music->instruments[instrument].sampleRate;
-    data->next.base.set = true;
-    data->next.base.setValue = 0.0f;
+    next->frequency = pd_noteToFrequency(player->pb.lastPlayedNote[channel]);
+    next->targetFrequency = 0;
+    next->sampleRate = music->instruments[instrument].sampleRate;
+    next->base.set = true;
+    next->base.setValue = 0.0f;
     
     //printLogVerbose("... update arpeggio chan: %d   val1: %f   val2:  %f", channel, (double)periods1, (double)periods2);
-    setNextFluctuatingSignalData(music, &data->header, (FluctuatingSignalStepData *)&data->current,
-                                 (FluctuatingSignalStepData *)&data->next, sizeof(data->current), periods1, periods2, 0,
+    setNextFluctuatingSignalData(player, &data->header, (FluctuatingSignalStepData *)&data->current,
+                                 (FluctuatingSignalStepData *)next, sizeof(data->current), periods1, periods2, 0,
                                  sampleCount);
 }
 
-static void processEffectRetrigger(TrackerMusic *music, uint8_t channel, uint8_t retriggerTicks, uint8_t volumeCommand)
+static void processEffectRetrigger(TrackerMusicPlayer *player, uint8_t channel, uint8_t retriggerTicks,
+                                   uint8_t volumeCommand)
 {
-    int inst = music->pb.lastPlayedInstrument[channel];
+    int inst = player->pb.lastPlayedInstrument[channel];
     
     if (inst == UNSET) {
         return;
     }
     
-    RetriggerSignalData *retriggerData = &music->pb.volumeAndRetriggerSignalData[channel].retriggerData;
-    retriggerData->next.frequency = pd_noteToFrequency(music->pb.lastPlayedNote[channel]);
-    retriggerData->next.synth = music->pb.lastSynth[channel];
-    music->pb.lastSynthIsRetrigger[channel] = true;
-    retriggerData->next.retriggerSampleCount = ticksToSamples(music, MAX(1, retriggerTicks));
-    retriggerData->next.lastRetriggerSample = music->pb.nextStepSample;
-    retriggerData->next.nextRetriggerSample = music->pb.nextStepSample + retriggerData->next.retriggerSampleCount;
+    RetriggerSignalData *retriggerData = &player->pb.volumeAndRetriggerSignalData[channel].retriggerData;
+    RetriggerSignalStepData *next = nextSignalStep(retriggerData);
+    next->frequency = pd_noteToFrequency(player->pb.lastPlayedNote[channel]);
+    next->synth = player->pb.lastSynth[channel];
+    player->pb.lastSynthIsRetrigger[channel] = true;
+    next->retriggerSampleCount = ticksToSamples(player, MAX(1, retriggerTicks));
+    next->lastRetriggerSample = player->pb.nextStepSample;
+    next->nextRetriggerSample = player->pb.nextStepSample + next->retriggerSampleCount;
     
-    //printLogVerbose("... update retrigger, sample count: %d   next sample: %d", retriggerData->next.retriggerSampleCount,
-    //                retriggerData->next.nextRetriggerSample);
+    //printLogVerbose("... update retrigger, sample count: %d   next sample: %d", next->retriggerSampleCount,
+    //                next->nextRetriggerSample);
 
-    setNextBaseSignalData(music, &retriggerData->header, (BaseSignalStepData *)&retriggerData->current,
-                          (BaseSignalStepData *)&retriggerData->next, sizeof(retriggerData->current));
+    setNextBaseSignalData(player, &retriggerData->header, (BaseSignalStepData *)&retriggerData->current,
+                          (BaseSignalStepData *)next, sizeof(retriggerData->current));
     char operator = 0;
     float adjustment = 0;
     
@@ -1400,22 +4086,26 @@ static void processEffectRetrigger(TrackerMusic *music, uint8_t channel, uint8_t
             break;
     }
     
-    setVolumeSteppedSignal(music, channel, retriggerData->next.retriggerSampleCount, operator, adjustment);
+    setVolumeSteppedSignal(player, channel, next->retriggerSampleCount, operator, adjustment);
 }
 
-static void updateGlobalVolume(TrackerMusic *music, float volume)
+static void updateGlobalVolume(TrackerMusicPlayer *player, float volume)
 {
+    TrackerMusic *music = player->music;
+    
     for(uint8_t channel = 0; channel < music->channelCount; ++channel) {
-        if (!music->channels[channel].enabled) {
+        if (!player->channels[channel].enabled) {
             continue;
         }
         
-        VolumeSignalData *data = &music->pb.volumeAndRetriggerSignalData[channel].volumeData;
-        data->next.globalVolume = clampf(volume / 64.0f, 0.0f, 1.0f); // don't want to multiply this by kVolumeScale!
-        data->next.setGlobalVolume = true;
-
-        setNextBaseSignalData(music, &data->header, (BaseSignalStepData *)&data->current,
-                              (BaseSignalStepData *)&data->next, sizeof(data->current));
+        VolumeSignalData *data = &player->pb.volumeAndRetriggerSignalData[channel].volumeData;
+        VolumeSignalStepData *next = nextSignalStep(data);
+        next->globalVolume = clampf(volume / 64.0f, 0.0f, 1.0f); // don't want to multiply this by kVolumeScale!
+        next->setGlobalVolume = true;
+        player->pb.activeChannels |= (1u << channel);
+
+        setNextBaseSignalData(player, &data->header, (BaseSignalStepData *)&data->current,
+                              (BaseSignalStepData *)next, sizeof(data->current));
     }
 }
 
@@ -1438,14 +4128,15 @@ static void setupSynth(TrackerMusic *music, uint8_t inst, TrackerMusicChannelSyn
     bool isLooping = (instrument->loopBegin != 0 || instrument->loopEnd != 0);
     uint32_t loopBegin = 0, loopEnd = 0;
     
-    if (offset * instrument->bytesPerSample >= instrument->sampleByteCount && !isLooping) {
+    if (offset >= instrumentSampleLength(instrument) && !isLooping) {
         //printLogVerbose("*** ... overrun!");
         return;
     }
     
-    if (pd->sound->synth->isPlaying(synth->synth)) {
+    if (isSynthPlaying(synth)) {
         printLog("Warning: tried to adjust sample offset on synth that is still playing -- have to cut off its note");
         pd->sound->synth->stop(synth->synth);
+        synth->playingCycle = 0;
     }
     
     synth->offset = offset;
@@ -1480,13 +4171,39 @@ static void setupSynth(TrackerMusic *music, uint8_t inst, TrackerMusicChannelSyn
 
         synth->sample =
             pd->sound->sample->newSampleFromData(instrument->offsetSampleData + offsetLoop * instrument->bytesPerSample,
-                                                 instrument->format, instrument->sampleRate / (isStereo ? 2 : 1),
+                                                 instrumentPCMFormat(instrument),
+                                                 instrument->sampleRate / (isStereo ? 2 : 1),
                                                  instrument->offsetSampleByteCount
                                                      - offsetLoop * instrument->bytesPerSample,
                                                  0);
         loopBegin = (instrument->loopEnd - instrument->loopBegin) - offsetLoop;
         loopEnd = (instrument->loopEnd - instrument->loopBegin) * 2 - offsetLoop;
         
+    } else if (isADPCMInstrument(instrument)) {
+        // ADPCM data can't be started partway through a block, so the part
+        // after the offset is decoded into its own sample. Instruments that
+        // are known to be played like this aren't encoded as ADPCM, so this
+        // should be rare.
+        uint32_t length = instrumentSampleLength(instrument) - offset;
+        int16_t *decoded = malloc(length * sizeof(int16_t));
+        
+        printLogVerbose("Note: decoding ADPCM instrument %d to play it from an offset", inst);
+        
+        if (decoded) {
+            decodeADPCM(instrument->sampleData, instrument->sampleByteCount, offset, length, decoded);
+            synth->sample = pd->sound->sample->newSampleFromData((uint8_t *)decoded, kSound16bitMono,
+                                                                 instrument->sampleRate, length * sizeof(int16_t), 1);
+            
+            if (!synth->sample) {
+                free(decoded);
+            }
+        }
+        
+        if (isLooping) {
+            loopBegin = instrument->loopBegin - offset;
+            loopEnd = instrument->loopEnd - offset;
+        }
+        
     } else {
         synth->sample =
             pd->sound->sample->newSampleFromData(instrument->sampleData + offset * instrument->bytesPerSample,
@@ -1517,40 +4234,41 @@ static void setupSynth(TrackerMusic *music, uint8_t inst, TrackerMusicChannelSyn
     pd->sound->synth->setReleaseTime(synth->synth, kInstrumentReleaseTime);
 }
 
-static TrackerMusicChannelSynth * selectNextSynthForInstrument(TrackerMusic *music,
-                                                                  TrackerMusicInstrument *instrument, uint8_t channel,
-                                                                  uint8_t inst, uint32_t offset)
+static TrackerMusicChannelSynth * selectNextSynthForInstrument(TrackerMusicPlayer *player,
+                                                               TrackerMusicInstrument *instrument, uint8_t channel,
+                                                               uint8_t inst, uint32_t offset)
 {
     TrackerMusicChannelSynth *availableSynths[TRACKER_MUSIC_INSTRUMENT_PDSYNTH_COUNT] = {0};
     uint8_t availableSynthsCount = 0;
     uint32_t lastNoteOn = 0, lastNoteOff = 0;
+    uint32_t currentTime = sequencerTime();
     
     for(uint8_t i = 0; i < TRACKER_MUSIC_INSTRUMENT_PDSYNTH_COUNT; ++i) {
         // Can't use the last synth if it's involved in a retrigger effect
-        if (music->pb.lastSynthIsRetrigger[channel]
-            && music->pb.lastSynth[channel] == &music->channels[channel].synths[i]) {
+        if (player->pb.lastSynthIsRetrigger[channel]
+            && player->pb.lastSynth[channel] == &player->channels[channel].synths[i]) {
             continue;
         }
         
-        getSynthLastNoteOnAndOffTimes(&music->channels[channel].synths[i], &lastNoteOn, &lastNoteOff);
+        getSynthLastNoteOnAndOffTimes(&player->channels[channel].synths[i], &lastNoteOn, &lastNoteOff);
         
         // Can't use a synth that has a note off event, or one that fired recently
-        if (pd->sound->getCurrentTime() <= lastNoteOff + kNoteOffLeeway) {
+        if (currentTime <= lastNoteOff + kNoteOffLeeway) {
             continue;
         }
         
         // Can't use a synth that has an upcoming note on either
-        if (pd->sound->getCurrentTime() <= lastNoteOn) {
+        if (currentTime <= lastNoteOn) {
             continue;
         }
 
         // Prioritize synths with matching inst and offsets
-        if (music->channels[channel].synths[i].synth && music->channels[channel].synths[i].instrument == inst
-            && music->channels[channel].synths[i].offset == offset) {
-            return &music->channels[channel].synths[i];
+        if (player->channels[channel].synths[i].synth && player->channels[channel].synths[i].instrument == inst
+            && player->channels[channel].synths[i].offset == offset) {
+            return &player->channels[channel].synths[i];
         }
 
-        availableSynths[availableSynthsCount++] = &music->channels[channel].synths[i];
+        availableSynths[availableSynthsCount++] = &player->channels[channel].synths[i];
     }
     
     if (availableSynthsCount == 0) {
@@ -1561,7 +4279,7 @@ static TrackerMusicChannelSynth * selectNextSynthForInstrument(TrackerMusic *mus
     // Failing the above we use the first available synth that's not playing
     
     for(uint8_t i = 0; i < availableSynthsCount; ++i) {
-        if (availableSynths[i]->synth && !pd->sound->synth->isPlaying(availableSynths[i]->synth)) {
+        if (availableSynths[i]->synth && !isSynthPlaying(availableSynths[i])) {
             return availableSynths[i];
         }
     }
@@ -1580,23 +4298,45 @@ static TrackerMusicChannelSynth * selectNextSynthForInstrument(TrackerMusic *mus
     return availableSynths[0];
 }
 
-static uint8_t getNextNoteAndStoreLastNote(TrackerMusic *music, uint8_t channel, PatternCell *cell)
+// Whether the synth is playing, or will be by the time the row before the one
+// being processed starts. That's as far ahead as the synth could be seen to be
+// playing without any lookahead, so rows scheduled further ahead than that are
+// played the same as they would have been without it.
+static bool isSynthPlayingByPreviousStep(TrackerMusicPlayer *player, TrackerMusicChannelSynth *synth)
+{
+    if (isSynthPlaying(synth)) {
+        return true;
+    }
+    
+    uint32_t lastNoteOn, lastNoteOff;
+    
+    getSynthLastNoteOnAndOffTimes(synth, &lastNoteOn, &lastNoteOff);
+    
+    if (sequencerTime() >= lastNoteOn || lastNoteOn > player->pb.previousStepSample) {
+        return false;
+    }
+    
+    // The upcoming note counts unless it's released before then too
+    return lastNoteOff < lastNoteOn || lastNoteOff > player->pb.previousStepSample;
+}
+
+static uint8_t getNextNoteAndStoreLastNote(TrackerMusicPlayer *player, uint8_t channel, TrackerMusicRowOp *op)
 {
-    if (((cell->what & EFFECT_FLAG) != 0 && cell->effect == kEffectTonePortamento)) {
+    if ((op->flags & kRowOpTonePortamento) != 0) {
         // Tone portamento requires some special logic concerning whether we
         // trigger a note, and which note it is
         
-        uint8_t noteToPlay = music->pb.lastNote[channel];
+        uint8_t noteToPlay = player->pb.lastNote[channel];
         
-        if (cell->note != 0) {
-            music->pb.lastNote[channel] = cell->note;
+        if (op->value != 0) {
+            player->pb.lastNote[channel] = op->value;
         }
         
         // If the instrument is already playing, then we don't want to play
         // another note. We just want the instrument to slide to whatever the
         // last note was.
-        if (music->pb.lastSynth[channel] && music->pb.lastSynth[channel]->synth
-            && pd->sound->synth->isPlaying(music->pb.lastSynth[channel]->synth)) {
+        if (player->pb.lastSynth[channel] && player->pb.lastSynth[channel]->synth
+            && isSynthPlayingByPreviousStep(player, player->pb.lastSynth[channel])) {
             return UNSET;
         }
         
@@ -1608,68 +4348,72 @@ static uint8_t getNextNoteAndStoreLastNote(TrackerMusic *music, uint8_t channel,
         // we're going to play. (Unless there is no last note, in which case we
         // just play the note of the current cell, and the tone portamento
         // effect won't do anything.)
-        return (noteToPlay == UNSET) ? cell->note : noteToPlay;
+        return (noteToPlay == UNSET) ? op->value : noteToPlay;
     }
     
-    if (cell->note != 0) {
-        music->pb.lastNote[channel] = cell->note;
-        return cell->note;
+    if (op->value != 0) {
+        player->pb.lastNote[channel] = op->value;
+        return op->value;
     }
     
-    return music->pb.lastNote[channel];
+    return player->pb.lastNote[channel];
 }
 
-static void processMusicNote(TrackerMusic *music, uint8_t channel, PatternCell *cell)
+static void processMusicNote(TrackerMusicPlayer *player, TrackerMusicRowOp *op)
 {
+    TrackerMusic *music = player->music;
+    uint8_t channel = op->channel;
     uint8_t inst, note;
     
-    if (cell->instrument != 0) {
-        music->pb.lastInstrument[channel] = cell->instrument - 1;
+    if (op->instrument != 0) {
+        player->pb.lastInstrument[channel] = op->instrument - 1;
         
-        if (!cellHasVolume(cell)) {
-            music->pb.lastVolume[channel] = music->instruments[cell->instrument - 1].volume;
-            setVolumeValue(music, channel, (float)music->pb.lastVolume[channel]);
+        if ((op->flags & kRowOpHasVolume) == 0) {
+            player->pb.lastVolume[channel] = music->instruments[op->instrument - 1].volume;
+            setVolumeValue(player, channel, (float)player->pb.lastVolume[channel]);
         }
     }
     
-    if (cell->note == NOTE_OFF) {
-        if (!cellHasVolume(cell)) {
-            music->pb.lastVolume[channel] = 0;
-            setVolumeValue(music, channel, (float)music->pb.lastVolume[channel]);
+    if (op->value == NOTE_OFF) {
+        if ((op->flags & kRowOpHasVolume) == 0) {
+            player->pb.lastVolume[channel] = 0;
+            setVolumeValue(player, channel, (float)player->pb.lastVolume[channel]);
         }
         
-        if (music->pb.lastSynth[channel]) {
-            releaseSynthNote(music->pb.lastSynth[channel], music->pb.nextStepSample);
-            music->pb.lastSynth[channel] = NULL;
+        if (player->pb.lastSynth[channel]) {
+            releaseSynthNote(player->pb.lastSynth[channel], player->pb.nextStepSample);
+            player->pb.lastSynth[channel] = NULL;
         }
         
         return;
     }
     
-    if (cell->note == UNSET || cell->note == 0) {
+    if (op->value == UNSET || op->value == 0) {
         return;
     }
     
-    note = getNextNoteAndStoreLastNote(music, channel, cell);
-    inst = music->pb.lastInstrument[channel];
+    note = getNextNoteAndStoreLastNote(player, channel, op);
+    inst = player->pb.lastInstrument[channel];
     
-    if (inst == UNSET || note == UNSET) {
+    if (inst == UNSET || note == UNSET || !usePagedSample(music, inst)) {
         return;
     }
 
     uint32_t offset = 0;
     
-    if ((cell->what & EFFECT_FLAG) && cell->effect == kEffectOffset) {
-        if (cell->effectVal == 0) {
-            offset = music->pb.lastOffset[channel] * 256;
+    if ((op->flags & kRowOpOffset) != 0) {
+        if (op->noteEffectVal == 0) {
+            offset = player->pb.lastOffset[channel] * 256;
         } else {
-            offset = cell->effectVal * 256;
-            music->pb.lastOffset[channel] = cell->effectVal;
+            offset = op->noteEffectVal * 256;
+            player->pb.lastOffset[channel] = op->noteEffectVal;
         }
+        
+        offset = instrumentSampleOffset(&music->instruments[inst], offset);
     }
 
     TrackerMusicChannelSynth *synth =
-        selectNextSynthForInstrument(music, &music->instruments[inst], channel, inst, offset);
+        selectNextSynthForInstrument(player, &music->instruments[inst], channel, inst, offset);
 
     if (!synth) {
         printLog("Error: no available PDSynth for instrument %d channel %d!", inst, channel);
@@ -1678,7 +4422,7 @@ static void processMusicNote(TrackerMusic *music, uint8_t channel, PatternCell *
     
     if (!synth->synth) {
         printLogVerbose("Note: Creating synth for instrument %d on the fly!", inst);
-        createInstrumentSynth(music, channel, synth);
+        createInstrumentSynth(player, channel, synth);
     }
     
     if (synth->offset != offset || synth->instrument != inst) {
@@ -1689,338 +4433,315 @@ static void processMusicNote(TrackerMusic *music, uint8_t channel, PatternCell *
         return;
     }
     
-    uint32_t noteTime = music->pb.nextStepSample;
+    uint32_t noteTime = player->pb.nextStepSample;
     
-    if ((cell->what & EFFECT_FLAG) && cell->effect == kEffectNoteDelay) {
-        if (cell->effectVal == 0 || cell->effectVal >= music->pb.speed) {
+    if ((op->flags & kRowOpNoteDelay) != 0) {
+        if (op->noteEffectVal == 0 || op->noteEffectVal >= player->pb.speed) {
             return;
         }
         
-        noteTime += ticksToSamples(music, cell->effectVal);
+        noteTime += ticksToSamples(player, op->noteEffectVal);
     }
     
-    if (music->pb.lastSynth[channel] && synth != music->pb.lastSynth[channel]) {
-        releaseSynthNote(music->pb.lastSynth[channel], noteTime);
+    if (player->pb.lastSynth[channel] && synth != player->pb.lastSynth[channel]) {
+        releaseSynthNote(player->pb.lastSynth[channel], noteTime);
     }
     
-    playSynthNote(synth, pd_noteToFrequency(note), noteTime);
-    music->pb.lastPlayedNote[channel] = note;
-    music->pb.lastPlayedInstrument[channel] = inst;
-    
-    setPitchValue(music, inst, channel, 0);
-
-    music->pb.lastSynth[channel] = synth;
-}
-
-static void processMusicVolume(TrackerMusic *music, uint8_t channel, PatternCell *cell)
-{
-    //printLogVerbose("... chan %d vol: %02x", channel, cell->volume);
+    playSynthNote(synth, pd_noteToFrequency(note), noteTime, sequencerTime(), false);
+    player->pb.lastPlayedNote[channel] = note;
+    player->pb.lastPlayedInstrument[channel] = inst;
     
-    if (cell->volume >= 0x00 && cell->volume <= 0x40) {
-        music->pb.lastVolume[channel] = cell->volume;
-        setVolumeValue(music, channel, (float)cell->volume);
-        
-    } else if (cell->volume >= 0x80 && cell->volume <= 0xc0) {
-        uint8_t pan = cell->volume - 0x80;
-        music->pb.lastPan[channel] = pan;
-        setPanValue(music, channel, (float)pan * 4);
-    }
-}
+    setPitchValue(player, inst, channel, 0);
 
-static void processMusicControlEffect(TrackerMusic *music, PatternCell *cell)
-{
-    if (cell->effect == 0) {
-        return;
-    }
-    
-    switch(cell->effect) {
-        case kEffectSetSpeed:
-            music->pb.speed = cell->effectVal;
-            updateTempo(music);
-            break;
-        case kEffectPositionJump:
-            printLogVerbose("... position jump, to: %d", cell->effectVal);
-            music->pb.nextNextOrderIndex = cell->effectVal;
-            if (music->pb.nextNextRow == UNSET) {
-                music->pb.nextNextRow = 0;
-            }
-            break;
-        case kEffectPatternBreak:
-            printLogVerbose("... pattern break, to: %d", cell->effectVal);
-            if (music->pb.nextNextOrderIndex == UNSET) {
-                music->pb.nextNextOrderIndex = music->pb.nextOrderIndex + 1;
-            }
-            music->pb.nextNextRow = clamp(cell->effectVal, 0, 63);
-            break;
-        case kEffectSetTempo:
-            if ((cell->effectVal & 0xF0) == 0x00) {
-                music->pb.tempo -= cell->effectVal & 0x0F;
-            } else if ((cell->effectVal & 0xF0) == 0x10) {
-                music->pb.tempo += cell->effectVal & 0x0F;
-            } else {
-                music->pb.tempo = cell->effectVal;
-            }
-            updateTempo(music);
-            break;
-        default:
-            break;
-    }
+    player->pb.lastSynth[channel] = synth;
 }
 
-static void processEffectVolumeSlide(TrackerMusic *music, uint8_t channel, uint8_t effectVal)
+static void processEffectVolumeSlide(TrackerMusicPlayer *player, uint8_t channel, uint8_t hi, uint8_t lo)
 {
-    effectVal = (effectVal != 0) ? effectVal : music->pb.lastEffectVal[channel];
-    
-    uint8_t lo = effectVal & 0x0F;
-    uint8_t hi = (effectVal & 0xF0) >> 4;
-    
     if (hi == 0 && lo != 0) {
-        setVolumeLinearSignal(music, channel, kSignalModeAdjust, -((float)lo) * (music->pb.speed - 1));
+        setVolumeLinearSignal(player, channel, kSignalModeAdjust, -((float)lo) * (player->pb.speed - 1));
         
     } else if (lo == 0 && hi != 0) {
-        setVolumeLinearSignal(music, channel, kSignalModeAdjust, (float)hi * (music->pb.speed - 1));
+        setVolumeLinearSignal(player, channel, kSignalModeAdjust, (float)hi * (player->pb.speed - 1));
         
     } else if (hi == 0xF && lo != 0xF) {
-        setVolumeLinearSignal(music, channel, kSignalModeAdjustFine, -((float)lo));
+        setVolumeLinearSignal(player, channel, kSignalModeAdjustFine, -((float)lo));
         
     } else if (lo == 0xF && hi != 0xF) {
-        setVolumeLinearSignal(music, channel, kSignalModeAdjustFine, (float)hi);
+        setVolumeLinearSignal(player, channel, kSignalModeAdjustFine, (float)hi);
     }
 }
 
-static void processEffectPanningSlide(TrackerMusic *music, uint8_t channel, uint8_t effectVal)
+static void processEffectPanningSlide(TrackerMusicPlayer *player, uint8_t channel, uint8_t effectVal)
 {
     if (effectVal != 0) {
-        music->pb.lastPanningSlide[channel] = effectVal;
+        player->pb.lastPanningSlide[channel] = effectVal;
     } else {
-        effectVal = music->pb.lastPanningSlide[channel];
+        effectVal = player->pb.lastPanningSlide[channel];
     }
     
     uint8_t lo = effectVal & 0x0F;
     uint8_t hi = (effectVal & 0xF0) >> 4;
     
     if (hi == 0 && lo != 0) {
-        setPanLinearSignal(music, channel, kSignalModeAdjust, ((float)lo) * 4.0f * (music->pb.speed - 1));
+        setPanLinearSignal(player, channel, kSignalModeAdjust, ((float)lo) * 4.0f * (player->pb.speed - 1));
         
     } else if (lo == 0 && hi != 0) {
-        setPanLinearSignal(music, channel, kSignalModeAdjust, -(float)hi * 4.0f * (music->pb.speed - 1));
+        setPanLinearSignal(player, channel, kSignalModeAdjust, -(float)hi * 4.0f * (player->pb.speed - 1));
         
     } else if (hi == 0xF && lo != 0xF) {
-        setPanLinearSignal(music, channel, kSignalModeAdjustFine, ((float)lo * 4.0f));
+        setPanLinearSignal(player, channel, kSignalModeAdjustFine, ((float)lo * 4.0f));
         
     } else if (lo == 0xF && hi != 0xF) {
-        setPanLinearSignal(music, channel, kSignalModeAdjustFine, -(float)hi * 4.0f);
+        setPanLinearSignal(player, channel, kSignalModeAdjustFine, -(float)hi * 4.0f);
     }
 }
 
-static void processEffectPortamento(TrackerMusic *music, uint8_t channel, uint8_t effectVal, float direction)
+static void processEffectPortamento(TrackerMusicPlayer *player, uint8_t channel, uint8_t effectVal, uint8_t hi,
+                                    uint8_t lo, float direction)
 {
-    if (music->pb.lastPlayedInstrument[channel] == UNSET) {
+    if (player->pb.lastPlayedInstrument[channel] == UNSET) {
         return;
     }
     
-    effectVal = (effectVal != 0) ? effectVal : music->pb.lastEffectVal[channel];
-    
-    short lo = effectVal & 0x0F;
-    short hi = (effectVal & 0xF0) >> 4;
-    
     if (hi == 0x0F) {
-        setPitchLinearSignal(music, music->pb.lastPlayedInstrument[channel], channel, kSignalModeAdjustFine,
+        setPitchLinearSignal(player, player->pb.lastPlayedInstrument[channel], channel, kSignalModeAdjustFine,
                               (float)lo * direction, 0);
     } else if (hi == 0x0E) {
-        setPitchLinearSignal(music, music->pb.lastPlayedInstrument[channel], channel, kSignalModeAdjustFine,
+        setPitchLinearSignal(player, player->pb.lastPlayedInstrument[channel], channel, kSignalModeAdjustFine,
                               (float)lo * direction / 4.0f, 0);
     } else {
-        setPitchLinearSignal(music, music->pb.lastPlayedInstrument[channel], channel, kSignalModeAdjust,
-                             (float)(effectVal * direction * (music->pb.speed - 1)), 0);
+        setPitchLinearSignal(player, player->pb.lastPlayedInstrument[channel], channel, kSignalModeAdjust,
+                             (float)(effectVal * direction * (player->pb.speed - 1)), 0);
     }
 }
 
-static void processEffectTonePortamento(TrackerMusic *music, uint8_t channel, uint8_t effectVal)
+static void processEffectTonePortamento(TrackerMusicPlayer *player, uint8_t channel, uint8_t effectVal)
 {
-    if (music->pb.lastPlayedInstrument[channel] == UNSET) {
+    if (player->pb.lastPlayedInstrument[channel] == UNSET) {
         return;
     }
     
     if (effectVal != 0) {
-        music->pb.lastTonePortamento[channel] = effectVal;
+        player->pb.lastTonePortamento[channel] = effectVal;
     } else {
-        effectVal = music->pb.lastTonePortamento[channel];
+        effectVal = player->pb.lastTonePortamento[channel];
     }
     
-    if (music->pb.lastNote[channel] == UNSET || music->pb.lastPlayedNote[channel] == UNSET) {
+    if (player->pb.lastNote[channel] == UNSET || player->pb.lastPlayedNote[channel] == UNSET) {
         return;
     }
 
-    setPitchLinearSignal(music, music->pb.lastPlayedInstrument[channel], channel, kSignalModeAdjust,
-                         effectVal * (music->pb.speed - 1), pd_noteToFrequency(music->pb.lastNote[channel]));
+    setPitchLinearSignal(player, player->pb.lastPlayedInstrument[channel], channel, kSignalModeAdjust,
+                         effectVal * (player->pb.speed - 1), pd_noteToFrequency(player->pb.lastNote[channel]));
 }
 
-static void processEffectVibrato(TrackerMusic *music, uint8_t channel, PatternCell *cell, uint8_t effectVal, bool fine)
+static void processEffectVibrato(TrackerMusicPlayer *player, uint8_t channel, uint8_t hi, uint8_t lo, bool fine,
+                                 bool hasNote)
 {
-    uint8_t inst = music->pb.lastPlayedInstrument[channel];
+    uint8_t inst = player->pb.lastPlayedInstrument[channel];
     
     if (inst == UNSET) {
         return;
     }
     
-    uint8_t lo = effectVal & 0x0F;
-    uint8_t hi = (effectVal & 0xF0) >> 4;
-    
     if (lo != 0) {
-        music->pb.lastVibrato[channel] = (music->pb.lastVibrato[channel] & 0xF0) | lo;
+        player->pb.lastVibrato[channel] = (player->pb.lastVibrato[channel] & 0xF0) | lo;
     } else {
-        lo = (music->pb.lastVibrato[channel] & 0x0F);
+        lo = (player->pb.lastVibrato[channel] & 0x0F);
     }
     
     if (hi != 0) {
-        music->pb.lastVibrato[channel] = (music->pb.lastVibrato[channel] & 0x0F) | (hi << 4);
+        player->pb.lastVibrato[channel] = (player->pb.lastVibrato[channel] & 0x0F) | (hi << 4);
     } else {
-        hi = (music->pb.lastVibrato[channel] & 0xF0) >> 4;
+        hi = (player->pb.lastVibrato[channel] & 0xF0) >> 4;
     }
 
-    setPitchWaveformSignal(music, inst, channel, hi, (float)lo / (fine ? 4.0f : 1.0f),
-                           (cell->what & NOTE_AND_INST_FLAG) != 0);
+    setPitchWaveformSignal(player, inst, channel, hi, (float)lo / (fine ? 4.0f : 1.0f), hasNote);
 }
 
-static void processEffectTremolo(TrackerMusic *music, uint8_t channel, PatternCell *cell)
+static void processEffectTremolo(TrackerMusicPlayer *player, uint8_t channel, uint8_t hi, uint8_t lo,
+                                 bool triggersNote)
 {
-    uint8_t effectVal = (cell->effectVal != 0) ? cell->effectVal : music->pb.lastEffectVal[channel];
-    uint8_t lo = effectVal & 0x0F;
-    uint8_t hi = (effectVal & 0xF0) >> 4;
-    bool reset = ((cell->what & NOTE_AND_INST_FLAG) != 0 && isPlayableNote(cell->note))
-                 || music->pb.lastEffect[channel] != kEffectTremolo;
+    bool reset = triggersNote || player->pb.lastEffect[channel] != kEffectTremolo;
     uint8_t speed = hi;
     uint8_t depth = lo;
 
-    setVolumeWaveformSignal(music, channel, speed, depth, reset);
+    setVolumeWaveformSignal(player, channel, speed, depth, reset);
 }
 
-static void processEffectArpeggio(TrackerMusic *music, uint8_t channel, uint8_t effectVal)
+static void processEffectArpeggio(TrackerMusicPlayer *player, uint8_t channel, uint8_t hi, uint8_t lo)
 {
-    effectVal = (effectVal != 0) ? effectVal : music->pb.lastEffectVal[channel];
-    uint8_t lo = effectVal & 0x0F;
-    uint8_t hi = (effectVal & 0xF0) >> 4;
-    uint8_t inst = music->pb.lastPlayedInstrument[channel];
+    TrackerMusic *music = player->music;
+    uint8_t inst = player->pb.lastPlayedInstrument[channel];
     
-    if (!isPlayableNote(music->pb.lastNote[channel]) || inst == UNSET) {
+    if (!isPlayableNote(player->pb.lastNote[channel]) || inst == UNSET) {
         return;
     }
     
-    float currentFreq = pd_noteToFrequency(music->pb.lastNote[channel]);
+    float currentFreq = pd_noteToFrequency(player->pb.lastNote[channel]);
     float currentPeriod = frequencyToAmigaPeriod(currentFreq, music->instruments[inst].sampleRate);
     float periods1 = frequencyToAmigaPeriod(currentFreq * powf(2, hi / 12.0f), music->instruments[inst].sampleRate)
                      - currentPeriod;
     float periods2 = frequencyToAmigaPeriod(currentFreq * powf(2, lo / 12.0f), music->instruments[inst].sampleRate)
                      - currentPeriod;
-    setPitchFluctuationSignal(music, inst, channel, periods1, periods2, ticksToSamples(music, 1));
+    setPitchFluctuationSignal(player, inst, channel, periods1, periods2, ticksToSamples(player, 1));
 }
 
-static void processMusicEffect(TrackerMusic *music, uint8_t channel, PatternCell *cell)
+static void processRowOp(TrackerMusicPlayer *player, TrackerMusicRowOp *op)
 {
-    if (cell->effect == 0) {
-        music->pb.lastEffect[channel] = 0;
-        return;
+    uint8_t channel = op->channel;
+    uint8_t effectVal = op->value;
+    uint8_t hi = op->hi;
+    uint8_t lo = op->lo;
+    
+    if ((op->flags & kRowOpRecallsEffectVal) != 0) {
+        effectVal = player->pb.lastEffectVal[channel];
+        hi = (effectVal & 0xF0) >> 4;
+        lo = effectVal & 0x0F;
     }
     
-    switch(cell->effect) {
+    switch(op->type) {
+        case kRowOpSetVolume:
+            player->pb.lastVolume[channel] = op->value;
+            setVolumeValue(player, channel, (float)op->value);
+            return;
+        case kRowOpSetPanning:
+            player->pb.lastPan[channel] = op->value;
+            setPanValue(player, channel, (float)op->value * 4);
+            return;
+        case kRowOpNote:
+            processMusicNote(player, op);
+            return;
+        case kRowOpSetSpeed:
+            player->pb.speed = op->value;
+            updateTempo(player);
+            return;
+        case kRowOpPositionJump:
+            printLogVerbose("... position jump, to: %d", op->value);
+            player->pb.nextNextOrderIndex = op->value;
+            if (player->pb.nextNextRow == UNSET) {
+                player->pb.nextNextRow = 0;
+            }
+            return;
+        case kRowOpPatternBreak:
+            printLogVerbose("... pattern break, to: %d", op->value);
+            if (player->pb.nextNextOrderIndex == UNSET) {
+                player->pb.nextNextOrderIndex = player->pb.nextOrderIndex + 1;
+            }
+            player->pb.nextNextRow = op->value;
+            return;
+        case kRowOpSetTempo:
+            player->pb.tempo = op->value;
+            updateTempo(player);
+            return;
+        case kRowOpSlideTempoDown:
+            player->pb.tempo -= op->value;
+            updateTempo(player);
+            return;
+        case kRowOpSlideTempoUp:
+            player->pb.tempo += op->value;
+            updateTempo(player);
+            return;
+        case kEffectNone:
+            player->pb.lastEffect[channel] = 0;
+            return;
         case kEffectVolumeSlide:
-            processEffectVolumeSlide(music, channel, cell->effectVal);
+            processEffectVolumeSlide(player, channel, hi, lo);
             break;
         case kEffectPortamentoDown: 
-            processEffectPortamento(music, channel, cell->effectVal, 1);
+            processEffectPortamento(player, channel, effectVal, hi, lo, 1);
             break;
         case kEffectPortamentoUp:
-            processEffectPortamento(music, channel, cell->effectVal, -1);
+            processEffectPortamento(player, channel, effectVal, hi, lo, -1);
             break;
         case kEffectTonePortamento:
-            processEffectTonePortamento(music, channel, cell->effectVal);
+            processEffectTonePortamento(player, channel, effectVal);
             break;
         case kEffectVolumeSlideAndVibrato:
-            processEffectVolumeSlide(music, channel, cell->effectVal);
-            processEffectVibrato(music, channel, cell, 0, false);
+            processEffectVolumeSlide(player, channel, hi, lo);
+            processEffectVibrato(player, channel, 0, 0, false, (op->flags & kRowOpHasNote) != 0);
             break;
         case kEffectVolumeSlideAndTonePortamento:
-            processEffectVolumeSlide(music, channel, cell->effectVal);
-            processEffectTonePortamento(music, channel, 0);
+            processEffectVolumeSlide(player, channel, hi, lo);
+            processEffectTonePortamento(player, channel, 0);
             break;
         case kEffectPanningSlide:
-            processEffectPanningSlide(music, channel, cell->effectVal);
+            processEffectPanningSlide(player, channel, effectVal);
             break;
         case kEffectVibratoSetWaveform:
-            music->pb.vibratoWaveform[channel] = cell->effectVal;
+            player->pb.vibratoWaveform[channel] = effectVal;
             break;
         case kEffectTremoloSetWaveform:
-            music->pb.tremoloWaveform[channel] = cell->effectVal;
+            player->pb.tremoloWaveform[channel] = effectVal;
             break;
         case kEffectSetPanning:
-            setPanValue(music, channel, (float)cell->effectVal * 16.0f);
+            setPanValue(player, channel, (float)effectVal * 16.0f);
             break;
         case kEffectSetPanningFine:
-            setPanValue(music, channel, (float)clamp(cell->effectVal, 0, 0x80) * 2.0f);
+            setPanValue(player, channel, (float)clamp(effectVal, 0, 0x80) * 2.0f);
             break;
         case kEffectVibrato:
-            processEffectVibrato(music, channel, cell, cell->effectVal, false);
+            processEffectVibrato(player, channel, hi, lo, false, (op->flags & kRowOpHasNote) != 0);
             break;
         case kEffectVibratoFine:
-            processEffectVibrato(music, channel, cell, cell->effectVal, true);
+            processEffectVibrato(player, channel, hi, lo, true, (op->flags & kRowOpHasNote) != 0);
             break;
-        case kEffectRetrigger: {
-            uint8_t effectVal = (cell->effectVal != 0) ? cell->effectVal : music->pb.lastEffectVal[channel];
-            uint8_t lo = effectVal & 0x0F;
-            uint8_t hi = (effectVal & 0xF0) >> 4;
-            
-            if (music->pb.lastSynth[channel]) {
-                processEffectRetrigger(music, channel, lo, hi);
+        case kEffectRetrigger:
+            if (player->pb.lastSynth[channel]) {
+                processEffectRetrigger(player, channel, lo, hi);
             }
-            
             break;
-        }
         case kEffectTremor: {
-            uint8_t effectVal = (cell->effectVal != 0) ? cell->effectVal : music->pb.lastEffectVal[channel];
-            uint8_t lo = effectVal & 0x0F;
-            uint8_t hi = (effectVal & 0xF0) >> 4;
-            bool reset = ((cell->what & NOTE_AND_INST_FLAG) != 0 && isPlayableNote(cell->note))
-                         || music->pb.lastEffect[channel] != kEffectTremor;
-            setVolumeFlippingSignal(music, channel, reset, hi + 1, lo + 1);
+            bool reset = (op->flags & kRowOpTriggersNote) != 0 || player->pb.lastEffect[channel] != kEffectTremor;
+            setVolumeFlippingSignal(player, channel, reset, hi + 1, lo + 1);
             break;
         }
         case kEffectTremolo:
-            processEffectTremolo(music, channel, cell);
+            processEffectTremolo(player, channel, hi, lo, (op->flags & kRowOpTriggersNote) != 0);
             break;
         case kEffectSetGlobalVolume:
-            updateGlobalVolume(music, (float)cell->effectVal);
+            updateGlobalVolume(player, (float)effectVal);
             break;
         case kEffectArpeggio: 
-            processEffectArpeggio(music, channel, cell->effectVal);
+            processEffectArpeggio(player, channel, hi, lo);
             break;
         default:
             break;
     }
     
-    if (cell->effectVal != 0) {
-        music->pb.lastEffectVal[channel] = cell->effectVal;
+    if ((op->flags & kRowOpStoresEffectVal) != 0) {
+        player->pb.lastEffectVal[channel] = op->value;
     }
     
-    music->pb.lastEffect[channel] = cell->effect;
+    player->pb.lastEffect[channel] = op->type;
+}
+
+// How many steps in a row a channel's pitch signal has to hold still for before
+// its frequency modulator can be removed. Removing it takes effect right away,
+// so it has to wait until the rows that were scheduled ahead have started.
+static uint8_t pitchSignalOffStepsThreshold(TrackerMusicPlayer *player)
+{
+    uint8_t rows = (player->lookaheadMilliseconds > 0) ? TRACKER_MUSIC_MAX_LOOKAHEAD_ROWS : player->lookaheadRows;
+    return kPitchSignalOffStepsThreshold + rows - 1;
 }
 
 // PDSynth frequency modulators use a significant amount of CPU time, even when
 // they're not actually calculating very much. So this function removes them
 // from any synth that doesn't actively need them to save CPU cycles
-void setFrequencyModulators(TrackerMusic *music, int channel)
+void setFrequencyModulators(TrackerMusicPlayer *player, int channel)
 {
-    PitchSignalStepData *pitchData = &music->pb.pitchSignalData[channel].next;
+    PitchSignalStepData *pitchData = nextSignalStep(&player->pb.pitchSignalData[channel]);
     bool signalHolding;
     
     if (pitchData->base.set) {
-        music->pb.pitchSignalValueIsZero[channel] = (pitchData->base.setValue == 0.0f);
+        player->pb.pitchSignalValueIsZero[channel] = (pitchData->base.setValue == 0.0f);
     }
     
     switch(pitchData->base.mode) {
         case kSignalModeAdjust:
         case kSignalModeAdjustFine:
-            music->pb.pitchSignalValueIsZero[channel] = false;
+            player->pb.pitchSignalValueIsZero[channel] = false;
             signalHolding = false;
             break;
         case kSignalModeWaveform:
@@ -2031,279 +4752,396 @@ void setFrequencyModulators(TrackerMusic *music, int channel)
             signalHolding = true;
     }
     
-    if (music->pb.pitchSignalValueIsZero[channel] && signalHolding) {
-        music->pb.pitchSignalOffSteps[channel] =
-            MIN(music->pb.pitchSignalOffSteps[channel] + 1, kPitchSignalOffStepsThreshold);
+    if (player->pb.pitchSignalValueIsZero[channel] && signalHolding) {
+        player->pb.pitchSignalOffSteps[channel] = MIN(player->pb.pitchSignalOffSteps[channel] + 1, UINT8_MAX);
     } else {
-        music->pb.pitchSignalOffSteps[channel] = 0;
+        player->pb.pitchSignalOffSteps[channel] = 0;
     }
     
-    bool enableModulator = (pitchFactor != 0.0f || music->pb.pitchSignalOffSteps[channel] < kPitchSignalOffStepsThreshold);
+    bool enableModulator = (player->pitchFactor != 0.0f
+                            || player->pb.pitchSignalOffSteps[channel] < pitchSignalOffStepsThreshold(player));
     
-    if (enableModulator && music->channels[channel].currentPitchController == NULL) {
+    if (enableModulator && player->channels[channel].currentPitchController == NULL) {
         printLogVerbose("... installing freq modulator for channel: %d", channel);
-        music->channels[channel].currentPitchController = music->channels[channel].pitchController;
+        player->channels[channel].currentPitchController = player->channels[channel].pitchController;
         
         for(int i = 0; i < TRACKER_MUSIC_INSTRUMENT_PDSYNTH_COUNT; ++i) {
-            if (music->channels[channel].synths[i].synth) {
-                pd->sound->synth->setFrequencyModulator(music->channels[channel].synths[i].synth,
-                                                        (PDSynthSignalValue *)music->channels[channel].pitchController);
+            if (player->channels[channel].synths[i].synth) {
+                pd->sound->synth->setFrequencyModulator(player->channels[channel].synths[i].synth,
+                                                        (PDSynthSignalValue *)player->channels[channel].pitchController);
             }
         }
         
-    } else if (!enableModulator && music->channels[channel].currentPitchController != NULL) {
+    } else if (!enableModulator && player->channels[channel].currentPitchController != NULL) {
         printLogVerbose("... removing freq modulator for channel: %d", channel);
-        music->channels[channel].currentPitchController = NULL;
+        player->channels[channel].currentPitchController = NULL;
         
         for(int i = 0; i < TRACKER_MUSIC_INSTRUMENT_PDSYNTH_COUNT; ++i) {
-            if (music->channels[channel].synths[i].synth) {
-                pd->sound->synth->setFrequencyModulator(music->channels[channel].synths[i].synth, NULL);
+            if (player->channels[channel].synths[i].synth) {
+                pd->sound->synth->setFrequencyModulator(player->channels[channel].synths[i].synth, NULL);
             }
         }
     }
 }
 
-static void calculateUpcomingStepSample(TrackerMusic *music)
+static void calculateUpcomingStepSample(TrackerMusicPlayer *player)
 {
-    if (speedFactor == 1.0f) {
-        music->pb.nextNextStepSample = music->pb.nextStepSample + music->pb.samplesPerStep;
+    if (player->speedFactor == 1.0f) {
+        player->pb.nextNextStepSample = player->pb.nextStepSample + player->pb.samplesPerStep;
     } else {
-        music->pb.nextNextStepSample = music->pb.nextStepSample + ((uint32_t)((float)music->pb.samplesPerStep / speedFactor));
+        player->pb.nextNextStepSample = player->pb.nextStepSample
+                                        + ((uint32_t)((float)player->pb.samplesPerStep / player->speedFactor));
     }
 }
 
-static void processNextStep(TrackerMusic *music, uint32_t currentTime)
+static void processNextStep(TrackerMusicPlayer *player)
 {
-    music->pb.nextStepSample = music->pb.nextNextStepSample;
-    calculateUpcomingStepSample(music);
+    TrackerMusic *music = player->music;
+    
+    player->pb.previousStepSample = player->pb.nextStepSample;
+    player->pb.nextStepSample = player->pb.nextNextStepSample;
+    calculateUpcomingStepSample(player);
     
-    if (music->pb.paused) {
+    if (player->pb.paused) {
         return;
     }
     
-    music->pb.nextRow = music->pb.nextNextRow;
-    music->pb.nextOrderIndex = music->pb.nextNextOrderIndex;
+    player->pb.nextRow = player->pb.nextNextRow;
+    player->pb.nextOrderIndex = player->pb.nextNextOrderIndex;
     
-    music->pb.nextNextOrderIndex = UNSET;
-    music->pb.nextNextRow = UNSET;
+    player->pb.nextNextOrderIndex = UNSET;
+    player->pb.nextNextRow = UNSET;
 
-    printLogVerbose("time: %d   processing: %d - order: %d  row: %d", currentTime, music->pb.nextStepSample,
-                    music->pb.nextOrderIndex, music->pb.nextRow);
+    printLogVerbose("time: %d   processing: %d - order: %d  row: %d", sequencerTime(), player->pb.nextStepSample,
+                    player->pb.nextOrderIndex, player->pb.nextRow);
+    
+    if (player->queuedMusic && (player->pb.nextOrderIndex >= music->orderCount
+                                || (player->pb.nextOrderIndex == player->queuedOrderIndex
+                                    && player->pb.nextRow == player->queuedRow))) {
+        if (prepareQueuedMusic(player)) {
+            handOffToQueuedMusic(player, player->pb.nextStepSample);
+            return;
+        }
+    }
 
-    if (music->pb.nextOrderIndex >= music->orderCount) {
-        stopTrackerMusicAt(music->pb.nextStepSample);
+    if (player->pb.nextOrderIndex >= music->orderCount) {
+        stopTrackerMusicAt(player, player->pb.nextStepSample);
         return;
     }
 
-    uint8_t patternIndex = music->orders[music->pb.nextOrderIndex];
-    PatternCell *pattern = patternAtIndex(music, patternIndex);
+    // The row's control effects come first in its ops, which is important in
+    // case nextNextStepSample changes
+    uint16_t opCount;
+    uint32_t rowChannels;
+    TrackerMusicRowOp *ops = patternRowOps(music, music->orders[player->pb.nextOrderIndex], player->pb.nextRow,
+                                           &opCount, &rowChannels);
     
-    // Important to process control effects first in case nextNextStepSample changes:
-    for(uint8_t channel = 0; channel < music->channelCount; ++channel) {
-        if (!music->channels[channel].enabled) {
-            continue;
-        }
-        
-        PatternCell *cell = patternCell(music, pattern, music->pb.nextRow, channel);
-        
-        if ((cell->what & EFFECT_FLAG) != 0) {
-            processMusicControlEffect(music, cell);
+    for(uint16_t i = 0; i < opCount; ++i) {
+        processRowOp(player, &ops[i]);
+    }
+    
+    if (player->pb.nextNextRow == UNSET || player->pb.nextNextOrderIndex == UNSET) {
+        if (player->pb.nextRow < 63) {
+            player->pb.nextNextRow = player->pb.nextRow + 1;
+            player->pb.nextNextOrderIndex = player->pb.nextOrderIndex;
+        } else {
+            player->pb.nextNextRow = 0;
+            player->pb.nextNextOrderIndex = player->pb.nextOrderIndex + 1;
         }
     }
     
-    for(uint8_t channel = 0; channel < music->channelCount; ++channel) {
-        if (!music->channels[channel].enabled) {
+    // The only channels with anything to do are the ones with cells in this row
+    // and the ones whose pitch signal hasn't settled yet, so that a song with
+    // lots of channels but only a few busy ones isn't much slower than a song
+    // with just those few. Channels with neither have no new signal data and
+    // their frequency modulator is already as it should be.
+    uint32_t channels = rowChannels | player->pb.activeChannels;
+    player->pb.activeChannels = 0;
+    
+    while(channels) {
+        uint8_t channel = (uint8_t)__builtin_ctz(channels);
+        channels &= channels - 1;
+        
+        if (!player->channels[channel].enabled) {
             continue;
         }
         
-        PatternCell *cell = patternCell(music, pattern, music->pb.nextRow, channel);
+        setFrequencyModulators(player, channel);
         
-        if ((cell->what & VOLUME_FLAG) != 0) {
-            processMusicVolume(music, channel, cell);
+        if (player->pb.pitchSignalOffSteps[channel] < pitchSignalOffStepsThreshold(player)) {
+            player->pb.activeChannels |= (1u << channel);
         }
         
-        if ((cell->what & NOTE_AND_INST_FLAG) != 0) {
-            processMusicNote(music, channel, cell);
-        }
+        publishVolumeSignalStep(player, &player->pb.volumeAndRetriggerSignalData[channel].volumeData);
+        publishSignalStep(player, &player->pb.volumeAndRetriggerSignalData[channel].retriggerData.header);
+        publishSignalStep(player, &player->pb.panSignalData[channel].header);
+        publishSignalStep(player, &player->pb.pitchSignalData[channel].header);
+    }
+}
+
+// How far past the current time that a player's rows are scheduled, not counting
+// the one row that's always scheduled ahead
+static uint32_t lookaheadSamples(TrackerMusicPlayer *player)
+{
+    // Stopping at the end of the song takes away the channels' modulators right
+    // away, so that waits until the last row has started whatever the lookahead
+    if (player->pb.nextNextOrderIndex >= player->music->orderCount) {
+        return 0;
+    }
+    
+    uint32_t rowSamples = player->pb.nextNextStepSample - player->pb.nextStepSample;
+    uint32_t samples = MAX((player->lookaheadRows - 1) * rowSamples,
+                           (uint32_t)((uint64_t)player->lookaheadMilliseconds * kAudioSampleRate / 1000));
+    
+    return MIN(samples, (TRACKER_MUSIC_MAX_LOOKAHEAD_ROWS - 1) * rowSamples);
+}
+
+static void processPlayers(void)
+{
+    bool processedRow = false;
+    
+    // A player can stop, or hand off to another player, partway through, in
+    // which case the list of players has changed and is gone through again.
+    // Players that have already caught up are skipped over quickly.
+    for(TrackerMusicPlayer *player = activePlayers; player; ) {
+        activePlayersChanged = false;
         
-        if ((cell->what & EFFECT_FLAG) != 0) {
-            processMusicEffect(music, channel, cell);
+        while(player->playing && sequencerTime() + lookaheadSamples(player) > player->pb.nextStepSample) {
+            processNextStep(player);
+            processedRow = true;
         }
+        
+        player = activePlayersChanged ? activePlayers : player->nextActivePlayer;
     }
     
-    if (music->pb.nextNextRow == UNSET || music->pb.nextNextOrderIndex == UNSET) {
-        if (music->pb.nextRow < 63) {
-            music->pb.nextNextRow = music->pb.nextRow + 1;
-            music->pb.nextNextOrderIndex = music->pb.nextOrderIndex;
-        } else {
-            music->pb.nextNextRow = 0;
-            music->pb.nextNextOrderIndex = music->pb.nextOrderIndex + 1;
-        }
+    if (processedRow) {
+        return;
     }
     
-    for(uint8_t channel = 0; channel < music->channelCount; ++channel) {
-        if (!music->channels[channel].enabled) {
-            continue;
+    // No row to process this cycle, so use the spare time to get the next
+    // orders' patterns ready, load any queued music, and clean up after players
+    // that have been handed off from
+    bool steppedLoader = false;
+    
+    for(TrackerMusicPlayer *player = activePlayers; player; player = player->nextActivePlayer) {
+        if (player->music->patternStorage == kPatternStorageLazy) {
+            prefetchNextOrderPattern(player);
+        }
+        
+        if (player->music->readPagedSample) {
+            prefetchPagedSamples(player);
         }
         
-        setFrequencyModulators(music, channel);
-        maybeIncrementSignalDataStepId(music, &music->pb.volumeAndRetriggerSignalData[channel].volumeData.header,
-                                       &music->pb.volumeAndRetriggerSignalData[channel].volumeData.next.base);
-        maybeIncrementSignalDataStepId(music, &music->pb.volumeAndRetriggerSignalData[channel].retriggerData.header,
-                                       (BaseSignalStepData *)&music->pb.volumeAndRetriggerSignalData[channel]
-                                           .retriggerData.next);
-        maybeIncrementSignalDataStepId(music, &music->pb.panSignalData[channel].header,
-                                       (BaseSignalStepData *)&music->pb.panSignalData[channel].next);
-        maybeIncrementSignalDataStepId(music, &music->pb.pitchSignalData[channel].header,
-                                       (BaseSignalStepData *)&music->pb.pitchSignalData[channel].next);
+        if (!steppedLoader && player->queuedMusicLoader) {
+            stepQueuedMusicLoader(player);
+            steppedLoader = true;
+        }
     }
+    
+    tearDownFinishedRetiringPlayers(sequencerTime());
 }
 
+// Processes whichever rows are due for every player that's playing, so the cost
+// of a cycle grows with the number of players actually playing. The cycle works
+// from the time it started at, which is only read again after slow work.
 void processTrackerMusicCycle(void)
 {
-    TrackerMusic *music = currentMusic;
-    
-    if (music == NULL) {
+    if (activePlayers == NULL && retiringPlayers == NULL) {
         return;
     }
     
-    uint32_t currentTime = pd->sound->getCurrentTime();
-    
-    while(currentTime > music->pb.nextStepSample) {
-        processNextStep(music, currentTime);
-    }
+    countQuery(sequencerTimeQueries);
+    cycleTime = pd->sound->getCurrentTime();
+    forgetSynthPlayingStates();
+    inCycle = true;
+    processPlayers();
+    inCycle = false;
+}
+
+#if TRACKER_MUSIC_VERBOSE
+void getTrackerMusicQueryCounts(TrackerMusicQueryCounts *counts)
+{
+    (*counts) = queryCounts;
+    counts->audioTimeQueries = atomic_load_explicit(&audioTimeQueries, memory_order_relaxed);
+    counts->audioTimeQueriesSaved = atomic_load_explicit(&audioTimeQueriesSaved, memory_order_relaxed);
+}
+#endif
+
+bool isTrackerMusicPlaying(TrackerMusicPlayer *player)
+{
+    return player && player->playing;
 }
 
-void stopTrackerMusicAt(uint32_t sample)
+void stopTrackerMusicAt(TrackerMusicPlayer *player, uint32_t sample)
 {
     int i, j;
     
-    if (!currentMusic) {
+    if (!player || !player->playing) {
         return;
     }
     
-    for(i = 0; i < TRACKER_MUSIC_MAX_CHANNELS; ++i) {
-        if (!currentMusic->channels[i].enabled) {
+    clearQueuedMusic(player);
+    
+    for(i = 0; i < player->music->channelCount; ++i) {
+        if (!player->channels[i].enabled) {
             continue;
         }
         
-        pd->sound->channel->setPanModulator(currentMusic->channels[i].soundChannel, NULL);
-        pd->sound->channel->setVolumeModulator(currentMusic->channels[i].soundChannel, NULL);
+        pd->sound->channel->setPanModulator(player->channels[i].soundChannel, NULL);
+        pd->sound->channel->setVolumeModulator(player->channels[i].soundChannel, NULL);
         
         for(j = 0; j < TRACKER_MUSIC_INSTRUMENT_PDSYNTH_COUNT; ++j) {
-            if (currentMusic->channels[i].synths[j].synth) {
-                pd->sound->synth->noteOff(currentMusic->channels[i].synths[j].synth, sample);
-                pd->sound->synth->setFrequencyModulator(currentMusic->channels[i].synths[j].synth, NULL);
+            if (player->channels[i].synths[j].synth) {
+                pd->sound->synth->noteOff(player->channels[i].synths[j].synth, sample);
+                pd->sound->synth->setFrequencyModulator(player->channels[i].synths[j].synth, NULL);
             }
-        }                             
+        }
     }
     
-    currentMusic = NULL;
+    forgetSynthPlayingStates();
+    
+    removeActivePlayer(player);
 }
 
-void stopTrackerMusic(void)
+void stopTrackerMusic(TrackerMusicPlayer *player)
 {
     int i, j;
     
-    if (!currentMusic) {
+    if (!player) {
+        return;
+    }
+    
+    if (player->retiring) {
+        tearDownRetiringPlayer(player);
+        return;
+    }
+    
+    if (!player->playing) {
         return;
     }
     
-    for(i = 0; i < TRACKER_MUSIC_MAX_CHANNELS; ++i) {
-        if (!currentMusic->channels[i].enabled) {
+    clearQueuedMusic(player);
+    
+    for(i = 0; i < player->music->channelCount; ++i) {
+        if (!player->channels[i].enabled) {
             continue;
         }
         
-        pd->sound->channel->setPanModulator(currentMusic->channels[i].soundChannel, NULL);
-        pd->sound->channel->setVolumeModulator(currentMusic->channels[i].soundChannel, NULL);
+        pd->sound->channel->setPanModulator(player->channels[i].soundChannel, NULL);
+        pd->sound->channel->setVolumeModulator(player->channels[i].soundChannel, NULL);
         
         for(j = 0; j < TRACKER_MUSIC_INSTRUMENT_PDSYNTH_COUNT; ++j) {
-            if (currentMusic->channels[i].synths[j].synth) {
-                pd->sound->synth->stop(currentMusic->channels[i].synths[j].synth);
-                pd->sound->synth->setFrequencyModulator(currentMusic->channels[i].synths[j].synth, NULL);
+            if (player->channels[i].synths[j].synth) {
+                pd->sound->synth->stop(player->channels[i].synths[j].synth);
+                pd->sound->synth->setFrequencyModulator(player->channels[i].synths[j].synth, NULL);
             }
         }
     }
     
-    currentMusic = NULL;
+    forgetSynthPlayingStates();
+    
+    removeActivePlayer(player);
 }
 
-void setTrackerMusicVolume(float vol)
+void setTrackerMusicVolume(TrackerMusicPlayer *player, float vol)
 {
-    if (!currentMusic) {
+    if (!player || !player->playing) {
         return;
     }
     
-    for(int i = 0; i < TRACKER_MUSIC_MAX_CHANNELS; ++i) {
-        if (!currentMusic->channels[i].enabled) {
+    for(int i = 0; i < player->music->channelCount; ++i) {
+        if (!player->channels[i].enabled) {
             continue;
         }
         
-        pd->sound->channel->setVolume(currentMusic->channels[i].soundChannel, vol);
+        pd->sound->channel->setVolume(player->channels[i].soundChannel, vol);
     }
 }
 
-void setTrackerMusicPaused(bool paused)
+void setTrackerMusicPaused(TrackerMusicPlayer *player, bool paused)
 {
-    if (!currentMusic) {
+    if (!player || !player->playing) {
         return;
     }
     
-    currentMusic->pb.paused = paused;
+    player->pb.paused = paused;
 }
 
-void setTrackerMusicPosition(uint8_t orderIndex, uint8_t row)
+void setTrackerMusicPosition(TrackerMusicPlayer *player, uint8_t orderIndex, uint8_t row)
 {
-    if (!currentMusic) {
+    if (!player || !player->playing) {
         return;
     }
     
-    currentMusic->pb.nextNextOrderIndex = orderIndex;
-    currentMusic->pb.nextNextRow = clamp(row, 0, 63);
+    player->pb.nextNextOrderIndex = orderIndex;
+    player->pb.nextNextRow = clamp(row, 0, 63);
+    
+    if (player->music->readPagedSample) {
+        readPagedSamplesForOrder(player->music, orderIndex);
+    }
 }
 
-void getTrackerMusicPosition(uint8_t *orderIndex, uint8_t *row)
+void getTrackerMusicPosition(TrackerMusicPlayer *player, uint8_t *orderIndex, uint8_t *row)
 {
-    if (!currentMusic) {
+    if (!player || !player->playing) {
         return;
     }
     
     if (orderIndex) {
-        *orderIndex = currentMusic->pb.nextOrderIndex;
+        *orderIndex = player->pb.nextOrderIndex;
     }
     
     if (row) {
-        *row = currentMusic->pb.nextRow;
+        *row = player->pb.nextRow;
+    }
+}
+
+// Multiplies the player's normal playback speed by the given value
+void setTrackerMusicSpeed(TrackerMusicPlayer *player, float speed)
+{
+    if (!player || !player->playing) {
+        return;
     }
+    
+    player->speedFactor = clampf(speed, 0.001, 100.0);
+    calculateUpcomingStepSample(player);
 }
 
-// Multiplies the normal playback speed by the given value
-void setTrackerMusicSpeed(float speed)
+// Has the player schedule rows further ahead of when they're played than the
+// single row it schedules by default, so that notes and effects still play on
+// time when processTrackerMusicCycle can't be called for a while, such as
+// during a long frame. Rows are scheduled at least `rows` rows ahead, or at
+// least `milliseconds` ahead, whichever is further, but never more than
+// TRACKER_MUSIC_MAX_LOOKAHEAD_ROWS rows ahead. Changes to the playback, like
+// setting the position or queueing music, take effect after the rows that are
+// already scheduled.
+void setTrackerMusicLookahead(TrackerMusicPlayer *player, uint8_t rows, uint32_t milliseconds)
 {
-    if (!currentMusic) {
+    if (!player) {
         return;
     }
     
-    speedFactor = clampf(speed, 0.001, 100.0);
-    calculateUpcomingStepSample(currentMusic);
+    player->lookaheadRows = clamp(rows, 1, TRACKER_MUSIC_MAX_LOOKAHEAD_ROWS);
+    player->lookaheadMilliseconds = milliseconds;
 }
 
 // Scales the pitch the same way as a frequency modulator: the signal is scaled
 // so that a value of 1 doubles the synth pitch (i.e. an octave up) and -1
 // halves it (an octave down).
-void setTrackerMusicPitchShift(float pitch)
+void setTrackerMusicPitchShift(TrackerMusicPlayer *player, float pitch)
 {
-    if (!currentMusic) {
+    if (!player || !player->playing) {
         return;
     }
     
-    pitchFactor = pitch;
+    player->pitchFactor = pitch;
     
-    for(uint8_t channel = 0; channel < currentMusic->channelCount; ++channel) {
-        if (!currentMusic->channels[channel].enabled) {
+    for(uint8_t channel = 0; channel < player->music->channelCount; ++channel) {
+        if (!player->channels[channel].enabled) {
             continue;
         }
         
-        setFrequencyModulators(currentMusic, channel);
+        player->pb.pitchSignalData[channel].pitchFactor = pitch;
+        setFrequencyModulators(player, channel);
     }
 }
@@ -13,9 +13,77 @@
 #define TRACKER_MUSIC_MAX_CHANNELS 32
 #endif
 
-#define TRACKER_MUSIC_INSTRUMENT_PDSYNTH_COUNT 3
+// Sets of channels are kept as bitmasks
+#if TRACKER_MUSIC_MAX_CHANNELS > 32
+#error "TRACKER_MUSIC_MAX_CHANNELS can't be more than 32"
+#endif
+
+// The most rows that a player can schedule ahead of when they're played (see
+// setTrackerMusicLookahead). Every channel's signals keep room for a step for
+// each of those rows, so if you don't need a long lookahead you can define this
+// ahead of time as a smaller value to save some memory.
+#ifndef TRACKER_MUSIC_MAX_LOOKAHEAD_ROWS
+#define TRACKER_MUSIC_MAX_LOOKAHEAD_ROWS 4
+#endif
+
+#if TRACKER_MUSIC_MAX_LOOKAHEAD_ROWS < 1 || TRACKER_MUSIC_MAX_LOOKAHEAD_ROWS > 64
+#error "TRACKER_MUSIC_MAX_LOOKAHEAD_ROWS must be between 1 and 64"
+#endif
+
+// Number of PDSynths a channel can have, which are created as they're needed.
+// A channel's notes overlap while they're being released and while they're
+// scheduled ahead, so this should be a few more than the number of rows that
+// are scheduled ahead.
+#ifndef TRACKER_MUSIC_INSTRUMENT_PDSYNTH_COUNT
+#define TRACKER_MUSIC_INSTRUMENT_PDSYNTH_COUNT (TRACKER_MUSIC_MAX_LOOKAHEAD_ROWS + 3)
+#endif
+
+// Steps each signal's queue has room for: one for each row that can be
+// scheduled ahead, one to spare in case the audio thread is a little behind,
+// and the one the main thread is filling in
+#define TRACKER_MUSIC_SIGNAL_STEP_SLOTS (TRACKER_MUSIC_MAX_LOOKAHEAD_ROWS + 2)
+
+// Number of decoded patterns kept around when patterns are decoded on demand
+// (kPatternStorageLazy). Must be at least 2 so that the pattern for the next
+// order can be decoded ahead of time without evicting the one that's playing.
+#ifndef TRACKER_MUSIC_PATTERN_CACHE_SIZE
+#define TRACKER_MUSIC_PATTERN_CACHE_SIZE 4
+#endif
+
+// Number of orders after the one that's playing whose instruments' samples are
+// read in ahead of time when samples are paged (see pagedSampleBudget)
+#ifndef TRACKER_MUSIC_SAMPLE_PREFETCH_ORDERS
+#define TRACKER_MUSIC_SAMPLE_PREFETCH_ORDERS 2
+#endif
+
+// Number of hash buckets in the sample bank that lets songs that are loaded at
+// the same time share identical samples
+#ifndef TRACKER_MUSIC_SAMPLE_BANK_SIZE
+#define TRACKER_MUSIC_SAMPLE_BANK_SIZE 64
+#endif
+
+// Roughly how many microseconds are spent loading queued music (see
+// queueTrackerMusic) on each call to processTrackerMusicCycle that has time to
+// spare
+#ifndef TRACKER_MUSIC_QUEUED_LOAD_MICROSECONDS
+#define TRACKER_MUSIC_QUEUED_LOAD_MICROSECONDS 2000
+#endif
+
+// Folder in the game's data folder that decoded songs are cached in when using
+// the cacheDecodedSong load option
+#ifndef TRACKER_MUSIC_CACHE_FOLDER
+#define TRACKER_MUSIC_CACHE_FOLDER "tracker_music_cache"
+#endif
+
+#if TRACKER_MUSIC_PATTERN_CACHE_SIZE < 2
+#error TRACKER_MUSIC_PATTERN_CACHE_SIZE must be at least 2
+#endif
 
 typedef struct _TrackerMusicChannelSynth TrackerMusicChannelSynth;
+typedef struct _TrackerMusic TrackerMusic;
+typedef struct _TrackerMusicPlayer TrackerMusicPlayer;
+typedef struct _TrackerMusicLoader TrackerMusicLoader;
+typedef struct _TrackerMusicSampleBankEntry TrackerMusicSampleBankEntry;
 
 enum {
     kSignalModeNone = 0,
@@ -43,6 +111,15 @@ enum {
     kMusicInvalidS3MError,
     kMusicUnsupportedS3MError,
     kMusicInvalidData,
+    kMusicInvalidTMCError,
+    kMusicLoadCancelled,
+    kMusicLoading, // not an error, returned while a TrackerMusicLoader is still loading
+};
+
+// Order index to pass to queueTrackerMusic to have the queued music take over
+// when the current music ends
+enum {
+    kTrackerMusicQueueAtEnd = 0xFF
 };
 
 enum {
@@ -78,16 +155,29 @@ typedef struct _BaseSignalStepData {
     uint32_t stepEnd;
     uint16_t mode;
     bool set;
-    float setValue;
+    float setValue; // once the step's been handed over, the last value set by it or any step before it
+    uint32_t setCount; // how many of the signal's steps up to and including this one have set the value
 } BaseSignalStepData;
 
+// A signal's upcoming steps are passed from the main thread to the audio thread
+// through a ring of TRACKER_MUSIC_SIGNAL_STEP_SLOTS steps, which only the main
+// thread writes to and only the audio thread reads from, so it doesn't need any
+// locking. writeIndex and readIndex count up to twice the number of slots
+// before wrapping around, so that a full ring can be told apart from an empty
+// one, and the slot an index refers to is the index modulo the number of slots.
+// The main thread fills in the slot at writeIndex and then increments it to
+// hand the step over, and the audio thread copies each step to current once
+// it's reached and then increments readIndex to hand the slot back.
 typedef struct _SignalDataHeader {
-    _Atomic uint32_t nextStepId;
-    uint32_t currentStepId;
-    uint32_t processedStepId;
+    _Atomic uint8_t writeIndex;
+    _Atomic uint8_t readIndex;
     uint16_t stepDataSize;
     uint16_t currentOffset;
-    uint16_t nextOffset;
+    uint16_t queueOffset;
+    bool stepping; // whether the current step hasn't ended yet
+    uint32_t takenSetCount; // the setCount of the last step the audio thread took
+    uint32_t publishedSetCount; // the setCount of the last step the main thread handed over
+    float publishedSetValue; // the last value set by a step the main thread handed over
     float cachedResult;
     float value;
     bool newStep;
@@ -176,14 +266,15 @@ typedef struct _VolumeSignalData {
     FlippingSignalData flippingData;
     WaveformSignalData waveformData;
     VolumeSignalStepData current;
-    VolumeSignalStepData next;
+    VolumeSignalStepData queue[TRACKER_MUSIC_SIGNAL_STEP_SLOTS];
     float globalVolume;
+    float publishedGlobalVolume; // the global volume of the last step the main thread handed over
 } VolumeSignalData;
 
 typedef struct _RetriggerSignalData {
     SignalDataHeader header;
     RetriggerSignalStepData current;
-    RetriggerSignalStepData next;
+    RetriggerSignalStepData queue[TRACKER_MUSIC_SIGNAL_STEP_SLOTS];
 } RetriggerSignalData;
 
 typedef struct _VolumeAndRetriggerSignalData {
@@ -196,7 +287,7 @@ typedef struct _PanSignalData {
     SignalDataHeader header;
     LinearSignalData linearData;
     LinearSignalStepData current;
-    LinearSignalStepData next;
+    LinearSignalStepData queue[TRACKER_MUSIC_SIGNAL_STEP_SLOTS];
 } PanSignalData;
 
 
@@ -209,6 +300,7 @@ typedef struct _PitchSignalStepData {
     };
     float frequency;
     float targetFrequency;
+    float sampleRate;
 } PitchSignalStepData;
 
 typedef struct _PitchSignalData {
@@ -216,12 +308,73 @@ typedef struct _PitchSignalData {
     LinearSignalData linearData;
     WaveformSignalData waveformData;
     PitchSignalStepData current;
-    PitchSignalStepData next;
-    float sampleRate;
+    PitchSignalStepData queue[TRACKER_MUSIC_SIGNAL_STEP_SLOTS];
     float frequency;
     float targetFrequency;
+    _Atomic float pitchFactor; // the player's pitch shift
 } PitchSignalData;
 
+enum {
+    kPatternStorageDense = 0,
+    kPatternStorageSparse,
+    kPatternStorageLazy,
+};
+
+typedef struct _TrackerMusicLoadOptions {
+    // kPatternStorageDense stores a cell for every channel of every row, and
+    // kPatternStorageSparse only stores the cells that have something in them,
+    // which takes much less memory for songs with lots of empty cells.
+    // kPatternStorageLazy keeps the patterns in their packed form and decodes
+    // them as they're about to be played into a small cache of decoded
+    // patterns (only supported when loading S3M files).
+    uint8_t patternStorage;
+    
+    // Encodes 16-bit mono instrument samples as ADPCM, which takes about a
+    // quarter of the memory at some cost to quality. Instruments that are
+    // played from an offset outside of their loop are left as PCM.
+    bool adpcmSamples;
+    
+    // Instruments to leave as PCM when adpcmSamples is set, where bit (i % 32)
+    // of adpcmOptOut[i / 32] is instrument i, counting from 0
+    uint32_t adpcmOptOut[4];
+    
+    // Instrument samples with a higher sample rate than this are filtered and
+    // resampled down to it while loading, to save memory. 0 for no limit.
+    uint32_t maxSampleRate;
+    
+    // Leaves out the patterns that aren't in the order list, the instruments
+    // that are never triggered, and the sample data after the end of looping
+    // instruments' loops, none of which can ever be heard. Rows that a pattern
+    // break always skips over don't count towards an instrument being used, so
+    // they mustn't be played with setTrackerMusicPosition. (S3M files only.)
+    bool removeUnusedData;
+    
+    // Moves the song's order list, instruments, patterns and samples into one
+    // block of exactly the size needed once it's loaded, so that nothing is
+    // left over from loading and the heap has fewer allocations to keep track
+    // of. Compacted samples aren't shared with other songs through the sample
+    // bank. (S3M files only.)
+    bool compactData;
+    
+    // Saves the decoded song as a TMC file in the game's data folder (under
+    // TRACKER_MUSIC_CACHE_FOLDER) the first time it's loaded, and loads that
+    // instead from then on, as long as the S3M file's size and modification
+    // time and the other load options are the same. Not used with
+    // kPatternStorageLazy, which TMC files can't store, or with paged samples.
+    // (Only used by loadMusicFromS3MWithOptions.)
+    bool cacheDecodedSong;
+    
+    // Leaves the instruments' samples in the file and only reads them in as
+    // they're needed, with at most this many bytes of them loaded at once.
+    // Samples for the next few orders (see TRACKER_MUSIC_SAMPLE_PREFETCH_ORDERS)
+    // are read ahead of time during processTrackerMusicCycle, and the least
+    // recently used ones are freed to make room. The budget is exceeded if the
+    // samples that the upcoming orders need don't fit in it. Paged samples
+    // aren't encoded as ADPCM or resampled, and the file stays open until the
+    // music is freed. 0 loads every sample up front. (S3M files only.)
+    uint32_t pagedSampleBudget;
+} TrackerMusicLoadOptions;
+
 typedef struct _PatternCell {
     uint8_t what;
     uint8_t instrument;
@@ -231,6 +384,27 @@ typedef struct _PatternCell {
     uint8_t effectVal;
 } PatternCell;
 
+// Rows are compiled into lists of these while the music's audio entities are
+// created (or, with lazy storage, as patterns are decoded), so that playing a
+// row is just going through its ops. A row's control effects come first,
+// followed by each cell's volume, note and effect, in that order.
+typedef struct _TrackerMusicRowOp {
+    uint8_t type; // the effect for channel effects, otherwise one of the kRowOp types
+    uint8_t channel;
+    uint8_t flags;
+    uint8_t value; // the effect value, volume, pan or note
+    union {
+        struct {
+            uint8_t hi; // the effect value's high and low nibbles
+            uint8_t lo;
+        };
+        struct {
+            uint8_t instrument; // notes only
+            uint8_t noteEffectVal; // notes only, the value of an offset or note delay in the same cell
+        };
+    };
+} TrackerMusicRowOp;
+
 typedef struct _TrackerMusicInstrument {
     uint8_t *sampleData;
     AudioSample *sample;
@@ -243,12 +417,18 @@ typedef struct _TrackerMusicInstrument {
     uint8_t volume;
     uint8_t *offsetSampleData;
     uint32_t offsetSampleByteCount;
+    uint16_t sharedSampleSource; // 1-based index of the instrument whose sample data this one uses, or 0
+    TrackerMusicSampleBankEntry *bankEntry; // owns sampleData and offsetSampleData when set
+    uint32_t originalSampleRate; // sample rate before being resampled, or 0 if it hasn't been
+    bool encodeADPCM; // set to have the sample encoded as ADPCM when the music's audio entities are created
+    uint32_t pagedLastUse; // paged samples only, when the sample was last played
 } TrackerMusicInstrument;
 
 typedef struct _TrackerMusicPlaybackData {
     bool paused;
     uint8_t speed;
     uint8_t tempo;
+    uint32_t previousStepSample;
     uint32_t nextStepSample;
     uint32_t nextNextStepSample;
     uint8_t nextOrderIndex;
@@ -277,17 +457,29 @@ typedef struct _TrackerMusicPlaybackData {
     PitchSignalData pitchSignalData[TRACKER_MUSIC_MAX_CHANNELS];
     uint8_t pitchSignalOffSteps[TRACKER_MUSIC_MAX_CHANNELS];
     bool pitchSignalValueIsZero[TRACKER_MUSIC_MAX_CHANNELS];
+    uint32_t activeChannels; // channels with signals that still need updating on the next step, as a bitmask
 } TrackerMusicPlaybackData;
 
+typedef struct _SynthNoteTimes {
+    uint32_t noteOn;
+    uint32_t noteOff;
+    float noteOnFreq;
+} SynthNoteTimes;
+
 typedef struct _TrackerMusicChannelSynth {
     PDSynth *synth;
     AudioSample *sample;
     uint8_t instrument;
     uint32_t offset;
-    float lastNoteOnFreq; // NB: may only be safely accessed from the Playdate audio thread
-    uint32_t lastNoteOn; // NB: can only be accessed while mutex is set
-    uint32_t lastNoteOff; // NB: can only be accessed while mutex is set
-    atomic_flag mutex;
+    // The last note on and note off times and the last note's frequency, which
+    // are changed from both the main and audio threads without locking (see
+    // loadSynthNoteTimes). noteTimesIndex is which of the copies is current.
+    SynthNoteTimes noteTimes[4];
+    _Atomic uint32_t noteTimesIndex;
+    // Whether the synth was playing as of the processTrackerMusicCycle call
+    // numbered playingCycle (see isSynthPlaying)
+    uint32_t playingCycle;
+    bool playing;
 } TrackerMusicChannelSynth;
 
 typedef struct _TrackerMusicChannel {
@@ -298,12 +490,12 @@ typedef struct _TrackerMusicChannel {
     PDSynthSignal *pitchController;
     PDSynthSignal *currentPitchController;
     TrackerMusicChannelSynth synths[TRACKER_MUSIC_INSTRUMENT_PDSYNTH_COUNT];
-    uint8_t pan;
 } TrackerMusicChannel;
 
 typedef struct _TrackerMusic {
     uint8_t *rawData;
     unsigned int size;
+    bool rawDataIsBorrowed; // rawData belongs to the caller, who keeps it around until the music is freed
     uint8_t initialSpeed;
     uint8_t initialTempo;
     
@@ -311,28 +503,138 @@ typedef struct _TrackerMusic {
     uint8_t *orders;
     
     uint16_t patternCount;
+    uint8_t patternStorage;
+    uint32_t patternCellCount;
     PatternCell *patterns;
+    uint32_t *patternCellOffsets; // sparse storage only
+    uint16_t *patternRowOffsets; // sparse storage only
+    uint8_t *packedPatterns; // lazy storage only
+    uint32_t *packedPatternOffsets; // lazy storage only
+    void (*decodePattern)(TrackerMusic *music, int patternIndex, PatternCell *pattern); // lazy storage only
+    uint16_t cachedPatterns[TRACKER_MUSIC_PATTERN_CACHE_SIZE];
+    uint32_t cachedPatternLastUse[TRACKER_MUSIC_PATTERN_CACHE_SIZE];
+    uint32_t patternCacheClock;
+    TrackerMusicRowOp *rowOps;
+    uint32_t rowOpCount;
+    uint32_t *patternOpOffsets; // where each pattern's ops start in rowOps, not used with lazy storage
+    uint16_t *rowOpOffsets; // where each row's ops start from the start of its pattern's (or cache slot's) ops
+    uint32_t *rowChannels; // bitmask of the channels with ops in each row, per pattern (or cache slot)
+    TrackerMusicRowOp *cachedPatternOps[TRACKER_MUSIC_PATTERN_CACHE_SIZE]; // lazy storage only
+    uint32_t cachedPatternOpCapacity[TRACKER_MUSIC_PATTERN_CACHE_SIZE]; // lazy storage only
     
     uint16_t instrumentCount;
     TrackerMusicInstrument *instruments;
+    uint32_t resampleBytesSaved; // how much memory was saved by resampling instruments when loading
+    uint32_t pagedSampleBudget; // paged samples only
+    uint32_t pagedSampleClock; // paged samples only
+    uint32_t *orderInstruments; // paged samples only, a bitmask of the instruments that each order triggers
+    uint32_t *neededInstruments; // paged samples only, a bitmask of the instruments the upcoming orders trigger
+    void *pagedSampleSource; // paged samples only
+    bool (*readPagedSample)(TrackerMusic *music, int instIndex, uint8_t *sampleData); // paged samples only
+    void (*closePagedSampleSource)(TrackerMusic *music); // paged samples only
     
-    TrackerMusicChannel channels[TRACKER_MUSIC_MAX_CHANNELS];
+    bool channelEnabled[TRACKER_MUSIC_MAX_CHANNELS];
+    uint8_t channelPan[TRACKER_MUSIC_MAX_CHANNELS];
     uint8_t channelCount;
     
-    TrackerMusicPlaybackData pb;
+    TrackerMusicPlayer *player; // the music's own player, which playTrackerMusic and queueTrackerMusic use
+    TrackerMusicPlayer *players; // every player of the music, including player
 } TrackerMusic;
 
+// Plays a song. Other than the caches of decoded patterns and paged samples,
+// the song itself (TrackerMusic) isn't changed by playing it, so any number of
+// players can share one song and its patterns and samples, with each one only
+// having its own playback state and audio entities. The music's own player is
+// created along with its audio entities, and more can be added with
+// createTrackerMusicPlayer. The fields are private.
+typedef struct _TrackerMusicPlayer {
+    TrackerMusic *music;
+    TrackerMusicChannel channels[TRACKER_MUSIC_MAX_CHANNELS];
+    TrackerMusicPlaybackData pb;
+    TrackerMusicPlayer *nextPlayer; // the next of the music's players
+    
+    bool playing;
+    float speedFactor;
+    float pitchFactor;
+    TrackerMusicPlayer *nextActivePlayer; // the next player that's playing
+    
+    // How far ahead of when they're played that rows are scheduled (see
+    // setTrackerMusicLookahead)
+    uint8_t lookaheadRows;
+    uint32_t lookaheadMilliseconds;
+    
+    // Music that's queued to take over from this player (see queueTrackerMusic)
+    TrackerMusic *queuedMusic;
+    TrackerMusicLoader *queuedMusicLoader;
+    uint8_t queuedOrderIndex;
+    uint8_t queuedRow;
+    bool freeMusicOnHandOff;
+    
+    // Set once queued music has taken over from this player, until it's cleaned
+    // up after its last notes have finished
+    bool retiring;
+    uint32_t retiringEndSample;
+    bool freeMusicWhenRetired;
+    TrackerMusicPlayer *nextRetiringPlayer;
+} TrackerMusicPlayer;
+
+// Loads music a bit at a time so that loading can be spread out over several
+// frames. Start loading with one of the beginLoadingMusicFrom... functions,
+// then call stepTrackerMusicLoader each frame until it returns something other
+// than kMusicLoading. The fields are private.
+typedef struct _TrackerMusicLoader {
+    TrackerMusic *music;
+    int (*readStep)(struct _TrackerMusicLoader *loader);
+    void (*readFinish)(struct _TrackerMusicLoader *loader, int result);
+    void *readState;
+    bool readOnly;
+    uint8_t stage;
+    uint16_t index;
+    int result;
+    uint8_t lastInstrument[TRACKER_MUSIC_MAX_CHANNELS]; // each channel's last instrument while scanning the orders
+    uint32_t rowOpCapacity;
+} TrackerMusicLoader;
+
+#if TRACKER_MUSIC_VERBOSE
+// How many times the Playdate has been asked for the current time, and whether
+// synths are playing, and how many times a value that had already been asked
+// for was used instead (see getTrackerMusicQueryCounts)
+typedef struct _TrackerMusicQueryCounts {
+    uint32_t sequencerTimeQueries;
+    uint32_t sequencerTimeQueriesSaved;
+    uint32_t synthPlayingQueries;
+    uint32_t synthPlayingQueriesSaved;
+    uint32_t audioTimeQueries; // from the audio thread
+    uint32_t audioTimeQueriesSaved;
+} TrackerMusicQueryCounts;
+#endif
+
 void initializeTrackerMusic(PlaydateAPI *inAPI);
 void playTrackerMusic(TrackerMusic *music, uint32_t when);
 void freeTrackerMusic(TrackerMusic *music);
+int createTrackerMusicPlayer(TrackerMusicPlayer *player, TrackerMusic *music);
+void freeTrackerMusicPlayer(TrackerMusicPlayer *player);
+void playTrackerMusicPlayer(TrackerMusicPlayer *player, uint32_t when);
+void playTrackerMusicPlayers(TrackerMusicPlayer **players, int count, uint32_t when);
 void processTrackerMusicCycle(void);
-void stopTrackerMusicAt(uint32_t sample);
-void stopTrackerMusic(void);
-void setTrackerMusicVolume(float vol);
-void setTrackerMusicPaused(bool paused);
-void setTrackerMusicPosition(uint8_t orderIndex, uint8_t row);
-void getTrackerMusicPosition(uint8_t *orderIndex, uint8_t *row);
-void setTrackerMusicSpeed(float speed);
-void setTrackerMusicPitchShift(float pitch);
+bool isTrackerMusicPlaying(TrackerMusicPlayer *player);
+void stopTrackerMusicAt(TrackerMusicPlayer *player, uint32_t sample);
+void stopTrackerMusic(TrackerMusicPlayer *player);
+void setTrackerMusicVolume(TrackerMusicPlayer *player, float vol);
+void setTrackerMusicPaused(TrackerMusicPlayer *player, bool paused);
+void setTrackerMusicPosition(TrackerMusicPlayer *player, uint8_t orderIndex, uint8_t row);
+void getTrackerMusicPosition(TrackerMusicPlayer *player, uint8_t *orderIndex, uint8_t *row);
+void setTrackerMusicSpeed(TrackerMusicPlayer *player, float speed);
+void setTrackerMusicPitchShift(TrackerMusicPlayer *player, float pitch);
+void setTrackerMusicLookahead(TrackerMusicPlayer *player, uint8_t rows, uint32_t milliseconds);
+void queueTrackerMusic(TrackerMusicPlayer *player, TrackerMusic *music, TrackerMusicLoader *loader, uint8_t orderIndex,
+                       uint8_t row, bool freeCurrentMusic);
+bool isTrackerMusicQueued(TrackerMusicPlayer *player);
+#if TRACKER_MUSIC_VERBOSE
+void getTrackerMusicQueryCounts(TrackerMusicQueryCounts *counts);
+#endif
+int stepTrackerMusicLoader(TrackerMusicLoader *loader, uint32_t microseconds);
+bool isTrackerMusicLoaderDone(TrackerMusicLoader *loader);
+void cancelTrackerMusicLoader(TrackerMusicLoader *loader);
 
 #endif // TRACKER_MUSIC_H
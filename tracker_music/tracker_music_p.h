@@ -3,10 +3,18 @@
 
 #include "tracker_music.h"
 
+#ifndef MIN
+#define MIN(a, b) ((a < b) ? a : b)
+#endif
+#ifndef MAX
+#define MAX(a, b) ((a > b) ? a : b)
+#endif
+
 #define ROWS_PER_PATTERN 64
 #define NOTE_AND_INST_FLAG 0x20
 #define VOLUME_FLAG 0x40
 #define EFFECT_FLAG 0x80
+#define CHANNEL_MASK 0x1F
 
 #define UNSET 0xFF
 #define NOTE_OFF 0xFE
@@ -22,6 +30,72 @@ static inline PatternCell * patternCell(TrackerMusic *music, PatternCell *patter
     return &pattern[row * music->channelCount + channel];
 }
 
+int lazyPatternSlot(TrackerMusic *music, int patternIndex);
+
+static inline PatternCell * lazyPattern(TrackerMusic *music, int patternIndex)
+{
+    return patternAtIndex(music, lazyPatternSlot(music, patternIndex));
+}
+
+// Returns the cells in a row of a pattern. With dense storage that's a cell for
+// every channel, including empty ones, and with sparse storage it's only the
+// cells that aren't empty. Either way a cell's channel is (what & CHANNEL_MASK).
+static inline PatternCell * patternRow(TrackerMusic *music, int patternIndex, int row, uint8_t *cellCount)
+{
+    if (music->patternStorage == kPatternStorageSparse) {
+        uint16_t *rowOffsets = &music->patternRowOffsets[patternIndex * (ROWS_PER_PATTERN + 1)];
+        (*cellCount) = rowOffsets[row + 1] - rowOffsets[row];
+        return &music->patterns[music->patternCellOffsets[patternIndex] + rowOffsets[row]];
+    }
+    
+    (*cellCount) = music->channelCount;
+    
+    if (music->patternStorage == kPatternStorageLazy) {
+        return patternCell(music, lazyPattern(music, patternIndex), row, 0);
+    }
+    
+    return patternCell(music, patternAtIndex(music, patternIndex), row, 0);
+}
+
+// Returns the ops that a row of a pattern is compiled into (see
+// TrackerMusicRowOp), along with a bitmask of the channels they're for
+static inline TrackerMusicRowOp * patternRowOps(TrackerMusic *music, int patternIndex, int row, uint16_t *opCount,
+                                                uint32_t *channels)
+{
+    TrackerMusicRowOp *ops;
+    
+    if (music->patternStorage == kPatternStorageLazy) {
+        patternIndex = lazyPatternSlot(music, patternIndex);
+        ops = music->cachedPatternOps[patternIndex];
+    } else {
+        ops = &music->rowOps[music->patternOpOffsets[patternIndex]];
+    }
+    
+    uint16_t *rowOffsets = &music->rowOpOffsets[patternIndex * (ROWS_PER_PATTERN + 1)];
+    (*opCount) = rowOffsets[row + 1] - rowOffsets[row];
+    (*channels) = music->rowChannels[patternIndex * ROWS_PER_PATTERN + row];
+    return &ops[rowOffsets[row]];
+}
+
 int createTrackerMusicAudioEntities(TrackerMusic *music);
+void beginTrackerMusicLoader(TrackerMusicLoader *loader, TrackerMusic *music, int (*readStep)(TrackerMusicLoader *),
+                             void (*readFinish)(TrackerMusicLoader *, int), void *readState, bool readOnly);
+int finishTrackerMusicLoader(TrackerMusicLoader *loader);
+int createTrackerMusicOffsetSamples(TrackerMusic *music);
+void encodeTrackerMusicADPCMSamples(TrackerMusic *music);
+uint32_t resampleTrackerMusicInstrument(TrackerMusic *music, int instIndex, uint32_t maxSampleRate);
+int appendSparsePattern(TrackerMusic *music, int patternIndex, PatternCell *pattern, uint32_t *capacity);
+void finishSparsePatterns(TrackerMusic *music);
+int initializeLazyPatterns(TrackerMusic *music);
+int initializePagedSamples(TrackerMusic *music, uint32_t budget);
+void deduplicateTrackerMusicSamples(TrackerMusic *music);
+int removeUnusedTrackerMusicData(TrackerMusic *music, uint32_t *usedInstruments, uint32_t *bytesFreed);
+void compactTrackerMusic(TrackerMusic *music);
+
+// Only used outside tracker_music.c by tools/synthstress.c, which checks that
+// they're safe to call from the main and audio threads at the same time
+void playSynthNote(TrackerMusicChannelSynth *synth, float freq, uint32_t when, uint32_t currentTime, bool audioThread);
+void releaseSynthNote(TrackerMusicChannelSynth *synth, uint32_t when);
+void getSynthLastNoteOnAndOffTimes(TrackerMusicChannelSynth *synth, uint32_t *noteOn, uint32_t *noteOff);
 
 #endif // TRACKER_MUSIC_P_H